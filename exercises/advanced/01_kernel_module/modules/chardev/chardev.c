@@ -6,6 +6,8 @@
  * - File operations (open, read, write, ioctl, release)
  * - Kernel-user data transfer
  * - IOCTL commands
+ * - FIFO mode: kfifo ring buffer with blocking/non-blocking I/O and poll
+ * - mmap of the device buffer for zero-copy access
  * 
  * Author: Embedded Linux Labs
  * License: GPL v2
@@ -15,6 +17,20 @@
  *   mknod /dev/bbbchar c <major> 0
  *   echo "Hello" > /dev/bbbchar
  *   cat /dev/bbbchar
+ *
+ * FIFO mode (CHARDEV_IOCSETMODE) turns the device into a pipe: writes
+ * append to a ring buffer, reads consume from it and block while it is
+ * empty (or return -EAGAIN with O_NONBLOCK), writes block while it is
+ * full. Sleepers are woken in batches: readers once CHARDEV_IOCSETWAKEUP
+ * bytes are queued, writers once that much space is free, instead of on
+ * every byte moved.
+ *
+ * Both buffers are vmalloc'ed and can be mmap'ed (MAP_SHARED). In FIFO
+ * mode the producer writes into the ring at its head and publishes the
+ * bytes with CHARDEV_IOCPUBLISH, the consumer reads them at the tail and
+ * releases them with CHARDEV_IOCCONSUME, so the data is never copied.
+ * The FIFO may be mapped twice over, the second half aliasing the first,
+ * so a span that wraps around the end of the ring is contiguous.
  */
 
 #include <linux/module.h>
@@ -25,7 +41,13 @@
 #include <linux/uaccess.h>
 #include <linux/ioctl.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
 #include <linux/mutex.h>
+#include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
 
 #define DEVICE_NAME "bbbchar"
 #define CLASS_NAME  "bbb"
@@ -34,17 +56,38 @@
 /* Buffer size for device data */
 #define BUFFER_SIZE 4096
 
+/* Device modes */
+#define CHARDEV_MODE_FLAT 0     /* Seekable buffer, EOF at data_len */
+#define CHARDEV_MODE_FIFO 1     /* Ring buffer, consumed by reads */
+
 /* IOCTL command definitions */
 #define CHARDEV_IOC_MAGIC 'B'
 #define CHARDEV_IOCRESET    _IO(CHARDEV_IOC_MAGIC, 0)
 #define CHARDEV_IOCGETSIZE  _IOR(CHARDEV_IOC_MAGIC, 1, int)
 #define CHARDEV_IOCSETSIZE  _IOW(CHARDEV_IOC_MAGIC, 2, int)
 #define CHARDEV_IOCGETCOUNT _IOR(CHARDEV_IOC_MAGIC, 3, int)
+#define CHARDEV_IOCSETMODE  _IOW(CHARDEV_IOC_MAGIC, 4, int)
+#define CHARDEV_IOCSETWAKEUP _IOW(CHARDEV_IOC_MAGIC, 5, int)
+#define CHARDEV_IOCPUBLISH  _IOWR(CHARDEV_IOC_MAGIC, 6, struct chardev_ring)
+#define CHARDEV_IOCCONSUME  _IOWR(CHARDEV_IOC_MAGIC, 7, struct chardev_ring)
+
+/* FIFO ring state for mmap users, head and tail run freely mod 2^32 */
+struct chardev_ring {
+    unsigned int size;          /* Ring size, a power of two */
+    unsigned int head;          /* Producer position, at head & (size - 1) */
+    unsigned int tail;          /* Consumer position */
+    unsigned int count;         /* Bytes to publish or consume */
+};
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Embedded Linux Labs");
 MODULE_DESCRIPTION("Character Device Driver Demo for BeagleBone Black");
-MODULE_VERSION("1.0");
+MODULE_VERSION("1.1");
+
+/* FIFO size in bytes, rounded up to a power of two of at least a page */
+static unsigned int fifo_size = 65536;
+module_param(fifo_size, uint, 0444);
+MODULE_PARM_DESC(fifo_size, "FIFO mode buffer size in bytes (default: 65536)");
 
 /* Device data structure */
 struct chardev_data {
@@ -55,6 +98,17 @@ struct chardev_data {
     unsigned long read_count;
     unsigned long write_count;
     struct mutex lock;
+    
+    /* FIFO mode */
+    int mode;
+    struct kfifo fifo;
+    unsigned int wakeup;        /* Batch size of wakeups, in bytes */
+    unsigned int read_want;     /* Fill that wakes the read queue */
+    unsigned int write_want;    /* Free space that wakes the write queue */
+    unsigned int read_seq;      /* Wakeups of the read queue */
+    unsigned int write_seq;     /* Wakeups of the write queue */
+    wait_queue_head_t read_wq;  /* Readers waiting for data */
+    wait_queue_head_t write_wq; /* Writers waiting for space */
 };
 
 /* Global variables */
@@ -64,6 +118,165 @@ static struct class *chardev_class;
 static struct device *chardev_device;
 static struct chardev_data *dev_data;
 
+/* ============= FIFO Mode ============= */
+
+/*
+ * Sleepers are woken in batches rather than on every read or write. A
+ * blocking reader waits for a full wakeup batch, or for as many bytes
+ * as it asked for if that is less, and before sleeping lowers
+ * read_want to that amount. Writers wake the read queue only when the
+ * FIFO fill crosses read_want, then reset it to the batch size, so
+ * poll() sees the batch and a reader asking for a short tail is not
+ * left waiting for a batch that never comes. Every wakeup bumps
+ * read_seq, which sends the sleepers that are still short back to
+ * register again. Writers wait for free space the same way through
+ * write_want and write_seq. Non-blocking callers take whatever there
+ * is.
+ */
+static void chardev_fifo_wake(struct chardev_data *data, wait_queue_head_t *wq,
+                              unsigned int *want, unsigned int *seq)
+{
+    *want = data->wakeup;
+    WRITE_ONCE(*seq, *seq + 1);
+    wake_up_interruptible(wq);
+}
+
+/* Bytes were queued on top of before, wake readers on a full batch */
+static void chardev_fifo_queued(struct chardev_data *data, unsigned int before)
+{
+    if (before < data->read_want &&
+        kfifo_len(&data->fifo) >= data->read_want)
+        chardev_fifo_wake(data, &data->read_wq,
+                          &data->read_want, &data->read_seq);
+}
+
+/* Space was freed on top of before, wake writers on a full batch */
+static void chardev_fifo_freed(struct chardev_data *data, unsigned int before)
+{
+    if (before < data->write_want &&
+        kfifo_avail(&data->fifo) >= data->write_want)
+        chardev_fifo_wake(data, &data->write_wq,
+                          &data->write_want, &data->write_seq);
+}
+
+static size_t chardev_fifo_want(struct chardev_data *data, struct file *filp,
+                                size_t count)
+{
+    if (filp->f_flags & O_NONBLOCK)
+        return 1;
+    return min_t(size_t, count, data->wakeup);
+}
+
+static ssize_t chardev_fifo_read(struct file *filp, char __user *buf,
+                                 size_t count)
+{
+    struct chardev_data *data = filp->private_data;
+    unsigned int before, copied, seq;
+    size_t want;
+    int ret;
+    
+    if (count == 0)
+        return 0;
+    count = min_t(size_t, count, kfifo_size(&data->fifo));
+    
+    mutex_lock(&data->lock);
+    
+    for (;;) {
+        want = chardev_fifo_want(data, filp, count);
+        if (kfifo_len(&data->fifo) >= want)
+            break;
+        
+        if (filp->f_flags & O_NONBLOCK) {
+            mutex_unlock(&data->lock);
+            return -EAGAIN;
+        }
+        
+        data->read_want = min_t(size_t, data->read_want, want);
+        seq = data->read_seq;
+        mutex_unlock(&data->lock);
+        
+        /* The condition is checked again under the lock */
+        if (wait_event_interruptible(data->read_wq,
+                kfifo_len(&data->fifo) >= want ||
+                READ_ONCE(data->read_seq) != seq))
+            return -ERESTARTSYS;
+        
+        mutex_lock(&data->lock);
+    }
+    
+    before = kfifo_avail(&data->fifo);
+    ret = kfifo_to_user(&data->fifo, buf, count, &copied);
+    if (ret) {
+        mutex_unlock(&data->lock);
+        return ret;
+    }
+    data->read_count++;
+    
+    chardev_fifo_freed(data, before);
+    
+    mutex_unlock(&data->lock);
+    
+    pr_debug(MODULE_TAG "FIFO read %u bytes\n", copied);
+    return copied;
+}
+
+/*
+ * Unlike a pipe, a blocking write does not wait for all of count to
+ * fit: it returns once it queued what it waited for, so callers loop
+ * on short writes.
+ */
+static ssize_t chardev_fifo_write(struct file *filp, const char __user *buf,
+                                  size_t count)
+{
+    struct chardev_data *data = filp->private_data;
+    unsigned int before, copied, seq;
+    size_t want;
+    int ret;
+    
+    if (count == 0)
+        return 0;
+    count = min_t(size_t, count, kfifo_size(&data->fifo));
+    
+    mutex_lock(&data->lock);
+    
+    for (;;) {
+        want = chardev_fifo_want(data, filp, count);
+        if (kfifo_avail(&data->fifo) >= want)
+            break;
+        
+        if (filp->f_flags & O_NONBLOCK) {
+            mutex_unlock(&data->lock);
+            return -EAGAIN;
+        }
+        
+        data->write_want = min_t(size_t, data->write_want, want);
+        seq = data->write_seq;
+        mutex_unlock(&data->lock);
+        
+        if (wait_event_interruptible(data->write_wq,
+                kfifo_avail(&data->fifo) >= want ||
+                READ_ONCE(data->write_seq) != seq))
+            return -ERESTARTSYS;
+        
+        mutex_lock(&data->lock);
+    }
+    
+    before = kfifo_len(&data->fifo);
+    ret = kfifo_from_user(&data->fifo, buf, count, &copied);
+    if (ret) {
+        mutex_unlock(&data->lock);
+        return ret;
+    }
+    data->write_count++;
+    
+    chardev_fifo_queued(data, before);
+    
+    mutex_unlock(&data->lock);
+    
+    pr_debug(MODULE_TAG "FIFO wrote %u bytes\n", copied);
+    return copied;
+}
+
 /* ============= File Operations ============= */
 
 static int chardev_open(struct inode *inode, struct file *filp)
@@ -100,6 +313,9 @@ static ssize_t chardev_read(struct file *filp, char __user *buf,
     struct chardev_data *data = filp->private_data;
     ssize_t bytes_read = 0;
     
+    if (data->mode == CHARDEV_MODE_FIFO)
+        return chardev_fifo_read(filp, buf, count);
+    
     mutex_lock(&data->lock);
     
     /* Check bounds */
@@ -134,6 +350,9 @@ static ssize_t chardev_write(struct file *filp, const char __user *buf,
     struct chardev_data *data = filp->private_data;
     ssize_t bytes_written = 0;
     
+    if (data->mode == CHARDEV_MODE_FIFO)
+        return chardev_fifo_write(filp, buf, count);
+    
     mutex_lock(&data->lock);
     
     /* Check bounds */
@@ -170,6 +389,7 @@ static ssize_t chardev_write(struct file *filp, const char __user *buf,
 static long chardev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     struct chardev_data *data = filp->private_data;
+    struct chardev_ring ring;
     int ret = 0;
     int tmp;
     
@@ -184,12 +404,18 @@ static long chardev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg
         /* Reset buffer */
         memset(data->buffer, 0, data->size);
         data->data_len = 0;
+        kfifo_reset(&data->fifo);
+        chardev_fifo_wake(data, &data->write_wq,
+                          &data->write_want, &data->write_seq);
         pr_info(MODULE_TAG "Buffer reset via ioctl\n");
         break;
         
     case CHARDEV_IOCGETSIZE:
         /* Get buffer size */
-        tmp = (int)data->size;
+        if (data->mode == CHARDEV_MODE_FIFO)
+            tmp = (int)kfifo_size(&data->fifo);
+        else
+            tmp = (int)data->size;
         if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
             ret = -EFAULT;
         break;
@@ -200,12 +426,92 @@ static long chardev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg
         break;
         
     case CHARDEV_IOCGETCOUNT:
-        /* Get data length */
-        tmp = (int)data->data_len;
+        /* Get data length, or bytes queued in FIFO mode */
+        if (data->mode == CHARDEV_MODE_FIFO)
+            tmp = (int)kfifo_len(&data->fifo);
+        else
+            tmp = (int)data->data_len;
         if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
             ret = -EFAULT;
         break;
         
+    case CHARDEV_IOCSETMODE:
+        /* Switch between flat and FIFO mode, emptying the FIFO */
+        if (get_user(tmp, (int __user *)arg)) {
+            ret = -EFAULT;
+            break;
+        }
+        if (tmp != CHARDEV_MODE_FLAT && tmp != CHARDEV_MODE_FIFO) {
+            ret = -EINVAL;
+            break;
+        }
+        /* Other openers may be sleeping on the FIFO */
+        if (data->open_count > 1) {
+            ret = -EBUSY;
+            break;
+        }
+        data->mode = tmp;
+        kfifo_reset(&data->fifo);
+        pr_info(MODULE_TAG "%s mode\n",
+                tmp == CHARDEV_MODE_FIFO ? "FIFO" : "Flat");
+        break;
+        
+    case CHARDEV_IOCSETWAKEUP:
+        /* Set the wakeup batch size, 1 wakes on every transition */
+        if (get_user(tmp, (int __user *)arg)) {
+            ret = -EFAULT;
+            break;
+        }
+        if (tmp < 1 || tmp > (int)kfifo_size(&data->fifo)) {
+            ret = -EINVAL;
+            break;
+        }
+        data->wakeup = tmp;
+        /* Sleepers re-evaluate what they wait for */
+        chardev_fifo_wake(data, &data->read_wq,
+                          &data->read_want, &data->read_seq);
+        chardev_fifo_wake(data, &data->write_wq,
+                          &data->write_want, &data->write_seq);
+        break;
+        
+    case CHARDEV_IOCPUBLISH:
+    case CHARDEV_IOCCONSUME:
+        /* Move the ring positions over data exchanged through mmap */
+        if (data->mode != CHARDEV_MODE_FIFO) {
+            ret = -EINVAL;
+            break;
+        }
+        if (copy_from_user(&ring, (void __user *)arg, sizeof(ring))) {
+            ret = -EFAULT;
+            break;
+        }
+        if (cmd == CHARDEV_IOCPUBLISH) {
+            if (ring.count > kfifo_avail(&data->fifo)) {
+                ret = -EINVAL;
+                break;
+            }
+            tmp = kfifo_len(&data->fifo);
+            kfifo_dma_in_finish(&data->fifo, ring.count);
+            data->write_count++;
+            chardev_fifo_queued(data, tmp);
+        } else {
+            if (ring.count > kfifo_len(&data->fifo)) {
+                ret = -EINVAL;
+                break;
+            }
+            tmp = kfifo_avail(&data->fifo);
+            kfifo_dma_out_finish(&data->fifo, ring.count);
+            data->read_count++;
+            chardev_fifo_freed(data, tmp);
+        }
+        ring.size = kfifo_size(&data->fifo);
+        ring.head = data->fifo.kfifo.in;
+        ring.tail = data->fifo.kfifo.out;
+        ring.count = 0;
+        if (copy_to_user((void __user *)arg, &ring, sizeof(ring)))
+            ret = -EFAULT;
+        break;
+        
     default:
         ret = -ENOTTY;
     }
@@ -219,6 +525,9 @@ static loff_t chardev_llseek(struct file *filp, loff_t offset, int whence)
     struct chardev_data *data = filp->private_data;
     loff_t new_pos;
     
+    if (data->mode == CHARDEV_MODE_FIFO)
+        return -ESPIPE;
+    
     mutex_lock(&data->lock);
     
     switch (whence) {
@@ -247,6 +556,76 @@ static loff_t chardev_llseek(struct file *filp, loff_t offset, int whence)
     return new_pos;
 }
 
+static __poll_t chardev_poll(struct file *filp, poll_table *wait)
+{
+    struct chardev_data *data = filp->private_data;
+    __poll_t mask = 0;
+    
+    /* The flat buffer never blocks */
+    if (data->mode != CHARDEV_MODE_FIFO)
+        return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+    
+    poll_wait(filp, &data->read_wq, wait);
+    poll_wait(filp, &data->write_wq, wait);
+    
+    /* Ready at the batch size the wakeups are batched on */
+    mutex_lock(&data->lock);
+    if (kfifo_len(&data->fifo) >= data->wakeup)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (kfifo_avail(&data->fifo) >= data->wakeup)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    mutex_unlock(&data->lock);
+    
+    return mask;
+}
+
+/*
+ * Map the buffer of the current mode. The FIFO may be mapped up to twice
+ * its size, pages past the end wrapping around to the start.
+ */
+static int chardev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct chardev_data *data = filp->private_data;
+    unsigned long pages = vma_pages(vma);
+    unsigned long npages, limit, i;
+    char *buf;
+    int ret = 0;
+    
+    /* A private mapping would copy on write and never reach the device */
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+    
+    /*
+     * No data->lock here: read() and write() fault user pages in under
+     * it, which takes mmap_lock, already held by our caller. Neither
+     * buffer moves while the module is loaded.
+     */
+    if (data->mode == CHARDEV_MODE_FIFO) {
+        buf = data->fifo.kfifo.data;
+        npages = kfifo_size(&data->fifo) >> PAGE_SHIFT;
+        limit = 2 * npages;
+    } else {
+        buf = data->buffer;
+        npages = PAGE_ALIGN(data->size) >> PAGE_SHIFT;
+        limit = npages;
+    }
+    
+    if (vma->vm_pgoff + pages > limit)
+        return -EINVAL;
+    
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    
+    for (i = 0; i < pages && !ret; i++) {
+        unsigned long page = (vma->vm_pgoff + i) % npages;
+        
+        ret = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE,
+                             vmalloc_to_page(buf + page * PAGE_SIZE));
+    }
+    
+    pr_debug(MODULE_TAG "Mapped %lu pages at page %lu\n", pages, vma->vm_pgoff);
+    return ret;
+}
+
 /* File operations structure */
 static const struct file_operations chardev_fops = {
     .owner          = THIS_MODULE,
@@ -256,12 +635,15 @@ static const struct file_operations chardev_fops = {
     .write          = chardev_write,
     .unlocked_ioctl = chardev_ioctl,
     .llseek         = chardev_llseek,
+    .poll           = chardev_poll,
+    .mmap           = chardev_mmap,
 };
 
 /* ============= Module Init/Exit ============= */
 
 static int __init chardev_init(void)
 {
+    void *fifo_buffer;
     int ret;
     
     pr_info(MODULE_TAG "Loading module...\n");
@@ -274,7 +656,7 @@ static int __init chardev_init(void)
     }
     
     /* Allocate buffer */
-    dev_data->buffer = kzalloc(BUFFER_SIZE, GFP_KERNEL);
+    dev_data->buffer = vmalloc_user(BUFFER_SIZE);
     if (!dev_data->buffer) {
         pr_err(MODULE_TAG "Failed to allocate buffer\n");
         ret = -ENOMEM;
@@ -284,11 +666,28 @@ static int __init chardev_init(void)
     dev_data->size = BUFFER_SIZE;
     mutex_init(&dev_data->lock);
     
+    /* Allocate FIFO mode ring buffer, page aligned for mmap */
+    fifo_size = roundup_pow_of_two(max_t(unsigned int, fifo_size, PAGE_SIZE));
+    fifo_buffer = vmalloc_user(fifo_size);
+    if (!fifo_buffer) {
+        pr_err(MODULE_TAG "Failed to allocate %u byte FIFO\n", fifo_size);
+        ret = -ENOMEM;
+        goto err_free_buffer;
+    }
+    kfifo_init(&dev_data->fifo, fifo_buffer, fifo_size);
+    
+    dev_data->mode = CHARDEV_MODE_FLAT;
+    dev_data->wakeup = 1;
+    dev_data->read_want = 1;
+    dev_data->write_want = 1;
+    init_waitqueue_head(&dev_data->read_wq);
+    init_waitqueue_head(&dev_data->write_wq);
+    
     /* Allocate device number dynamically */
     ret = alloc_chrdev_region(&dev_num, 0, 1, DEVICE_NAME);
     if (ret < 0) {
         pr_err(MODULE_TAG "Failed to allocate device number\n");
-        goto err_free_buffer;
+        goto err_free_fifo;
     }
     
     pr_info(MODULE_TAG "Allocated device number: major=%d, minor=%d\n",
@@ -323,7 +722,8 @@ static int __init chardev_init(void)
     
     pr_info(MODULE_TAG "Module loaded successfully\n");
     pr_info(MODULE_TAG "Device created at /dev/%s\n", DEVICE_NAME);
-    pr_info(MODULE_TAG "Buffer size: %d bytes\n", BUFFER_SIZE);
+    pr_info(MODULE_TAG "Buffer size: %d bytes, FIFO size: %u bytes\n",
+            BUFFER_SIZE, kfifo_size(&dev_data->fifo));
     
     return 0;
 
@@ -333,8 +733,10 @@ err_del_cdev:
     cdev_del(&chardev_cdev);
 err_unreg_chrdev:
     unregister_chrdev_region(dev_num, 1);
+err_free_fifo:
+    vfree(fifo_buffer);
 err_free_buffer:
-    kfree(dev_data->buffer);
+    vfree(dev_data->buffer);
 err_free_data:
     kfree(dev_data);
     return ret;
@@ -352,7 +754,8 @@ static void __exit chardev_exit(void)
     unregister_chrdev_region(dev_num, 1);
     
     mutex_destroy(&dev_data->lock);
-    kfree(dev_data->buffer);
+    vfree(dev_data->fifo.kfifo.data);
+    vfree(dev_data->buffer);
     kfree(dev_data);
     
     pr_info(MODULE_TAG "Module unloaded\n");
@@ -15,13 +15,57 @@
 /* Reset the buffer to zeros */
 #define CHARDEV_IOCRESET    _IO(CHARDEV_IOC_MAGIC, 0)
 
-/* Get buffer size (returns int) */
+/* Get buffer size, or FIFO size in FIFO mode (returns int) */
 #define CHARDEV_IOCGETSIZE  _IOR(CHARDEV_IOC_MAGIC, 1, int)
 
 /* Set buffer size (takes int) - not implemented */
 #define CHARDEV_IOCSETSIZE  _IOW(CHARDEV_IOC_MAGIC, 2, int)
 
-/* Get current data length (returns int) */
+/* Get current data length, or bytes queued in FIFO mode (returns int) */
 #define CHARDEV_IOCGETCOUNT _IOR(CHARDEV_IOC_MAGIC, 3, int)
 
+/*
+ * Set device mode (takes int). Fails with EBUSY while the device is
+ * open more than once. Switching empties the FIFO.
+ */
+#define CHARDEV_IOCSETMODE  _IOW(CHARDEV_IOC_MAGIC, 4, int)
+
+/*
+ * Set FIFO wakeup batch in bytes (takes int, 1..FIFO size, default 1).
+ * poll() reports readable once this many bytes are queued and writable
+ * once this much space is free. A blocking read returns once the batch,
+ * or count bytes if fewer, are queued; a tail shorter than the batch is
+ * picked up with a non-blocking read. Writes block the same way.
+ */
+#define CHARDEV_IOCSETWAKEUP _IOW(CHARDEV_IOC_MAGIC, 5, int)
+
+/*
+ * Zero-copy FIFO access through mmap(MAP_SHARED) of the device, in FIFO
+ * mode. Positions run freely and wrap at 2^32; the bytes queued are
+ * head - tail and a position is at offset pos & (size - 1) of the
+ * mapping. The FIFO may be mapped at up to twice its size, the second
+ * half aliasing the first, so that a span crossing the end of the ring
+ * can be accessed in one piece.
+ */
+struct chardev_ring {
+    unsigned int size;          /* Ring size, a power of two */
+    unsigned int head;          /* Producer position */
+    unsigned int tail;          /* Consumer position */
+    unsigned int count;         /* Bytes to publish or consume */
+};
+
+/*
+ * Producer: count bytes written at head are queued (EINVAL if more than
+ * is free). Consumer: count bytes at tail are released (EINVAL if more
+ * than is queued). Both return the updated ring with count 0, so
+ * count 0 just reads it. Readers and writers are woken as for
+ * read()/write().
+ */
+#define CHARDEV_IOCPUBLISH  _IOWR(CHARDEV_IOC_MAGIC, 6, struct chardev_ring)
+#define CHARDEV_IOCCONSUME  _IOWR(CHARDEV_IOC_MAGIC, 7, struct chardev_ring)
+
+/* Device modes */
+#define CHARDEV_MODE_FLAT 0     /* Seekable 4 KiB buffer (default) */
+#define CHARDEV_MODE_FIFO 1     /* Ring buffer, blocking reads/writes, poll */
+
 #endif /* _CHARDEV_H_ */
@@ -12,11 +12,33 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 
 #include "chardev.h"
 
 #define DEVICE_PATH "/dev/bbbchar"
 
+/* FIFO throughput test */
+#define FIFO_TOTAL  (16 * 1024 * 1024)
+#define FIFO_CHUNK  4096
+
+static double now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Byte at offset off of the test stream */
+static unsigned char pattern(long off)
+{
+    return (unsigned char)(off % 251);
+}
+
 void test_write_read(int fd)
 {
     char write_buf[] = "Hello from BeagleBone Black!";
@@ -120,6 +142,303 @@ void test_seek(int fd)
     printf("Seek -3 from current: position %ld\n", (long)pos);
 }
 
+void test_fifo_nonblock(int fd)
+{
+    char buf[FIFO_CHUNK];
+    int size = 0, flags;
+    long filled = 0;
+    ssize_t bytes;
+    
+    printf("\n=== Test: FIFO Non-blocking ===\n");
+    
+    ioctl(fd, CHARDEV_IOCGETSIZE, &size);
+    flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    
+    /* Empty FIFO */
+    bytes = read(fd, buf, sizeof(buf));
+    if (bytes < 0 && errno == EAGAIN)
+        printf("✓ Read on empty FIFO: EAGAIN\n");
+    else
+        printf("✗ Read on empty FIFO returned %zd\n", bytes);
+    
+    /* Fill it up */
+    memset(buf, 'x', sizeof(buf));
+    while ((bytes = write(fd, buf, sizeof(buf))) > 0)
+        filled += bytes;
+    if (bytes < 0 && errno == EAGAIN && filled == size)
+        printf("✓ Write on full FIFO: EAGAIN after %ld bytes\n", filled);
+    else
+        printf("✗ FIFO took %ld of %d bytes, then returned %zd\n",
+               filled, size, bytes);
+    
+    /* Drain it */
+    while ((bytes = read(fd, buf, sizeof(buf))) > 0)
+        filled -= bytes;
+    if (filled == 0)
+        printf("✓ Drained all bytes\n");
+    else
+        printf("✗ %ld bytes missing after drain\n", filled);
+    
+    fcntl(fd, F_SETFL, flags);
+}
+
+/*
+ * Stream FIFO_TOTAL bytes from a blocking writer in a child process to
+ * a reader polling with O_NONBLOCK, checking every byte. Returns MB/s,
+ * 0 if the stream broke.
+ */
+double test_fifo_throughput(int fd, int wakeup)
+{
+    static unsigned char buf[65536];
+    long off = 0, reads = 0, bad = 0;
+    struct pollfd pfd;
+    double start, elapsed;
+    pid_t pid;
+    int rfd, status;
+    
+    printf("\n=== Test: FIFO Throughput (wakeup %d bytes) ===\n", wakeup);
+    
+    if (ioctl(fd, CHARDEV_IOCSETWAKEUP, &wakeup) < 0) {
+        perror("CHARDEV_IOCSETWAKEUP failed");
+        return 0;
+    }
+    
+    rfd = open(DEVICE_PATH, O_RDONLY | O_NONBLOCK);
+    if (rfd < 0) {
+        perror("open reader failed");
+        return 0;
+    }
+    
+    start = now();
+    
+    pid = fork();
+    if (pid == 0) {
+        unsigned char chunk[FIFO_CHUNK];
+        long woff = 0;
+        int wfd;
+        
+        close(rfd);
+        wfd = open(DEVICE_PATH, O_WRONLY);
+        if (wfd < 0)
+            _exit(1);
+        
+        while (woff < FIFO_TOTAL) {
+            ssize_t n, i;
+            
+            for (i = 0; i < FIFO_CHUNK; i++)
+                chunk[i] = pattern(woff + i);
+            
+            /* Short writes: the rest goes out with the next chunk */
+            n = write(wfd, chunk, FIFO_CHUNK);
+            if (n < 0)
+                _exit(1);
+            woff += n;
+        }
+        
+        close(wfd);
+        _exit(0);
+    }
+    if (pid < 0) {
+        perror("fork failed");
+        close(rfd);
+        return 0;
+    }
+    
+    pfd.fd = rfd;
+    pfd.events = POLLIN;
+    
+    while (off < FIFO_TOTAL) {
+        ssize_t n, i;
+        
+        /*
+         * poll() only fires on a full batch, the timeout picks up a
+         * tail shorter than that.
+         */
+        if (poll(&pfd, 1, 100) < 0) {
+            perror("poll failed");
+            break;
+        }
+        
+        n = read(rfd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EAGAIN)
+                continue;
+            perror("read failed");
+            break;
+        }
+        
+        for (i = 0; i < n; i++)
+            if (buf[i] != pattern(off + i))
+                bad++;
+        off += n;
+        reads++;
+    }
+    
+    elapsed = now() - start;
+    waitpid(pid, &status, 0);
+    close(rfd);
+    
+    printf("Moved %ld bytes in %.3f s: %.1f MB/s, %ld reads of %ld bytes avg\n",
+           off, elapsed, off / elapsed / 1e6, reads, reads ? off / reads : 0);
+    
+    if (off == FIFO_TOTAL && bad == 0 &&
+        WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        printf("✓ Stream verified\n");
+        return off / elapsed / 1e6;
+    }
+    printf("✗ Stream broken: %ld bad bytes, writer status %d\n", bad, status);
+    return 0;
+}
+
+/*
+ * The same stream through the mmap'ed ring: the child writes the
+ * pattern straight into the FIFO and publishes it, the parent checks it
+ * in place and consumes it. Returns MB/s, 0 if the stream broke.
+ */
+double test_fifo_mmap(int fd, int wakeup)
+{
+    struct chardev_ring ring = {0};
+    long off = 0, batches = 0, bad = 0;
+    struct pollfd pfd;
+    double start, elapsed;
+    unsigned char *map;
+    pid_t pid;
+    int status;
+    
+    printf("\n=== Test: FIFO mmap Throughput (wakeup %d bytes) ===\n", wakeup);
+    
+    if (ioctl(fd, CHARDEV_IOCSETWAKEUP, &wakeup) < 0 ||
+        ioctl(fd, CHARDEV_IOCCONSUME, &ring) < 0) {
+        perror("FIFO ioctl failed");
+        return 0;
+    }
+    
+    /* Mapped twice over, so a span across the end of the ring is contiguous */
+    map = mmap(NULL, 2 * ring.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap failed");
+        return 0;
+    }
+    
+    start = now();
+    
+    pid = fork();
+    if (pid == 0) {
+        long woff = 0;
+        
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        ring.count = 0;
+        
+        while (woff < FIFO_TOTAL) {
+            unsigned int space, n, i;
+            unsigned char *dst;
+            
+            /* Publishes the previous chunk, returns where the ring is */
+            if (ioctl(fd, CHARDEV_IOCPUBLISH, &ring) < 0)
+                _exit(1);
+            
+            space = ring.size - (ring.head - ring.tail);
+            if (space == 0) {
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            
+            n = space < FIFO_CHUNK ? space : FIFO_CHUNK;
+            dst = map + (ring.head & (ring.size - 1));
+            for (i = 0; i < n; i++)
+                dst[i] = pattern(woff + i);
+            
+            ring.count = n;
+            woff += n;
+        }
+        
+        if (ioctl(fd, CHARDEV_IOCPUBLISH, &ring) < 0)
+            _exit(1);
+        _exit(0);
+    }
+    if (pid < 0) {
+        perror("fork failed");
+        munmap(map, 2 * ring.size);
+        return 0;
+    }
+    
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    ring.count = 0;
+    
+    while (off < FIFO_TOTAL) {
+        unsigned int avail, i;
+        const unsigned char *src;
+        
+        if (poll(&pfd, 1, 100) < 0) {
+            perror("poll failed");
+            break;
+        }
+        
+        /* Consumes the previous batch, returns what is queued now */
+        if (ioctl(fd, CHARDEV_IOCCONSUME, &ring) < 0) {
+            perror("CHARDEV_IOCCONSUME failed");
+            break;
+        }
+        
+        avail = ring.head - ring.tail;
+        src = map + (ring.tail & (ring.size - 1));
+        for (i = 0; i < avail; i++)
+            if (src[i] != pattern(off + i))
+                bad++;
+        
+        ring.count = avail;
+        off += avail;
+        if (avail)
+            batches++;
+    }
+    ioctl(fd, CHARDEV_IOCCONSUME, &ring);
+    
+    elapsed = now() - start;
+    waitpid(pid, &status, 0);
+    munmap(map, 2 * ring.size);
+    
+    printf("Moved %ld bytes in %.3f s: %.1f MB/s, %ld batches of %ld bytes avg\n",
+           off, elapsed, off / elapsed / 1e6, batches, batches ? off / batches : 0);
+    
+    if (off == FIFO_TOTAL && bad == 0 &&
+        WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        printf("✓ Stream verified\n");
+        return off / elapsed / 1e6;
+    }
+    printf("✗ Stream broken: %ld bad bytes, writer status %d\n", bad, status);
+    return 0;
+}
+
+void test_fifo(int fd)
+{
+    int mode = CHARDEV_MODE_FIFO;
+    int wakeup = 1;
+    double copy, zero_copy;
+    
+    if (ioctl(fd, CHARDEV_IOCSETMODE, &mode) < 0) {
+        perror("CHARDEV_IOCSETMODE failed (device open elsewhere?)");
+        return;
+    }
+    
+    test_fifo_nonblock(fd);
+    
+    /* Wake on every transition from empty, then in 16 KiB batches */
+    test_fifo_throughput(fd, 1);
+    copy = test_fifo_throughput(fd, 16384);
+    
+    zero_copy = test_fifo_mmap(fd, 16384);
+    if (copy > 0 && zero_copy > 0)
+        printf("mmap vs read/write: %.2fx\n", zero_copy / copy);
+    
+    ioctl(fd, CHARDEV_IOCSETWAKEUP, &wakeup);
+    mode = CHARDEV_MODE_FLAT;
+    if (ioctl(fd, CHARDEV_IOCSETMODE, &mode) < 0)
+        perror("CHARDEV_IOCSETMODE failed");
+}
+
 int main(void)
 {
     int fd;
@@ -146,6 +465,9 @@ int main(void)
     ioctl(fd, CHARDEV_IOCRESET);
     test_seek(fd);
     
+    /* Ring buffer mode */
+    test_fifo(fd);
+    
     /* Close device */
     close(fd);
     printf("\nDevice closed. All tests completed!\n");
@@ -0,0 +1,644 @@
+/*
+ * fota_aio.c - Queued O_DIRECT writes for the FOTA client
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/aio_abi.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+#include "fota_aio.h"
+
+#define AIO_ALIGN       4096
+
+enum {
+    ENGINE_URING,
+    ENGINE_KAIO,
+    ENGINE_SYNC,
+    ENGINE_COUNT,
+};
+
+static const char *const engine_names[ENGINE_COUNT] = {
+    "io_uring", "aio", "sync",
+};
+
+static int engine = -1;        /* Selected engine, -1: not chosen yet */
+static unsigned queue_depth = FOTA_AIO_DEFAULT_DEPTH;
+static size_t queue_block = FOTA_AIO_DEFAULT_BLOCK;
+
+struct aio_buf {
+    unsigned char *p;
+    int refs;                   /* Held by the caller, plus writes in flight */
+};
+
+struct aio_op {
+    int buf;                    /* Buffer written from, -1: op is free */
+    const unsigned char *p;
+    size_t len;
+    uint64_t offset;
+    struct iovec iov;           /* io_uring without registered buffers */
+    struct iocb cb;             /* aio */
+};
+
+#ifdef HAVE_IO_URING
+struct uring {
+    int fd;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    int fixed;                  /* Buffers registered with the ring */
+};
+#endif
+
+struct fota_aio {
+    int fd;
+    int engine;
+    unsigned depth;
+    size_t block;
+
+    struct aio_buf bufs[FOTA_AIO_MAX_DEPTH + 1];
+    unsigned nbufs;
+    struct aio_op ops[FOTA_AIO_MAX_DEPTH];
+    unsigned inflight;
+    int failed;
+
+#ifdef HAVE_IO_URING
+    struct uring ring;
+#endif
+    aio_context_t ctx;
+};
+
+/* ============= Helpers ============= */
+
+static int pwrite_all(int fd, const unsigned char *p, size_t len,
+                      uint64_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int find_buf(const struct fota_aio *aio, const unsigned char *p)
+{
+    for (unsigned i = 0; i < aio->nbufs; i++) {
+        if (p >= aio->bufs[i].p && p < aio->bufs[i].p + aio->block)
+            return i;
+    }
+    return -1;
+}
+
+/* A write finished with res (bytes written or -errno) */
+static void complete(struct fota_aio *aio, unsigned i, long long res)
+{
+    struct aio_op *op = &aio->ops[i];
+
+    /* Rare with O_DIRECT: finish a short write in the foreground */
+    if (res >= 0 && (size_t)res < op->len) {
+        if (pwrite_all(aio->fd, op->p + res, op->len - res,
+                       op->offset + res) < 0)
+            res = -errno;
+    }
+
+    if (res < 0) {
+        syslog(LOG_ERR, "aio: write at %llu failed: %s",
+               (unsigned long long)op->offset, strerror(-res));
+        aio->failed = 1;
+    }
+
+    aio->bufs[op->buf].refs--;
+    op->buf = -1;
+    aio->inflight--;
+}
+
+/* ============= io_uring ============= */
+
+#ifdef HAVE_IO_URING
+
+#define load_acquire(p)         __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)     __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg,
+                                 unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_exit(struct uring *r)
+{
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr)
+        munmap(r->sq_ptr, r->sq_size);
+    /* Closing the ring waits for the writes still in flight */
+    if (r->fd >= 0)
+        close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+static int uring_init(struct fota_aio *aio)
+{
+    struct uring *r = &aio->ring;
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_io_uring_setup(aio->depth, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size)
+            r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        goto fail;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    unsigned char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* Pinned once instead of for every write; needs RLIMIT_MEMLOCK room */
+    struct iovec iov[FOTA_AIO_MAX_DEPTH + 1];
+    for (unsigned i = 0; i < aio->nbufs; i++) {
+        iov[i].iov_base = aio->bufs[i].p;
+        iov[i].iov_len = aio->block;
+    }
+    if (aio->nbufs == 0)
+        return 0;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_BUFFERS, iov,
+                              aio->nbufs) == 0)
+        r->fixed = 1;
+    else
+        syslog(LOG_INFO, "aio: cannot register buffers (%s), using vectored writes",
+               strerror(errno));
+    return 0;
+
+fail:
+    uring_exit(r);
+    return -1;
+}
+
+static int uring_submit(struct fota_aio *aio, unsigned i)
+{
+    struct uring *r = &aio->ring;
+    struct aio_op *op = &aio->ops[i];
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (r->fixed) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = (uintptr_t)op->p;
+        sqe->len = op->len;
+        sqe->buf_index = op->buf;
+    } else {
+        op->iov.iov_base = (void *)op->p;
+        op->iov.iov_len = op->len;
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uintptr_t)&op->iov;
+        sqe->len = 1;
+    }
+    sqe->fd = aio->fd;
+    sqe->off = op->offset;
+    sqe->user_data = i;
+
+    r->sq_array[idx] = idx;
+    store_release(r->sq_tail, tail + 1);
+
+    for (;;) {
+        int n = sys_io_uring_enter(r->fd, 1, 0, 0);
+        if (n == 1)
+            return 0;
+        if (n < 0 && errno == EINTR)
+            continue;
+        syslog(LOG_ERR, "aio: io_uring_enter failed: %s",
+               n < 0 ? strerror(errno) : "nothing submitted");
+        return -1;
+    }
+}
+
+static int uring_reap(struct fota_aio *aio, int wait)
+{
+    struct uring *r = &aio->ring;
+
+    if (wait && sys_io_uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+        errno != EINTR) {
+        syslog(LOG_ERR, "aio: io_uring_enter failed: %s", strerror(errno));
+        return -1;
+    }
+
+    unsigned head = *r->cq_head;
+    unsigned tail = load_acquire(r->cq_tail);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        complete(aio, cqe->user_data, cqe->res);
+        head++;
+    }
+    store_release(r->cq_head, head);
+    return 0;
+}
+
+#endif /* HAVE_IO_URING */
+
+/* ============= Linux AIO ============= */
+
+static int kaio_submit(struct fota_aio *aio, unsigned i)
+{
+    struct aio_op *op = &aio->ops[i];
+    struct iocb *cbs[1] = { &op->cb };
+
+    memset(&op->cb, 0, sizeof(op->cb));
+    op->cb.aio_data = i;
+    op->cb.aio_lio_opcode = IOCB_CMD_PWRITE;
+    op->cb.aio_fildes = aio->fd;
+    op->cb.aio_buf = (uintptr_t)op->p;
+    op->cb.aio_nbytes = op->len;
+    op->cb.aio_offset = op->offset;
+
+    for (;;) {
+        long n = syscall(__NR_io_submit, aio->ctx, 1, cbs);
+        if (n == 1)
+            return 0;
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        syslog(LOG_ERR, "aio: io_submit failed: %s",
+               n < 0 ? strerror(errno) : "nothing submitted");
+        return -1;
+    }
+}
+
+static int kaio_reap(struct fota_aio *aio, int wait)
+{
+    struct io_event ev[FOTA_AIO_MAX_DEPTH];
+    struct timespec zero = { 0, 0 };
+
+    long n = syscall(__NR_io_getevents, aio->ctx, wait ? 1 : 0,
+                     (long)aio->depth, ev, wait ? NULL : &zero);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        syslog(LOG_ERR, "aio: io_getevents failed: %s", strerror(errno));
+        return -1;
+    }
+    for (long e = 0; e < n; e++)
+        complete(aio, ev[e].data, ev[e].res);
+    return 0;
+}
+
+/* ============= Engine dispatch ============= */
+
+static int engine_init(struct fota_aio *aio)
+{
+    switch (aio->engine) {
+#ifdef HAVE_IO_URING
+    case ENGINE_URING:
+        return uring_init(aio);
+#endif
+    case ENGINE_KAIO:
+        aio->ctx = 0;
+        return syscall(__NR_io_setup, aio->depth, &aio->ctx) < 0 ? -1 : 0;
+    case ENGINE_SYNC:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static void engine_exit(struct fota_aio *aio)
+{
+#ifdef HAVE_IO_URING
+    if (aio->engine == ENGINE_URING)
+        uring_exit(&aio->ring);
+#endif
+    /* Like closing the ring, this waits for what is in flight */
+    if (aio->engine == ENGINE_KAIO)
+        syscall(__NR_io_destroy, aio->ctx);
+}
+
+static int engine_submit(struct fota_aio *aio, unsigned i)
+{
+#ifdef HAVE_IO_URING
+    if (aio->engine == ENGINE_URING)
+        return uring_submit(aio, i);
+#endif
+    return kaio_submit(aio, i);
+}
+
+/*
+ * Collect finished writes, wait for at least one if wait is set
+ * Returns -1 if the queue itself failed; the writes in flight are then
+ * given up (the memory stays valid until engine_exit() has waited).
+ */
+static int reap(struct fota_aio *aio, int wait)
+{
+    int ret;
+
+    if (aio->inflight == 0)
+        return 0;
+
+#ifdef HAVE_IO_URING
+    if (aio->engine == ENGINE_URING)
+        ret = uring_reap(aio, wait);
+    else
+#endif
+        ret = kaio_reap(aio, wait);
+
+    if (ret < 0) {
+        aio->failed = 1;
+        aio->inflight = 0;
+    }
+    return ret;
+}
+
+/* ============= Public API ============= */
+
+int fota_aio_engine_available(int i)
+{
+    struct fota_aio probe;
+
+    if (i < 0 || i >= ENGINE_COUNT)
+        return 0;
+
+    /* Sandboxes and kernel.io_uring_disabled make setup fail */
+    memset(&probe, 0, sizeof(probe));
+    probe.engine = i;
+    probe.depth = 1;
+    if (engine_init(&probe) < 0)
+        return 0;
+    engine_exit(&probe);
+    return 1;
+}
+
+const char *fota_aio_engine_name(int i)
+{
+    return i >= 0 && i < ENGINE_COUNT ? engine_names[i] : NULL;
+}
+
+int fota_aio_select(const char *name)
+{
+    if (!name || strcmp(name, "auto") == 0) {
+        for (int i = 0; i < ENGINE_COUNT; i++) {
+            if (fota_aio_engine_available(i)) {
+                engine = i;
+                return 0;
+            }
+        }
+        return -1;
+    }
+
+    for (int i = 0; i < ENGINE_COUNT; i++) {
+        if (strcmp(name, engine_names[i]) == 0) {
+            if (!fota_aio_engine_available(i))
+                return -1;
+            engine = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *fota_aio_engine(void)
+{
+    if (engine < 0)
+        fota_aio_select(NULL);
+    return engine_names[engine];
+}
+
+void fota_aio_set_queue(unsigned depth, size_t block_size)
+{
+    if (depth < 1)
+        depth = 1;
+    if (depth > FOTA_AIO_MAX_DEPTH)
+        depth = FOTA_AIO_MAX_DEPTH;
+    if (block_size < FOTA_AIO_MIN_BLOCK)
+        block_size = FOTA_AIO_MIN_BLOCK;
+    if (block_size > FOTA_AIO_MAX_BLOCK)
+        block_size = FOTA_AIO_MAX_BLOCK;
+
+    queue_depth = depth;
+    queue_block = block_size - block_size % FOTA_AIO_MIN_BLOCK;
+}
+
+fota_aio_t *fota_aio_new(int fd, int async)
+{
+    struct fota_aio *aio = calloc(1, sizeof(*aio));
+    if (!aio)
+        return NULL;
+
+    if (engine < 0)
+        fota_aio_select(NULL);
+
+    aio->fd = fd;
+    aio->engine = async ? engine : ENGINE_SYNC;
+    aio->depth = aio->engine == ENGINE_SYNC ? 1 : queue_depth;
+    aio->block = queue_block;
+    aio->nbufs = aio->engine == ENGINE_SYNC ? 1 : aio->depth + 1;
+#ifdef HAVE_IO_URING
+    aio->ring.fd = -1;
+#endif
+
+    for (unsigned i = 0; i < aio->nbufs; i++) {
+        if (posix_memalign((void **)&aio->bufs[i].p, AIO_ALIGN, aio->block) != 0) {
+            aio->bufs[i].p = NULL;
+            goto fail;
+        }
+    }
+    for (unsigned i = 0; i < aio->depth; i++)
+        aio->ops[i].buf = -1;
+
+    if (engine_init(aio) < 0) {
+        syslog(LOG_WARNING, "aio: cannot set up %s (%s), writing synchronously",
+               engine_names[aio->engine], strerror(errno));
+        aio->engine = ENGINE_SYNC;
+        aio->depth = 1;
+    }
+    return aio;
+
+fail:
+    for (unsigned i = 0; i < aio->nbufs; i++)
+        free(aio->bufs[i].p);
+    free(aio);
+    return NULL;
+}
+
+size_t fota_aio_block_size(const fota_aio_t *aio)
+{
+    return aio->block;
+}
+
+unsigned char *fota_aio_get(fota_aio_t *aio)
+{
+    for (;;) {
+        if (aio->failed)
+            return NULL;
+
+        for (unsigned i = 0; i < aio->nbufs; i++) {
+            if (aio->bufs[i].refs == 0) {
+                aio->bufs[i].refs = 1;
+                return aio->bufs[i].p;
+            }
+        }
+
+        /* All buffers held by the caller: nothing will come back */
+        if (aio->inflight == 0 || reap(aio, 1) < 0)
+            return NULL;
+    }
+}
+
+int fota_aio_write(fota_aio_t *aio, const unsigned char *p, size_t len,
+                   uint64_t offset)
+{
+    int b = find_buf(aio, p);
+
+    if (aio->failed || b < 0 || p + len > aio->bufs[b].p + aio->block)
+        return -1;
+
+    if (aio->engine == ENGINE_SYNC) {
+        if (pwrite_all(aio->fd, p, len, offset) < 0) {
+            syslog(LOG_ERR, "aio: write at %llu failed: %s",
+                   (unsigned long long)offset, strerror(errno));
+            aio->failed = 1;
+            return -1;
+        }
+        return 0;
+    }
+
+    while (aio->inflight == aio->depth) {
+        if (reap(aio, 1) < 0)
+            return -1;
+    }
+    if (aio->failed)
+        return -1;
+
+    unsigned i = 0;
+    while (aio->ops[i].buf >= 0)
+        i++;
+
+    struct aio_op *op = &aio->ops[i];
+    op->buf = b;
+    op->p = p;
+    op->len = len;
+    op->offset = offset;
+    aio->bufs[b].refs++;
+    aio->inflight++;
+
+    if (engine_submit(aio, i) < 0) {
+        aio->bufs[b].refs--;
+        op->buf = -1;
+        aio->inflight--;
+        aio->failed = 1;
+        return -1;
+    }
+
+    /* Free what has finished meanwhile, without waiting */
+    return reap(aio, 0) < 0 || aio->failed ? -1 : 0;
+}
+
+void fota_aio_put(fota_aio_t *aio, unsigned char *buf)
+{
+    int b = find_buf(aio, buf);
+
+    if (b >= 0 && aio->bufs[b].refs > 0)
+        aio->bufs[b].refs--;
+}
+
+int fota_aio_drain(fota_aio_t *aio)
+{
+    while (aio->inflight > 0) {
+        if (reap(aio, 1) < 0)
+            break;
+    }
+    return aio->failed ? -1 : 0;
+}
+
+void fota_aio_free(fota_aio_t *aio)
+{
+    if (!aio)
+        return;
+
+    fota_aio_drain(aio);
+    engine_exit(aio);
+    for (unsigned i = 0; i < aio->nbufs; i++)
+        free(aio->bufs[i].p);
+    free(aio);
+}
@@ -0,0 +1,98 @@
+/*
+ * fota_aio.h - Queued O_DIRECT writes for the FOTA client
+ *
+ * A synchronous O_DIRECT write keeps exactly one request at the device:
+ * while the controller works on it, the client waits, and while the
+ * client fills the next buffer, the device idles. eMMC and SD hosts
+ * reach their throughput with several requests outstanding (the MMC
+ * core prepares the next request while one transfers). This writer
+ * keeps up to a queue depth of writes in flight from a pool of aligned
+ * buffers of the configured block size.
+ *
+ * Engines, tried in this order for "auto":
+ *   io_uring  Raw io_uring_setup()/io_uring_enter() syscalls, no
+ *             liburing. The buffer pool is registered with the ring
+ *             (IORING_REGISTER_BUFFERS) so the kernel does not map the
+ *             pages for every write; without a memlock allowance for
+ *             that, plain vectored writes are used.
+ *   aio       Linux native AIO (io_setup()/io_submit()), the interface
+ *             libaio wraps, called directly. Asynchronous for O_DIRECT.
+ *   sync      pwrite(), one write at a time.
+ *
+ * The engine is picked once per process (io_engine in fota.conf);
+ * kernels or sandboxes without io_uring fall back to the next one.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_AIO_H_
+#define _FOTA_AIO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FOTA_AIO_DEFAULT_DEPTH  4
+#define FOTA_AIO_DEFAULT_BLOCK  (1024 * 1024)
+#define FOTA_AIO_MAX_DEPTH      64
+#define FOTA_AIO_MIN_BLOCK      4096
+#define FOTA_AIO_MAX_BLOCK      (16 * 1024 * 1024)
+
+typedef struct fota_aio fota_aio_t;
+
+/*
+ * Use the named engine ("io_uring", "aio", "sync"), or the best one
+ * available for NULL/"auto".
+ * Returns 0, or -1 if the engine is unknown or not available here
+ */
+int fota_aio_select(const char *name);
+
+/* Name of the engine in use */
+const char *fota_aio_engine(void);
+
+/* Enumerate engines: name of engine i (NULL past the end) */
+const char *fota_aio_engine_name(int i);
+
+/* Can engine i be used on this kernel? */
+int fota_aio_engine_available(int i);
+
+/*
+ * Writes in flight and bytes per buffer for writers created from now
+ * on. Out of range values are clamped, the block size is rounded down
+ * to a multiple of FOTA_AIO_MIN_BLOCK.
+ */
+void fota_aio_set_queue(unsigned depth, size_t block_size);
+
+/*
+ * Writer for fd, which should be open with O_DIRECT unless async is 0.
+ * async = 0 forces the sync engine (buffered files).
+ */
+fota_aio_t *fota_aio_new(int fd, int async);
+
+/* Size of the buffers handed out by fota_aio_get() */
+size_t fota_aio_block_size(const fota_aio_t *aio);
+
+/*
+ * A free buffer, waiting for a write to complete if all are busy.
+ * Returns NULL once a write has failed.
+ */
+unsigned char *fota_aio_get(fota_aio_t *aio);
+
+/*
+ * Queue a write of len bytes at p, which lies in a buffer from
+ * fota_aio_get() that has not been put back yet. The data must not be
+ * changed until the buffer is reused. Returns 0, or -1 on failure (also
+ * of an earlier write).
+ */
+int fota_aio_write(fota_aio_t *aio, const unsigned char *p, size_t len,
+                   uint64_t offset);
+
+/* Done with buf: it is reused once its queued writes have completed */
+void fota_aio_put(fota_aio_t *aio, unsigned char *buf);
+
+/* Wait for all queued writes, returns 0 or -1 if any failed */
+int fota_aio_drain(fota_aio_t *aio);
+
+/* Drain and free the writer (the fd stays open) */
+void fota_aio_free(fota_aio_t *aio);
+
+#endif /* _FOTA_AIO_H_ */
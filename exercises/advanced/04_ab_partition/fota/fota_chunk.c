@@ -0,0 +1,552 @@
+/*
+ * fota_chunk.c - Content-defined chunks for deduplicated rootfs updates
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "fota_chunk.h"
+#include "fota_stream.h"
+
+#define SCAN_BUF_SIZE (1024 * 1024)
+
+/* Bytes that still influence the gear hash */
+#define GEAR_WINDOW 64
+
+/*
+ * Gear table: 256 pseudo-random 64-bit values. Generated with
+ * splitmix64 from a fixed seed so that the build host and every client
+ * cut at exactly the same places.
+ */
+static uint64_t gear[256];
+static int gear_ready;
+
+static void gear_init(void)
+{
+    uint64_t x = 0x464f544143444331ULL;  /* "FOTACDC1" */
+
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    gear_ready = 1;
+}
+
+/* n one bits at the top, where the gear hash mixes best */
+static uint64_t top_bits(int n)
+{
+    return ((1ULL << n) - 1) << (64 - n);
+}
+
+void fota_chunker_init(fota_chunker_t *c, uint32_t min_size,
+                       uint32_t avg_size, uint32_t max_size)
+{
+    int bits = 0;
+
+    if (!gear_ready)
+        gear_init();
+
+    while ((2U << bits) <= avg_size)
+        bits++;
+
+    memset(c, 0, sizeof(*c));
+    c->min_size = min_size;
+    c->avg_size = avg_size;
+    c->max_size = max_size;
+
+    /*
+     * Normalized chunking: cuts are harder to hit before avg_size and
+     * easier after it, which narrows the size distribution around avg.
+     */
+    c->mask_s = top_bits(bits + 2);
+    c->mask_l = top_bits(bits - 2);
+}
+
+size_t fota_chunker_next(fota_chunker_t *c, const unsigned char *buf,
+                         size_t len)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        /*
+         * No cut before min_size, and the hash only depends on the
+         * last GEAR_WINDOW bytes, so the start of a chunk is skipped.
+         */
+        if (c->len + GEAR_WINDOW < c->min_size) {
+            size_t skip = c->min_size - GEAR_WINDOW - c->len;
+            if (skip > len - i)
+                skip = len - i;
+            c->len += skip;
+            i += skip;
+            continue;
+        }
+
+        c->hash = (c->hash << 1) + gear[buf[i++]];
+        c->len++;
+
+        if (c->len < c->min_size)
+            continue;
+        if (c->len >= c->max_size ||
+            !(c->hash & (c->len < c->avg_size ? c->mask_s : c->mask_l))) {
+            c->len = 0;
+            c->hash = 0;
+            return i;
+        }
+    }
+    return 0;
+}
+
+/* ============= Index ============= */
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> (8 * i);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = v >> (8 * i);
+}
+
+static int sizes_valid(uint32_t min_size, uint32_t avg_size, uint32_t max_size)
+{
+    return min_size > GEAR_WINDOW && min_size <= avg_size &&
+           avg_size <= max_size && max_size <= FOTA_CHUNK_LIMIT;
+}
+
+int fota_chunk_index_parse(const void *buf, size_t len,
+                           fota_chunk_index_t *idx)
+{
+    const unsigned char *p = buf;
+    uint64_t offset = 0;
+    size_t i;
+
+    memset(idx, 0, sizeof(*idx));
+
+    if (len < FOTA_CHUNK_HEADER_SIZE ||
+        memcmp(p, FOTA_CHUNK_MAGIC, 8) != 0) {
+        syslog(LOG_ERR, "Chunk index: bad magic");
+        return -1;
+    }
+
+    idx->min_size = get_le32(p + 8);
+    idx->avg_size = get_le32(p + 12);
+    idx->max_size = get_le32(p + 16);
+    idx->image_size = get_le64(p + 24);
+    uint64_t count = get_le64(p + 32);
+
+    if (!sizes_valid(idx->min_size, idx->avg_size, idx->max_size) ||
+        count != (len - FOTA_CHUNK_HEADER_SIZE) / FOTA_CHUNK_ENTRY_SIZE ||
+        (len - FOTA_CHUNK_HEADER_SIZE) % FOTA_CHUNK_ENTRY_SIZE) {
+        syslog(LOG_ERR, "Chunk index: bad header");
+        return -1;
+    }
+
+    idx->chunks = calloc(count ? count : 1, sizeof(fota_chunk_t));
+    if (!idx->chunks)
+        return -1;
+    idx->count = count;
+
+    p += FOTA_CHUNK_HEADER_SIZE;
+    for (i = 0; i < count; i++, p += FOTA_CHUNK_ENTRY_SIZE) {
+        fota_chunk_t *c = &idx->chunks[i];
+
+        memcpy(c->id, p, sizeof(c->id));
+        c->size = get_le32(p + 32);
+        c->offset = offset;
+        if (c->size == 0 || c->size > idx->max_size)
+            break;
+        offset += c->size;
+    }
+
+    if (i < count || offset != idx->image_size) {
+        syslog(LOG_ERR, "Chunk index: chunks do not add up to the image");
+        fota_chunk_index_free(idx);
+        return -1;
+    }
+    return 0;
+}
+
+int fota_chunk_index_load(const char *path, fota_chunk_index_t *idx)
+{
+    struct stat st;
+    unsigned char *buf;
+    int ret = -1;
+
+    memset(idx, 0, sizeof(*idx));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0 || st.st_size < FOTA_CHUNK_HEADER_SIZE)
+        goto out;
+
+    buf = malloc(st.st_size);
+    if (!buf)
+        goto out;
+
+    if (read(fd, buf, st.st_size) == st.st_size)
+        ret = fota_chunk_index_parse(buf, st.st_size, idx);
+    free(buf);
+
+out:
+    close(fd);
+    return ret;
+}
+
+int fota_chunk_index_save(const char *path, const fota_chunk_index_t *idx)
+{
+    unsigned char hdr[FOTA_CHUNK_HEADER_SIZE] = {0};
+    unsigned char entry[FOTA_CHUNK_ENTRY_SIZE];
+    char tmp[PATH_MAX];
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        syslog(LOG_ERR, "Cannot write chunk index %s: %s", tmp, strerror(errno));
+        return -1;
+    }
+
+    memcpy(hdr, FOTA_CHUNK_MAGIC, 8);
+    put_le32(hdr + 8, idx->min_size);
+    put_le32(hdr + 12, idx->avg_size);
+    put_le32(hdr + 16, idx->max_size);
+    put_le64(hdr + 24, idx->image_size);
+    put_le64(hdr + 32, idx->count);
+    fwrite(hdr, 1, sizeof(hdr), fp);
+
+    for (size_t i = 0; i < idx->count; i++) {
+        memcpy(entry, idx->chunks[i].id, 32);
+        put_le32(entry + 32, idx->chunks[i].size);
+        fwrite(entry, 1, sizeof(entry), fp);
+    }
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        fclose(fp);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(fp);
+
+    if (rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int index_append(fota_chunk_index_t *idx, size_t *alloc,
+                        fota_sha256_ctx *sha, uint32_t size)
+{
+    if (idx->count == *alloc) {
+        size_t n = *alloc ? *alloc * 2 : 1024;
+        fota_chunk_t *chunks = realloc(idx->chunks, n * sizeof(*chunks));
+        if (!chunks)
+            return -1;
+        idx->chunks = chunks;
+        *alloc = n;
+    }
+
+    fota_chunk_t *c = &idx->chunks[idx->count++];
+    fota_sha256_final(sha, c->id);
+    c->size = size;
+    c->offset = idx->image_size;
+    idx->image_size += size;
+
+    fota_sha256_init(sha);
+    return 0;
+}
+
+int fota_chunk_index_scan(const char *path, uint64_t limit,
+                          fota_chunk_index_t *idx)
+{
+    fota_chunker_t chunker;
+    fota_sha256_ctx sha;
+    size_t alloc = 0;
+    uint64_t total = 0;
+    int ret = -1;
+
+    if (!sizes_valid(idx->min_size, idx->avg_size, idx->max_size))
+        return -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Cannot open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    unsigned char *buf = malloc(SCAN_BUF_SIZE);
+    if (!buf)
+        goto out;
+
+    /* Chunks appear in image order, so the size counter is the offset */
+    idx->image_size = 0;
+    idx->count = 0;
+    fota_chunker_init(&chunker, idx->min_size, idx->avg_size, idx->max_size);
+    fota_sha256_init(&sha);
+
+    for (;;) {
+        size_t want = SCAN_BUF_SIZE;
+        if (limit && limit - total < want)
+            want = limit - total;
+        if (want == 0)
+            break;
+
+        ssize_t got = read(fd, buf, want);
+        if (got < 0) {
+            syslog(LOG_ERR, "Cannot read %s: %s", path, strerror(errno));
+            goto out;
+        }
+        if (got == 0)
+            break;
+        total += got;
+
+        unsigned char *p = buf;
+        size_t left = got;
+        while (left > 0) {
+            uint32_t pending = chunker.len;
+            size_t n = fota_chunker_next(&chunker, p, left);
+
+            if (n == 0) {
+                fota_sha256_update(&sha, p, left);
+                break;
+            }
+            fota_sha256_update(&sha, p, n);
+            if (index_append(idx, &alloc, &sha, pending + n) < 0)
+                goto out;
+            p += n;
+            left -= n;
+        }
+    }
+
+    if (chunker.len > 0 && index_append(idx, &alloc, &sha, chunker.len) < 0)
+        goto out;
+    ret = 0;
+
+out:
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+static int compare_id(const void *a, const void *b)
+{
+    const fota_chunk_t *ca = *(const fota_chunk_t *const *)a;
+    const fota_chunk_t *cb = *(const fota_chunk_t *const *)b;
+
+    return memcmp(ca->id, cb->id, sizeof(ca->id));
+}
+
+int fota_chunk_index_sort(fota_chunk_index_t *idx)
+{
+    free(idx->by_id);
+    idx->by_id = malloc((idx->count ? idx->count : 1) * sizeof(fota_chunk_t *));
+    if (!idx->by_id)
+        return -1;
+
+    for (size_t i = 0; i < idx->count; i++)
+        idx->by_id[i] = &idx->chunks[i];
+    qsort(idx->by_id, idx->count, sizeof(fota_chunk_t *), compare_id);
+    return 0;
+}
+
+const fota_chunk_t *fota_chunk_index_find(const fota_chunk_index_t *idx,
+                                          const unsigned char *id)
+{
+    fota_chunk_t key;
+    const fota_chunk_t *keyp = &key;
+
+    if (!idx->by_id)
+        return NULL;
+
+    memcpy(key.id, id, sizeof(key.id));
+    fota_chunk_t **hit = bsearch(&keyp, idx->by_id, idx->count,
+                                 sizeof(fota_chunk_t *), compare_id);
+    return hit ? *hit : NULL;
+}
+
+void fota_chunk_index_free(fota_chunk_index_t *idx)
+{
+    free(idx->chunks);
+    free(idx->by_id);
+    idx->chunks = NULL;
+    idx->by_id = NULL;
+    idx->count = 0;
+}
+
+int fota_chunk_verify(const unsigned char *id, const void *buf, size_t len)
+{
+    unsigned char hash[FOTA_SHA256_DIGEST_LENGTH];
+
+    fota_sha256(buf, len, hash);
+    return memcmp(hash, id, sizeof(hash)) == 0;
+}
+
+/* ============= Cache ============= */
+
+static void cache_path(const char *dir, const fota_chunk_t *chunk,
+                       char *path, size_t len)
+{
+    char hex[65];
+
+    fota_sha256_hex(chunk->id, hex);
+    snprintf(path, len, "%s/%s", dir, hex);
+}
+
+int fota_chunk_cache_get(const char *dir, const fota_chunk_t *chunk,
+                         unsigned char *buf)
+{
+    char path[PATH_MAX];
+    ssize_t got;
+
+    cache_path(dir, chunk, path, sizeof(path));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    got = read(fd, buf, chunk->size);
+    close(fd);
+
+    if (got != (ssize_t)chunk->size || !fota_chunk_verify(chunk->id, buf, got)) {
+        syslog(LOG_WARNING, "Dropping corrupt cached chunk %s", path);
+        unlink(path);
+        return -1;
+    }
+
+    /* Recently used, see fota_chunk_cache_prune() */
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return 0;
+}
+
+int fota_chunk_cache_put(const char *dir, const fota_chunk_t *chunk,
+                         const unsigned char *buf)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 4];
+
+    cache_path(dir, chunk, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    /* Not synced: a torn file fails verification and is fetched again */
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Cannot cache chunk %s: %s", tmp, strerror(errno));
+        return -1;
+    }
+    if (write(fd, buf, chunk->size) != (ssize_t)chunk->size) {
+        syslog(LOG_ERR, "Cannot cache chunk %s: %s", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int fota_chunk_cache_has(const char *dir, const fota_chunk_t *chunk)
+{
+    char path[PATH_MAX];
+
+    cache_path(dir, chunk, path, sizeof(path));
+    return access(path, F_OK) == 0;
+}
+
+typedef struct {
+    char name[72];
+    uint64_t size;
+    time_t mtime;
+} cache_entry_t;
+
+static int compare_mtime(const void *a, const void *b)
+{
+    const cache_entry_t *ea = a, *eb = b;
+
+    return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+void fota_chunk_cache_prune(const char *dir, uint64_t max_bytes)
+{
+    cache_entry_t *entries = NULL;
+    size_t count = 0, alloc = 0;
+    uint64_t total = 0;
+    struct dirent *de;
+    struct stat st;
+
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+
+    int dfd = dirfd(d);
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.' ||
+            fstatat(dfd, de->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        /* Leftovers of interrupted downloads and writes */
+        if (strlen(de->d_name) != 64) {
+            unlinkat(dfd, de->d_name, 0);
+            continue;
+        }
+
+        if (count == alloc) {
+            size_t n = alloc ? alloc * 2 : 256;
+            cache_entry_t *e = realloc(entries, n * sizeof(*e));
+            if (!e)
+                break;
+            entries = e;
+            alloc = n;
+        }
+        snprintf(entries[count].name, sizeof(entries[count].name), "%s",
+                 de->d_name);
+        entries[count].size = st.st_size;
+        entries[count].mtime = st.st_mtime;
+        total += st.st_size;
+        count++;
+    }
+
+    qsort(entries, count, sizeof(*entries), compare_mtime);
+
+    size_t removed = 0;
+    for (size_t i = 0; i < count && total > max_bytes; i++) {
+        unlinkat(dfd, entries[i].name, 0);
+        total -= entries[i].size;
+        removed++;
+    }
+
+    if (removed)
+        syslog(LOG_INFO, "Chunk cache: removed %zu chunks, %llu bytes left",
+               removed, (unsigned long long)total);
+
+    free(entries);
+    closedir(d);
+}
@@ -0,0 +1,128 @@
+/*
+ * fota_chunk.h - Content-defined chunks for deduplicated rootfs updates
+ *
+ * A rootfs_chunked update describes the new root image as a list of
+ * variable-size chunks, each named by the SHA256 of its contents.
+ * Chunk boundaries are picked by a rolling hash over the data itself
+ * (FastCDC-style gear hash), so an insertion or deletion only changes
+ * the chunks around it and successive releases share most chunks.
+ *
+ * The client assembles the new image from chunks it already has, in
+ * the active slot or in the local chunk cache, and downloads only the
+ * others from the chunk store:
+ *
+ *   <chunk_url>/<first 4 hex digits>/<sha256 hex>
+ *
+ * Chunks are stored gzip-compressed or plain, as rootfs_compression
+ * says. Index format (all integers little-endian):
+ *
+ *   header:  "FOTACIX1"  u32 min_size  u32 avg_size  u32 max_size
+ *            u32 flags(0)  u64 image_size  u64 count
+ *   entries: u8 sha256[32]  u32 size      count times, in image order
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_CHUNK_H_
+#define _FOTA_CHUNK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fota_sha256.h"
+
+#define FOTA_CHUNK_MAGIC        "FOTACIX1"
+#define FOTA_CHUNK_HEADER_SIZE  40
+#define FOTA_CHUNK_ENTRY_SIZE   36
+
+/* Default chunk sizes, as used by casync */
+#define FOTA_CHUNK_MIN_SIZE     (16 * 1024)
+#define FOTA_CHUNK_AVG_SIZE     (64 * 1024)
+#define FOTA_CHUNK_MAX_SIZE     (256 * 1024)
+
+/* Upper bound accepted from an index */
+#define FOTA_CHUNK_LIMIT        (4 * 1024 * 1024)
+
+typedef struct {
+    unsigned char id[FOTA_SHA256_DIGEST_LENGTH];
+    uint32_t size;
+    uint64_t offset;            /* Position in the image */
+} fota_chunk_t;
+
+typedef struct {
+    uint32_t min_size, avg_size, max_size;
+    uint64_t image_size;
+    size_t count;
+    fota_chunk_t *chunks;       /* In image order */
+    fota_chunk_t **by_id;       /* Sorted for lookups, see _sort() */
+} fota_chunk_index_t;
+
+/*
+ * Rolling chunker. Feed the data in order with fota_chunker_next():
+ * it returns n > 0 if the current chunk ends after buf[n - 1], or 0
+ * if all of buf belongs to the current chunk. Whatever is pending at
+ * the end of the data is the last chunk.
+ */
+typedef struct {
+    uint32_t min_size, avg_size, max_size;
+    uint64_t mask_s, mask_l;    /* Cut masks below / above avg_size */
+    uint64_t hash;
+    uint32_t len;               /* Bytes in the current chunk */
+} fota_chunker_t;
+
+void fota_chunker_init(fota_chunker_t *c, uint32_t min_size,
+                       uint32_t avg_size, uint32_t max_size);
+
+size_t fota_chunker_next(fota_chunker_t *c, const unsigned char *buf,
+                         size_t len);
+
+/* Parse an index received from the server, returns 0 or -1 */
+int fota_chunk_index_parse(const void *buf, size_t len,
+                           fota_chunk_index_t *idx);
+
+/* Read an index file, returns 0 or -1 */
+int fota_chunk_index_load(const char *path, fota_chunk_index_t *idx);
+
+/* Atomically write an index file, returns 0 or -1 */
+int fota_chunk_index_save(const char *path, const fota_chunk_index_t *idx);
+
+/*
+ * Chunk the first limit bytes of a file or block device (all of it
+ * for 0) with the chunk sizes already set in idx. Returns 0 or -1.
+ */
+int fota_chunk_index_scan(const char *path, uint64_t limit,
+                          fota_chunk_index_t *idx);
+
+/* Prepare for fota_chunk_index_find(), returns 0 or -1 */
+int fota_chunk_index_sort(fota_chunk_index_t *idx);
+
+/* A chunk with this id, NULL if there is none */
+const fota_chunk_t *fota_chunk_index_find(const fota_chunk_index_t *idx,
+                                          const unsigned char *id);
+
+void fota_chunk_index_free(fota_chunk_index_t *idx);
+
+/* Does buf hash to id? */
+int fota_chunk_verify(const unsigned char *id, const void *buf, size_t len);
+
+/*
+ * Local chunk cache: verified chunks, uncompressed, one file each,
+ * named by the hex id. Used chunks are touched, pruning removes the
+ * least recently used ones first.
+ */
+
+/* Read a cached chunk into buf and check it, returns 0 or -1 */
+int fota_chunk_cache_get(const char *dir, const fota_chunk_t *chunk,
+                         unsigned char *buf);
+
+/* Add a verified chunk, returns 0 or -1 */
+int fota_chunk_cache_put(const char *dir, const fota_chunk_t *chunk,
+                         const unsigned char *buf);
+
+/* Does the cache have a file for this chunk? (not verified) */
+int fota_chunk_cache_has(const char *dir, const fota_chunk_t *chunk);
+
+/* Shrink the cache to max_bytes, drop partial downloads */
+void fota_chunk_cache_prune(const char *dir, uint64_t max_bytes);
+
+#endif /* _FOTA_CHUNK_H_ */
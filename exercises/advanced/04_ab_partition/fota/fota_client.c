@@ -4,21 +4,47 @@
  *
  * Features:
  *   - Periodic check for firmware updates from server
+ *   - Conditional checks (ETag/Last-Modified, 304) and a compact manifest
  *   - Download and verify update bundles (SHA256)
+ *   - Interrupted downloads resume with HTTP Range requests
+ *   - Concurrent artifact and byte-range downloads (curl multi)
+ *   - Connection, TLS session and DNS reuse across checks and downloads
+ *   - Optional streaming mode: download, verify and extract in one pass
+ *   - Network and storage work overlap: pipe thread per transfer, boot
+ *     flash and rootfs mkfs run while the next archive downloads
+ *   - gzip, zstd (multi-threaded over independent frames) or lz4
+ *     compressed archives, per artifact
+ *   - Raw rootfs images written with O_DIRECT, skipping empty blocks,
+ *     several writes in flight (io_uring, Linux AIO)
+ *   - Block-level delta updates against the active slot
+ *   - Incremental boot partition updates: only files that differ from
+ *     a per-file manifest are rewritten, each atomically
+ *   - Crash-consistent apply journal: interrupted updates resume from
+ *     the last durable step
+ *   - dm-verity hash tree for read-only rootfs images, built from the
+ *     written partition and checked against the manifest root hash
+ *   - Update timeline: time, bytes and throughput of every stage, kept
+ *     in /data/fota and optionally reported with the next check
  *   - Apply updates to standby partition slot
- *   - Support for Falcon mode (SPL direct boot)
+ *   - Support for Falcon mode (SPL direct boot), with the args of the
+ *     new slot prepared during the update
  *   - Automatic boot success confirmation
- *   - Manual update trigger via file or signal
+ *   - Low-impact apply: SCHED_IDLE, idle I/O class, bounded writeback,
+ *     bandwidth limit and pausing on load/pressure
+ *   - Event-driven daemon: epoll on timerfd, inotify and signalfd
+ *   - Manual update trigger via file or signal (SIGUSR1)
  *
  * Dependencies:
  *   - libcurl (HTTP/HTTPS client)
  *   - json-c (JSON parsing)
- *   - openssl (SHA256 verification)
- *   - u-boot-tools (fw_setenv/fw_printenv)
+ *   - openssl (TLS, one of the SHA256 backends)
+ *   - zlib (gzip inflate in streaming mode)
+ *   - optional: libzstd, liblz4 (zstd and lz4 archives, WITH_ZSTD=1,
+ *     WITH_LZ4=1)
+ *   - /etc/fw_env.config (U-Boot environment, accessed in-process)
  *
  * Build:
- *   arm-linux-gnueabihf-gcc -o fota_client fota_client.c \
- *       -lcurl -ljson-c -lcrypto -Wall -O2
+ *   make (see Makefile, CROSS_COMPILE defaults to arm-linux-gnueabihf-)
  *
  * SPDX-License-Identifier: MIT
  */
@@ -26,34 +52,88 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <syslog.h>
 #include <signal.h>
 #include <time.h>
+#include <limits.h>
 #include <curl/curl.h>
 #include <json-c/json.h>
-#include <openssl/sha.h>
+#include <zlib.h>
+#ifdef FOTA_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef FOTA_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "fota_aio.h"
+#include "fota_chunk.h"
+#include "fota_delta.h"
+#include "fota_env.h"
+#include "fota_event.h"
+#include "fota_fdt.h"
+#include "fota_image.h"
+#include "fota_journal.h"
+#include "fota_metrics.h"
+#include "fota_net.h"
+#include "fota_pipe.h"
+#include "fota_resume.h"
+#include "fota_sha256.h"
+#include "fota_stream.h"
+#include "fota_tar.h"
+#include "fota_throttle.h"
+#include "fota_verity.h"
 
 #define VERSION "1.0.0"
 #define CONFIG_FILE "/etc/fota/fota.conf"
-#define STATE_FILE "/data/fota/state.json"
+#define FW_ENV_CONFIG "/etc/fw_env.config"
+#define STATE_DIR "/data/fota"
+#define STATE_FILE STATE_DIR "/state.json"
+#define CHECK_CACHE STATE_DIR "/check.cache"
+#define CHUNK_DIR STATE_DIR "/chunks"
+#define JOURNAL_FILE STATE_DIR "/apply.journal"
+#define TIMELINE_FILE STATE_DIR "/timeline.json"
+#define TIMELINE_REPORT_MAX 6144  /* Longest timeline sent with a check */
+#define CHECK_CONTENT_TYPE "application/x-fota-manifest"
 #define DOWNLOAD_DIR "/tmp/fota"
 #define CHECK_INTERVAL 3600  /* Default: check every hour */
+#define CHECK_JITTER 300     /* Default: up to 5 min added per check */
+#define TRIGGER_FILE "/tmp/fota_trigger"
+#define PID_FILE "/run/fota_client.pid"  /* Daemon only, for fota-trigger */
+#define RESUME_RETRIES 5     /* Failed attempts in a row without progress */
+#define MAX_CONNECTIONS 4    /* Default cap on concurrent transfers */
+#define CHUNK_CACHE_MAX (64 * 1024 * 1024)  /* Default chunk cache size */
 
-/* Partition device mappings for BeagleBone Black */
+/* Default partition device mappings for BeagleBone Black */
 #define BOOT_A "/dev/mmcblk0p1"
 #define ROOT_A "/dev/mmcblk0p2"
 #define BOOT_B "/dev/mmcblk0p3"
 #define ROOT_B "/dev/mmcblk0p5"
 
+/* Falcon args of a slot, see write_falcon_args() */
+#define FALCON_DTB "am335x-boneblack.dtb"
+#define FALCON_ARGS_FILE "args"
+#define FALCON_BOOTARGS "console=ttyO0,115200n8 root=%s rootwait rw quiet"
+
 /* Mount points for update operations */
 #define MNT_BOOT "/tmp/fota_boot"
 #define MNT_ROOT "/tmp/fota_root"
 
+/*
+ * Read-only rootfs images (rootfs_fs): the slot boots with these root
+ * arguments and its writable layer in OVERLAY_DIR/<root partition>, see
+ * rootfs/sbin/overlay-init
+ */
+#define OVERLAY_DIR "/data/overlay"
+#define OVERLAY_ROOTARGS "ro rootfstype=%s init=/sbin/overlay-init"
+
 /*
  * Configuration structure
  * Loaded from CONFIG_FILE
@@ -64,7 +144,25 @@ typedef struct {
     char current_version[32];  /* Currently installed version */
     char current_slot;         /* Active slot: 'a' or 'b' */
     int check_interval;        /* Seconds between update checks */
+    int check_jitter;          /* Random seconds added to each interval */
     int falcon_enabled;        /* Use Falcon mode (SPL direct boot) */
+    char falcon_dtb[64];       /* DTB on the boot partition */
+    char falcon_args_file[64]; /* Args blob SPL loads from it */
+    int stream_mode;           /* Extract while downloading, no staging */
+    char download_dir[128];    /* Staging directory (staged mode) */
+    int max_connections;       /* Concurrent transfers (staged mode) */
+    int download_ranges;       /* Byte ranges per artifact (staged mode) */
+    long bandwidth_limit;      /* Download bytes/s, 0 = unlimited */
+    int low_impact;            /* Idle scheduling and throttled writeback */
+    fota_pause_t pause;        /* Pause thresholds while applying */
+    uint64_t chunk_cache_max;  /* Chunk cache size in bytes */
+    int io_depth;              /* Raw image writes in flight */
+    size_t io_block_size;      /* Bytes per raw image write */
+    int decompress_threads;    /* zstd frames in parallel, 0 = per CPU */
+    int report_timeline;       /* Send the last update timeline with a check */
+    char boot_dev[2][64];      /* Boot partitions of slots a and b */
+    char root_dev[2][64];      /* Root partitions of slots a and b */
+    char fw_env_config[128];   /* fw_env.config describing the environment */
 } fota_config_t;
 
 /*
@@ -76,14 +174,41 @@ typedef struct {
     char boot_url[512];        /* URL to boot partition archive */
     char boot_sha256[65];      /* Expected SHA256 of boot archive */
     size_t boot_size;          /* Expected size in bytes */
+    char boot_compression[16]; /* "gzip" (default), "zstd", "lz4", "none" */
+    fota_tar_filelist_t boot_files; /* Optional per-file manifest of it */
     char rootfs_url[512];      /* URL to rootfs archive */
     char rootfs_sha256[65];    /* Expected SHA256 of rootfs archive */
     size_t rootfs_size;        /* Expected size in bytes */
+    char rootfs_type[16];      /* "tar" (default), "rootfs_image", "rootfs_delta",
+                                  "rootfs_chunked" */
+    char rootfs_compression[16]; /* "gzip", "zstd", "lz4" or "none" */
+    char rootfs_fs[16];        /* Filesystem in the image: "ext4" (default),
+                                  "squashfs", "erofs" */
+    uint64_t rootfs_image_size; /* Uncompressed image size (image/delta) */
+    char rootfs_image_sha256[65]; /* SHA256 of the rebuilt image (delta) */
+    uint64_t rootfs_source_size; /* Image the delta was made against */
+    char rootfs_source_sha256[65];
+    char rootfs_full_url[512]; /* Full image if the delta does not apply */
+    char rootfs_full_sha256[65];
+    size_t rootfs_full_size;
+    char rootfs_full_compression[16];
+    fota_bmap_t rootfs_bmap;   /* Optional block map (rootfs_image) */
+    char rootfs_chunk_url[512]; /* Chunk store (rootfs_chunked) */
+    int rootfs_verity;         /* Boot the image through dm-verity */
+    char rootfs_verity_root_hash[65]; /* Root hash from the build host */
+    char rootfs_verity_salt[65]; /* Hex, none if empty */
 } update_manifest_t;
 
+/* Manifest artifact types */
+#define ARTIFACT_TAR    "tar"
+#define ARTIFACT_IMAGE  "rootfs_image"
+#define ARTIFACT_DELTA  "rootfs_delta"
+#define ARTIFACT_CHUNKED "rootfs_chunked"
+
 /* Global state */
 static volatile int running = 1;
 static fota_config_t config;
+static fota_journal_t journal;  /* Update being applied, slot 0 if none */
 
 /*
  * Signal handler for graceful shutdown
@@ -95,11 +220,65 @@ void signal_handler(int sig)
 }
 
 /*
- * CURL callback: Write data to file
+ * Per-artifact timing breakdown
+ * download_s is time spent waiting on the network, i.e. the transfer
+ * wall time minus the time spent hashing and writing inside the callback.
+ * In streaming mode write_s covers inflating and extracting. When the
+ * body is processed on a pipe thread (see fetch_artifact()), hashing and
+ * writing overlap the transfer and wall_s is less than the sum.
+ */
+typedef struct {
+    size_t bytes;              /* Payload bytes received */
+    double download_s;         /* Network time */
+    double hash_s;             /* SHA256 update time */
+    double write_s;            /* Time spent writing the payload */
+    double wall_s;             /* Elapsed time, 0: the sum of the above */
+} artifact_timing_t;
+
+/*
+ * CURL callback: Feed data to the artifact stream
+ * The artifact is hashed while it is being written, so the digest is
+ * ready as soon as the transfer completes.
+ */
+static size_t write_stream_callback(void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+
+    if (fota_stream_feed((fota_stream_t *)userp, ptr, realsize) < 0)
+        return 0;  /* Makes curl abort with CURLE_WRITE_ERROR */
+
+    return realsize;
+}
+
+/*
+ * CURL callback: Queue data for the pipe thread
+ */
+static size_t write_pipe_callback(void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+
+    if (fota_pipe_write(userp, ptr, realsize) < 0)
+        return 0;
+
+    return realsize;
+}
+
+/*
+ * Pipe sink: Hash, inflate and write on the pipe thread
+ */
+static int stream_sink(void *opaque, const void *buf, size_t len)
+{
+    return fota_stream_feed((fota_stream_t *)opaque, buf, len);
+}
+
+/*
+ * Stream sink: Extract into a mounted partition
  */
-static size_t write_file_callback(void *ptr, size_t size, size_t nmemb, void *stream)
+static int tar_sink(void *opaque, const void *buf, size_t len)
 {
-    return fwrite(ptr, size, nmemb, (FILE *)stream);
+    fota_throttle_pause();
+    fota_journal_fault("extract");
+    return fota_tar_write((fota_tar_t *)opaque, buf, len);
 }
 
 /*
@@ -141,25 +320,21 @@ int calculate_sha256(const char *filename, char *hash_out)
         return -1;
     }
 
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
+    fota_sha256_ctx ctx;
+    fota_sha256_init(&ctx);
 
     unsigned char buffer[8192];
     size_t bytes;
 
     while ((bytes = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        SHA256_Update(&ctx, buffer, bytes);
+        fota_sha256_update(&ctx, buffer, bytes);
     }
     fclose(fp);
 
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_Final(hash, &ctx);
+    unsigned char hash[FOTA_SHA256_DIGEST_LENGTH];
+    fota_sha256_final(&ctx, hash);
 
-    /* Convert to hex string */
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        sprintf(hash_out + (i * 2), "%02x", hash[i]);
-    }
-    hash_out[64] = '\0';
+    fota_sha256_hex(hash, hash_out);
 
     return 0;
 }
@@ -169,17 +344,15 @@ int calculate_sha256(const char *filename, char *hash_out)
  */
 char get_current_slot(void)
 {
-    FILE *fp = popen("fw_printenv -n slot 2>/dev/null", "r");
-    if (!fp)
+    fota_env_t *env = fota_env_open(config.fw_env_config);
+    if (!env)
         return 'a';
 
-    char slot = 'a';
-    if (fscanf(fp, "%c", &slot) != 1) {
-        slot = 'a';
-    }
-    pclose(fp);
+    const char *slot = fota_env_get(env, "slot");
+    char current = (slot && slot[0] == 'b') ? 'b' : 'a';
+    fota_env_close(env);
 
-    return (slot == 'b') ? 'b' : 'a';
+    return current;
 }
 
 /*
@@ -188,22 +361,34 @@ char get_current_slot(void)
 void get_standby_slot(char current, char *standby,
                       const char **boot_dev, const char **root_dev)
 {
-    if (current == 'a') {
-        *standby = 'b';
-        *boot_dev = BOOT_B;
-        *root_dev = ROOT_B;
-    } else {
-        *standby = 'a';
-        *boot_dev = BOOT_A;
-        *root_dev = ROOT_A;
-    }
+    *standby = (current == 'a') ? 'b' : 'a';
+    *boot_dev = config.boot_dev[*standby - 'a'];
+    *root_dev = config.root_dev[*standby - 'a'];
+}
+
+/*
+ * Root partition of the running slot (source for delta updates)
+ */
+const char *get_active_root(char current)
+{
+    return config.root_dev[current == 'b'];
 }
 
 /*
- * Download a file from URL to local path
+ * Transfer an artifact from URL into a stream
+ * The body is received on this thread and handed to the stream through
+ * a bounded pipe (see fota_pipe.h), so hashing, inflating and writing
+ * run while the next data arrives. Without a pipe thread the stream is
+ * fed from the curl callback. flush (may be NULL) runs on the pipe
+ * thread after the last piece, see fota_pipe_set_flush().
+ * On success hash_out holds the SHA256 (hex) of the received bytes and
+ * timing the download/hash/write breakdown.
  * Returns 0 on success, -1 on failure
  */
-int download_file(const char *url, const char *dest, size_t expected_size)
+static int fetch_artifact(const char *url, size_t expected_size,
+                          fota_stream_t *stream, int (*flush)(void *arg),
+                          void *flush_arg, char *hash_out,
+                          artifact_timing_t *timing)
 {
     CURL *curl = curl_easy_init();
     if (!curl) {
@@ -211,349 +396,3447 @@ int download_file(const char *url, const char *dest, size_t expected_size)
         return -1;
     }
 
-    FILE *fp = fopen(dest, "wb");
-    if (!fp) {
-        syslog(LOG_ERR, "Cannot create file: %s", dest);
-        curl_easy_cleanup(curl);
-        return -1;
-    }
+    fota_pipe_t *pipe = fota_pipe_new(stream_sink, stream);
+    if (pipe && flush)
+        fota_pipe_set_flush(pipe, flush, flush_arg);
 
+    fota_net_setup(curl);
     curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_file_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    if (pipe) {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_pipe_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, pipe);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_stream_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, stream);
+    }
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, 600L);  /* 10 minute timeout */
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
     curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
 
     /* Progress callback could be added here */
 
+    double start = fota_now();
     CURLcode res = curl_easy_perform(curl);
-    fclose(fp);
+    double transfer_s = fota_now() - start;
+    fota_net_account(curl);
+    curl_easy_cleanup(curl);
+
+    /* Blocked on a full pipe is time the storage side was behind */
+    double wait_s = 0;
+    if (pipe)
+        fota_pipe_close(pipe, &wait_s);
+
+    int ret = fota_stream_finish(stream, hash_out);
+
+    timing->bytes = stream->in_bytes;
+    timing->hash_s = stream->hash_s;
+    timing->write_s = stream->sink_s;
+    if (pipe) {
+        timing->download_s = transfer_s - wait_s;
+        timing->wall_s = fota_now() - start;
+    } else {
+        timing->download_s = transfer_s - timing->hash_s - timing->write_s;
+        timing->wall_s = 0;
+    }
 
     if (res != CURLE_OK) {
         syslog(LOG_ERR, "Download failed: %s", curl_easy_strerror(res));
-        unlink(dest);
-        curl_easy_cleanup(curl);
         return -1;
     }
 
     /* Verify size if expected_size > 0 */
-    if (expected_size > 0) {
-        struct stat st;
-        if (stat(dest, &st) == 0 && (size_t)st.st_size != expected_size) {
-            syslog(LOG_ERR, "Size mismatch: expected %zu, got %ld",
-                   expected_size, st.st_size);
-            unlink(dest);
-            curl_easy_cleanup(curl);
-            return -1;
-        }
+    if (expected_size > 0 && timing->bytes != expected_size) {
+        syslog(LOG_ERR, "Size mismatch: expected %zu, got %zu",
+               expected_size, timing->bytes);
+        return -1;
     }
 
-    curl_easy_cleanup(curl);
-    return 0;
+    return ret;
 }
 
 /*
- * Check for updates from server
- * Returns: 1 = update available, 0 = no update, -1 = error
+ * Parallel staged downloads
+ *
+ * All artifacts of an update are fetched at the same time through one
+ * curl multi handle, large ones optionally split into byte ranges, with
+ * at most config.max_connections transfers in flight. Every range is
+ * written with pwrite() at its own offset.
+ *
+ * The SHA256 follows the contiguous frontier: a byte is hashed as soon
+ * as everything before it is on disk, straight from the network buffer
+ * while the frontier range is receiving, otherwise by reading back what
+ * the ranges ahead of it already wrote. The digest is ready when the
+ * last range completes, and the progress record (offset + hash state,
+ * see fota_resume.h) always describes a valid prefix, so an interrupted
+ * download resumes from the frontier, even across a reboot.
  */
-int check_for_update(update_manifest_t *manifest)
-{
-    char url[512];
-    snprintf(url, sizeof(url), "%s/api/v1/devices/%s/update",
-             config.server_url, config.device_id);
-
-    CURL *curl = curl_easy_init();
-    if (!curl)
-        return -1;
 
-    struct memory_chunk chunk = {0};
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+#define DOWNLOAD_MAX_RANGES 16
+#define DOWNLOAD_MIN_RANGE (1024 * 1024)  /* Smallest range worth a connection */
 
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_memory_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+typedef struct download download_t;
 
-    /* Add headers with device info */
-    struct curl_slist *headers = NULL;
-    char version_header[64];
-    snprintf(version_header, sizeof(version_header),
-             "X-Current-Version: %s", config.current_version);
-    headers = curl_slist_append(headers, version_header);
+typedef struct {
+    download_t *dl;
+    uint64_t start;            /* First byte */
+    uint64_t end;              /* One past the last byte, 0 = until EOF */
+    uint64_t pos;              /* Next byte to write */
+    CURL *curl;                /* Set while in flight */
+    uint64_t req_pos;          /* pos when the request started */
+    int ranged;                /* Request carries a Range header */
+    int checked;               /* Response status checked */
+    int failures;              /* Failed attempts in a row without progress */
+    double retry_at;           /* Backoff deadline */
+    int done;
+} download_range_t;
 
-    char slot_header[32];
-    snprintf(slot_header, sizeof(slot_header),
-             "X-Current-Slot: %c", config.current_slot);
-    headers = curl_slist_append(headers, slot_header);
+struct download {
+    /* Filled in by the caller */
+    const char *url;
+    const char *dest;
+    const char *progress_path; /* NULL: no record, no fdatasync */
+    size_t expected_size;
+    const char *expected_sha;
+    int max_ranges;            /* 0: config.download_ranges */
+    void (*on_done)(download_t *dl);  /* Optional, see download_files() */
+    void *arg;                 /* For on_done */
 
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    /* Results */
+    char hash[65];             /* SHA256 (hex) of the payload */
+    artifact_timing_t timing;
+    int failed;                /* Download did not complete */
 
-    CURLcode res = curl_easy_perform(curl);
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    /* Engine state */
+    int fd;
+    uint64_t size;             /* Artifact size, 0 if unknown */
+    download_range_t ranges[DOWNLOAD_MAX_RANGES];
+    int nranges;
+    fota_sha256_ctx sha;
+    uint64_t hashed;           /* Bytes hashed, the frontier */
+    fota_progress_t progress;  /* Last record written */
+    int local_error;           /* Partial file unusable */
+    int restart;               /* Server refused a range */
+    int done;
+    int closed;                /* download_close() ran */
+    double start;
+    double end;                /* When download_close() ran */
+};
 
-    if (res != CURLE_OK) {
-        syslog(LOG_WARNING, "Update check failed: %s", curl_easy_strerror(res));
-        free(chunk.memory);
-        return -1;
-    }
+/*
+ * Record the frontier and its hash state
+ * Everything below the frontier is synced first, so after a crash the
+ * record never points past what is on disk.
+ */
+static int download_checkpoint(download_t *dl)
+{
+    double t0 = fota_now();
 
-    /* Parse JSON response */
-    struct json_object *root = json_tokener_parse(chunk.memory);
-    free(chunk.memory);
+    /* Small files are simply fetched again */
+    if (!dl->progress_path)
+        return 0;
 
-    if (!root) {
-        syslog(LOG_ERR, "Failed to parse update response");
+    if (fdatasync(dl->fd) != 0) {
+        syslog(LOG_ERR, "Cannot write %s: %s", dl->dest, strerror(errno));
         return -1;
     }
 
-    struct json_object *update_available;
-    if (!json_object_object_get_ex(root, "update_available", &update_available) ||
-        !json_object_get_boolean(update_available)) {
-        json_object_put(root);
-        return 0;  /* No update available */
-    }
+    dl->progress.offset = dl->hashed;
+    dl->progress.sha = dl->sha;
 
-    /* Extract manifest data */
-    struct json_object *obj;
+    /* Without a record the next attempt just starts over */
+    if (fota_progress_save(dl->progress_path, &dl->progress) < 0)
+        syslog(LOG_WARNING, "Cannot save download progress to %s",
+               dl->progress_path);
 
-    if (json_object_object_get_ex(root, "version", &obj))
-        strncpy(manifest->version, json_object_get_string(obj), 31);
+    dl->timing.write_s += fota_now() - t0;
+    return 0;
+}
 
-    if (json_object_object_get_ex(root, "boot_url", &obj))
-        strncpy(manifest->boot_url, json_object_get_string(obj), 511);
+/*
+ * Split what is left behind the frontier into ranges
+ */
+static void download_plan(download_t *dl, int max_ranges)
+{
+    uint64_t left = dl->size - dl->hashed;
+    int n = 1;
 
-    if (json_object_object_get_ex(root, "boot_sha256", &obj))
-        strncpy(manifest->boot_sha256, json_object_get_string(obj), 64);
+    if (dl->size > 0) {
+        n = left / DOWNLOAD_MIN_RANGE;
+        if (n > max_ranges)
+            n = max_ranges;
+        if (n > DOWNLOAD_MAX_RANGES)
+            n = DOWNLOAD_MAX_RANGES;
+        if (n < 1)
+            n = 1;
+    }
 
-    if (json_object_object_get_ex(root, "boot_size", &obj))
-        manifest->boot_size = json_object_get_int64(obj);
+    memset(dl->ranges, 0, sizeof(dl->ranges));
+    dl->nranges = n;
 
-    if (json_object_object_get_ex(root, "rootfs_url", &obj))
-        strncpy(manifest->rootfs_url, json_object_get_string(obj), 511);
+    for (int i = 0; i < n; i++) {
+        download_range_t *r = &dl->ranges[i];
+        r->dl = dl;
+        r->start = dl->hashed + left * i / n;
+        r->end = dl->size ? dl->hashed + left * (i + 1) / n : 0;
+        r->pos = r->start;
+    }
+}
 
-    if (json_object_object_get_ex(root, "rootfs_sha256", &obj))
-        strncpy(manifest->rootfs_sha256, json_object_get_string(obj), 64);
+/*
+ * Ask the server for the artifact size (ranges need it up front)
+ */
+static uint64_t probe_size(const char *url)
+{
+    curl_off_t len = -1;
+    CURL *curl = curl_easy_init();
 
-    if (json_object_object_get_ex(root, "rootfs_size", &obj))
-        manifest->rootfs_size = json_object_get_int64(obj);
+    if (!curl)
+        return 0;
 
-    json_object_put(root);
+    fota_net_setup(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
 
-    syslog(LOG_INFO, "Update available: %s -> %s",
-           config.current_version, manifest->version);
+    if (curl_easy_perform(curl) == CURLE_OK)
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &len);
+    fota_net_account(curl);
+    curl_easy_cleanup(curl);
 
-    return 1;  /* Update available */
+    return len > 0 ? (uint64_t)len : 0;
 }
 
 /*
- * Apply update to standby slot
+ * Open the partial file and pick up an earlier attempt of the very
+ * same artifact (url, digest and size) at its recorded frontier
  * Returns 0 on success, -1 on failure
  */
-int apply_update(update_manifest_t *manifest)
+static int download_open(download_t *dl)
 {
-    char standby_slot;
-    const char *boot_dev, *root_dev;
-    char cmd[512];
-    char hash[65];
-
-    get_standby_slot(config.current_slot, &standby_slot, &boot_dev, &root_dev);
-
-    syslog(LOG_INFO, "Applying update v%s to slot %c",
-           manifest->version, standby_slot);
+    fota_progress_t *p = &dl->progress;
+    int max_ranges = dl->max_ranges ? dl->max_ranges : config.download_ranges;
+    struct stat st;
 
-    /* Create download directory */
-    mkdir(DOWNLOAD_DIR, 0755);
-
-    /* Download and verify boot archive */
-    char boot_file[256];
-    snprintf(boot_file, sizeof(boot_file), "%s/boot.tar.gz", DOWNLOAD_DIR);
-
-    syslog(LOG_INFO, "Downloading boot files...");
-    if (download_file(manifest->boot_url, boot_file, manifest->boot_size) < 0) {
-        syslog(LOG_ERR, "Failed to download boot files");
+    dl->fd = open(dl->dest, O_RDWR | O_CREAT, 0644);
+    if (dl->fd < 0) {
+        syslog(LOG_ERR, "Cannot create file: %s", dl->dest);
         return -1;
     }
 
-    if (calculate_sha256(boot_file, hash) < 0 ||
-        strcmp(hash, manifest->boot_sha256) != 0) {
-        syslog(LOG_ERR, "Boot archive checksum mismatch");
-        syslog(LOG_ERR, "  Expected: %s", manifest->boot_sha256);
-        syslog(LOG_ERR, "  Got:      %s", hash);
-        return -1;
+    if (dl->progress_path && fota_progress_load(dl->progress_path, p) == 0 &&
+        strcmp(p->url, dl->url) == 0 &&
+        strcmp(p->sha256, dl->expected_sha) == 0 &&
+        p->size == dl->expected_size &&
+        fstat(dl->fd, &st) == 0 && (uint64_t)st.st_size >= p->offset) {
+        dl->sha = p->sha;
+        dl->hashed = p->offset;
+        syslog(LOG_INFO, "Resuming %s at byte %llu", dl->dest,
+               (unsigned long long)dl->hashed);
+    } else {
+        memset(p, 0, sizeof(*p));
+        snprintf(p->url, sizeof(p->url), "%s", dl->url);
+        snprintf(p->sha256, sizeof(p->sha256), "%s", dl->expected_sha);
+        p->size = dl->expected_size;
+        fota_progress_clear(dl->progress_path);
+        fota_sha256_init(&dl->sha);
+        dl->hashed = 0;
     }
-    syslog(LOG_INFO, "Boot archive verified");
-
-    /* Download and verify rootfs archive */
-    char rootfs_file[256];
-    snprintf(rootfs_file, sizeof(rootfs_file), "%s/rootfs.tar.gz", DOWNLOAD_DIR);
 
-    syslog(LOG_INFO, "Downloading rootfs...");
-    if (download_file(manifest->rootfs_url, rootfs_file, manifest->rootfs_size) < 0) {
-        syslog(LOG_ERR, "Failed to download rootfs");
+    /* Bytes past the frontier are not covered by the hash state */
+    if (ftruncate(dl->fd, dl->hashed) < 0) {
+        syslog(LOG_ERR, "Cannot resume %s: %s", dl->dest, strerror(errno));
         return -1;
     }
 
-    if (calculate_sha256(rootfs_file, hash) < 0 ||
-        strcmp(hash, manifest->rootfs_sha256) != 0) {
-        syslog(LOG_ERR, "Rootfs archive checksum mismatch");
-        return -1;
+    dl->size = dl->expected_size;
+    if (dl->size == 0 && max_ranges > 1)
+        dl->size = probe_size(dl->url);
+
+    /* Stale partial file longer than the artifact */
+    if (dl->size > 0 && dl->hashed > dl->size) {
+        if (ftruncate(dl->fd, 0) < 0)
+            return -1;
+        fota_sha256_init(&dl->sha);
+        dl->hashed = 0;
     }
-    syslog(LOG_INFO, "Rootfs archive verified");
 
-    /* Flash boot partition */
-    syslog(LOG_INFO, "Flashing boot partition %s...", boot_dev);
-    mkdir(MNT_BOOT, 0755);
+    download_plan(dl, max_ranges);
 
-    snprintf(cmd, sizeof(cmd), "mount %s %s", boot_dev, MNT_BOOT);
-    if (system(cmd) != 0) {
-        syslog(LOG_ERR, "Failed to mount boot partition");
-        return -1;
-    }
+    /* Complete before an earlier interruption, nothing to fetch */
+    if (dl->size > 0 && dl->hashed == dl->size)
+        for (int i = 0; i < dl->nranges; i++)
+            dl->ranges[i].done = 1;
 
-    snprintf(cmd, sizeof(cmd), "rm -rf %s/* && tar xzf %s -C %s/",
-             MNT_BOOT, boot_file, MNT_BOOT);
-    system(cmd);
+    return 0;
+}
 
-    sync();
-    umount(MNT_BOOT);
+/*
+ * Hash whatever the ranges ahead of the frontier have already written
+ */
+static int download_advance(download_t *dl)
+{
+    static unsigned char buf[64 * 1024];
 
-    /* Flash rootfs partition */
-    syslog(LOG_INFO, "Formatting and flashing rootfs %s...", root_dev);
+    for (int i = 0; i < dl->nranges; i++) {
+        download_range_t *r = &dl->ranges[i];
 
-    snprintf(cmd, sizeof(cmd), "mkfs.ext4 -F -L ROOT_%c %s",
-             standby_slot - 32, root_dev);  /* Uppercase label */
-    if (system(cmd) != 0) {
-        syslog(LOG_ERR, "Failed to format rootfs partition");
-        return -1;
-    }
+        while (dl->hashed >= r->start && dl->hashed < r->pos) {
+            size_t n = r->pos - dl->hashed;
+            if (n > sizeof(buf))
+                n = sizeof(buf);
 
-    mkdir(MNT_ROOT, 0755);
-    snprintf(cmd, sizeof(cmd), "mount %s %s", root_dev, MNT_ROOT);
-    if (system(cmd) != 0) {
-        syslog(LOG_ERR, "Failed to mount rootfs partition");
-        return -1;
+            ssize_t got = pread(dl->fd, buf, n, dl->hashed);
+            if (got <= 0) {
+                syslog(LOG_ERR, "Cannot read back %s", dl->dest);
+                return -1;
+            }
+            fota_sha256_update(&dl->sha, buf, got);
+            dl->hashed += got;
+        }
     }
 
-    snprintf(cmd, sizeof(cmd), "tar xzf %s -C %s/", rootfs_file, MNT_ROOT);
-    system(cmd);
+    if (dl->hashed - dl->progress.offset >= FOTA_RESUME_CHECKPOINT)
+        return download_checkpoint(dl);
 
-    sync();
-    umount(MNT_ROOT);
+    return 0;
+}
 
-    /* Cleanup downloads */
-    unlink(boot_file);
-    unlink(rootfs_file);
-    rmdir(DOWNLOAD_DIR);
+/*
+ * CURL callback: Write one range at its offset and move the frontier
+ */
+static size_t write_range_callback(void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    download_range_t *r = (download_range_t *)userp;
+    download_t *dl = r->dl;
+    size_t len = size * nmemb;
 
-    /* Update U-Boot environment to switch slots */
-    syslog(LOG_INFO, "Switching to slot %c...", standby_slot);
+    if (dl->restart || dl->local_error)
+        return 0;
 
-    snprintf(cmd, sizeof(cmd), "fw_setenv slot %c", standby_slot);
-    system(cmd);
+    /* A Range request answered with the whole artifact */
+    if (!r->checked) {
+        long code = 0;
+        curl_easy_getinfo(r->curl, CURLINFO_RESPONSE_CODE, &code);
+        if (r->ranged && code == 200) {
+            dl->restart = 1;
+            return 0;
+        }
+        r->checked = 1;
+    }
 
-    system("fw_setenv bootcount 0");
+    if (r->end && r->pos + len > r->end) {
+        syslog(LOG_ERR, "Server sent more than requested for %s", dl->dest);
+        dl->local_error = 1;
+        return 0;
+    }
 
-    /* Update Falcon slot if enabled */
-    if (config.falcon_enabled) {
-        snprintf(cmd, sizeof(cmd), "fw_setenv falcon_slot %c", standby_slot);
-        system(cmd);
+    fota_throttle_pause();
 
-        /* Mark that Falcon args need regeneration */
-        snprintf(cmd, sizeof(cmd),
-                 "fw_setenv falcon_prepare_%c_pending 1", standby_slot);
-        system(cmd);
+    double t0 = fota_now();
+    for (size_t off = 0; off < len; ) {
+        ssize_t n = pwrite(dl->fd, (const char *)ptr + off, len - off,
+                           r->pos + off);
+        if (n < 0) {
+            syslog(LOG_ERR, "Cannot write %s: %s", dl->dest, strerror(errno));
+            dl->local_error = 1;
+            return 0;
+        }
+        off += n;
     }
+    double t1 = fota_now();
 
-    /* Save pending update state */
-    mkdir("/data/fota", 0755);
-    snprintf(cmd, sizeof(cmd),
-             "echo '{\"pending_version\":\"%s\",\"pending_slot\":\"%c\"}' > %s",
-             manifest->version, standby_slot, STATE_FILE);
-    system(cmd);
+    /* The frontier range is hashed from the network buffer */
+    if (r->pos == dl->hashed) {
+        fota_sha256_update(&dl->sha, ptr, len);
+        dl->hashed += len;
+    }
+    r->pos += len;
+    dl->timing.bytes += len;
 
-    syslog(LOG_INFO, "Update applied successfully, rebooting...");
+    int ret = download_advance(dl);
 
-    sync();
-    sleep(2);
-    system("reboot");
+    dl->timing.write_s += t1 - t0;
+    dl->timing.hash_s += fota_now() - t1;
 
-    return 0;
+    if (ret < 0) {
+        dl->local_error = 1;
+        return 0;
+    }
+    return len;
 }
 
 /*
- * Load configuration from file
+ * Start the transfer of a range from its current position
  */
-int load_config(void)
+static int range_start(CURLM *multi, download_range_t *r)
 {
-    FILE *fp = fopen(CONFIG_FILE, "r");
-    if (!fp) {
-        syslog(LOG_ERR, "Cannot open config file: %s", CONFIG_FILE);
+    download_t *dl = r->dl;
+    char range[64];
+
+    r->curl = curl_easy_init();
+    if (!r->curl)
         return -1;
-    }
 
-    /* Set defaults */
-    memset(&config, 0, sizeof(config));
-    config.check_interval = CHECK_INTERVAL;
+    fota_net_setup(r->curl);
+    curl_easy_setopt(r->curl, CURLOPT_URL, dl->url);
+    curl_easy_setopt(r->curl, CURLOPT_WRITEFUNCTION, write_range_callback);
+    curl_easy_setopt(r->curl, CURLOPT_WRITEDATA, r);
+    curl_easy_setopt(r->curl, CURLOPT_PRIVATE, r);
+    curl_easy_setopt(r->curl, CURLOPT_FAILONERROR, 1L);
+    /* No total limit: a slow link finishes, a stalled one is retried */
+    curl_easy_setopt(r->curl, CURLOPT_CONNECTTIMEOUT, 30L);
+    curl_easy_setopt(r->curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(r->curl, CURLOPT_LOW_SPEED_TIME, 60L);
 
-    char line[512];
-    while (fgets(line, sizeof(line), fp)) {
-        /* Skip comments and empty lines */
-        if (line[0] == '#' || line[0] == '\n')
-            continue;
+    /* bandwidth_limit is for the whole download, split between transfers */
+    if (config.bandwidth_limit > 0 && config.max_connections > 1)
+        curl_easy_setopt(r->curl, CURLOPT_MAX_RECV_SPEED_LARGE,
+                         (curl_off_t)(config.bandwidth_limit / config.max_connections));
 
-        char key[64], value[256];
-        if (sscanf(line, "%63[^=]=%255[^\n]", key, value) == 2) {
-            if (strcmp(key, "server_url") == 0)
-                strncpy(config.server_url, value, sizeof(config.server_url) - 1);
-            else if (strcmp(key, "device_id") == 0)
-                strncpy(config.device_id, value, sizeof(config.device_id) - 1);
-            else if (strcmp(key, "current_version") == 0)
-                strncpy(config.current_version, value, sizeof(config.current_version) - 1);
-            else if (strcmp(key, "check_interval") == 0)
-                config.check_interval = atoi(value);
-            else if (strcmp(key, "falcon_enabled") == 0)
-                config.falcon_enabled = atoi(value);
-        }
+    r->req_pos = r->pos;
+    r->ranged = r->pos > 0 || (r->end && r->end < dl->size);
+    r->checked = 0;
+    if (r->ranged) {
+        if (r->end)
+            snprintf(range, sizeof(range), "%llu-%llu",
+                     (unsigned long long)r->pos,
+                     (unsigned long long)r->end - 1);
+        else
+            snprintf(range, sizeof(range), "%llu-",
+                     (unsigned long long)r->pos);
+        curl_easy_setopt(r->curl, CURLOPT_RANGE, range);
     }
-    fclose(fp);
-
-    /* Get current slot from U-Boot */
-    config.current_slot = get_current_slot();
 
-    /* Validate required fields */
-    if (config.server_url[0] == '\0' || config.device_id[0] == '\0') {
-        syslog(LOG_ERR, "Missing required config: server_url or device_id");
+    if (curl_multi_add_handle(multi, r->curl) != CURLM_OK) {
+        curl_easy_cleanup(r->curl);
+        r->curl = NULL;
         return -1;
     }
-
     return 0;
 }
 
+static void range_stop(CURLM *multi, download_range_t *r)
+{
+    if (!r->curl)
+        return;
+    curl_multi_remove_handle(multi, r->curl);
+    curl_easy_cleanup(r->curl);
+    r->curl = NULL;
+}
+
 /*
- * Mark current boot as successful
- * Called after system is stable
+ * Transient failures that a Range request from the current offset
+ * can recover from
  */
-void mark_boot_success(void)
+static int transfer_retryable(CURLcode res, long code)
 {
-    /* Reset boot counter */
-    system("fw_setenv bootcount 0");
+    switch (res) {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_SSL_CONNECT_ERROR:
+        return 1;
+    case CURLE_HTTP_RETURNED_ERROR:
+        return code >= 500;
+    default:
+        return 0;
+    }
+}
 
-    /* Check for pending update to confirm */
-    FILE *fp = fopen(STATE_FILE, "r");
-    if (fp) {
-        char buffer[512];
-        size_t len = fread(buffer, 1, sizeof(buffer) - 1, fp);
+/*
+ * Handle a finished transfer: complete the range, schedule a retry
+ * with backoff, or give up on the artifact
+ */
+static void range_done(CURLM *multi, download_range_t *r, CURLcode res)
+{
+    download_t *dl = r->dl;
+    long code = 0;
+
+    curl_easy_getinfo(r->curl, CURLINFO_RESPONSE_CODE, &code);
+    fota_net_account(r->curl);
+    range_stop(multi, r);
+
+    if (dl->local_error || dl->restart)
+        return;
+
+    if (res == CURLE_OK) {
+        if (r->end == 0) {
+            r->done = 1;
+            dl->size = r->pos;   /* Size learned from the transfer */
+            return;
+        }
+        if (r->pos == r->end) {
+            r->done = 1;
+            return;
+        }
+        res = CURLE_PARTIAL_FILE;
+    }
+
+    /* Server cannot serve the range: start over without ranges */
+    if (r->ranged && (res == CURLE_RANGE_ERROR || code == 416)) {
+        dl->restart = 1;
+        return;
+    }
+
+    if (!transfer_retryable(res, code)) {
+        syslog(LOG_ERR, "Download of %s failed: %s", dl->url,
+               curl_easy_strerror(res));
+        dl->failed = 1;
+        return;
+    }
+
+    syslog(LOG_WARNING, "Download of %s interrupted at byte %llu: %s",
+           dl->url, (unsigned long long)r->pos, curl_easy_strerror(res));
+
+    /* Keep what arrived in case this run does not get further */
+    if (dl->hashed > dl->progress.offset && download_checkpoint(dl) < 0) {
+        dl->local_error = 1;
+        return;
+    }
+
+    /* Reconnect at once while data flows, back off when it does not */
+    if (r->pos > r->req_pos) {
+        r->failures = 0;
+        r->retry_at = 0;
+    } else if (++r->failures > RESUME_RETRIES) {
+        syslog(LOG_ERR, "Download of %s failed: %s", dl->url,
+               curl_easy_strerror(res));
+        dl->failed = 1;
+    } else {
+        r->retry_at = fota_now() + (1 << (r->failures - 1));  /* 1, 2, 4, ... s */
+    }
+}
+
+/*
+ * Drop everything received and fetch the artifact again in one piece
+ */
+static int download_restart(CURLM *multi, download_t *dl)
+{
+    syslog(LOG_WARNING, "Server cannot resume %s, restarting download",
+           dl->url);
+
+    for (int i = 0; i < dl->nranges; i++)
+        range_stop(multi, &dl->ranges[i]);
+
+    if (ftruncate(dl->fd, 0) < 0)
+        return -1;
+
+    fota_sha256_init(&dl->sha);
+    dl->hashed = 0;
+    dl->progress.offset = 0;
+    fota_progress_clear(dl->progress_path);
+    dl->restart = 0;
+
+    download_plan(dl, 1);
+    return 0;
+}
+
+/*
+ * Finish an artifact: final digest, size check and progress record
+ * A complete download keeps its record (offset == size), so a reboot
+ * before the archive is flashed does not fetch it again.
+ */
+static void download_close(download_t *dl)
+{
+    unsigned char hash[FOTA_SHA256_DIGEST_LENGTH];
+    fota_sha256_ctx sha = dl->sha;
+
+    if (!dl->done)
+        dl->failed = 1;
+
+    if (!dl->local_error && download_checkpoint(dl) < 0)
+        dl->local_error = 1;
+
+    if (dl->local_error) {
+        dl->failed = 1;
+        unlink(dl->dest);
+        fota_progress_clear(dl->progress_path);
+    }
+
+    double t0 = fota_now();
+    fota_sha256_final(&sha, hash);
+    fota_sha256_hex(hash, dl->hash);
+    dl->timing.hash_s += fota_now() - t0;
+
+    dl->end = fota_now();
+    double total = dl->end - dl->start;
+    dl->timing.download_s = total - dl->timing.hash_s - dl->timing.write_s;
+
+    if (!dl->failed && dl->expected_size > 0 && dl->hashed != dl->expected_size) {
+        syslog(LOG_ERR, "Size mismatch: expected %zu, got %llu",
+               dl->expected_size, (unsigned long long)dl->hashed);
+        dl->failed = 1;
+    }
+
+    if (dl->fd >= 0)
+        close(dl->fd);
+    dl->fd = -1;
+    dl->closed = 1;
+}
+
+/*
+ * Download a set of artifacts to files concurrently
+ * Each download_t needs url, dest, progress_path, expected_size and
+ * expected_sha ("" if unknown), max_ranges is optional; on return hash,
+ * timing and failed are set. An artifact that fails keeps its partial file and progress
+ * record for the next attempt unless the file itself is unusable.
+ * An artifact is closed as soon as it completes, and on_done (if set) is
+ * called for it right away while the others are still in flight, so the
+ * caller can start working on it.
+ * Returns 0 if all downloads completed, -1 otherwise
+ */
+int download_files(download_t *dls, int count)
+{
+    int max_conns = config.max_connections > 0 ? config.max_connections : 1;
+    int ret = 0;
+
+    CURLM *multi = curl_multi_init();
+    if (!multi)
+        return -1;
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)max_conns);
+
+    for (int i = 0; i < count; i++) {
+        download_t *dl = &dls[i];
+
+        memset(dl->hash, 0, sizeof(dl->hash));
+        memset(&dl->timing, 0, sizeof(dl->timing));
+        dl->failed = dl->local_error = dl->restart = dl->done = 0;
+        dl->closed = 0;
+        dl->nranges = 0;
+        dl->fd = -1;
+        dl->start = fota_now();
+        if (download_open(dl) < 0)
+            dl->local_error = 1;
+    }
+
+    while (running && !fota_event_stop_pending()) {
+        double now = fota_now();
+        double next_retry = 0;
+        int pending = 0;
+        int active = 0;
+
+        for (int i = 0; i < count; i++) {
+            download_t *dl = &dls[i];
+
+            if (dl->restart && download_restart(multi, dl) < 0)
+                dl->local_error = 1;
+
+            /* Stop the other ranges of an artifact that gave up */
+            if (dl->failed || dl->local_error)
+                for (int j = 0; j < dl->nranges; j++)
+                    range_stop(multi, &dl->ranges[j]);
+
+            for (int j = 0; j < dl->nranges; j++)
+                if (dl->ranges[j].curl)
+                    active++;
+        }
+
+        for (int i = 0; i < count; i++) {
+            download_t *dl = &dls[i];
+
+            if (dl->failed || dl->local_error || dl->done)
+                continue;
+
+            int complete = 1;
+            for (int j = 0; j < dl->nranges && !dl->local_error; j++) {
+                download_range_t *r = &dl->ranges[j];
+
+                if (r->done)
+                    continue;
+                complete = 0;
+                if (r->curl)
+                    continue;
+
+                if (r->retry_at > now) {
+                    if (!next_retry || r->retry_at < next_retry)
+                        next_retry = r->retry_at;
+                    pending++;
+                } else if (active < max_conns) {
+                    if (range_start(multi, r) == 0)
+                        active++;
+                    else
+                        dl->local_error = 1;
+                } else {
+                    pending++;
+                }
+            }
+
+            if (complete && !dl->local_error) {
+                dl->done = 1;
+                download_close(dl);
+                if (!dl->failed && dl->on_done)
+                    dl->on_done(dl);
+            }
+        }
+
+        if (active == 0) {
+            if (!pending)
+                break;
+            /* Only backoff timers left */
+            if (next_retry > now)
+                usleep((next_retry - now) * 1e6);
+            continue;
+        }
+
+        int still;
+        curl_multi_perform(multi, &still);
+
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            download_range_t *r;
+
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&r);
+            range_done(multi, r, msg->data.result);
+        }
+
+        curl_multi_wait(multi, NULL, 0, 1000, NULL);
+    }
+
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < dls[i].nranges; j++)
+            range_stop(multi, &dls[i].ranges[j]);
+        if (!dls[i].closed)
+            download_close(&dls[i]);
+        if (dls[i].failed)
+            ret = -1;
+    }
+
+    curl_multi_cleanup(multi);
+    return ret;
+}
+
+/*
+ * Download a single file from URL to local path
+ * See download_files(); hash_out receives the SHA256 (hex).
+ * Returns 0 on success, -1 on failure
+ */
+int download_file(const char *url, const char *dest, const char *progress_path,
+                  size_t expected_size, const char *expected_sha,
+                  char *hash_out, artifact_timing_t *timing)
+{
+    download_t dl = {
+        .url = url,
+        .dest = dest,
+        .progress_path = progress_path,
+        .expected_size = expected_size,
+        .expected_sha = expected_sha,
+    };
+
+    int ret = download_files(&dl, 1);
+    strcpy(hash_out, dl.hash);
+    *timing = dl.timing;
+    return ret;
+}
+
+/*
+ * Remove a staged download and its progress record
+ */
+static void discard_download(const char *file, const char *progress_path)
+{
+    unlink(file);
+    fota_progress_clear(progress_path);
+}
+
+/*
+ * Extractor for dest_dir
+ * With a file list, dest_dir is updated in place: what the list does
+ * not have is removed first and only files that differ are rewritten
+ * (see fota_tar_set_files()). Without one, dest_dir should be empty.
+ */
+static fota_tar_t *extractor_new(const char *dest_dir,
+                                 const fota_tar_filelist_t *files)
+{
+    fota_tar_t *tar = fota_tar_new(dest_dir);
+    if (!tar)
+        return NULL;
+    if (config.low_impact)
+        fota_tar_set_writeback(tar, FOTA_WRITEBACK_SYNC);
+
+    if (files && files->nfiles) {
+        if (fota_tar_set_files(tar, files) < 0) {
+            fota_tar_free(tar);
+            return NULL;
+        }
+        unsigned long removed = fota_tar_prune(tar);
+        if (removed)
+            syslog(LOG_INFO, "Removed %lu entries not in the new release from %s",
+                   removed, dest_dir);
+    }
+    return tar;
+}
+
+static void log_extract_stats(const fota_tar_t *tar, const char *dest_dir)
+{
+    unsigned long entries, unchanged;
+    uint64_t bytes, unchanged_bytes;
+
+    fota_tar_stats(tar, &entries, &bytes);
+    fota_tar_unchanged(tar, &unchanged, &unchanged_bytes);
+    if (unchanged)
+        syslog(LOG_INFO, "Extracted %lu entries (%llu bytes) into %s, "
+               "%lu files (%llu bytes) unchanged",
+               entries - unchanged, (unsigned long long)bytes, dest_dir,
+               unchanged, (unsigned long long)unchanged_bytes);
+    else
+        syslog(LOG_INFO, "Extracted %lu entries (%llu bytes) into %s",
+               entries, (unsigned long long)bytes, dest_dir);
+}
+
+/*
+ * Download a compressed tar archive (comp: FOTA_COMP_*) and extract it
+ * into dest_dir on the fly
+ * Nothing is staged: the body is hashed, inflated and extracted with
+ * fixed size buffers. The caller must still compare hash_out with the
+ * manifest before trusting what was written. files may be NULL, see
+ * extractor_new().
+ * Returns 0 on success, -1 on failure
+ */
+int stream_extract(const char *url, const char *dest_dir,
+                   const fota_tar_filelist_t *files, size_t expected_size,
+                   int comp, char *hash_out, artifact_timing_t *timing)
+{
+    fota_stream_t stream;
+
+    fota_tar_t *tar = extractor_new(dest_dir, files);
+    if (!tar)
+        return -1;
+
+    /*
+     * Left alone, the kernel holds the extracted data in the page cache
+     * and writes most of it in the final syncfs(), after the transfer.
+     * Flushing as we go keeps the device busy while the rest arrives;
+     * the wait is on the pipe thread, not the network.
+     */
+    fota_tar_set_writeback(tar, FOTA_WRITEBACK_SYNC);
+
+    if (fota_stream_init(&stream, comp, tar_sink, tar) < 0) {
+        fota_tar_free(tar);
+        return -1;
+    }
+
+    int ret = fetch_artifact(url, expected_size, &stream, NULL, NULL,
+                             hash_out, timing);
+    if (ret == 0)
+        ret = fota_tar_finish(tar);
+
+    log_extract_stats(tar, dest_dir);
+
+    fota_stream_cleanup(&stream);
+    fota_tar_free(tar);
+    return ret;
+}
+
+/*
+ * Extract a staged compressed tar archive into dest_dir
+ * Same pipeline as stream_extract(), so the staged path gets the same
+ * throttling; the digest of what was actually extracted is returned.
+ * Returns 0 on success, -1 on failure
+ */
+static int extract_archive(const char *archive, const char *dest_dir,
+                           const fota_tar_filelist_t *files, int comp,
+                           char *hash_out)
+{
+    fota_stream_t stream;
+    unsigned char buf[FOTA_STREAM_BUF_SIZE];
+    ssize_t n;
+    int ret = -1;
+
+    int fd = open(archive, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Cannot open %s: %s", archive, strerror(errno));
+        return -1;
+    }
+
+    fota_tar_t *tar = extractor_new(dest_dir, files);
+    if (!tar) {
+        close(fd);
+        return -1;
+    }
+
+    if (fota_stream_init(&stream, comp, tar_sink, tar) < 0)
+        goto out_tar;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (fota_stream_feed(&stream, buf, n) < 0)
+            break;
+    }
+    if (n == 0 && fota_stream_finish(&stream, hash_out) == 0)
+        ret = fota_tar_finish(tar);
+    else if (n < 0)
+        syslog(LOG_ERR, "Cannot read %s: %s", archive, strerror(errno));
+
+    log_extract_stats(tar, dest_dir);
+
+    fota_stream_cleanup(&stream);
+out_tar:
+    fota_tar_free(tar);
+    close(fd);
+    return ret;
+}
+
+/*
+ * Raw image writer with journal checkpoints
+ * While an update is applied, every FOTA_JOURNAL_CHECKPOINT image bytes
+ * the target is flushed and the journal records how far the image is
+ * durable, so the next attempt compares that part instead of writing it.
+ */
+typedef struct {
+    fota_image_t *img;
+    uint64_t checkpoint;       /* Image offset of the next checkpoint */
+} image_target_t;
+
+static int image_target_open(image_target_t *t, const char *device,
+                             uint64_t image_size, const fota_bmap_t *bmap)
+{
+    t->img = fota_image_open(device, image_size, bmap);
+    if (!t->img)
+        return -1;
+
+    t->checkpoint = FOTA_JOURNAL_CHECKPOINT;
+    if (journal.slot && journal.rootfs_offset) {
+        syslog(LOG_INFO, "Resuming %s: checking the first %llu bytes",
+               device, (unsigned long long)journal.rootfs_offset);
+        fota_image_resume(t->img, journal.rootfs_offset);
+        t->checkpoint += journal.rootfs_offset;
+    }
+    return 0;
+}
+
+static int image_target_write(image_target_t *t, const void *buf, size_t len)
+{
+    fota_image_stats_t st;
+    uint64_t offset;
+
+    if (fota_image_write(t->img, buf, len) < 0)
+        return -1;
+
+    fota_image_get_stats(t->img, &st);
+    if (!journal.slot || st.image_bytes < t->checkpoint)
+        return 0;
+
+    if (fota_image_sync(t->img, &offset) < 0)
+        return -1;
+
+    /* The old record stays valid if this one cannot be written */
+    journal.rootfs_offset = offset;
+    fota_journal_save(JOURNAL_FILE, &journal);
+    fota_journal_fault("checkpoint");
+
+    t->checkpoint = offset + FOTA_JOURNAL_CHECKPOINT;
+    return 0;
+}
+
+static void log_image_stats(const char *device, const fota_image_t *img)
+{
+    fota_image_stats_t st;
+
+    fota_image_get_stats(img, &st);
+    syslog(LOG_INFO, "Image %s: %llu bytes, %llu written, %llu zeroed, "
+           "%llu skipped, %llu already there", device,
+           (unsigned long long)st.image_bytes,
+           (unsigned long long)st.written_bytes,
+           (unsigned long long)st.zeroed_bytes,
+           (unsigned long long)st.skipped_bytes,
+           (unsigned long long)st.verified_bytes);
+}
+
+/*
+ * Stream sink: Raw image writer
+ */
+static int image_sink(void *opaque, const void *buf, size_t len)
+{
+    fota_throttle_pause();
+    return image_target_write((image_target_t *)opaque, buf, len);
+}
+
+/*
+ * Pipe flush: Complete the writes queued from the pipe thread before it
+ * exits, io_uring would cancel them
+ */
+static int image_drain(void *opaque)
+{
+    return fota_image_drain(((image_target_t *)opaque)->img);
+}
+
+/*
+ * Download a raw filesystem image and write it to a block device
+ * Empty blocks are skipped (bmap) or zeroed without data transfer.
+ * Returns 0 on success, -1 on failure
+ */
+int stream_image(const char *url, const char *device, size_t expected_size,
+                 uint64_t image_size, const fota_bmap_t *bmap, int comp,
+                 char *hash_out, artifact_timing_t *timing)
+{
+    fota_stream_t stream;
+    fota_image_stats_t st;
+    image_target_t target;
+
+    if (image_target_open(&target, device, image_size, bmap) < 0)
+        return -1;
+
+    if (fota_stream_init(&stream, comp, image_sink, &target) < 0) {
+        fota_image_close(target.img);
+        return -1;
+    }
+
+    int ret = fetch_artifact(url, expected_size, &stream, image_drain, &target,
+                             hash_out, timing);
+
+    double t0 = fota_now();
+    if (ret == 0)
+        ret = fota_image_finish(target.img);
+    timing->write_s += fota_now() - t0;
+    if (timing->wall_s)
+        timing->wall_s += fota_now() - t0;
+
+    log_image_stats(device, target.img);
+    fota_image_get_stats(target.img, &st);
+
+    if (ret == 0 && image_size && st.image_bytes != image_size) {
+        syslog(LOG_ERR, "Image size mismatch: expected %llu, got %llu",
+               (unsigned long long)image_size,
+               (unsigned long long)st.image_bytes);
+        ret = -1;
+    }
+
+    fota_stream_cleanup(&stream);
+    fota_image_close(target.img);
+    return ret;
+}
+
+/*
+ * Stream sink: Delta applier
+ */
+static int delta_sink(void *opaque, const void *buf, size_t len)
+{
+    fota_throttle_pause();
+    return fota_delta_write((fota_delta_t *)opaque, buf, len);
+}
+
+/*
+ * Download a delta and rebuild the new image from source on device
+ * hash_out receives the SHA256 of the delta as transferred, image_hash
+ * the SHA256 of the rebuilt image.
+ * Returns 0 on success, -1 on failure
+ */
+int stream_delta(const char *url, const char *source, const char *device,
+                 size_t expected_size, uint64_t image_size, int comp,
+                 char *hash_out, char *image_hash, artifact_timing_t *timing)
+{
+    fota_stream_t stream;
+    fota_delta_stats_t st;
+    image_target_t target;
+    int ret = -1;
+
+    if (image_target_open(&target, device, image_size, NULL) < 0)
+        return -1;
+
+    fota_delta_t *delta = fota_delta_new(source, image_sink, &target);
+    if (!delta)
+        goto out_image;
+
+    if (fota_stream_init(&stream, comp, delta_sink, delta) < 0)
+        goto out_delta;
+
+    ret = fetch_artifact(url, expected_size, &stream, image_drain, &target,
+                         hash_out, timing);
+
+    double t0 = fota_now();
+    if (fota_delta_finish(delta, image_hash) < 0)
+        ret = -1;
+    if (ret == 0)
+        ret = fota_image_finish(target.img);
+    timing->write_s += fota_now() - t0;
+    if (timing->wall_s)
+        timing->wall_s += fota_now() - t0;
+
+    log_image_stats(device, target.img);
+    fota_delta_get_stats(delta, &st);
+    syslog(LOG_INFO, "Delta %s -> %s: %llu bytes rebuilt, %llu copied, "
+           "%llu from delta, %llu zero", source, device,
+           (unsigned long long)st.target_bytes,
+           (unsigned long long)st.copied_bytes,
+           (unsigned long long)st.literal_bytes,
+           (unsigned long long)st.zero_bytes);
+
+    fota_stream_cleanup(&stream);
+out_delta:
+    fota_delta_free(delta);
+out_image:
+    fota_image_close(target.img);
+    return ret;
+}
+
+/*
+ * Log the timing breakdown of one artifact
+ */
+static void log_artifact_timing(const char *name, const artifact_timing_t *t)
+{
+    double total = t->wall_s ? t->wall_s : t->download_s + t->hash_s + t->write_s;
+
+    syslog(LOG_INFO, "%s: %zu bytes in %.2fs (download %.2fs, hash %.2fs, "
+           "write %.2fs, %.1f KiB/s)", name, t->bytes, total,
+           t->download_s, t->hash_s, t->write_s,
+           total > 0 ? t->bytes / 1024.0 / total : 0.0);
+}
+
+/*
+ * Add a stage from start until now to the update timeline, see
+ * fota_metrics.h
+ */
+static void metric(const char *stage, const char *artifact, double start,
+                   uint64_t bytes, int ok)
+{
+    fota_metric_t m = {
+        .stage = stage,
+        .artifact = artifact,
+        .start = start,
+        .end = fota_now(),
+        .bytes = bytes,
+        .ok = ok,
+    };
+
+    fota_metrics_add(&m);
+}
+
+/* Same for a transfer, with its timing breakdown */
+static void metric_transfer(const char *stage, const char *artifact,
+                            double start, double end,
+                            const artifact_timing_t *t, int ok)
+{
+    fota_metric_t m = {
+        .stage = stage,
+        .artifact = artifact,
+        .start = start,
+        .end = end,
+        .bytes = t->bytes,
+        .download_s = t->download_s,
+        .hash_s = t->hash_s,
+        .write_s = t->write_s,
+        .ok = ok,
+    };
+
+    fota_metrics_add(&m);
+}
+
+/*
+ * Manifest helpers
+ */
+static int rootfs_is_delta(const update_manifest_t *manifest)
+{
+    return strcmp(manifest->rootfs_type, ARTIFACT_DELTA) == 0;
+}
+
+static int rootfs_is_chunked(const update_manifest_t *manifest)
+{
+    return strcmp(manifest->rootfs_type, ARTIFACT_CHUNKED) == 0;
+}
+
+/* Artifacts that are written to the raw partition without mkfs */
+static int rootfs_is_image(const update_manifest_t *manifest)
+{
+    return strcmp(manifest->rootfs_type, ARTIFACT_IMAGE) == 0 ||
+           rootfs_is_delta(manifest) || rootfs_is_chunked(manifest);
+}
+
+/* Root filesystems mounted read-only, with an overlay on /data */
+static int rootfs_is_readonly(const update_manifest_t *manifest)
+{
+    return strcmp(manifest->rootfs_fs, "ext4") != 0;
+}
+
+/*
+ * Filesystems a rootfs image may hold, identified by the magic in their
+ * superblock
+ */
+static const struct {
+    const char *name;
+    off_t offset;
+    const char *magic;
+    size_t len;
+} rootfs_fs_types[] = {
+    { "ext4",     1024 + 0x38, "\x53\xef", 2 },
+    { "squashfs", 0,           "hsqs", 4 },
+    { "erofs",    1024,        "\xe2\xe1\xf5\xe0", 4 },
+};
+
+static int rootfs_fs_index(const char *name)
+{
+    for (size_t i = 0; i < sizeof(rootfs_fs_types) / sizeof(rootfs_fs_types[0]); i++)
+        if (strcmp(rootfs_fs_types[i].name, name) == 0)
+            return i;
+    return -1;
+}
+
+static void filelist_free(fota_tar_filelist_t *list)
+{
+    for (size_t i = 0; i < list->nfiles; i++)
+        free(list->files[i].path);
+    free(list->files);
+    list->files = NULL;
+    list->nfiles = 0;
+}
+
+static void manifest_free(update_manifest_t *manifest)
+{
+    filelist_free(&manifest->boot_files);
+    free(manifest->rootfs_bmap.ranges);
+    manifest->rootfs_bmap.ranges = NULL;
+    manifest->rootfs_bmap.nranges = 0;
+}
+
+/*
+ * Parse a block map: {"block_size": 4096, "ranges": [[first, last], ...]}
+ * Ranges are inclusive block numbers, as in bmaptool's BlockMap. A map
+ * that is not in this shape is dropped, the image is then written whole.
+ */
+static void parse_bmap(struct json_object *obj, fota_bmap_t *bmap)
+{
+    struct json_object *bs, *ranges;
+
+    if (!json_object_object_get_ex(obj, "block_size", &bs) ||
+        !json_object_object_get_ex(obj, "ranges", &ranges))
+        return;
+    if (!json_object_is_type(ranges, json_type_array))
+        goto invalid;
+
+    size_t n = json_object_array_length(ranges);
+    bmap->ranges = calloc(n ? n : 1, sizeof(fota_range_t));
+    if (!bmap->ranges)
+        return;
+
+    bmap->block_size = json_object_get_int(bs);
+    for (size_t i = 0; i < n; i++) {
+        struct json_object *r = json_object_array_get_idx(ranges, i);
+        if (!json_object_is_type(r, json_type_array) ||
+            json_object_array_length(r) != 2)
+            goto invalid;
+        fota_range_t *range = &bmap->ranges[bmap->nranges++];
+        range->first = json_object_get_int64(json_object_array_get_idx(r, 0));
+        range->last = json_object_get_int64(json_object_array_get_idx(r, 1));
+    }
+    return;
+
+invalid:
+    /* Skipping a range would leave its blocks unwritten */
+    syslog(LOG_WARNING, "Malformed rootfs_bmap ignored, writing the whole image");
+    free(bmap->ranges);
+    bmap->ranges = NULL;
+    bmap->nranges = 0;
+}
+
+/*
+ * Compact form of a block map: "block_size:first-last,first-last,..."
+ */
+static void parse_bmap_compact(const char *value, fota_bmap_t *bmap)
+{
+    size_t n = 1;
+    char *end;
+
+    for (const char *p = value; *p; p++)
+        if (*p == ',')
+            n++;
+
+    free(bmap->ranges);
+    bmap->nranges = 0;
+    bmap->ranges = calloc(n, sizeof(fota_range_t));
+    if (!bmap->ranges)
+        return;
+
+    bmap->block_size = strtoul(value, &end, 10);
+    if (*end != ':')
+        return;
+
+    while (*end == ':' || *end == ',') {
+        fota_range_t *range = &bmap->ranges[bmap->nranges];
+
+        range->first = strtoull(end + 1, &end, 10);
+        if (*end != '-')
+            break;
+        range->last = strtoull(end + 1, &end, 10);
+        bmap->nranges++;
+    }
+}
+
+/*
+ * Parse a per-file manifest: [{"path": ..., "size": ..., "sha256": ...}, ...]
+ */
+static void parse_filelist(struct json_object *arr, fota_tar_filelist_t *list)
+{
+    size_t n = json_object_array_length(arr);
+
+    filelist_free(list);
+    list->files = calloc(n ? n : 1, sizeof(fota_tar_file_t));
+    if (!list->files)
+        return;
+
+    for (size_t i = 0; i < n; i++) {
+        struct json_object *f = json_object_array_get_idx(arr, i);
+        struct json_object *path, *size, *sha;
+
+        if (!json_object_object_get_ex(f, "path", &path) ||
+            !json_object_object_get_ex(f, "size", &size) ||
+            !json_object_object_get_ex(f, "sha256", &sha))
+            continue;
+
+        fota_tar_file_t *file = &list->files[list->nfiles];
+        file->path = strdup(json_object_get_string(path));
+        if (!file->path)
+            continue;
+        file->size = json_object_get_int64(size);
+        snprintf(file->sha256, sizeof(file->sha256), "%s",
+                 json_object_get_string(sha));
+        list->nfiles++;
+    }
+}
+
+/*
+ * Compact form of a per-file manifest: "path:size:sha256,..."
+ */
+static void parse_filelist_compact(const char *value, fota_tar_filelist_t *list)
+{
+    size_t n = 1;
+    char *copy, *save;
+
+    for (const char *p = value; *p; p++)
+        if (*p == ',')
+            n++;
+
+    filelist_free(list);
+    list->files = calloc(n, sizeof(fota_tar_file_t));
+    copy = strdup(value);
+    if (!list->files || !copy) {
+        free(copy);
+        return;
+    }
+
+    for (char *item = strtok_r(copy, ",", &save); item;
+         item = strtok_r(NULL, ",", &save)) {
+        char *size = strchr(item, ':');
+        char *sha = size ? strchr(size + 1, ':') : NULL;
+
+        if (!sha)
+            continue;
+        *size++ = '\0';
+        *sha++ = '\0';
+
+        fota_tar_file_t *file = &list->files[list->nfiles];
+        file->path = strdup(item);
+        if (!file->path)
+            continue;
+        file->size = strtoull(size, NULL, 10);
+        snprintf(file->sha256, sizeof(file->sha256), "%s", sha);
+        list->nfiles++;
+    }
+    free(copy);
+}
+
+/*
+ * Set one manifest field, shared by the JSON and the compact format
+ * Unknown keys (release notes, changelog, ...) are ignored.
+ */
+static void manifest_set(update_manifest_t *manifest, const char *key,
+                         const char *value)
+{
+    if (!value)
+        return;
+
+    if (strcmp(key, "version") == 0)
+        strncpy(manifest->version, value, 31);
+    else if (strcmp(key, "boot_url") == 0)
+        strncpy(manifest->boot_url, value, 511);
+    else if (strcmp(key, "boot_sha256") == 0)
+        strncpy(manifest->boot_sha256, value, 64);
+    else if (strcmp(key, "boot_size") == 0)
+        manifest->boot_size = strtoull(value, NULL, 10);
+    else if (strcmp(key, "boot_compression") == 0)
+        strncpy(manifest->boot_compression, value, 15);
+    else if (strcmp(key, "boot_files") == 0)
+        parse_filelist_compact(value, &manifest->boot_files);
+    else if (strcmp(key, "rootfs_url") == 0)
+        strncpy(manifest->rootfs_url, value, 511);
+    else if (strcmp(key, "rootfs_sha256") == 0)
+        strncpy(manifest->rootfs_sha256, value, 64);
+    else if (strcmp(key, "rootfs_size") == 0)
+        manifest->rootfs_size = strtoull(value, NULL, 10);
+    else if (strcmp(key, "rootfs_type") == 0)
+        strncpy(manifest->rootfs_type, value, 15);
+    else if (strcmp(key, "rootfs_compression") == 0)
+        strncpy(manifest->rootfs_compression, value, 15);
+    else if (strcmp(key, "rootfs_fs") == 0)
+        strncpy(manifest->rootfs_fs, value, 15);
+    else if (strcmp(key, "rootfs_image_size") == 0)
+        manifest->rootfs_image_size = strtoull(value, NULL, 10);
+    else if (strcmp(key, "rootfs_image_sha256") == 0)
+        strncpy(manifest->rootfs_image_sha256, value, 64);
+    else if (strcmp(key, "rootfs_source_size") == 0)
+        manifest->rootfs_source_size = strtoull(value, NULL, 10);
+    else if (strcmp(key, "rootfs_source_sha256") == 0)
+        strncpy(manifest->rootfs_source_sha256, value, 64);
+    else if (strcmp(key, "rootfs_full_url") == 0)
+        strncpy(manifest->rootfs_full_url, value, 511);
+    else if (strcmp(key, "rootfs_full_sha256") == 0)
+        strncpy(manifest->rootfs_full_sha256, value, 64);
+    else if (strcmp(key, "rootfs_full_size") == 0)
+        manifest->rootfs_full_size = strtoull(value, NULL, 10);
+    else if (strcmp(key, "rootfs_full_compression") == 0)
+        strncpy(manifest->rootfs_full_compression, value, 15);
+    else if (strcmp(key, "rootfs_bmap") == 0)
+        parse_bmap_compact(value, &manifest->rootfs_bmap);
+    else if (strcmp(key, "rootfs_chunk_url") == 0)
+        strncpy(manifest->rootfs_chunk_url, value, 511);
+    else if (strcmp(key, "rootfs_verity") == 0)
+        manifest->rootfs_verity = strcmp(value, "true") == 0 || atoi(value) != 0;
+    else if (strcmp(key, "rootfs_verity_root_hash") == 0)
+        strncpy(manifest->rootfs_verity_root_hash, value, 64);
+    else if (strcmp(key, "rootfs_verity_salt") == 0)
+        strncpy(manifest->rootfs_verity_salt, value, 64);
+}
+
+/*
+ * JSON response (application/json)
+ * Returns 1 if an update is offered, 0 if not, -1 on a parse error
+ */
+static int parse_json_response(const char *body, update_manifest_t *manifest)
+{
+    struct json_object *root = json_tokener_parse(body);
+    int available = 0;
+
+    if (!root)
+        return -1;
+
+    json_object_object_foreach(root, key, val) {
+        if (strcmp(key, "update_available") == 0)
+            available = json_object_get_boolean(val);
+        else if (strcmp(key, "rootfs_bmap") == 0 &&
+                 json_object_is_type(val, json_type_object))
+            parse_bmap(val, &manifest->rootfs_bmap);
+        else if (strcmp(key, "boot_files") == 0 &&
+                 json_object_is_type(val, json_type_array))
+            parse_filelist(val, &manifest->boot_files);
+        else
+            manifest_set(manifest, key, json_object_get_string(val));
+    }
+
+    json_object_put(root);
+    return available;
+}
+
+/*
+ * Compact response (CHECK_CONTENT_TYPE): one "key=value" per line with
+ * the keys of the JSON manifest, no quoting or nesting. An empty body
+ * or "update_available=0" means no update.
+ */
+static int parse_compact_response(char *body, update_manifest_t *manifest)
+{
+    int available = 0;
+    char *save;
+
+    for (char *line = strtok_r(body, "\r\n", &save); line;
+         line = strtok_r(NULL, "\r\n", &save)) {
+        char *eq = strchr(line, '=');
+
+        if (line[0] == '#' || !eq)
+            continue;
+        *eq = '\0';
+        if (strcmp(line, "update_available") == 0)
+            available = atoi(eq + 1) != 0;
+        else
+            manifest_set(manifest, line, eq + 1);
+    }
+    return available;
+}
+
+/*
+ * Validators of the last "no update" answer
+ * Sent back as If-None-Match / If-Modified-Since so an unchanged answer
+ * costs a bodyless 304. They only apply to the exact same request: a
+ * different URL, version or slot invalidates them. Kept in STATE_DIR so
+ * they survive restarts and reboots.
+ */
+typedef struct {
+    char url[512];
+    char version[32];
+    char slot;
+    char etag[128];
+    char last_modified[64];
+} check_cache_t;
+
+static check_cache_t check_cache;
+static int check_cache_loaded;
+
+static void check_cache_load(void)
+{
+    char line[640];
+
+    check_cache_loaded = 1;
+
+    FILE *fp = fopen(CHECK_CACHE, "r");
+    if (!fp)
+        return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *eq = strchr(line, '=');
+        if (!eq)
+            continue;
+        *eq = '\0';
+        eq[1 + strcspn(eq + 1, "\n")] = '\0';
+
+        const char *value = eq + 1;
+        if (strcmp(line, "url") == 0)
+            snprintf(check_cache.url, sizeof(check_cache.url), "%s", value);
+        else if (strcmp(line, "version") == 0)
+            snprintf(check_cache.version, sizeof(check_cache.version), "%s", value);
+        else if (strcmp(line, "slot") == 0)
+            check_cache.slot = value[0];
+        else if (strcmp(line, "etag") == 0)
+            snprintf(check_cache.etag, sizeof(check_cache.etag), "%s", value);
+        else if (strcmp(line, "last_modified") == 0)
+            snprintf(check_cache.last_modified, sizeof(check_cache.last_modified),
+                     "%s", value);
+    }
+    fclose(fp);
+}
+
+/*
+ * Store new validators, written only when they change
+ * A lost update just costs one full response, no fsync needed.
+ */
+static void check_cache_store(const char *url, const char *etag,
+                              const char *last_modified)
+{
+    check_cache_t c = {0};
+
+    snprintf(c.url, sizeof(c.url), "%s", url);
+    snprintf(c.version, sizeof(c.version), "%s", config.current_version);
+    c.slot = config.current_slot;
+    snprintf(c.etag, sizeof(c.etag), "%s", etag);
+    snprintf(c.last_modified, sizeof(c.last_modified), "%s", last_modified);
+
+    if (memcmp(&c, &check_cache, sizeof(c)) == 0)
+        return;
+    check_cache = c;
+
+    if (!etag[0] && !last_modified[0]) {
+        unlink(CHECK_CACHE);
+        return;
+    }
+
+    mkdir(STATE_DIR, 0755);
+    FILE *fp = fopen(CHECK_CACHE ".tmp", "w");
+    if (!fp)
+        return;
+    fprintf(fp, "url=%s\nversion=%s\nslot=%c\netag=%s\nlast_modified=%s\n",
+            c.url, c.version, c.slot, c.etag, c.last_modified);
+    if (fclose(fp) != 0 || rename(CHECK_CACHE ".tmp", CHECK_CACHE) != 0)
+        unlink(CHECK_CACHE ".tmp");
+}
+
+static int check_cache_valid(const char *url)
+{
+    if (!check_cache_loaded)
+        check_cache_load();
+
+    return (check_cache.etag[0] || check_cache.last_modified[0]) &&
+           strcmp(check_cache.url, url) == 0 &&
+           strcmp(check_cache.version, config.current_version) == 0 &&
+           check_cache.slot == config.current_slot;
+}
+
+/* Validators of the response, reset on every status line (redirects) */
+typedef struct {
+    char etag[128];
+    char last_modified[64];
+} response_headers_t;
+
+static void copy_header_value(char *dst, size_t dst_size, const char *v, size_t len)
+{
+    while (len && (*v == ' ' || *v == '\t')) {
+        v++;
+        len--;
+    }
+    while (len && (v[len - 1] == '\r' || v[len - 1] == '\n' || v[len - 1] == ' '))
+        len--;
+    snprintf(dst, dst_size, "%.*s", (int)len, v);
+}
+
+static size_t header_callback(char *buf, size_t size, size_t nitems, void *userp)
+{
+    response_headers_t *h = userp;
+    size_t len = size * nitems;
+
+    if (len >= 5 && strncmp(buf, "HTTP/", 5) == 0)
+        memset(h, 0, sizeof(*h));
+    else if (len > 5 && strncasecmp(buf, "ETag:", 5) == 0)
+        copy_header_value(h->etag, sizeof(h->etag), buf + 5, len - 5);
+    else if (len > 14 && strncasecmp(buf, "Last-Modified:", 14) == 0)
+        copy_header_value(h->last_modified, sizeof(h->last_modified),
+                          buf + 14, len - 14);
+    return len;
+}
+
+/*
+ * SHA256 (hex) of the first size bytes of a device
+ * Returns 0 on success, -1 on failure or if the device is shorter
+ */
+static int calculate_sha256_range(const char *device, uint64_t size,
+                                  char *hash_out)
+{
+    fota_sha256_ctx ctx;
+    unsigned char hash[FOTA_SHA256_DIGEST_LENGTH];
+    static unsigned char buffer[256 * 1024];
+    uint64_t done = 0;
+
+    int fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Cannot open %s for hashing: %s", device, strerror(errno));
+        return -1;
+    }
+
+    fota_sha256_init(&ctx);
+    while (done < size) {
+        size_t want = size - done < sizeof(buffer) ? size - done : sizeof(buffer);
+        ssize_t n = pread(fd, buffer, want, done);
+
+        if (n <= 0)
+            break;
+        fota_sha256_update(&ctx, buffer, n);
+        done += n;
+    }
+    close(fd);
+
+    if (done < size) {
+        syslog(LOG_ERR, "Cannot read %llu bytes of %s",
+               (unsigned long long)size, device);
+        return -1;
+    }
+
+    fota_sha256_final(&ctx, hash);
+    fota_sha256_hex(hash, hash_out);
+    return 0;
+}
+
+/*
+ * A delta only rebuilds the new image from the exact image it was made
+ * against. Check the active root against rootfs_source_sha256 before
+ * anything is downloaded or written. If it has diverged (remounted rw,
+ * a different base release), switch to the full image when the manifest
+ * offers one, otherwise skip the update: applying the delta would
+ * rewrite the whole standby slot just to fail the final digest check,
+ * at every check interval. The result is kept per source digest, so the
+ * root is read once and not at every check.
+ * Returns 0 if the manifest can be applied, -1 if not
+ */
+static int delta_source_check(update_manifest_t *manifest)
+{
+    static char checked[65];
+    static int matched;
+    const char *source = get_active_root(config.current_slot);
+    int fresh = 0;
+
+    if (!manifest->rootfs_source_sha256[0] || !manifest->rootfs_source_size) {
+        syslog(LOG_WARNING, "Delta manifest lacks rootfs_source_sha256/size, "
+               "%s not checked", source);
+        return 0;
+    }
+
+    if (strcmp(checked, manifest->rootfs_source_sha256) != 0) {
+        char hash[65];
+        double t0 = fota_now();
+
+        matched = calculate_sha256_range(source, manifest->rootfs_source_size,
+                                         hash) == 0 &&
+                  strcasecmp(hash, manifest->rootfs_source_sha256) == 0;
+        metric("source", "rootfs", t0, manifest->rootfs_source_size, matched);
+        snprintf(checked, sizeof(checked), "%s", manifest->rootfs_source_sha256);
+        fresh = 1;
+    }
+    if (matched)
+        return 0;
+
+    if (!manifest->rootfs_full_url[0] || !manifest->rootfs_full_sha256[0]) {
+        if (!fresh)
+            return -1;
+
+        /* Logged and saved for the server once, not at every check */
+        syslog(LOG_ERR, "Active root %s is not the image the delta to v%s was "
+               "made against and there is no full image, update skipped",
+               source, manifest->version);
+        mkdir(STATE_DIR, 0755);
+        fota_metrics_set("from_version", config.current_version);
+        fota_metrics_set("to_version", manifest->version);
+        fota_metrics_set("rootfs_type", manifest->rootfs_type);
+        fota_metrics_set("result", "delta_source_mismatch");
+        fota_metrics_save(TIMELINE_FILE);
+        return -1;
+    }
+
+    syslog(LOG_WARNING, "Active root %s is not the image the delta to v%s was "
+           "made against, using the full image", source, manifest->version);
+
+    strcpy(manifest->rootfs_type, ARTIFACT_IMAGE);
+    snprintf(manifest->rootfs_url, sizeof(manifest->rootfs_url), "%s",
+             manifest->rootfs_full_url);
+    snprintf(manifest->rootfs_sha256, sizeof(manifest->rootfs_sha256), "%s",
+             manifest->rootfs_full_sha256);
+    manifest->rootfs_size = manifest->rootfs_full_size;
+    snprintf(manifest->rootfs_compression, sizeof(manifest->rootfs_compression),
+             "%s", manifest->rootfs_full_compression[0] ?
+             manifest->rootfs_full_compression : "none");
+
+    if (fota_stream_codec(manifest->rootfs_compression) < 0) {
+        syslog(LOG_ERR, "Unsupported compression of the full image: %s",
+               manifest->rootfs_compression);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Check for updates from server
+ * The request is conditional when validators of an earlier "no update"
+ * answer are known, and offers the compact format ahead of JSON.
+ * Returns: 1 = update available, 0 = no update, -1 = error
+ */
+int check_for_update(update_manifest_t *manifest)
+{
+    char url[512];
+    snprintf(url, sizeof(url), "%s/api/v1/devices/%s/update",
+             config.server_url, config.device_id);
+
+    /* Every check starts a timeline, it is kept if an update follows */
+    fota_metrics_begin();
+    double t0 = fota_now();
+
+    /* Long-lived handle: connection and TLS session survive between checks */
+    CURL *curl = fota_net_handle();
+    if (!curl)
+        return -1;
+
+    struct memory_chunk chunk = {0};
+    chunk.memory = calloc(1, 1);
+    chunk.size = 0;
+
+    response_headers_t resp = {0};
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_memory_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)&resp);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+
+    /* Add headers with device info */
+    struct curl_slist *headers = NULL;
+    char version_header[64];
+    snprintf(version_header, sizeof(version_header),
+             "X-Current-Version: %s", config.current_version);
+    headers = curl_slist_append(headers, version_header);
+
+    char slot_header[32];
+    snprintf(slot_header, sizeof(slot_header),
+             "X-Current-Slot: %c", config.current_slot);
+    headers = curl_slist_append(headers, slot_header);
+
+    headers = curl_slist_append(headers,
+                                "Accept: " CHECK_CONTENT_TYPE ", application/json;q=0.5");
+
+    char etag_header[160], modified_header[96];
+    int conditional = check_cache_valid(url);
+    if (conditional && check_cache.etag[0]) {
+        snprintf(etag_header, sizeof(etag_header),
+                 "If-None-Match: %s", check_cache.etag);
+        headers = curl_slist_append(headers, etag_header);
+    }
+    if (conditional && check_cache.last_modified[0]) {
+        snprintf(modified_header, sizeof(modified_header),
+                 "If-Modified-Since: %s", check_cache.last_modified);
+        headers = curl_slist_append(headers, modified_header);
+    }
+
+    /* Timeline of the last update attempt, sent until the server got it */
+    char *timeline = NULL;
+    if (config.report_timeline) {
+        char *line = fota_metrics_unreported(TIMELINE_FILE, TIMELINE_REPORT_MAX);
+        if (line && asprintf(&timeline, "X-Update-Timeline: %s", line) > 0)
+            headers = curl_slist_append(headers, timeline);
+        else
+            timeline = NULL;
+        free(line);
+    }
+
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    CURLcode res = curl_easy_perform(curl);
+    fota_net_account(curl);
+    curl_slist_free_all(headers);
+
+    long code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    int answered = res == CURLE_OK && (code == 200 || code == 204 || code == 304);
+    metric("check", NULL, t0, chunk.size, answered);
+    if (timeline && answered)
+        fota_metrics_reported(TIMELINE_FILE);
+    free(timeline);
+
+    if (res != CURLE_OK) {
+        syslog(LOG_WARNING, "Update check failed: %s", curl_easy_strerror(res));
+        free(chunk.memory);
+        return -1;
+    }
+
+    char *content_type = NULL;
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
+
+    /* Same answer as last time, which was "no update" */
+    if (code == 304) {
+        free(chunk.memory);
+        syslog(LOG_DEBUG, "No update (not modified)");
+        return 0;
+    }
+
+    if (code != 200 && code != 204) {
+        syslog(LOG_WARNING, "Update check failed: HTTP %ld", code);
+        free(chunk.memory);
+        return -1;
+    }
+
+    strcpy(manifest->rootfs_type, ARTIFACT_TAR);
+    strcpy(manifest->rootfs_fs, "ext4");
+
+    int available = 0;
+    if (code == 204)
+        available = 0;
+    else if (content_type &&
+             strncmp(content_type, CHECK_CONTENT_TYPE, strlen(CHECK_CONTENT_TYPE)) == 0)
+        available = parse_compact_response(chunk.memory, manifest);
+    else
+        available = parse_json_response(chunk.memory, manifest);
+    free(chunk.memory);
+
+    if (available < 0) {
+        syslog(LOG_ERR, "Failed to parse update response");
+        manifest_free(manifest);
+        return -1;
+    }
+
+    /* Validators are only useful for the common "no update" answer */
+    if (!available) {
+        check_cache_store(url, resp.etag, resp.last_modified);
+        manifest_free(manifest);
+        return 0;  /* No update available */
+    }
+    check_cache_store(url, "", "");
+
+    /* Tarballs are gzip'ed, images are sent as-is unless stated */
+    if (manifest->boot_compression[0] == '\0')
+        strcpy(manifest->boot_compression, "gzip");
+    if (manifest->rootfs_compression[0] == '\0')
+        strcpy(manifest->rootfs_compression,
+               rootfs_is_image(manifest) ? "none" : "gzip");
+
+    /* zstd and lz4 only if built in */
+    if (fota_stream_codec(manifest->boot_compression) < 0 ||
+        fota_stream_codec(manifest->rootfs_compression) < 0) {
+        syslog(LOG_ERR, "Unsupported compression: boot %s, rootfs %s",
+               manifest->boot_compression, manifest->rootfs_compression);
+        manifest_free(manifest);
+        return -1;
+    }
+
+    if (strcmp(manifest->rootfs_type, ARTIFACT_TAR) != 0 &&
+        !rootfs_is_image(manifest)) {
+        syslog(LOG_ERR, "Unsupported rootfs type: %s", manifest->rootfs_type);
+        manifest_free(manifest);
+        return -1;
+    }
+
+    /* Tarballs are extracted into ext4, other filesystems come as images */
+    if (rootfs_fs_index(manifest->rootfs_fs) < 0 ||
+        (rootfs_is_readonly(manifest) && !rootfs_is_image(manifest))) {
+        syslog(LOG_ERR, "Unsupported rootfs filesystem: %s in %s",
+               manifest->rootfs_fs, manifest->rootfs_type);
+        manifest_free(manifest);
+        return -1;
+    }
+
+    /*
+     * dm-verity needs an image nobody writes to, and the tree has to
+     * cover every block of it: blocks a block map skips would keep the
+     * old slot's data
+     */
+    if (manifest->rootfs_verity_root_hash[0])
+        manifest->rootfs_verity = 1;
+    if (manifest->rootfs_verity) {
+        if (!rootfs_is_image(manifest) || !rootfs_is_readonly(manifest) ||
+            manifest->rootfs_image_size == 0) {
+            syslog(LOG_ERR, "dm-verity needs a squashfs or erofs rootfs image "
+                   "and its rootfs_image_size");
+            manifest_free(manifest);
+            return -1;
+        }
+        if (manifest->rootfs_bmap.nranges) {
+            syslog(LOG_INFO, "Block map ignored, the verity tree covers all blocks");
+            free(manifest->rootfs_bmap.ranges);
+            manifest->rootfs_bmap.ranges = NULL;
+            manifest->rootfs_bmap.nranges = 0;
+        }
+    }
+
+    /* Without the target digest a delta cannot be verified */
+    if (rootfs_is_delta(manifest) &&
+        (manifest->rootfs_image_sha256[0] == '\0' ||
+         manifest->rootfs_image_size == 0)) {
+        syslog(LOG_ERR, "Delta manifest lacks rootfs_image_sha256/size");
+        manifest_free(manifest);
+        return -1;
+    }
+
+    /* Nothing is written for a delta that cannot rebuild the image */
+    if (rootfs_is_delta(manifest) && delta_source_check(manifest) < 0) {
+        manifest_free(manifest);
+        return 0;
+    }
+
+    syslog(LOG_INFO, "Update available: %s -> %s",
+           config.current_version, manifest->version);
+
+    return 1;  /* Update available */
+}
+
+/*
+ * Compare a computed digest with the manifest and log the outcome
+ * Returns 0 if they match, -1 otherwise
+ */
+static int verify_digest(const char *name, const char *hash, const char *expected)
+{
+    if (strcmp(hash, expected) != 0) {
+        syslog(LOG_ERR, "%s archive checksum mismatch", name);
+        syslog(LOG_ERR, "  Expected: %s", expected);
+        syslog(LOG_ERR, "  Got:      %s", hash);
+        return -1;
+    }
+    syslog(LOG_INFO, "%s archive verified", name);
+    return 0;
+}
+
+/*
+ * Chunked rootfs (rootfs_chunked, see fota_chunk.h)
+ *
+ * The chunk index is the artifact: it is downloaded and checked against
+ * rootfs_sha256 first. The image is then assembled in order onto the
+ * standby partition, window by window: chunks found in the active slot
+ * (located through the index that slot was installed from, or by
+ * chunking the slot itself) or in the chunk cache are reused, the
+ * others are downloaded into the cache, max_connections at a time.
+ * Every chunk is checked against its id before it is written, so a
+ * modified active slot or a corrupt cache entry only costs a download,
+ * and the verified index covers the whole image without hashing it
+ * again. Chunks fetched before an interruption stay in the cache, and
+ * chunks below the journal's rootfs_offset are taken from the standby
+ * partition itself, after the same check.
+ */
+
+#define CHUNK_BATCH 64         /* Missing chunks fetched per window */
+
+typedef struct {
+    size_t resumed_chunks, slot_chunks, cache_chunks, fetched_chunks;
+    uint64_t resumed_bytes, slot_bytes, cache_bytes, fetched_bytes;
+    uint64_t transfer_bytes;   /* Fetched, as transferred */
+} chunk_stats_t;
+
+typedef struct {
+    unsigned char *buf;
+    size_t len;
+    size_t max;
+} chunk_buf_t;
+
+/*
+ * Stream sink: Collect a chunk in memory
+ */
+static int chunk_sink(void *opaque, const void *buf, size_t len)
+{
+    chunk_buf_t *cb = (chunk_buf_t *)opaque;
+
+    if (len > cb->max - cb->len)
+        return -1;
+    memcpy(cb->buf + cb->len, buf, len);
+    cb->len += len;
+    return 0;
+}
+
+static void chunk_index_path(char slot, char *path, size_t len)
+{
+    snprintf(path, len, "%s/rootfs_%c.index", STATE_DIR, slot);
+}
+
+/*
+ * Download and verify the chunk index
+ * Returns 0 on success, -1 on failure
+ */
+static int fetch_chunk_index(const update_manifest_t *manifest,
+                             fota_chunk_index_t *idx, char *hash_out,
+                             artifact_timing_t *timing)
+{
+    fota_stream_t stream;
+    chunk_buf_t cb = { .max = FOTA_CHUNK_HEADER_SIZE +
+                              (size_t)FOTA_CHUNK_ENTRY_SIZE * 1024 * 1024 };
+    int ret = -1;
+
+    if (manifest->rootfs_size > cb.max) {
+        syslog(LOG_ERR, "Chunk index too large: %zu bytes", manifest->rootfs_size);
+        return -1;
+    }
+    if (manifest->rootfs_size > 0)
+        cb.max = manifest->rootfs_size;
+
+    cb.buf = malloc(cb.max);
+    if (!cb.buf)
+        return -1;
+
+    if (fota_stream_init(&stream, 0, chunk_sink, &cb) < 0)
+        goto out;
+
+    ret = fetch_artifact(manifest->rootfs_url, manifest->rootfs_size, &stream,
+                         NULL, NULL, hash_out, timing);
+    fota_stream_cleanup(&stream);
+
+    if (ret == 0 && verify_digest("Chunk index", hash_out,
+                                  manifest->rootfs_sha256) < 0)
+        ret = -1;
+    if (ret == 0)
+        ret = fota_chunk_index_parse(cb.buf, cb.len, idx);
+
+out:
+    free(cb.buf);
+    return ret;
+}
+
+/*
+ * Where the active slot's chunks are: the index it was installed from,
+ * or, for a slot written some other way, a scan of the slot with the
+ * chunk sizes of the new index. Without either nothing is reused.
+ */
+static void load_slot_chunks(const fota_chunk_index_t *idx, const char *source,
+                             fota_chunk_index_t *slot)
+{
+    char path[64];
+
+    chunk_index_path(config.current_slot, path, sizeof(path));
+    if (fota_chunk_index_load(path, slot) == 0) {
+        syslog(LOG_INFO, "Active slot: %zu chunks from %s", slot->count, path);
+    } else {
+        double t0 = fota_now();
+
+        slot->min_size = idx->min_size;
+        slot->avg_size = idx->avg_size;
+        slot->max_size = idx->max_size;
+        if (fota_chunk_index_scan(source, idx->image_size, slot) < 0) {
+            syslog(LOG_WARNING, "Cannot chunk %s, downloading all chunks", source);
+            fota_chunk_index_free(slot);
+            return;
+        }
+        syslog(LOG_INFO, "Active slot: %zu chunks from scanning %s in %.2fs",
+               slot->count, source, fota_now() - t0);
+    }
+
+    if (fota_chunk_index_sort(slot) < 0)
+        fota_chunk_index_free(slot);
+}
+
+/*
+ * Read a fetched chunk, inflate it and check it against its id
+ * Returns 0 on success, -1 on failure
+ */
+static int load_fetched_chunk(const char *path, int comp,
+                              const fota_chunk_t *chunk, unsigned char *buf)
+{
+    unsigned char in[16 * 1024];
+    char hash[65];
+    fota_stream_t stream;
+    chunk_buf_t cb = { .buf = buf, .max = chunk->size };
+    ssize_t got;
+    int ret = -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (fota_stream_init(&stream, comp, chunk_sink, &cb) < 0)
+        goto out;
+
+    while ((got = read(fd, in, sizeof(in))) > 0)
+        if (fota_stream_feed(&stream, in, got) < 0)
+            break;
+
+    if (got == 0 && fota_stream_finish(&stream, hash) == 0 &&
+        cb.len == chunk->size && fota_chunk_verify(chunk->id, buf, cb.len))
+        ret = 0;
+    fota_stream_cleanup(&stream);
+
+out:
+    close(fd);
+    return ret;
+}
+
+/*
+ * Download chunks into the cache, max_connections at a time
+ * Returns 0 if all of them arrived intact, -1 otherwise
+ */
+static int fetch_chunks(const update_manifest_t *manifest, int comp,
+                        const fota_chunk_t **chunks, int count,
+                        unsigned char *buf, chunk_stats_t *st,
+                        artifact_timing_t *timing)
+{
+    static struct {
+        char url[640];
+        char dest[128];
+    } names[CHUNK_BATCH];
+    download_t dls[CHUNK_BATCH];
+    char hex[65];
+    int ret;
+
+    memset(dls, 0, sizeof(dls));
+    for (int i = 0; i < count; i++) {
+        fota_sha256_hex(chunks[i]->id, hex);
+        snprintf(names[i].url, sizeof(names[i].url), "%s/%.4s/%s",
+                 manifest->rootfs_chunk_url, hex, hex);
+        snprintf(names[i].dest, sizeof(names[i].dest), "%s/%s.part",
+                 CHUNK_DIR, hex);
+
+        dls[i].url = names[i].url;
+        dls[i].dest = names[i].dest;
+        dls[i].expected_sha = "";
+        dls[i].max_ranges = 1;
+    }
+
+    double t0 = fota_now();
+    ret = download_files(dls, count);
+    timing->download_s += fota_now() - t0;
+
+    for (int i = 0; i < count; i++) {
+        if (dls[i].failed) {
+            unlink(names[i].dest);
+            continue;
+        }
+
+        t0 = fota_now();
+        if (load_fetched_chunk(names[i].dest, comp, chunks[i], buf) < 0 ||
+            fota_chunk_cache_put(CHUNK_DIR, chunks[i], buf) < 0) {
+            syslog(LOG_ERR, "Chunk %s is corrupt", names[i].url);
+            ret = -1;
+        } else {
+            st->fetched_chunks++;
+            st->fetched_bytes += chunks[i]->size;
+            st->transfer_bytes += dls[i].timing.bytes;
+        }
+        timing->hash_s += fota_now() - t0;
+        unlink(names[i].dest);
+    }
+
+    return ret;
+}
+
+/*
+ * Get one chunk of the new image into buf: from where an interrupted
+ * attempt wrote it, the active slot, the cache, or, if all of them
+ * turn out to be stale, the chunk store
+ * Returns 0 on success, -1 on failure
+ */
+static int get_chunk(const update_manifest_t *manifest, int comp,
+                     const fota_chunk_index_t *slot, int slot_fd,
+                     int resume_fd, const fota_chunk_t *chunk,
+                     unsigned char *buf, chunk_stats_t *st,
+                     artifact_timing_t *timing)
+{
+    const fota_chunk_t *have = fota_chunk_index_find(slot, chunk->id);
+
+    if (resume_fd >= 0 && chunk->offset + chunk->size <= journal.rootfs_offset &&
+        pread(resume_fd, buf, chunk->size, chunk->offset) == (ssize_t)chunk->size &&
+        fota_chunk_verify(chunk->id, buf, chunk->size)) {
+        st->resumed_chunks++;
+        st->resumed_bytes += chunk->size;
+        return 0;
+    }
+
+    if (have && pread(slot_fd, buf, chunk->size, have->offset) ==
+                (ssize_t)chunk->size &&
+        fota_chunk_verify(chunk->id, buf, chunk->size)) {
+        st->slot_chunks++;
+        st->slot_bytes += chunk->size;
+        return 0;
+    }
+
+    if (fota_chunk_cache_get(CHUNK_DIR, chunk, buf) == 0) {
+        st->cache_chunks++;
+        st->cache_bytes += chunk->size;
+        return 0;
+    }
+
+    /* Planned as present but changed since, fetch it on its own */
+    if (fetch_chunks(manifest, comp, &chunk, 1, buf, st, timing) < 0)
+        return -1;
+    return fota_chunk_cache_get(CHUNK_DIR, chunk, buf);
+}
+
+/*
+ * Assemble a chunked rootfs on device
+ * hash_out receives the SHA256 of the chunk index as transferred.
+ * Returns 0 on success, -1 on failure
+ */
+int stream_chunked(update_manifest_t *manifest, const char *source,
+                   const char *device, char standby_slot, char *hash_out,
+                   artifact_timing_t *timing)
+{
+    fota_chunk_index_t idx, slot;
+    const fota_chunk_t *missing[CHUNK_BATCH];
+    chunk_stats_t st;
+    unsigned char *buf = NULL;
+    image_target_t target = { NULL, 0 };
+    char path[64];
+    int comp = fota_stream_codec(manifest->rootfs_compression);
+    int slot_fd = -1, resume_fd = -1;
+    uint64_t resume_offset = 0;
+    int ret = -1;
+
+    memset(&slot, 0, sizeof(slot));
+    memset(&st, 0, sizeof(st));
+
+    if (fetch_chunk_index(manifest, &idx, hash_out, timing) < 0)
+        return -1;
+
+    if (manifest->rootfs_image_size &&
+        manifest->rootfs_image_size != idx.image_size) {
+        syslog(LOG_ERR, "Chunk index is for a %llu byte image, expected %llu",
+               (unsigned long long)idx.image_size,
+               (unsigned long long)manifest->rootfs_image_size);
+        goto out;
+    }
+
+    /* Default store: "chunks" next to the index */
+    if (!manifest->rootfs_chunk_url[0]) {
+        const char *slash = strrchr(manifest->rootfs_url, '/');
+        int dir = slash ? (int)(slash - manifest->rootfs_url) : 0;
+
+        snprintf(manifest->rootfs_chunk_url, sizeof(manifest->rootfs_chunk_url),
+                 "%.*s/chunks", dir, manifest->rootfs_url);
+    }
+
+    mkdir(STATE_DIR, 0755);
+    mkdir(CHUNK_DIR, 0755);
+
+    buf = malloc(idx.max_size);
+    if (!buf)
+        goto out;
+
+    load_slot_chunks(&idx, source, &slot);
+    slot_fd = open(source, O_RDONLY | O_CLOEXEC);
+
+    if (image_target_open(&target, device, idx.image_size, NULL) < 0)
+        goto out;
+
+    if (journal.slot && journal.rootfs_offset) {
+        resume_fd = open(device, O_RDONLY | O_CLOEXEC);
+        if (resume_fd >= 0)
+            resume_offset = journal.rootfs_offset;
+    }
+
+    for (size_t pos = 0; pos < idx.count;) {
+        size_t end = pos;
+        int nmissing = 0;
+
+        /* Window: up to CHUNK_BATCH distinct chunks that have to be fetched */
+        for (; end < idx.count && nmissing < CHUNK_BATCH; end++) {
+            const fota_chunk_t *c = &idx.chunks[end];
+            int dup = 0;
+
+            if (c->offset + c->size <= resume_offset ||
+                fota_chunk_index_find(&slot, c->id) ||
+                fota_chunk_cache_has(CHUNK_DIR, c))
+                continue;
+            for (int i = 0; i < nmissing && !dup; i++)
+                dup = memcmp(missing[i]->id, c->id, sizeof(c->id)) == 0;
+            if (!dup)
+                missing[nmissing++] = c;
+        }
+
+        if (nmissing && fetch_chunks(manifest, comp, missing, nmissing, buf,
+                                     &st, timing) < 0) {
+            syslog(LOG_ERR, "Failed to download chunks");
+            goto out;
+        }
+
+        for (; pos < end; pos++) {
+            const fota_chunk_t *c = &idx.chunks[pos];
+
+            fota_throttle_pause();
+            if (!running || fota_event_stop_pending())
+                goto out;
+
+            if (get_chunk(manifest, comp, &slot, slot_fd, resume_fd, c, buf,
+                          &st, timing) < 0) {
+                syslog(LOG_ERR, "Chunk at offset %llu unavailable",
+                       (unsigned long long)c->offset);
+                goto out;
+            }
+
+            double t0 = fota_now();
+            int err = image_target_write(&target, buf, c->size);
+            timing->write_s += fota_now() - t0;
+            if (err < 0)
+                goto out;
+        }
+
+        /* Assembled chunks are in the new slot now */
+        fota_chunk_cache_prune(CHUNK_DIR, config.chunk_cache_max);
+    }
+
+    double t0 = fota_now();
+    ret = fota_image_finish(target.img);
+    timing->write_s += fota_now() - t0;
+    if (ret < 0)
+        goto out;
+
+    /* Downloaded chunks are written from the cache as well */
+    syslog(LOG_INFO, "Chunked rootfs: %zu chunks, %llu bytes; %zu chunks "
+           "(%llu bytes) already on the target, %zu (%llu) from the active "
+           "slot, %zu (%llu) from the cache, %zu (%llu) downloaded, "
+           "%llu bytes transferred",
+           idx.count, (unsigned long long)idx.image_size,
+           st.resumed_chunks, (unsigned long long)st.resumed_bytes,
+           st.slot_chunks, (unsigned long long)st.slot_bytes,
+           st.cache_chunks - st.fetched_chunks,
+           (unsigned long long)(st.cache_bytes - st.fetched_bytes),
+           st.fetched_chunks, (unsigned long long)st.fetched_bytes,
+           (unsigned long long)st.transfer_bytes);
+    timing->bytes += st.transfer_bytes;
+
+    /* Lets the next update reuse this slot without scanning it */
+    chunk_index_path(standby_slot, path, sizeof(path));
+    if (fota_chunk_index_save(path, &idx) < 0)
+        syslog(LOG_WARNING, "Cannot save chunk index %s", path);
+
+out:
+    if (target.img)
+        fota_image_close(target.img);
+    if (resume_fd >= 0)
+        close(resume_fd);
+    if (slot_fd >= 0)
+        close(slot_fd);
+    free(buf);
+    fota_chunk_index_free(&slot);
+    fota_chunk_index_free(&idx);
+    return ret;
+}
+
+/*
+ * Write a rootfs_image artifact straight to the standby root partition
+ * No mkfs and no staging: the image carries the filesystem, so this is
+ * the same in staged and streaming mode.
+ * Returns 0 on success, -1 on failure
+ */
+static int write_rootfs_image(update_manifest_t *manifest, char standby_slot,
+                              const char *root_dev)
+{
+    char hash[65];
+    char image_hash[65];
+    artifact_timing_t timing = {0};
+    double t0 = fota_now();
+    int ret;
+
+    if (rootfs_is_chunked(manifest)) {
+        const char *source = get_active_root(config.current_slot);
+
+        syslog(LOG_INFO, "Assembling rootfs on %s from chunks...", root_dev);
+
+        ret = stream_chunked(manifest, source, root_dev, standby_slot, hash,
+                             &timing);
+        metric_transfer("image", "rootfs", t0, fota_now(), &timing, ret == 0);
+        if (ret < 0) {
+            syslog(LOG_ERR, "Failed to assemble chunked rootfs");
+            return -1;
+        }
+        log_artifact_timing("rootfs", &timing);
+        return 0;
+    }
+
+    if (rootfs_is_delta(manifest)) {
+        const char *source = get_active_root(config.current_slot);
+
+        syslog(LOG_INFO, "Rebuilding rootfs on %s from %s + delta...",
+               root_dev, source);
+
+        ret = stream_delta(manifest->rootfs_url, source, root_dev,
+                           manifest->rootfs_size, manifest->rootfs_image_size,
+                           fota_stream_codec(manifest->rootfs_compression),
+                           hash, image_hash, &timing);
+        metric_transfer("image", "rootfs", t0, fota_now(), &timing, ret == 0);
+        if (ret < 0) {
+            syslog(LOG_ERR, "Failed to apply rootfs delta");
+            return -1;
+        }
+        log_artifact_timing("rootfs", &timing);
+
+        if (verify_digest("Rootfs delta", hash, manifest->rootfs_sha256) < 0)
+            return -1;
+        return verify_digest("Rebuilt rootfs", image_hash,
+                             manifest->rootfs_image_sha256);
+    }
+
+    syslog(LOG_INFO, "Writing rootfs image to %s...", root_dev);
+
+    ret = stream_image(manifest->rootfs_url, root_dev, manifest->rootfs_size,
+                       manifest->rootfs_image_size, &manifest->rootfs_bmap,
+                       fota_stream_codec(manifest->rootfs_compression),
+                       hash, &timing);
+    metric_transfer("image", "rootfs", t0, fota_now(), &timing, ret == 0);
+    if (ret < 0) {
+        syslog(LOG_ERR, "Failed to write rootfs image");
+        return -1;
+    }
+    log_artifact_timing("rootfs", &timing);
+
+    return verify_digest("Rootfs", hash, manifest->rootfs_sha256);
+}
+
+/*
+ * Check that the image on the standby root partition holds rootfs_fs,
+ * the filesystem the slot is going to be booted with. A manifest naming
+ * the wrong one verifies fine and only fails at the mount.
+ * Returns 0 on success, -1 on failure
+ */
+static int check_rootfs_fs(const update_manifest_t *manifest,
+                           const char *root_dev)
+{
+    int i = rootfs_fs_index(manifest->rootfs_fs);
+    unsigned char magic[4];
+    ssize_t n = -1;
+
+    int fd = open(root_dev, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        n = pread(fd, magic, rootfs_fs_types[i].len, rootfs_fs_types[i].offset);
+        close(fd);
+    }
+
+    if (n != (ssize_t)rootfs_fs_types[i].len ||
+        memcmp(magic, rootfs_fs_types[i].magic, n) != 0) {
+        syslog(LOG_ERR, "Rootfs image on %s is not %s", root_dev,
+               manifest->rootfs_fs);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Drop the overlay of a read-only root slot: its upper layer was made
+ * on top of the image that is about to be replaced
+ */
+static void overlay_reset(const char *root_dev)
+{
+    char path[256], cmd[512];
+    const char *name = strrchr(root_dev, '/');
+
+    snprintf(path, sizeof(path), "%s/%s", OVERLAY_DIR, name ? name + 1 : root_dev);
+    if (access(path, F_OK) != 0)
+        return;
+
+    syslog(LOG_INFO, "Removing overlay %s", path);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+    system(cmd);
+}
+
+/*
+ * Create a fresh ext4 filesystem on the standby rootfs partition
+ * In low-impact mode the whole-device discard is skipped (it can stall
+ * eMMC for seconds) and inode tables are initialized lazily by the
+ * kernel in the background.
+ */
+static int format_rootfs(char standby_slot, const char *root_dev)
+{
+    char cmd[512];
+
+    fota_throttle_pause();
+    double t0 = fota_now();
+    snprintf(cmd, sizeof(cmd), "mkfs.ext4 -F %s-L ROOT_%c %s",
+             config.low_impact ? "-E nodiscard,lazy_itable_init=1 " : "",
+             standby_slot - 32, root_dev);  /* Uppercase label */
+    int ret = system(cmd) == 0 ? 0 : -1;
+    metric("mkfs", "rootfs", t0, 0, ret == 0);
+
+    if (ret < 0)
+        syslog(LOG_ERR, "Failed to format rootfs partition");
+    return ret;
+}
+
+/*
+ * Mount a standby partition at dir
+ * Returns 0 on success, -1 on failure
+ */
+static int mount_partition(const char *dev, const char *dir, const char *artifact)
+{
+    char cmd[512];
+    double t0 = fota_now();
+
+    mkdir(dir, 0755);
+    snprintf(cmd, sizeof(cmd), "mount %s %s", dev, dir);
+    int ret = system(cmd) == 0 ? 0 : -1;
+    metric("mount", artifact, t0, 0, ret == 0);
+
+    if (ret < 0)
+        syslog(LOG_ERR, "Failed to mount %s partition", artifact);
+    return ret;
+}
+
+/*
+ * Flush what was written to a partition mounted by mount_partition()
+ * and unmount it
+ */
+static void unmount_partition(const char *dir, const char *artifact)
+{
+    double t0 = fota_now();
+    int ret = fota_syncfs(dir);
+
+    metric("sync", artifact, t0, 0, ret == 0);
+    umount(dir);
+}
+
+/* Size of a staged file, 0 if unknown */
+static uint64_t file_bytes(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+/*
+ * Record a completed apply step (steps only move forward)
+ * A journal that cannot be written leaves the previous step in place,
+ * which only means more work for the next attempt.
+ */
+static void journal_advance(fota_step_t step)
+{
+    if (journal.step >= step)
+        return;
+
+    journal.step = step;
+    fota_journal_save(JOURNAL_FILE, &journal);
+    syslog(LOG_INFO, "Update v%s: %s", journal.version, fota_step_name(step));
+    fota_journal_fault(fota_step_name(step));
+}
+
+/*
+ * Write the staged boot archive to the standby boot partition
+ * With a per-file manifest only the files that differ are written,
+ * otherwise the partition is emptied and the whole archive extracted.
+ * Returns 0 on success, -1 on failure
+ */
+static int flash_boot(const update_manifest_t *manifest, const char *boot_dev,
+                      const char *boot_file, const char *boot_progress)
+{
+    char cmd[512];
+    char hash[65];
+    int ret;
+
+    syslog(LOG_INFO, "Flashing boot partition %s...", boot_dev);
+
+    if (mount_partition(boot_dev, MNT_BOOT, "boot") < 0)
+        return -1;
+
+    double t0 = fota_now();
+    if (!manifest->boot_files.nfiles) {
+        snprintf(cmd, sizeof(cmd), "rm -rf %s/*", MNT_BOOT);
+        system(cmd);
+    }
+
+    ret = extract_archive(boot_file, MNT_BOOT, &manifest->boot_files,
+                          fota_stream_codec(manifest->boot_compression), hash);
+    metric("extract", "boot", t0, file_bytes(boot_file), ret == 0);
+    unmount_partition(MNT_BOOT, "boot");
+    if (ret < 0 || verify_digest("Boot", hash, manifest->boot_sha256) < 0) {
+        syslog(LOG_ERR, "Failed to flash boot partition");
+        discard_download(boot_file, boot_progress);
+        return -1;
+    }
+    syslog(LOG_INFO, "boot: flashed in %.2fs", fota_now() - t0);
+    discard_download(boot_file, boot_progress);
+    return 0;
+}
+
+/*
+ * Background apply work of a staged update, see apply_staged()
+ */
+typedef struct {
+    const update_manifest_t *manifest;
+    char standby_slot;
+    const char *boot_dev;
+    const char *root_dev;
+    const char *boot_file;
+    const char *boot_progress;
+    fota_job_t boot_job;       /* flash_boot() */
+    fota_job_t format_job;     /* format_rootfs() */
+    int boot_started;
+    int format_started;
+} staged_apply_t;
+
+static int flash_boot_job(void *arg)
+{
+    staged_apply_t *st = arg;
+
+    return flash_boot(st->manifest, st->boot_dev, st->boot_file,
+                      st->boot_progress);
+}
+
+static int format_rootfs_job(void *arg)
+{
+    staged_apply_t *st = arg;
+
+    return format_rootfs(st->standby_slot, st->root_dev);
+}
+
+/*
+ * download_files() callback: the boot archive is complete
+ * Flashing starts while the rootfs is still downloading. An archive
+ * that does not match is left for apply_staged() to report.
+ */
+static void boot_downloaded(download_t *dl)
+{
+    staged_apply_t *st = dl->arg;
+
+    if (strcmp(dl->hash, dl->expected_sha) != 0)
+        return;
+
+    fota_job_start(&st->boot_job, flash_boot_job, st);
+    st->boot_started = 1;
+}
+
+/*
+ * Wait for the background work of a staged update
+ * A boot partition that was written is recorded even if the rest of
+ * the update failed, so the next attempt does not write it again.
+ * Returns 0 if all jobs that were started succeeded, -1 otherwise
+ */
+static int staged_wait(staged_apply_t *st)
+{
+    int ret = 0;
+
+    if (st->format_started) {
+        st->format_started = 0;
+        if (fota_job_wait(&st->format_job) < 0)
+            ret = -1;
+    }
+
+    if (st->boot_started) {
+        st->boot_started = 0;
+        if (fota_job_wait(&st->boot_job) < 0)
+            ret = -1;
+        else
+            journal_advance(FOTA_STEP_BOOT_WRITTEN);
+    }
+    return ret;
+}
+
+/*
+ * Staged update: download both archives to the download directory,
+ * verify them, then write the standby partitions with tar.
+ * Interrupted downloads are resumed by the next attempt, progress
+ * records live in STATE_DIR. A boot partition the journal has as
+ * written is neither downloaded nor written again.
+ *
+ * The stages overlap: the rootfs partition is formatted while the
+ * archives download, and the boot partition is flashed as soon as its
+ * archive is complete and matches, while the rootfs is still on its
+ * way. Each archive is hashed as it arrives, so verifying it is a
+ * comparison. The update then takes about as long as the longer of
+ * the network and the storage work, not their sum.
+ * Returns 0 on success, -1 on failure
+ */
+static int apply_staged(update_manifest_t *manifest, char standby_slot,
+                        const char *boot_dev, const char *root_dev)
+{
+    char hash[65];
+    double t0;
+    int ret;
+
+    /* Create download and state directories */
+    mkdir(STATE_DIR, 0755);
+    mkdir(config.download_dir, 0755);
+
+    char boot_file[256];
+    snprintf(boot_file, sizeof(boot_file), "%s/boot.tar.gz", config.download_dir);
+    const char *boot_progress = STATE_DIR "/boot.progress";
+
+    char rootfs_file[256];
+    snprintf(rootfs_file, sizeof(rootfs_file), "%s/rootfs.tar.gz", config.download_dir);
+    const char *rootfs_progress = STATE_DIR "/rootfs.progress";
+
+    staged_apply_t st = {
+        .manifest = manifest,
+        .standby_slot = standby_slot,
+        .boot_dev = boot_dev,
+        .root_dev = root_dev,
+        .boot_file = boot_file,
+        .boot_progress = boot_progress,
+    };
+
+    /* Fetch both archives at once (images are never staged) */
+    download_t dls[2] = {
+        {
+            .url = manifest->boot_url,
+            .dest = boot_file,
+            .progress_path = boot_progress,
+            .expected_size = manifest->boot_size,
+            .expected_sha = manifest->boot_sha256,
+            .on_done = boot_downloaded,
+            .arg = &st,
+        },
+        {
+            .url = manifest->rootfs_url,
+            .dest = rootfs_file,
+            .progress_path = rootfs_progress,
+            .expected_size = manifest->rootfs_size,
+            .expected_sha = manifest->rootfs_sha256,
+        },
+    };
+    int first = journal.step >= FOTA_STEP_BOOT_WRITTEN ? 1 : 0;
+    int last = rootfs_is_image(manifest) ? 0 : 1;
+
+    /* The standby rootfs is rewritten anyway, format it meanwhile */
+    t0 = fota_now();
+    if (last == 1) {
+        fota_job_start(&st.format_job, format_rootfs_job, &st);
+        st.format_started = 1;
+    }
+
+    if (first <= last) {
+        syslog(LOG_INFO, "Downloading %s...",
+               first < last ? "boot files and rootfs" :
+               first ? "rootfs" : "boot files");
+        double t1 = fota_now();
+        ret = download_files(&dls[first], last - first + 1);
+        for (int i = first; i <= last; i++)
+            metric_transfer("download", i ? "rootfs" : "boot", dls[i].start,
+                            dls[i].end, &dls[i].timing, !dls[i].failed);
+        if (ret < 0) {
+            syslog(LOG_ERR, "Failed to download %s",
+                   dls[0].failed ? "boot files" : "rootfs");
+            staged_wait(&st);
+            return -1;
+        }
+        syslog(LOG_INFO, "Downloads completed in %.2fs", fota_now() - t1);
+        journal_advance(FOTA_STEP_DOWNLOADED);
+    }
+
+    if (first == 0) {
+        log_artifact_timing("boot", &dls[0].timing);
+        if (verify_digest("Boot", dls[0].hash, manifest->boot_sha256) < 0) {
+            discard_download(boot_file, boot_progress);
+            staged_wait(&st);
+            return -1;
+        }
+    }
+
+    if (last == 1) {
+        log_artifact_timing("rootfs", &dls[1].timing);
+        if (verify_digest("Rootfs", dls[1].hash, manifest->rootfs_sha256) < 0) {
+            discard_download(rootfs_file, rootfs_progress);
+            staged_wait(&st);
+            return -1;
+        }
+    }
+    journal_advance(FOTA_STEP_VERIFIED);
+
+    if (staged_wait(&st) < 0)
+        return -1;
+
+    if (rootfs_is_image(manifest)) {
+        rmdir(config.download_dir);
+        return write_rootfs_image(manifest, standby_slot, root_dev);
+    }
+
+    /* Flash rootfs partition, formatted by now */
+    syslog(LOG_INFO, "Flashing rootfs %s...", root_dev);
+    double t1 = fota_now();
+
+    if (mount_partition(root_dev, MNT_ROOT, "rootfs") < 0)
+        return -1;
+
+    double t2 = fota_now();
+    ret = extract_archive(rootfs_file, MNT_ROOT, NULL,
+                          fota_stream_codec(manifest->rootfs_compression), hash);
+    metric("extract", "rootfs", t2, file_bytes(rootfs_file), ret == 0);
+    unmount_partition(MNT_ROOT, "rootfs");
+    if (ret < 0 || verify_digest("Rootfs", hash, manifest->rootfs_sha256) < 0) {
+        syslog(LOG_ERR, "Failed to flash rootfs partition");
+        discard_download(rootfs_file, rootfs_progress);
+        return -1;
+    }
+    syslog(LOG_INFO, "rootfs: flashed in %.2fs, update written in %.2fs",
+           fota_now() - t1, fota_now() - t0);
+
+    /* Cleanup downloads */
+    discard_download(rootfs_file, rootfs_progress);
+    rmdir(config.download_dir);
+
+    return 0;
+}
+
+/*
+ * Stream the boot archive into the standby boot partition
+ * Same as flash_boot(): unchanged files are only read, not rewritten.
+ * Returns 0 on success, -1 on failure
+ */
+static int stream_boot(const update_manifest_t *manifest, const char *boot_dev)
+{
+    char cmd[512];
+    char hash[65];
+    artifact_timing_t timing = {0};
+    int ret;
+
+    syslog(LOG_INFO, "Streaming boot files to %s...", boot_dev);
+
+    if (mount_partition(boot_dev, MNT_BOOT, "boot") < 0)
+        return -1;
+
+    if (!manifest->boot_files.nfiles) {
+        snprintf(cmd, sizeof(cmd), "rm -rf %s/*", MNT_BOOT);
+        system(cmd);
+    }
+
+    double t0 = fota_now();
+    ret = stream_extract(manifest->boot_url, MNT_BOOT, &manifest->boot_files,
+                         manifest->boot_size,
+                         fota_stream_codec(manifest->boot_compression), hash,
+                         &timing);
+    metric_transfer("stream", "boot", t0, fota_now(), &timing, ret == 0);
+    unmount_partition(MNT_BOOT, "boot");
+
+    if (ret < 0) {
+        syslog(LOG_ERR, "Failed to stream boot files");
+        return -1;
+    }
+    log_artifact_timing("boot", &timing);
+
+    if (verify_digest("Boot", hash, manifest->boot_sha256) < 0)
+        return -1;
+
+    journal_advance(FOTA_STEP_BOOT_WRITTEN);
+    return 0;
+}
+
+/*
+ * Streaming update: download, hash, inflate and extract each archive
+ * straight into the mounted standby partition. Nothing is staged in
+ * DOWNLOAD_DIR, so RAM use does not grow with the image size. Each
+ * transfer feeds its partition through a pipe thread, and the rootfs
+ * partition is formatted while the boot files stream.
+ * The standby slot is only committed by the caller if both digests
+ * match; on failure it is left unbootable but inactive.
+ * Returns 0 on success, -1 on failure
+ */
+static int apply_streaming(update_manifest_t *manifest, char standby_slot,
+                           const char *boot_dev, const char *root_dev)
+{
+    char hash[65];
+    artifact_timing_t rootfs_timing = {0};
+    int ret;
+
+    /* The rootfs partition is formatted while the boot files stream */
+    staged_apply_t st = {
+        .standby_slot = standby_slot,
+        .root_dev = root_dev,
+    };
+    if (!rootfs_is_image(manifest)) {
+        fota_job_start(&st.format_job, format_rootfs_job, &st);
+        st.format_started = 1;
+    }
+
+    ret = 0;
+    if (journal.step < FOTA_STEP_BOOT_WRITTEN &&
+        stream_boot(manifest, boot_dev) < 0)
+        ret = -1;
+    if (staged_wait(&st) < 0 || ret < 0)
+        return -1;
+
+    if (rootfs_is_image(manifest))
+        return write_rootfs_image(manifest, standby_slot, root_dev);
+
+    /* Rootfs partition */
+    syslog(LOG_INFO, "Streaming rootfs to %s...", root_dev);
+
+    if (mount_partition(root_dev, MNT_ROOT, "rootfs") < 0)
+        return -1;
+
+    double t0 = fota_now();
+    ret = stream_extract(manifest->rootfs_url, MNT_ROOT, NULL,
+                         manifest->rootfs_size,
+                         fota_stream_codec(manifest->rootfs_compression), hash,
+                         &rootfs_timing);
+    metric_transfer("stream", "rootfs", t0, fota_now(), &rootfs_timing, ret == 0);
+    unmount_partition(MNT_ROOT, "rootfs");
+
+    if (ret < 0) {
+        syslog(LOG_ERR, "Failed to stream rootfs");
+        return -1;
+    }
+    log_artifact_timing("rootfs", &rootfs_timing);
+
+    return verify_digest("Rootfs", hash, manifest->rootfs_sha256);
+}
+
+/*
+ * Continue the journal of this very update (same version, slot and
+ * artifacts) or start a new one
+ */
+static void journal_begin(const update_manifest_t *manifest, char standby_slot)
+{
+    fota_journal_t old;
+
+    mkdir(STATE_DIR, 0755);
+
+    if (fota_journal_load(JOURNAL_FILE, &old) == 0 &&
+        old.slot == standby_slot && old.step < FOTA_STEP_ENV_SWITCHED &&
+        strcmp(old.version, manifest->version) == 0 &&
+        strcmp(old.boot_sha256, manifest->boot_sha256) == 0 &&
+        strcmp(old.rootfs_sha256, manifest->rootfs_sha256) == 0) {
+        journal = old;
+        syslog(LOG_INFO, "Resuming update v%s after step %s (rootfs offset %llu)",
+               journal.version, fota_step_name(journal.step),
+               (unsigned long long)journal.rootfs_offset);
+        return;
+    }
+
+    memset(&journal, 0, sizeof(journal));
+    snprintf(journal.version, sizeof(journal.version), "%s", manifest->version);
+    journal.slot = standby_slot;
+    snprintf(journal.boot_sha256, sizeof(journal.boot_sha256), "%s",
+             manifest->boot_sha256);
+    snprintf(journal.rootfs_sha256, sizeof(journal.rootfs_sha256), "%s",
+             manifest->rootfs_sha256);
+    fota_journal_save(JOURNAL_FILE, &journal);
+}
+
+/*
+ * Deal with the journal an earlier run left behind
+ * Returns 1 if the environment already points at the new slot but the
+ * reboot into it never happened, 0 otherwise.
+ */
+static int journal_recover(void)
+{
+    fota_journal_t j;
+
+    if (fota_journal_load(JOURNAL_FILE, &j) < 0)
+        return 0;
+
+    if (j.slot == config.current_slot) {
+        if (fota_journal_this_boot(&j)) {
+            syslog(LOG_INFO, "Slot %c is selected but not booted yet", j.slot);
+            return 1;
+        }
+        fota_journal_clear(JOURNAL_FILE);
+    } else if (j.step == FOTA_STEP_ENV_SWITCHED) {
+        syslog(LOG_WARNING, "Update v%s did not boot from slot %c",
+               j.version, j.slot);
+        fota_journal_clear(JOURNAL_FILE);
+    } else {
+        syslog(LOG_INFO, "Unfinished update v%s to slot %c after step %s",
+               j.version, j.slot, fota_step_name(j.step));
+    }
+    return 0;
+}
+
+/*
+ * Record the update the new slot confirms once it is up (see
+ * mark_boot_success()). Written before the slot switch, so the new
+ * slot never boots without it.
+ * Returns 0 on success, -1 on failure
+ */
+static int save_pending_state(const char *version, char slot)
+{
+    char slot_name[2] = { slot, '\0' };
+
+    mkdir(STATE_DIR, 0755);
+
+    struct json_object *root = json_object_new_object();
+    json_object_object_add(root, "pending_version", json_object_new_string(version));
+    json_object_object_add(root, "pending_slot", json_object_new_string(slot_name));
+
+    int ret = fota_record_save(STATE_FILE, root);
+    json_object_put(root);
+
+    if (ret < 0)
+        syslog(LOG_ERR, "Cannot write %s", STATE_FILE);
+    return ret;
+}
+
+/*
+ * Read a whole file of at most max bytes into a malloc'ed buffer
+ * Returns the buffer, NULL on failure
+ */
+static void *read_file(const char *path, size_t max, size_t *len)
+{
+    struct stat st;
+    void *buf = NULL;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Cannot open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0 || (uint64_t)st.st_size > max) {
+        syslog(LOG_ERR, "%s: unexpected size", path);
+        goto out;
+    }
+
+    buf = malloc(st.st_size);
+    if (buf && read(fd, buf, st.st_size) != st.st_size) {
+        syslog(LOG_ERR, "Cannot read %s", path);
+        free(buf);
+        buf = NULL;
+    }
+    *len = st.st_size;
+out:
+    close(fd);
+    return buf;
+}
+
+/*
+ * Prepare the Falcon args of a freshly written slot
+ * Does what "spl export fdt" in falcon_prepare_<slot> would do on the
+ * first boot through full U-Boot, as far as the kernel depends on it:
+ * the slot's DTB with the kernel command line in /chosen/bootargs,
+ * stored as the args file SPL loads from the boot partition. The
+ * command line is falcon_args_<slot> from the environment, or built
+ * from the root partition, followed by the slot's rootargs.
+ * Returns 0 on success, -1 on failure
+ */
+static int write_falcon_args(fota_env_t *env, char slot, const char *boot_dev,
+                             const char *root_dev, const char *rootargs)
+{
+    char name[32], bootargs[1024], path[256], cmd[512];
+    size_t dtb_len, args_len;
+    void *args = NULL;
+    int ret = -1;
+
+    snprintf(name, sizeof(name), "falcon_args_%c", slot);
+    const char *value = fota_env_get(env, name);
+    if (value)
+        snprintf(bootargs, sizeof(bootargs), "%s", value);
+    else
+        snprintf(bootargs, sizeof(bootargs), FALCON_BOOTARGS, root_dev);
+    if (rootargs[0]) {
+        size_t len = strlen(bootargs);
+        snprintf(bootargs + len, sizeof(bootargs) - len, " %s", rootargs);
+    }
+
+    mkdir(MNT_BOOT, 0755);
+    snprintf(cmd, sizeof(cmd), "mount %s %s", boot_dev, MNT_BOOT);
+    if (system(cmd) != 0) {
+        syslog(LOG_ERR, "Failed to mount boot partition");
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", MNT_BOOT, config.falcon_dtb);
+    void *dtb = read_file(path, FOTA_FDT_MAX_SIZE, &dtb_len);
+    if (dtb)
+        args = fota_fdt_setprop(dtb, dtb_len, "/chosen", "bootargs",
+                                bootargs, strlen(bootargs) + 1, &args_len);
+    if (args) {
+        snprintf(path, sizeof(path), "%s/%s", MNT_BOOT, config.falcon_args_file);
+        ret = fota_file_save(path, args, args_len);
+    }
+    umount(MNT_BOOT);
+
+    if (ret == 0)
+        syslog(LOG_INFO, "Falcon args for slot %c written (%zu bytes): %s",
+               slot, args_len, bootargs);
+    else
+        syslog(LOG_WARNING, "Cannot prepare Falcon args for slot %c", slot);
+
+    free(dtb);
+    free(args);
+    return ret;
+}
+
+/*
+ * Build the dm-verity hash tree of the rootfs image just written, see
+ * fota_verity.h
+ * Returns 0 on success, -1 on failure
+ */
+static int build_verity(const update_manifest_t *manifest, const char *root_dev)
+{
+    fota_verity_t v;
+
+    if (fota_verity_init(&v, manifest->rootfs_image_size,
+                         manifest->rootfs_verity_salt) < 0)
+        return -1;
+
+    syslog(LOG_INFO, "Building dm-verity hash tree of %s (%llu blocks)...",
+           root_dev, (unsigned long long)v.data_blocks);
+
+    double t0 = fota_now();
+    int ret = fota_verity_build(&v, root_dev, manifest->rootfs_verity_root_hash);
+    metric("verity", "rootfs", t0, v.data_blocks * FOTA_VERITY_BLOCK_SIZE, ret == 0);
+    if (ret < 0) {
+        syslog(LOG_ERR, "Failed to build dm-verity hash tree");
+        return -1;
+    }
+
+    fota_verity_root_hex(&v, journal.verity_root);
+    syslog(LOG_INFO, "dm-verity root hash %s%s (%.1f s)", journal.verity_root,
+           manifest->rootfs_verity_root_hash[0] ? ", as in the manifest" : "",
+           fota_now() - t0);
+    return 0;
+}
+
+/*
+ * Root arguments of a read-only slot: the dm-verity table for the tree
+ * on root_dev, then the overlay arguments. The root hash is checked
+ * against the one recorded when the tree was built, which may have been
+ * by an earlier run.
+ * Returns 0 on success, -1 on failure
+ */
+static int readonly_rootargs(const update_manifest_t *manifest,
+                             const char *root_dev, char *buf, size_t len)
+{
+    const char *expected = journal.verity_root[0] ? journal.verity_root :
+                           manifest->rootfs_verity_root_hash;
+    fota_verity_t v;
+    size_t n = 0;
+
+    if (manifest->rootfs_verity) {
+        if (fota_verity_init(&v, manifest->rootfs_image_size,
+                             manifest->rootfs_verity_salt) < 0 ||
+            fota_verity_load(&v, root_dev, expected) < 0 ||
+            fota_verity_rootargs(&v, root_dev, buf, len - 1) < 0)
+            return -1;
+        n = strlen(buf);
+        buf[n++] = ' ';
+    }
+    snprintf(buf + n, len - n, OVERLAY_ROOTARGS, manifest->rootfs_fs);
+    return 0;
+}
+
+/*
+ * Save the timeline of this attempt for the server, see fota_metrics.h
+ */
+static void timeline_save(const char *result)
+{
+    fota_metrics_set("result", result);
+    fota_metrics_save(TIMELINE_FILE);
+}
+
+/*
+ * Apply update to standby slot
+ * Steps recorded in the journal by an interrupted attempt at the same
+ * update are not repeated, see fota_journal.h.
+ * Returns 0 on success, -1 on failure
+ */
+int apply_update(update_manifest_t *manifest)
+{
+    char standby_slot;
+    const char *boot_dev, *root_dev;
+    char cmd[512];
+    int ret;
+
+    get_standby_slot(config.current_slot, &standby_slot, &boot_dev, &root_dev);
+
+    syslog(LOG_INFO, "Applying update v%s to slot %c (%s)",
+           manifest->version, standby_slot,
+           config.stream_mode ? "streaming" : "staged");
+
+    journal_begin(manifest, standby_slot);
+
+    fota_metrics_set("from_version", config.current_version);
+    fota_metrics_set("to_version", manifest->version);
+    fota_metrics_set("mode", config.stream_mode ? "streaming" : "staged");
+    fota_metrics_set("rootfs_type", manifest->rootfs_type);
+    if (journal.step > FOTA_STEP_NONE)
+        fota_metrics_set("resumed_after", fota_step_name(journal.step));
+
+    if (journal.step < FOTA_STEP_ROOTFS_WRITTEN) {
+        /* The standby slot is about to change, its chunk index goes stale */
+        chunk_index_path(standby_slot, cmd, sizeof(cmd));
+        unlink(cmd);
+        overlay_reset(root_dev);
+
+        /*
+         * Inherited by mkfs and the other helpers, and by the pipe, zstd
+         * and I/O threads, which the apply starts after this point
+         */
+        if (config.low_impact)
+            fota_throttle_enter();
+
+        if (config.stream_mode)
+            ret = apply_streaming(manifest, standby_slot, boot_dev, root_dev);
+        else
+            ret = apply_staged(manifest, standby_slot, boot_dev, root_dev);
+
+        if (ret == 0 && rootfs_is_image(manifest))
+            ret = check_rootfs_fs(manifest, root_dev);
+        if (ret == 0 && manifest->rootfs_verity)
+            ret = build_verity(manifest, root_dev);
+
+        if (config.low_impact)
+            fota_throttle_leave();
+
+        if (ret < 0)
+            return -1;
+
+        journal_advance(FOTA_STEP_ROOTFS_WRITTEN);
+    }
+
+    double t0 = fota_now();
+    if (save_pending_state(manifest->version, standby_slot) < 0)
+        return -1;
+
+    /*
+     * Update U-Boot environment to switch slots
+     * All variables go out in one write, see fota_env.h.
+     */
+    syslog(LOG_INFO, "Switching to slot %c...", standby_slot);
+
+    fota_env_t *env = fota_env_open(config.fw_env_config);
+    if (!env) {
+        syslog(LOG_ERR, "Cannot read U-Boot environment, slot not switched");
+        return -1;
+    }
+
+    char slot[2] = { standby_slot, '\0' };
+    fota_env_set(env, "slot", slot);
+    fota_env_set(env, "bootcount", "0");
+
+    /*
+     * Read-only roots are mounted by overlay-init, through dm-verity if
+     * the manifest asks for it, ext4 as before
+     */
+    char rootargs[512] = "";
+    if (rootfs_is_readonly(manifest) &&
+        readonly_rootargs(manifest, root_dev, rootargs, sizeof(rootargs)) < 0) {
+        syslog(LOG_ERR, "No valid dm-verity hash tree on %s, slot not switched",
+               root_dev);
+        fota_env_close(env);
+
+        /* The next attempt checks the image again and rebuilds the tree */
+        journal.step = FOTA_STEP_BOOT_WRITTEN;
+        journal.verity_root[0] = '\0';
+        fota_journal_save(JOURNAL_FILE, &journal);
+        return -1;
+    }
+    snprintf(cmd, sizeof(cmd), "rootargs_%c", standby_slot);
+    fota_env_set(env, cmd, rootargs[0] ? rootargs : NULL);
+
+    /*
+     * Update Falcon slot if enabled
+     * With its args in place SPL boots the new slot directly, otherwise
+     * they are regenerated by U-Boot on the first boot.
+     */
+    if (config.falcon_enabled) {
+        fota_env_set(env, "falcon_slot", slot);
+
+        snprintf(cmd, sizeof(cmd), "falcon_prepare_%c_pending", standby_slot);
+        if (write_falcon_args(env, standby_slot, boot_dev, root_dev,
+                              rootargs) == 0)
+            fota_env_set(env, cmd, NULL);
+        else
+            fota_env_set(env, cmd, "1");
+    }
+
+    ret = fota_env_commit(env);
+    fota_env_close(env);
+    metric("env_switch", NULL, t0, 0, ret == 0);
+    if (ret < 0) {
+        syslog(LOG_ERR, "Failed to write U-Boot environment, slot not switched");
+        return -1;
+    }
+    journal_advance(FOTA_STEP_ENV_SWITCHED);
+
+    fota_net_log_stats("Network");
+    timeline_save("switched");
+    syslog(LOG_INFO, "Update applied successfully, rebooting...");
+
+    sync();
+    sleep(2);
+    system("reboot");
+
+    return 0;
+}
+
+/*
+ * Copy a string setting, as copy_string() in fota_journal.c, telling
+ * about values that do not fit
+ */
+static void config_string(char *dst, size_t len, const char *key,
+                          const char *value)
+{
+    if ((size_t)snprintf(dst, len, "%s", value) >= len)
+        syslog(LOG_WARNING, "%s longer than %zu characters, truncated",
+               key, len - 1);
+}
+
+/*
+ * Load configuration from file
+ */
+int load_config(void)
+{
+    FILE *fp = fopen(CONFIG_FILE, "r");
+    if (!fp) {
+        syslog(LOG_ERR, "Cannot open config file: %s", CONFIG_FILE);
+        return -1;
+    }
+
+    /* Set defaults */
+    memset(&config, 0, sizeof(config));
+    config.check_interval = CHECK_INTERVAL;
+    config.check_jitter = CHECK_JITTER;
+    strcpy(config.download_dir, DOWNLOAD_DIR);
+    config.max_connections = MAX_CONNECTIONS;
+    config.chunk_cache_max = CHUNK_CACHE_MAX;
+    config.io_depth = FOTA_AIO_DEFAULT_DEPTH;
+    config.io_block_size = FOTA_AIO_DEFAULT_BLOCK;
+    config.download_ranges = 1;
+    config.pause.max_pause = 30;
+    strcpy(config.boot_dev[0], BOOT_A);
+    strcpy(config.root_dev[0], ROOT_A);
+    strcpy(config.boot_dev[1], BOOT_B);
+    strcpy(config.root_dev[1], ROOT_B);
+    strcpy(config.fw_env_config, FW_ENV_CONFIG);
+    strcpy(config.falcon_dtb, FALCON_DTB);
+    strcpy(config.falcon_args_file, FALCON_ARGS_FILE);
+
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        /* Skip comments and empty lines */
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        char key[64], value[256];
+        if (sscanf(line, "%63[^=]=%255[^\n]", key, value) == 2) {
+            if (strcmp(key, "server_url") == 0)
+                strncpy(config.server_url, value, sizeof(config.server_url) - 1);
+            else if (strcmp(key, "device_id") == 0)
+                strncpy(config.device_id, value, sizeof(config.device_id) - 1);
+            else if (strcmp(key, "current_version") == 0)
+                strncpy(config.current_version, value, sizeof(config.current_version) - 1);
+            else if (strcmp(key, "check_interval") == 0)
+                config.check_interval = atoi(value);
+            else if (strcmp(key, "check_jitter") == 0)
+                config.check_jitter = atoi(value);
+            else if (strcmp(key, "falcon_enabled") == 0)
+                config.falcon_enabled = atoi(value);
+            else if (strcmp(key, "falcon_dtb") == 0)
+                config_string(config.falcon_dtb, sizeof(config.falcon_dtb), key, value);
+            else if (strcmp(key, "falcon_args_file") == 0)
+                config_string(config.falcon_args_file, sizeof(config.falcon_args_file), key, value);
+            else if (strcmp(key, "stream_mode") == 0)
+                config.stream_mode = atoi(value);
+            else if (strcmp(key, "download_dir") == 0)
+                config_string(config.download_dir, sizeof(config.download_dir), key, value);
+            else if (strcmp(key, "max_connections") == 0)
+                config.max_connections = atoi(value);
+            else if (strcmp(key, "download_ranges") == 0)
+                config.download_ranges = atoi(value);
+            else if (strcmp(key, "bandwidth_limit") == 0)
+                config.bandwidth_limit = atol(value);
+            else if (strcmp(key, "low_impact") == 0)
+                config.low_impact = atoi(value);
+            else if (strcmp(key, "pause_load") == 0)
+                config.pause.max_load = atof(value);
+            else if (strcmp(key, "pause_psi") == 0)
+                config.pause.max_psi = atof(value);
+            else if (strcmp(key, "pause_max") == 0)
+                config.pause.max_pause = atoi(value);
+            else if (strcmp(key, "chunk_cache_max") == 0)
+                config.chunk_cache_max = strtoull(value, NULL, 10);
+            else if (strcmp(key, "boot_a") == 0)
+                config_string(config.boot_dev[0], sizeof(config.boot_dev[0]), key, value);
+            else if (strcmp(key, "root_a") == 0)
+                config_string(config.root_dev[0], sizeof(config.root_dev[0]), key, value);
+            else if (strcmp(key, "boot_b") == 0)
+                config_string(config.boot_dev[1], sizeof(config.boot_dev[1]), key, value);
+            else if (strcmp(key, "root_b") == 0)
+                config_string(config.root_dev[1], sizeof(config.root_dev[1]), key, value);
+            else if (strcmp(key, "fw_env_config") == 0)
+                config_string(config.fw_env_config, sizeof(config.fw_env_config), key, value);
+            else if (strcmp(key, "hash_backend") == 0) {
+                if (fota_sha256_select(value) < 0)
+                    syslog(LOG_WARNING, "SHA-256 backend %s not available, using %s",
+                           value, fota_sha256_backend());
+            } else if (strcmp(key, "io_engine") == 0) {
+                if (fota_aio_select(value) < 0)
+                    syslog(LOG_WARNING, "I/O engine %s not available, using %s",
+                           value, fota_aio_engine());
+            } else if (strcmp(key, "io_depth") == 0)
+                config.io_depth = atoi(value);
+            else if (strcmp(key, "io_block_size") == 0)
+                config.io_block_size = strtoul(value, NULL, 10);
+            else if (strcmp(key, "decompress_threads") == 0)
+                config.decompress_threads = atoi(value);
+            else if (strcmp(key, "report_timeline") == 0)
+                config.report_timeline = atoi(value);
+        }
+    }
+    fclose(fp);
+
+    fota_net_set_rate_limit(config.bandwidth_limit);
+    fota_throttle_set_pause(&config.pause);
+    fota_aio_set_queue(config.io_depth, config.io_block_size);
+    fota_stream_set_threads(config.decompress_threads > 0 ?
+                            config.decompress_threads : 0);
+
+    /* Get current slot from U-Boot */
+    config.current_slot = get_current_slot();
+
+    /* Validate required fields */
+    if (config.server_url[0] == '\0' || config.device_id[0] == '\0') {
+        syslog(LOG_ERR, "Missing required config: server_url or device_id");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Mark current boot as successful
+ * Called after system is stable
+ */
+void mark_boot_success(void)
+{
+    /* Reset boot counter (no write if it already is 0) */
+    fota_env_t *env = fota_env_open(config.fw_env_config);
+    if (env) {
+        fota_env_set(env, "bootcount", "0");
+        if (fota_env_commit(env) < 0)
+            syslog(LOG_ERR, "Failed to reset bootcount");
+        fota_env_close(env);
+    }
+
+    /* Check for pending update to confirm */
+    FILE *fp = fopen(STATE_FILE, "r");
+    if (fp) {
+        char buffer[512];
+        size_t len = fread(buffer, 1, sizeof(buffer) - 1, fp);
         fclose(fp);
         buffer[len] = '\0';
 
         struct json_object *root = json_tokener_parse(buffer);
         if (root) {
-            struct json_object *version;
-            if (json_object_object_get_ex(root, "pending_version", &version)) {
+            struct json_object *version, *slot;
+
+            /* Written before the switch, the switch may not have happened */
+            if (json_object_object_get_ex(root, "pending_slot", &slot) &&
+                json_object_get_string(slot)[0] != config.current_slot) {
+                syslog(LOG_WARNING, "Pending update for slot %s not booted, "
+                       "staying on slot %c", json_object_get_string(slot),
+                       config.current_slot);
+            } else if (json_object_object_get_ex(root, "pending_version", &version)) {
                 const char *new_version = json_object_get_string(version);
 
                 /* Update version in config file */
@@ -572,21 +3855,49 @@ void mark_boot_success(void)
 }
 
 /*
- * Check for manual update trigger
+ * Check for an update and apply it
  */
-void check_manual_trigger(void)
+static void run_update_check(void)
 {
-    const char *trigger_file = "/tmp/fota_trigger";
+    update_manifest_t manifest = {0};
 
-    if (access(trigger_file, F_OK) == 0) {
-        syslog(LOG_INFO, "Manual update trigger detected");
-        unlink(trigger_file);
+    if (check_for_update(&manifest) > 0) {
+        if (apply_update(&manifest) < 0)
+            timeline_save("failed");
+        /* If we get here, apply_update didn't reboot - something failed */
+        manifest_free(&manifest);
+    }
+}
 
-        update_manifest_t manifest = {0};
-        if (check_for_update(&manifest) > 0) {
-            apply_update(&manifest);
-        }
+/*
+ * Record the daemon's PID, so fota-trigger signals it and not a --check
+ * or --download run that happens to be going on
+ */
+static void pidfile_write(void)
+{
+    FILE *fp = fopen(PID_FILE, "w");
+    if (!fp) {
+        syslog(LOG_WARNING, "Cannot write %s: %s", PID_FILE, strerror(errno));
+        return;
+    }
+    fprintf(fp, "%d\n", (int)getpid());
+    fclose(fp);
+}
+
+/*
+ * Re-read the configuration (SIGHUP), keeping the old one if it fails
+ */
+static void reload_config(void)
+{
+    fota_config_t old = config;
+
+    if (load_config() < 0) {
+        syslog(LOG_ERR, "Reload failed, keeping previous configuration");
+        config = old;
+        return;
     }
+    syslog(LOG_INFO, "Configuration reloaded (check_interval=%d)",
+           config.check_interval);
 }
 
 /*
@@ -601,10 +3912,629 @@ void print_usage(const char *progname)
     printf("  -f, --foreground  Run in foreground (don't daemonize)\n");
     printf("  -c, --check       Check for update once and exit\n");
     printf("  -s, --success     Mark current boot as successful\n");
+    printf("  --download <url> <file> [ranges]\n");
+    printf("                    Download to a file, resuming an earlier attempt,\n");
+    printf("                    optionally over parallel byte ranges\n");
+    printf("  --bench-net <url> [count] [ca_file]\n");
+    printf("                    Time repeated requests with and without\n");
+    printf("                    connection/TLS session reuse\n");
+    printf("  --bench-hash [MB]\n");
+    printf("                    Compare SHA-256 backends on this CPU\n");
+    printf("  --write-image <url|file> <device>\n");
+    printf("                    Write a raw image (.gz/.zst/.lz4: decompressed)\n");
+    printf("                    to a device\n");
+    printf("  --bench-decompress <file> [threads]\n");
+    printf("                    Compress a file with each codec built in and\n");
+    printf("                    time decompressing it (up to threads for zstd)\n");
+    printf("  --bench-io <device|file> [MB]\n");
+    printf("                    Sweep I/O engines, queue depths and block sizes\n");
+    printf("                    (overwrites the target)\n");
     printf("  -v, --version     Show version and exit\n");
     printf("  -h, --help        Show this help message\n");
 }
 
+/*
+ * Codec of a file by its extension (.gz, .zst, .lz4, otherwise none)
+ * Returns -1 if it is not built in
+ */
+static int codec_by_extension(const char *name)
+{
+    static const struct {
+        const char *ext;
+        const char *codec;
+    } exts[] = {
+        { ".gz", "gzip" },
+        { ".zst", "zstd" },
+        { ".lz4", "lz4" },
+    };
+    size_t len = strlen(name);
+
+    for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+        size_t n = strlen(exts[i].ext);
+        if (len > n && strcmp(name + len - n, exts[i].ext) == 0)
+            return fota_stream_codec(exts[i].codec);
+    }
+    return FOTA_COMP_NONE;
+}
+
+/*
+ * Write a raw image to a device outside of an update
+ * Used for manual flashing and for benchmarking against the tar path.
+ */
+static int write_image_cmd(const char *src, const char *device)
+{
+    char url[PATH_MAX + 8];
+    char path[PATH_MAX];
+    char hash[65];
+    artifact_timing_t timing;
+    int comp = codec_by_extension(src);
+
+    if (comp < 0) {
+        fprintf(stderr, "%s: compression not built in\n", src);
+        return 1;
+    }
+
+    openlog("fota", LOG_PID | LOG_PERROR, LOG_DAEMON);
+    curl_global_init(CURL_GLOBAL_ALL);
+    fota_net_init();
+
+    /* Plain paths are read through curl's file:// handler */
+    if (strstr(src, "://")) {
+        snprintf(url, sizeof(url), "%s", src);
+    } else if (realpath(src, path)) {
+        snprintf(url, sizeof(url), "file://%s", path);
+    } else {
+        fprintf(stderr, "Cannot open %s: %s\n", src, strerror(errno));
+        return 1;
+    }
+
+    double t0 = fota_now();
+    int ret = stream_image(url, device, 0, 0, NULL, comp, hash, &timing);
+    double elapsed = fota_now() - t0;
+
+    fota_net_cleanup();
+    curl_global_cleanup();
+
+    if (ret < 0) {
+        fprintf(stderr, "Failed to write %s to %s\n", src, device);
+        return 1;
+    }
+
+    log_artifact_timing("image", &timing);
+    printf("%s  %s -> %s (%.2fs)\n", hash, src, device, elapsed);
+    return 0;
+}
+
+/*
+ * Download a single file outside of an update
+ * Progress is kept in <file>.progress, so running the same command
+ * again after an interruption continues the transfer.
+ */
+static int download_cmd(const char *url, const char *dest, int ranges)
+{
+    char progress[PATH_MAX];
+    char hash[65];
+    artifact_timing_t timing;
+
+    openlog("fota", LOG_PID | LOG_PERROR, LOG_DAEMON);
+    curl_global_init(CURL_GLOBAL_ALL);
+    fota_net_init();
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    snprintf(progress, sizeof(progress), "%s.progress", dest);
+    config.download_ranges = ranges > 0 ? ranges : 1;
+    config.max_connections = config.download_ranges;
+
+    int ret = download_file(url, dest, progress, 0, "", hash, &timing);
+
+    fota_net_cleanup();
+    curl_global_cleanup();
+
+    if (ret < 0) {
+        fprintf(stderr, "Failed to download %s\n", url);
+        return 1;
+    }
+
+    fota_progress_clear(progress);
+    log_artifact_timing("download", &timing);
+    printf("%s  %s\n", hash, dest);
+    return 0;
+}
+
+/*
+ * CURL callback: Drop the body (benchmarks)
+ */
+static size_t discard_callback(void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    (void)ptr;
+    (void)userp;
+    return size * nmemb;
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/*
+ * Request a URL count times per reuse level and report wall and CPU
+ * time per request, i.e. what the shared caches save on every check
+ */
+static int bench_net_cmd(const char *url, int count, const char *ca)
+{
+    static const struct {
+        int level;
+        const char *name;
+    } modes[] = {
+        { FOTA_NET_REUSE_NONE, "no reuse" },
+        { FOTA_NET_REUSE_SESSION, "TLS session reuse" },
+        { FOTA_NET_REUSE_ALL, "connection reuse" },
+    };
+    int ret = 0;
+
+    openlog("fota", LOG_PID, LOG_DAEMON);
+    curl_global_init(CURL_GLOBAL_ALL);
+    fota_net_init();
+    fota_net_set_ca(ca);
+
+    printf("%-20s %10s %10s %8s %8s %8s\n", "Mode", "ms/req", "CPU ms/req",
+           "connect", "TLS full", "resumed");
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]) && !ret; m++) {
+        fota_net_set_reuse(modes[m].level);
+        fota_net_reset_stats();
+
+        double t0 = fota_now();
+        double c0 = cpu_seconds();
+
+        for (int i = 0; i < count; i++) {
+            CURL *curl = fota_net_handle();
+            if (!curl) {
+                ret = 1;
+                break;
+            }
+            curl_easy_setopt(curl, CURLOPT_URL, url);
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_callback);
+            curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+
+            CURLcode res = curl_easy_perform(curl);
+            fota_net_account(curl);
+            if (res != CURLE_OK) {
+                fprintf(stderr, "%s: %s\n", url, curl_easy_strerror(res));
+                ret = 1;
+                break;
+            }
+        }
+
+        const fota_net_stats_t *st = fota_net_stats();
+        printf("%-20s %10.2f %10.2f %8lu %8lu %8lu\n", modes[m].name,
+               (fota_now() - t0) * 1000 / count,
+               (cpu_seconds() - c0) * 1000 / count,
+               st->connects, st->tls_full, st->tls_resumed);
+    }
+
+    fota_net_cleanup();
+    curl_global_cleanup();
+    return ret;
+}
+
+/*
+ * Hash throughput of every backend this CPU supports, for updates of
+ * different granularity, plus the four-lane multi-buffer function.
+ * Each backend's digest is checked against the generic one.
+ */
+static int bench_hash_cmd(int mb)
+{
+    static const size_t sizes[] = { 64, 1024, 16384, 65536, 1024 * 1024 };
+    const size_t nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    const size_t total = (size_t)mb * 1024 * 1024;
+    unsigned char ref[FOTA_SHA256_DIGEST_LENGTH];
+    unsigned char digest[FOTA_SHA256_DIGEST_LENGTH];
+    unsigned char *buf;
+    const char *best;
+    int ret = 0;
+
+    buf = malloc(total);
+    if (!buf) {
+        fprintf(stderr, "Cannot allocate %d MB\n", mb);
+        return 1;
+    }
+    for (size_t i = 0; i < total; i++)
+        buf[i] = (unsigned char)(i * 2654435761u >> 24);
+
+    fota_sha256_select(NULL);
+    best = fota_sha256_backend();
+    fota_sha256_select("generic");
+    fota_sha256(buf, total, ref);
+
+    printf("MB/s for %d MB, by update size\n", mb);
+    printf("%-10s", "Backend");
+    for (size_t s = 0; s < nsizes; s++) {
+        if (sizes[s] >= 1024)
+            printf(" %7zuK", sizes[s] / 1024);
+        else
+            printf(" %8zu", sizes[s]);
+    }
+    printf("\n");
+
+    for (int b = 0; fota_sha256_backend_name(b); b++) {
+        const char *name = fota_sha256_backend_name(b);
+        int mismatch = 0;
+
+        if (!fota_sha256_backend_available(b)) {
+            printf("%-10s %s\n", name, "not supported");
+            continue;
+        }
+        fota_sha256_select(name);
+        printf("%-10s", name);
+        for (size_t s = 0; s < nsizes; s++) {
+            fota_sha256_ctx ctx;
+            double t0 = fota_now();
+
+            fota_sha256_init(&ctx);
+            for (size_t off = 0; off < total; off += sizes[s])
+                fota_sha256_update(&ctx, buf + off, sizes[s]);
+            fota_sha256_final(&ctx, digest);
+            printf(" %8.1f", mb / (fota_now() - t0));
+
+            if (memcmp(digest, ref, sizeof(ref)) != 0)
+                mismatch = 1;
+        }
+        printf("%s\n", mismatch ? "  MISMATCH" : "");
+        ret |= mismatch;
+    }
+
+    /* Four quarters of the buffer, one per lane */
+    const unsigned char *lanes[4];
+    unsigned char digests[4][FOTA_SHA256_DIGEST_LENGTH];
+    size_t quarter = total / 4;
+
+    for (int l = 0; l < 4; l++)
+        lanes[l] = buf + l * quarter;
+    double t0 = fota_now();
+    fota_sha256_x4(lanes, quarter, digests);
+    printf("%-10s %8.1f (aggregate of 4 independent streams)\n", "x4",
+           mb / (fota_now() - t0));
+    for (int l = 0; l < 4; l++) {
+        fota_sha256(lanes[l], quarter, digest);
+        if (memcmp(digest, digests[l], sizeof(digest)) != 0) {
+            printf("x4 lane %d MISMATCH\n", l);
+            ret = 1;
+        }
+    }
+
+    fota_sha256_select(best);
+    printf("auto selects: %s\n", best);
+    free(buf);
+    return ret;
+}
+
+/* Sink of a decompression pass: compares the output with the input */
+typedef struct {
+    const unsigned char *ref;
+    size_t len;
+    size_t pos;
+    int mismatch;
+} bench_sink_t;
+
+static int bench_sink(void *opaque, const void *buf, size_t len)
+{
+    bench_sink_t *b = opaque;
+
+    if (b->pos + len > b->len || memcmp(b->ref + b->pos, buf, len) != 0)
+        b->mismatch = 1;
+    b->pos += len;
+    return 0;
+}
+
+/*
+ * Compress len bytes at in with codec comp, as the build host would
+ * zstd: frame > 0 splits the input into frames of that size
+ * Returns a malloc'ed buffer, NULL on failure
+ */
+static unsigned char *bench_compress(int comp, const unsigned char *in,
+                                     size_t len, size_t frame, size_t *out_len)
+{
+    unsigned char *out = NULL;
+
+    if (comp == FOTA_COMP_GZIP) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS,
+                         8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return NULL;
+        size_t cap = deflateBound(&zs, len);
+        out = malloc(cap);
+        zs.next_in = (unsigned char *)in;
+        zs.avail_in = len;
+        zs.next_out = out;
+        zs.avail_out = cap;
+        if (!out || deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+            free(out);
+            out = NULL;
+        }
+        *out_len = zs.total_out;
+        deflateEnd(&zs);
+    }
+#ifdef FOTA_HAVE_ZSTD
+    if (comp == FOTA_COMP_ZSTD) {
+        if (frame == 0)
+            frame = len;
+        size_t frames = (len + frame - 1) / frame;
+        size_t cap = frames * ZSTD_compressBound(frame);
+        ZSTD_CCtx *cctx = ZSTD_createCCtx();
+        out = cctx ? malloc(cap) : NULL;
+        *out_len = 0;
+        for (size_t off = 0; out && off < len; off += frame) {
+            size_t n = len - off < frame ? len - off : frame;
+            size_t ret = ZSTD_compressCCtx(cctx, out + *out_len, cap - *out_len,
+                                           in + off, n, ZSTD_CLEVEL_DEFAULT);
+            if (ZSTD_isError(ret)) {
+                free(out);
+                out = NULL;
+                break;
+            }
+            *out_len += ret;
+        }
+        ZSTD_freeCCtx(cctx);
+    }
+#endif
+#ifdef FOTA_HAVE_LZ4
+    if (comp == FOTA_COMP_LZ4) {
+        size_t cap = LZ4F_compressFrameBound(len, NULL);
+        out = malloc(cap);
+        if (out) {
+            *out_len = LZ4F_compressFrame(out, cap, in, len, NULL);
+            if (LZ4F_isError(*out_len)) {
+                free(out);
+                out = NULL;
+            }
+        }
+    }
+#endif
+    (void)frame;
+    return out;
+}
+
+/*
+ * Decompress through a stream, fed in pieces of the size the pipe
+ * thread hands over. Returns MB/s of output, or -1 on failure
+ */
+static double bench_decompress_pass(int comp, const unsigned char *in,
+                                    size_t len, const unsigned char *ref,
+                                    size_t ref_len)
+{
+    fota_stream_t stream;
+    bench_sink_t sink = { .ref = ref, .len = ref_len };
+    char hash[65];
+    int ret = 0;
+
+    double t0 = fota_now();
+    if (fota_stream_init(&stream, comp, bench_sink, &sink) < 0)
+        return -1;
+    for (size_t off = 0; off < len && ret == 0; off += FOTA_PIPE_SLOT_SIZE) {
+        size_t n = len - off < FOTA_PIPE_SLOT_SIZE ? len - off : FOTA_PIPE_SLOT_SIZE;
+        ret = fota_stream_feed(&stream, in + off, n);
+    }
+    if (ret == 0)
+        ret = fota_stream_finish(&stream, hash);
+    fota_stream_cleanup(&stream);
+    double elapsed = fota_now() - t0;
+
+    if (ret < 0 || sink.mismatch || sink.pos != ref_len)
+        return -1;
+    return ref_len / (1024.0 * 1024.0) / elapsed;
+}
+
+/*
+ * Compress a file with every codec built in and time its decompression
+ * for 1 .. max_threads zstd threads. Only zstd split into frames can
+ * use more than one; the other rows show what a single core does.
+ */
+static int bench_decompress_cmd(const char *file, int max_threads)
+{
+    static const struct {
+        const char *label;
+        const char *codec;
+        size_t frame;
+    } formats[] = {
+        { "gzip", "gzip", 0 },
+        { "lz4", "lz4", 0 },
+        { "zstd", "zstd", 0 },
+        { "zstd 4M frames", "zstd", 4 * 1024 * 1024 },
+    };
+    const size_t nformats = sizeof(formats) / sizeof(formats[0]);
+    unsigned char *ref;
+    struct stat st;
+    ssize_t n;
+    size_t len = 0;
+    int ret = 0;
+
+    openlog("fota", LOG_PID | LOG_PERROR, LOG_DAEMON);
+
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", file, strerror(errno));
+        return 1;
+    }
+    ref = malloc(st.st_size ? st.st_size : 1);
+    if (!ref) {
+        fprintf(stderr, "Cannot allocate %lld bytes\n", (long long)st.st_size);
+        close(fd);
+        return 1;
+    }
+    while (len < (size_t)st.st_size &&
+           (n = read(fd, ref + len, st.st_size - len)) > 0)
+        len += n;
+    close(fd);
+
+    printf("MB/s of output decompressing %s (%.1f MB), by zstd threads\n",
+           file, len / (1024.0 * 1024.0));
+    printf("%-16s %6s", "Format", "Ratio");
+    for (int t = 1; t <= max_threads; t *= 2)
+        printf(" %8d", t);
+    printf("\n");
+
+    for (size_t f = 0; f < nformats; f++) {
+        int comp = fota_stream_codec(formats[f].codec);
+        size_t clen;
+
+        if (comp < 0) {
+            printf("%-16s %s\n", formats[f].label, "not built in");
+            continue;
+        }
+        unsigned char *in = bench_compress(comp, ref, len, formats[f].frame, &clen);
+        if (!in) {
+            printf("%-16s %s\n", formats[f].label, "compression failed");
+            ret = 1;
+            continue;
+        }
+
+        printf("%-16s %6.2f", formats[f].label, (double)len / clen);
+        for (int t = 1; t <= max_threads; t *= 2) {
+            if (comp != FOTA_COMP_ZSTD && t > 1) {
+                printf(" %8s", "-");
+                continue;
+            }
+            fota_stream_set_threads(t);
+            double rate = bench_decompress_pass(comp, in, clen, ref, len);
+            if (rate < 0) {
+                printf(" %8s", "failed");
+                ret = 1;
+            } else {
+                printf(" %8.1f", rate);
+            }
+            fflush(stdout);
+        }
+        printf("\n");
+        free(in);
+    }
+
+    free(ref);
+    return ret;
+}
+
+/*
+ * Time one pass of O_DIRECT writes over the first bytes of fd
+ * Returns MB/s, or -1 if a write failed
+ */
+static double bench_io_pass(int fd, size_t bytes)
+{
+    fota_aio_t *aio = fota_aio_new(fd, 1);
+    if (!aio)
+        return -1;
+
+    size_t block = fota_aio_block_size(aio);
+    int ret = 0;
+    double t0 = fota_now();
+
+    for (uint64_t off = 0; off < bytes && ret == 0; off += block) {
+        unsigned char *buf = fota_aio_get(aio);
+        if (!buf) {
+            ret = -1;
+            break;
+        }
+        /* Not all zeros, and the copy an update does costs the same */
+        memset(buf, (int)(off / block) | 1, block);
+        ret = fota_aio_write(aio, buf, block, off);
+        fota_aio_put(aio, buf);
+    }
+    if (fota_aio_drain(aio) < 0 || fdatasync(fd) < 0)
+        ret = -1;
+    double elapsed = fota_now() - t0;
+
+    fota_aio_free(aio);
+    return ret < 0 ? -1 : bytes / (1024.0 * 1024.0) / elapsed;
+}
+
+/*
+ * Sweep engines, queue depths and block sizes against a device or file
+ * The target is overwritten. A regular file is preallocated first, so
+ * the passes overwrite blocks instead of extending the file.
+ */
+static int bench_io_cmd(const char *target, int mb)
+{
+    static const unsigned depths[] = { 1, 2, 4, 8, 16, 32 };
+    static const size_t blocks[] = { 64 * 1024, 256 * 1024, 1024 * 1024,
+                                     4 * 1024 * 1024 };
+    const size_t ndepths = sizeof(depths) / sizeof(depths[0]);
+    const size_t nblocks = sizeof(blocks) / sizeof(blocks[0]);
+    size_t bytes = (size_t)mb * 1024 * 1024;
+    double best = 0;
+    const char *best_engine = NULL;
+    unsigned best_depth = 0;
+    size_t best_block = 0;
+    struct stat st;
+
+    openlog("fota", LOG_PID | LOG_PERROR, LOG_DAEMON);
+
+    int fd = open(target, O_RDWR | O_CREAT | O_DIRECT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s with O_DIRECT: %s\n", target,
+                strerror(errno));
+        return 1;
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        posix_fallocate(fd, 0, bytes) != 0) {
+        fprintf(stderr, "Cannot allocate %d MB in %s\n", mb, target);
+        close(fd);
+        return 1;
+    }
+
+    printf("MB/s writing %d MB to %s, by block size\n", mb, target);
+    printf("%-9s %5s", "Engine", "Depth");
+    for (size_t b = 0; b < nblocks; b++)
+        printf(" %7zuK", blocks[b] / 1024);
+    printf("\n");
+
+    for (int e = 0; fota_aio_engine_name(e); e++) {
+        const char *name = fota_aio_engine_name(e);
+
+        if (!fota_aio_engine_available(e)) {
+            printf("%-9s %s\n", name, "not supported");
+            continue;
+        }
+        fota_aio_select(name);
+
+        for (size_t d = 0; d < ndepths; d++) {
+            /* The sync engine has one write in flight, whatever is set */
+            if (strcmp(name, "sync") == 0 && depths[d] > 1)
+                break;
+
+            printf("%-9s %5u", name, depths[d]);
+            for (size_t b = 0; b < nblocks; b++) {
+                fota_aio_set_queue(depths[d], blocks[b]);
+                double rate = bench_io_pass(fd, bytes);
+                if (rate < 0) {
+                    printf(" %8s", "failed");
+                    continue;
+                }
+                printf(" %8.1f", rate);
+                fflush(stdout);
+                if (rate > best) {
+                    best = rate;
+                    best_engine = name;
+                    best_depth = depths[d];
+                    best_block = blocks[b];
+                }
+            }
+            printf("\n");
+        }
+    }
+    close(fd);
+
+    if (!best_engine)
+        return 1;
+    printf("fastest: io_engine=%s io_depth=%u io_block_size=%zu\n",
+           best_engine, best_depth, best_block);
+    return 0;
+}
+
 /*
  * Main entry point
  */
@@ -612,6 +4542,16 @@ int main(int argc, char *argv[])
 {
     int daemon_mode = 1;
     int force_check = 0;
+    sigset_t usr1;
+
+    /*
+     * SIGUSR1 terminates by default: blocked in every mode, so a check
+     * requested while this is not (yet) the daemon cannot kill an apply.
+     * The daemon reads it from its signalfd, see fota_event.h.
+     */
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &usr1, NULL);
 
     /* Parse command line arguments */
     for (int i = 1; i < argc; i++) {
@@ -623,9 +4563,30 @@ int main(int argc, char *argv[])
         } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--success") == 0) {
             openlog("fota", LOG_PID, LOG_DAEMON);
             load_config();
-            mark_boot_success();
+            /* Not before the reboot into a freshly selected slot */
+            if (!journal_recover())
+                mark_boot_success();
             closelog();
             return 0;
+        } else if (strcmp(argv[i], "--download") == 0 && i + 2 < argc) {
+            return download_cmd(argv[i + 1], argv[i + 2],
+                                i + 3 < argc ? atoi(argv[i + 3]) : 1);
+        } else if (strcmp(argv[i], "--bench-net") == 0 && i + 1 < argc) {
+            int count = i + 2 < argc ? atoi(argv[i + 2]) : 20;
+            return bench_net_cmd(argv[i + 1], count > 0 ? count : 20,
+                                 i + 3 < argc ? argv[i + 3] : NULL);
+        } else if (strcmp(argv[i], "--bench-hash") == 0) {
+            int mb = i + 1 < argc ? atoi(argv[i + 1]) : 16;
+            return bench_hash_cmd(mb > 0 ? mb : 16);
+        } else if (strcmp(argv[i], "--write-image") == 0 && i + 2 < argc) {
+            return write_image_cmd(argv[i + 1], argv[i + 2]);
+        } else if (strcmp(argv[i], "--bench-decompress") == 0 && i + 1 < argc) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            int threads = i + 2 < argc ? atoi(argv[i + 2]) : (int)cpus;
+            return bench_decompress_cmd(argv[i + 1], threads > 0 ? threads : 1);
+        } else if (strcmp(argv[i], "--bench-io") == 0 && i + 1 < argc) {
+            int mb = i + 2 < argc ? atoi(argv[i + 2]) : 64;
+            return bench_io_cmd(argv[i + 1], mb > 0 ? mb : 64);
         } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--version") == 0) {
             printf("FOTA Client v%s\n", VERSION);
             return 0;
@@ -644,6 +4605,7 @@ int main(int argc, char *argv[])
 
     /* Initialize CURL globally */
     curl_global_init(CURL_GLOBAL_ALL);
+    fota_net_init();
 
     /* Set up signal handlers */
     signal(SIGINT, signal_handler);
@@ -658,6 +4620,14 @@ int main(int argc, char *argv[])
     syslog(LOG_INFO, "FOTA Client v%s started (slot=%c, version=%s)",
            VERSION, config.current_slot, config.current_version);
 
+    /* Nothing else to do before the new slot is booted */
+    if (journal_recover()) {
+        syslog(LOG_INFO, "Rebooting into slot %c...", config.current_slot);
+        sync();
+        system("reboot");
+        return 0;
+    }
+
     /* Single check mode */
     if (force_check) {
         update_manifest_t manifest = {0};
@@ -666,7 +4636,9 @@ int main(int argc, char *argv[])
         if (result > 0) {
             printf("Update available: %s -> %s\n",
                    config.current_version, manifest.version);
-            apply_update(&manifest);
+            if (apply_update(&manifest) < 0)
+                timeline_save("failed");
+            manifest_free(&manifest);
         } else if (result == 0) {
             printf("No update available (current: %s)\n", config.current_version);
         } else {
@@ -687,31 +4659,40 @@ int main(int argc, char *argv[])
     /* Mark previous boot as successful */
     mark_boot_success();
 
-    /* Main daemon loop */
-    time_t last_check = 0;
-
-    while (running) {
-        time_t now = time(NULL);
-
-        /* Check for manual trigger file */
-        check_manual_trigger();
+    fota_event_t *events = fota_event_open(TRIGGER_FILE);
+    if (!events) {
+        syslog(LOG_ERR, "Failed to set up event sources");
+        return 1;
+    }
+    pidfile_write();
 
-        /* Periodic update check */
-        if (now - last_check >= config.check_interval) {
-            update_manifest_t manifest = {0};
+    /*
+     * Main daemon loop
+     * First check right away, then sleep until the timer, the trigger
+     * file or a signal wakes us. Any check restarts the interval.
+     */
+    int ev = FOTA_EVENT_TIMER;
 
-            if (check_for_update(&manifest) > 0) {
-                apply_update(&manifest);
-                /* If we get here, apply_update didn't reboot - something failed */
-            }
+    while (!(ev & FOTA_EVENT_STOP)) {
+        if (ev & FOTA_EVENT_RELOAD)
+            reload_config();
 
-            last_check = now;
+        if (ev & (FOTA_EVENT_TIMER | FOTA_EVENT_TRIGGER | FOTA_EVENT_CHECK)) {
+            run_update_check();
+            fota_event_arm(events, config.check_interval, config.check_jitter);
+        } else if (ev & FOTA_EVENT_RELOAD) {
+            fota_event_arm(events, config.check_interval, config.check_jitter);
         }
 
-        sleep(60);  /* Check triggers every minute */
+        ev = fota_event_wait(events);
+        if (ev < 0)
+            break;
     }
 
     /* Cleanup */
+    unlink(PID_FILE);
+    fota_event_close(events);
+    fota_net_cleanup();
     curl_global_cleanup();
     closelog();
 
@@ -0,0 +1,303 @@
+/*
+ * fota_delta.c - Block-level delta updates for the FOTA client
+ *
+ * See fota_delta.h for the stream format.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "fota_delta.h"
+
+#define DELTA_COPY_BUF  (256 * 1024)    /* Source read size for copies */
+
+/* Parser states */
+enum delta_state {
+    DELTA_HEADER,
+    DELTA_OP,
+    DELTA_ARGS,
+    DELTA_DATA,
+    DELTA_END,
+};
+
+struct fota_delta {
+    int srcfd;
+    uint64_t src_capacity;
+    fota_sink_fn out;
+    void *opaque;
+    fota_sha256_ctx sha;        /* Digest of the rebuilt image */
+
+    enum delta_state state;
+    unsigned char hdr[FOTA_DELTA_HEADER_SIZE];
+    size_t hdr_len;
+    size_t hdr_need;
+    char op;
+    uint64_t data_left;         /* Literal bytes left in a 'D' op */
+
+    uint64_t source_size;
+    uint64_t target_size;
+    unsigned char *buf;         /* Copy buffer, also used for zeros */
+
+    fota_delta_stats_t stats;
+};
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+/* Hand rebuilt image bytes to the output sink */
+static int emit(struct fota_delta *d, const void *buf, size_t len)
+{
+    if (d->stats.target_bytes + len > d->target_size) {
+        syslog(LOG_ERR, "delta: output exceeds target size");
+        return -1;
+    }
+    fota_sha256_update(&d->sha, buf, len);
+    d->stats.target_bytes += len;
+    return d->out(d->opaque, buf, len);
+}
+
+static int do_copy(struct fota_delta *d, uint64_t offset, uint32_t len)
+{
+    if (offset + len > d->source_size || offset + len > d->src_capacity) {
+        syslog(LOG_ERR, "delta: copy beyond end of source");
+        return -1;
+    }
+
+    d->stats.copied_bytes += len;
+
+    while (len > 0) {
+        size_t n = len < DELTA_COPY_BUF ? len : DELTA_COPY_BUF;
+        ssize_t r = pread(d->srcfd, d->buf, n, offset);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            syslog(LOG_ERR, "delta: source read at %llu failed: %s",
+                   (unsigned long long)offset, r < 0 ? strerror(errno) : "EOF");
+            return -1;
+        }
+        if (emit(d, d->buf, r) < 0)
+            return -1;
+        offset += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int do_zero(struct fota_delta *d, uint32_t len)
+{
+    memset(d->buf, 0, DELTA_COPY_BUF);
+    d->stats.zero_bytes += len;
+
+    while (len > 0) {
+        size_t n = len < DELTA_COPY_BUF ? len : DELTA_COPY_BUF;
+        if (emit(d, d->buf, n) < 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static int handle_header(struct fota_delta *d)
+{
+    if (memcmp(d->hdr, FOTA_DELTA_MAGIC, 8) != 0) {
+        syslog(LOG_ERR, "delta: bad magic");
+        return -1;
+    }
+
+    d->source_size = get_le64(d->hdr + 16);
+    d->target_size = get_le64(d->hdr + 24);
+
+    if (d->source_size > d->src_capacity) {
+        syslog(LOG_ERR, "delta: needs a %llu byte source, active slot has %llu",
+               (unsigned long long)d->source_size,
+               (unsigned long long)d->src_capacity);
+        return -1;
+    }
+
+    syslog(LOG_INFO, "delta: block size %u, source %llu bytes, target %llu bytes",
+           get_le32(d->hdr + 8), (unsigned long long)d->source_size,
+           (unsigned long long)d->target_size);
+    return 0;
+}
+
+/* Arguments of the current op are complete */
+static int handle_op(struct fota_delta *d)
+{
+    switch (d->op) {
+    case FOTA_DELTA_OP_COPY:
+        d->state = DELTA_OP;
+        return do_copy(d, get_le64(d->hdr), get_le32(d->hdr + 8));
+    case FOTA_DELTA_OP_ZERO:
+        d->state = DELTA_OP;
+        return do_zero(d, get_le32(d->hdr));
+    case FOTA_DELTA_OP_DATA:
+        d->data_left = get_le32(d->hdr);
+        d->stats.literal_bytes += d->data_left;
+        d->state = d->data_left ? DELTA_DATA : DELTA_OP;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+fota_delta_t *fota_delta_new(const char *source, fota_sink_fn out,
+                             void *opaque)
+{
+    struct fota_delta *d = calloc(1, sizeof(*d));
+    struct stat st;
+
+    if (!d)
+        return NULL;
+
+    d->srcfd = open(source, O_RDONLY | O_CLOEXEC);
+    if (d->srcfd < 0) {
+        syslog(LOG_ERR, "delta: cannot open source %s: %s",
+               source, strerror(errno));
+        free(d);
+        return NULL;
+    }
+
+    if (fstat(d->srcfd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        if (ioctl(d->srcfd, BLKGETSIZE64, &d->src_capacity) < 0)
+            d->src_capacity = 0;
+    } else {
+        d->src_capacity = st.st_size;
+    }
+
+    d->buf = malloc(DELTA_COPY_BUF);
+    if (!d->buf) {
+        fota_delta_free(d);
+        return NULL;
+    }
+
+    d->out = out;
+    d->opaque = opaque;
+    d->state = DELTA_HEADER;
+    d->hdr_need = FOTA_DELTA_HEADER_SIZE;
+    fota_sha256_init(&d->sha);
+
+    return d;
+}
+
+int fota_delta_write(fota_delta_t *d, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        size_t n;
+
+        switch (d->state) {
+        case DELTA_HEADER:
+        case DELTA_ARGS:
+            n = d->hdr_need - d->hdr_len;
+            if (n > len)
+                n = len;
+            memcpy(d->hdr + d->hdr_len, p, n);
+            d->hdr_len += n;
+
+            if (d->hdr_len == d->hdr_need) {
+                int ret;
+                if (d->state == DELTA_HEADER) {
+                    ret = handle_header(d);
+                    d->state = DELTA_OP;
+                } else {
+                    ret = handle_op(d);
+                }
+                if (ret < 0)
+                    return -1;
+            }
+            break;
+
+        case DELTA_OP:
+            n = 1;
+            d->op = *p;
+            d->hdr_len = 0;
+
+            if (d->op == FOTA_DELTA_OP_COPY) {
+                d->hdr_need = 12;
+            } else if (d->op == FOTA_DELTA_OP_DATA ||
+                       d->op == FOTA_DELTA_OP_ZERO) {
+                d->hdr_need = 4;
+            } else if (d->op == FOTA_DELTA_OP_END) {
+                d->state = DELTA_END;
+                break;
+            } else {
+                syslog(LOG_ERR, "delta: unknown op 0x%02x", (unsigned char)d->op);
+                return -1;
+            }
+            d->state = DELTA_ARGS;
+            break;
+
+        case DELTA_DATA:
+            n = len < d->data_left ? len : d->data_left;
+            if (emit(d, p, n) < 0)
+                return -1;
+            d->data_left -= n;
+            if (d->data_left == 0)
+                d->state = DELTA_OP;
+            break;
+
+        case DELTA_END:
+        default:
+            syslog(LOG_ERR, "delta: trailing data after end marker");
+            return -1;
+        }
+
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int fota_delta_finish(fota_delta_t *d, char *hash_out)
+{
+    unsigned char hash[FOTA_SHA256_DIGEST_LENGTH];
+
+    fota_sha256_final(&d->sha, hash);
+    fota_sha256_hex(hash, hash_out);
+
+    if (d->state != DELTA_END) {
+        syslog(LOG_ERR, "delta: stream truncated");
+        return -1;
+    }
+    if (d->stats.target_bytes != d->target_size) {
+        syslog(LOG_ERR, "delta: rebuilt %llu bytes, expected %llu",
+               (unsigned long long)d->stats.target_bytes,
+               (unsigned long long)d->target_size);
+        return -1;
+    }
+    return 0;
+}
+
+void fota_delta_get_stats(const fota_delta_t *d, fota_delta_stats_t *stats)
+{
+    *stats = d->stats;
+}
+
+void fota_delta_free(fota_delta_t *d)
+{
+    if (!d)
+        return;
+
+    close(d->srcfd);
+    free(d->buf);
+    free(d);
+}
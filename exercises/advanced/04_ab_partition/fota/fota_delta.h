@@ -0,0 +1,70 @@
+/*
+ * fota_delta.h - Block-level delta updates for the FOTA client
+ *
+ * A delta rebuilds the new root image from the blocks of the active
+ * slot plus the data that actually changed. It is produced on the
+ * build host by fota_mkdelta (rsync-style rolling checksum matching of
+ * the new image against the blocks of the old one) and applied on the
+ * device while it is being downloaded.
+ *
+ * Stream format (all integers little-endian):
+ *
+ *   header:  "FOTADLT1"  u32 block_size  u32 flags(0)
+ *            u64 source_size  u64 target_size
+ *   ops:     'C' u64 src_offset u32 len   copy from the active slot
+ *            'D' u32 len <len bytes>      literal data
+ *            'Z' u32 len                  zeros
+ *            'E'                          end of delta
+ *
+ * Ops produce the target image strictly in order, so the output can go
+ * straight to the raw image writer.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_DELTA_H_
+#define _FOTA_DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fota_stream.h"
+
+#define FOTA_DELTA_MAGIC        "FOTADLT1"
+#define FOTA_DELTA_HEADER_SIZE  32
+
+#define FOTA_DELTA_OP_COPY      'C'
+#define FOTA_DELTA_OP_DATA      'D'
+#define FOTA_DELTA_OP_ZERO      'Z'
+#define FOTA_DELTA_OP_END       'E'
+
+typedef struct {
+    uint64_t target_bytes;      /* Bytes of the rebuilt image */
+    uint64_t copied_bytes;      /* Taken from the active slot */
+    uint64_t literal_bytes;     /* Carried in the delta */
+    uint64_t zero_bytes;
+} fota_delta_stats_t;
+
+typedef struct fota_delta fota_delta_t;
+
+/*
+ * Start applying a delta against source (the active slot). The
+ * rebuilt image is hashed and handed to out in order.
+ */
+fota_delta_t *fota_delta_new(const char *source, fota_sink_fn out,
+                             void *opaque);
+
+/* Feed the next piece of the delta stream, returns 0 or -1 */
+int fota_delta_write(fota_delta_t *delta, const void *buf, size_t len);
+
+/*
+ * Check that the delta was complete and return the SHA256 (hex) of the
+ * rebuilt image in hash_out. Returns 0 or -1.
+ */
+int fota_delta_finish(fota_delta_t *delta, char *hash_out);
+
+void fota_delta_get_stats(const fota_delta_t *delta, fota_delta_stats_t *stats);
+
+void fota_delta_free(fota_delta_t *delta);
+
+#endif /* _FOTA_DELTA_H_ */
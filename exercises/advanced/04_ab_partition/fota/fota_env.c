@@ -0,0 +1,338 @@
+/*
+ * fota_env.c - In-process access to the U-Boot environment
+ *
+ * On-disk layout (include/env.h in U-Boot):
+ *   single:    crc32 (LE) | data
+ *   redundant: crc32 (LE) | flags | data
+ * data is "name=value\0name=value\0\0" padded to the end of the copy,
+ * the CRC covers the whole data area.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "fota_env.h"
+
+#define ENV_COPIES 2
+
+typedef struct {
+    char dev[PATH_MAX];
+    uint64_t offset;
+    size_t size;                /* Whole copy including header */
+} env_location_t;
+
+struct fota_env {
+    env_location_t loc[ENV_COPIES];
+    int copies;                 /* 1, or 2 for a redundant environment */
+    int current;                /* Copy the environment was read from */
+    uint8_t flags;              /* Flags byte of the current copy */
+
+    char **vars;                /* "name=value" entries in original order */
+    int nvars;
+    int dirty;
+};
+
+static size_t header_size(const fota_env_t *env)
+{
+    return env->copies > 1 ? 5 : 4;
+}
+
+/*
+ * Parse fw_env.config: device offset size [erase-size [sectors]]
+ */
+static int parse_config(fota_env_t *env, const char *path)
+{
+    char line[512];
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        syslog(LOG_ERR, "Cannot open %s", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) && env->copies < ENV_COPIES) {
+        env_location_t *loc = &env->loc[env->copies];
+        char offset[32], size[32];
+        struct stat st;
+
+        if (sscanf(line, " %4095s %31s %31s", loc->dev, offset, size) != 3 ||
+            loc->dev[0] == '#')
+            continue;
+
+        loc->offset = strtoull(offset, NULL, 0);
+        loc->size = strtoull(size, NULL, 0);
+
+        if (stat(loc->dev, &st) == 0 && S_ISCHR(st.st_mode)) {
+            syslog(LOG_ERR, "%s: MTD environments are not supported", loc->dev);
+            fclose(fp);
+            return -1;
+        }
+        if (loc->size <= 5) {
+            syslog(LOG_ERR, "%s: invalid environment size", path);
+            fclose(fp);
+            return -1;
+        }
+        env->copies++;
+    }
+    fclose(fp);
+
+    if (env->copies == 0) {
+        syslog(LOG_ERR, "%s: no environment configured", path);
+        return -1;
+    }
+    if (env->copies > 1 && env->loc[0].size != env->loc[1].size) {
+        syslog(LOG_ERR, "%s: redundant copies differ in size", path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read one copy, returns its buffer if the CRC matches, else NULL
+ */
+static unsigned char *read_copy(const fota_env_t *env, int i)
+{
+    const env_location_t *loc = &env->loc[i];
+    size_t hdr = header_size(env);
+
+    int fd = open(loc->dev, O_RDONLY);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Cannot open %s", loc->dev);
+        return NULL;
+    }
+
+    unsigned char *buf = malloc(loc->size);
+    if (!buf || pread(fd, buf, loc->size, loc->offset) != (ssize_t)loc->size) {
+        syslog(LOG_ERR, "Cannot read environment from %s", loc->dev);
+        free(buf);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    uint32_t stored = buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
+    if (crc32(0, buf + hdr, loc->size - hdr) != stored) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/*
+ * Pick the active copy the way U-Boot does for the incremental scheme:
+ * the higher flags value wins, 0 wins over 255 (wrap around)
+ */
+static int newer_copy(uint8_t flags0, uint8_t flags1)
+{
+    if (flags0 == 255 && flags1 == 0)
+        return 1;
+    if (flags1 == 255 && flags0 == 0)
+        return 0;
+    return flags1 > flags0 ? 1 : 0;
+}
+
+static int parse_vars(fota_env_t *env, const char *data, size_t len)
+{
+    size_t pos = 0;
+
+    while (pos < len && data[pos] != '\0') {
+        size_t n = strnlen(data + pos, len - pos);
+        if (pos + n == len)
+            break;              /* Unterminated, ignore the rest */
+
+        if (strchr(data + pos, '=')) {
+            char **vars = realloc(env->vars, (env->nvars + 1) * sizeof(char *));
+            if (!vars)
+                return -1;
+            env->vars = vars;
+            env->vars[env->nvars] = strdup(data + pos);
+            if (!env->vars[env->nvars])
+                return -1;
+            env->nvars++;
+        }
+        pos += n + 1;
+    }
+    return 0;
+}
+
+fota_env_t *fota_env_open(const char *config)
+{
+    unsigned char *copy[ENV_COPIES] = {NULL, NULL};
+
+    fota_env_t *env = calloc(1, sizeof(*env));
+    if (!env)
+        return NULL;
+
+    if (parse_config(env, config ? config : FOTA_ENV_CONFIG) < 0)
+        goto fail;
+
+    for (int i = 0; i < env->copies; i++)
+        copy[i] = read_copy(env, i);
+
+    if (copy[0] && copy[1])
+        env->current = newer_copy(copy[0][4], copy[1][4]);
+    else if (copy[0])
+        env->current = 0;
+    else if (copy[1])
+        env->current = 1;
+    else {
+        syslog(LOG_ERR, "No valid U-Boot environment (bad CRC)");
+        goto fail;
+    }
+
+    if (env->copies > 1)
+        env->flags = copy[env->current][4];
+
+    size_t hdr = header_size(env);
+    if (parse_vars(env, (const char *)copy[env->current] + hdr,
+                   env->loc[env->current].size - hdr) < 0)
+        goto fail;
+
+    free(copy[0]);
+    free(copy[1]);
+    return env;
+
+fail:
+    free(copy[0]);
+    free(copy[1]);
+    fota_env_close(env);
+    return NULL;
+}
+
+static int find_var(const fota_env_t *env, const char *name)
+{
+    size_t len = strlen(name);
+
+    for (int i = 0; i < env->nvars; i++)
+        if (strncmp(env->vars[i], name, len) == 0 && env->vars[i][len] == '=')
+            return i;
+    return -1;
+}
+
+const char *fota_env_get(fota_env_t *env, const char *name)
+{
+    int i = find_var(env, name);
+    return i < 0 ? NULL : env->vars[i] + strlen(name) + 1;
+}
+
+int fota_env_set(fota_env_t *env, const char *name, const char *value)
+{
+    int i = find_var(env, name);
+
+    if (name[0] == '\0' || strchr(name, '='))
+        return -1;
+
+    /* Unchanged values do not cost a write */
+    if (value && i >= 0 && strcmp(env->vars[i] + strlen(name) + 1, value) == 0)
+        return 0;
+    if (!value && i < 0)
+        return 0;
+
+    if (!value) {
+        free(env->vars[i]);
+        memmove(&env->vars[i], &env->vars[i + 1],
+                (env->nvars - i - 1) * sizeof(char *));
+        env->nvars--;
+        env->dirty = 1;
+        return 0;
+    }
+
+    char *var = malloc(strlen(name) + strlen(value) + 2);
+    if (!var)
+        return -1;
+    sprintf(var, "%s=%s", name, value);
+
+    if (i >= 0) {
+        free(env->vars[i]);
+        env->vars[i] = var;
+    } else {
+        char **vars = realloc(env->vars, (env->nvars + 1) * sizeof(char *));
+        if (!vars) {
+            free(var);
+            return -1;
+        }
+        env->vars = vars;
+        env->vars[env->nvars++] = var;
+    }
+    env->dirty = 1;
+    return 0;
+}
+
+int fota_env_commit(fota_env_t *env)
+{
+    if (!env->dirty)
+        return 0;
+
+    /* Redundant: write the other copy, it becomes the active one */
+    int target = env->copies > 1 ? !env->current : 0;
+    const env_location_t *loc = &env->loc[target];
+    size_t hdr = header_size(env);
+    size_t pos = hdr;
+    int ret = -1;
+
+    unsigned char *buf = calloc(1, loc->size);
+    if (!buf)
+        return -1;
+
+    for (int i = 0; i < env->nvars; i++) {
+        size_t len = strlen(env->vars[i]) + 1;
+        if (pos + len >= loc->size) {
+            syslog(LOG_ERR, "U-Boot environment too large");
+            goto out;
+        }
+        memcpy(buf + pos, env->vars[i], len);
+        pos += len;
+    }
+
+    uint8_t flags = env->flags + 1;
+    uint32_t crc = crc32(0, buf + hdr, loc->size - hdr);
+    buf[0] = crc;
+    buf[1] = crc >> 8;
+    buf[2] = crc >> 16;
+    buf[3] = crc >> 24;
+    if (env->copies > 1)
+        buf[4] = flags;
+
+    int fd = open(loc->dev, O_WRONLY);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Cannot open %s for writing", loc->dev);
+        goto out;
+    }
+
+    if (pwrite(fd, buf, loc->size, loc->offset) != (ssize_t)loc->size ||
+        fsync(fd) != 0) {
+        syslog(LOG_ERR, "Cannot write environment to %s", loc->dev);
+        close(fd);
+        goto out;
+    }
+    close(fd);
+
+    env->current = target;
+    env->flags = flags;
+    env->dirty = 0;
+    ret = 0;
+
+out:
+    free(buf);
+    return ret;
+}
+
+void fota_env_close(fota_env_t *env)
+{
+    if (!env)
+        return;
+    for (int i = 0; i < env->nvars; i++)
+        free(env->vars[i]);
+    free(env->vars);
+    free(env);
+}
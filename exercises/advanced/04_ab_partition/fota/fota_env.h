@@ -0,0 +1,46 @@
+/*
+ * fota_env.h - In-process access to the U-Boot environment
+ *
+ * Reads the environment location from fw_env.config (same format as
+ * u-boot-tools), validates the CRC32 of the primary and, if configured,
+ * the redundant copy, and selects the active one by its flags byte.
+ *
+ * Changes are collected in memory and written by fota_env_commit() in
+ * a single write. With a redundant environment that write goes to the
+ * inactive copy with an incremented flag, so a power cut at any point
+ * leaves either the old or the complete new environment valid. Without
+ * a redundant copy the environment is rewritten in place.
+ *
+ * Supported are block devices and files (MMC, eMMC, FAT image), with
+ * U-Boot's incremental flag scheme. MTD devices need erase handling
+ * and are rejected.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_ENV_H_
+#define _FOTA_ENV_H_
+
+#define FOTA_ENV_CONFIG "/etc/fw_env.config"
+
+typedef struct fota_env fota_env_t;
+
+/*
+ * Load the active environment described by config (NULL: default path)
+ * Returns NULL if no copy has a valid CRC: U-Boot would fall back to its
+ * built-in default then, which is not known here, so nothing is written.
+ */
+fota_env_t *fota_env_open(const char *config);
+
+/* Value of a variable, NULL if unset */
+const char *fota_env_get(fota_env_t *env, const char *name);
+
+/* Set (value NULL: delete) a variable in memory, returns 0 or -1 */
+int fota_env_set(fota_env_t *env, const char *name, const char *value);
+
+/* Write all pending changes at once, no-op if nothing changed */
+int fota_env_commit(fota_env_t *env);
+
+void fota_env_close(fota_env_t *env);
+
+#endif /* _FOTA_ENV_H_ */
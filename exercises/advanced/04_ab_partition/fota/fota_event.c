@@ -0,0 +1,258 @@
+/*
+ * fota_event.c - Event sources of the FOTA daemon
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/random.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "fota_event.h"
+
+struct fota_event {
+    int epoll_fd;
+    int timer_fd;
+    int inotify_fd;
+    int signal_fd;
+    char trigger[PATH_MAX];     /* Full path of the trigger file */
+    const char *trigger_name;   /* Last component, as inotify reports it */
+    sigset_t mask;
+    sigset_t old_mask;
+};
+
+static void handled_signals(sigset_t *mask)
+{
+    sigemptyset(mask);
+    sigaddset(mask, SIGTERM);
+    sigaddset(mask, SIGINT);
+    sigaddset(mask, SIGUSR1);
+    sigaddset(mask, SIGHUP);
+}
+
+static int watch_fd(fota_event_t *ev, int fd)
+{
+    struct epoll_event e = { .events = EPOLLIN, .data.fd = fd };
+    return epoll_ctl(ev->epoll_fd, EPOLL_CTL_ADD, fd, &e);
+}
+
+/*
+ * Watch the directory rather than the file: the file does not exist
+ * while there is nothing to do. Only creation and renames are watched,
+ * other activity in the directory does not wake the daemon.
+ */
+static int watch_trigger(fota_event_t *ev, const char *trigger_file)
+{
+    char dir[PATH_MAX];
+
+    snprintf(ev->trigger, sizeof(ev->trigger), "%s", trigger_file);
+    snprintf(dir, sizeof(dir), "%s", trigger_file);
+
+    char *slash = strrchr(dir, '/');
+    if (slash == dir)
+        dir[1] = '\0';
+    else if (slash)
+        *slash = '\0';
+    else
+        strcpy(dir, ".");
+    ev->trigger_name = slash ? ev->trigger + (slash - dir) + 1 : ev->trigger;
+
+    ev->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ev->inotify_fd < 0)
+        return -1;
+    if (inotify_add_watch(ev->inotify_fd, dir,
+                          IN_CREATE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+        syslog(LOG_ERR, "Cannot watch %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Remove the trigger file if it exists, 1 if it did
+ */
+static int consume_trigger(fota_event_t *ev)
+{
+    return unlink(ev->trigger) == 0;
+}
+
+fota_event_t *fota_event_open(const char *trigger_file)
+{
+    fota_event_t *ev = calloc(1, sizeof(*ev));
+    if (!ev)
+        return NULL;
+
+    ev->epoll_fd = ev->timer_fd = ev->inotify_fd = ev->signal_fd = -1;
+
+    handled_signals(&ev->mask);
+    if (sigprocmask(SIG_BLOCK, &ev->mask, &ev->old_mask) < 0) {
+        free(ev);
+        return NULL;
+    }
+
+    ev->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ev->timer_fd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    ev->signal_fd = signalfd(-1, &ev->mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (ev->epoll_fd < 0 || ev->timer_fd < 0 || ev->signal_fd < 0) {
+        syslog(LOG_ERR, "Cannot create event descriptors: %s", strerror(errno));
+        goto fail;
+    }
+
+    if (watch_trigger(ev, trigger_file) < 0)
+        goto fail;
+
+    if (watch_fd(ev, ev->timer_fd) < 0 || watch_fd(ev, ev->inotify_fd) < 0 ||
+        watch_fd(ev, ev->signal_fd) < 0)
+        goto fail;
+
+    /* Left from before the start, the daemon checks right away anyway */
+    consume_trigger(ev);
+
+    return ev;
+
+fail:
+    fota_event_close(ev);
+    return NULL;
+}
+
+int fota_event_arm(fota_event_t *ev, int interval, int jitter)
+{
+    uint32_t rnd = 0;
+    struct itimerspec its = {0};
+
+    if (jitter > 0) {
+        if (getrandom(&rnd, sizeof(rnd), GRND_NONBLOCK) != sizeof(rnd))
+            rnd = time(NULL) ^ getpid();
+        interval += rnd % ((uint32_t)jitter + 1);
+    }
+
+    /* One-shot, re-armed after every check so checks never queue up */
+    its.it_value.tv_sec = interval > 0 ? interval : 1;
+    if (timerfd_settime(ev->timer_fd, 0, &its, NULL) < 0) {
+        syslog(LOG_ERR, "Cannot arm check timer: %s", strerror(errno));
+        return -1;
+    }
+
+    syslog(LOG_DEBUG, "Next update check in %d s", (int)its.it_value.tv_sec);
+    return 0;
+}
+
+static int read_signals(fota_event_t *ev)
+{
+    struct signalfd_siginfo si;
+    int events = 0;
+
+    while (read(ev->signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        switch (si.ssi_signo) {
+        case SIGTERM:
+        case SIGINT:
+            syslog(LOG_INFO, "Received signal %u, shutting down", si.ssi_signo);
+            events |= FOTA_EVENT_STOP;
+            break;
+        case SIGUSR1:
+            syslog(LOG_INFO, "Update check requested by signal");
+            events |= FOTA_EVENT_CHECK;
+            break;
+        case SIGHUP:
+            events |= FOTA_EVENT_RELOAD;
+            break;
+        }
+    }
+    return events;
+}
+
+static int read_inotify(fota_event_t *ev)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int seen = 0;
+    ssize_t len;
+
+    while ((len = read(ev->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *ie = (const struct inotify_event *)p;
+
+            if (ie->mask & IN_Q_OVERFLOW)
+                seen = 1;       /* Events lost, look at the file itself */
+            else if (ie->len && strcmp(ie->name, ev->trigger_name) == 0)
+                seen = 1;
+            p += sizeof(*ie) + ie->len;
+        }
+    }
+
+    if (seen && consume_trigger(ev)) {
+        syslog(LOG_INFO, "Manual update trigger detected");
+        return FOTA_EVENT_TRIGGER;
+    }
+    return 0;
+}
+
+int fota_event_wait(fota_event_t *ev)
+{
+    int events = 0;
+
+    while (!events) {
+        struct epoll_event ready[3];
+
+        int n = epoll_wait(ev->epoll_fd, ready, 3, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = ready[i].data.fd;
+
+            if (fd == ev->signal_fd) {
+                events |= read_signals(ev);
+            } else if (fd == ev->inotify_fd) {
+                events |= read_inotify(ev);
+            } else if (fd == ev->timer_fd) {
+                uint64_t expirations;
+                if (read(fd, &expirations, sizeof(expirations)) > 0)
+                    events |= FOTA_EVENT_TIMER;
+            }
+        }
+    }
+
+    return events;
+}
+
+int fota_event_stop_pending(void)
+{
+    sigset_t pending;
+
+    if (sigpending(&pending) < 0)
+        return 0;
+    return sigismember(&pending, SIGTERM) == 1 || sigismember(&pending, SIGINT) == 1;
+}
+
+void fota_event_close(fota_event_t *ev)
+{
+    if (!ev)
+        return;
+
+    if (ev->signal_fd >= 0)
+        close(ev->signal_fd);
+    if (ev->inotify_fd >= 0)
+        close(ev->inotify_fd);
+    if (ev->timer_fd >= 0)
+        close(ev->timer_fd);
+    if (ev->epoll_fd >= 0)
+        close(ev->epoll_fd);
+    sigprocmask(SIG_SETMASK, &ev->old_mask, NULL);
+    free(ev);
+}
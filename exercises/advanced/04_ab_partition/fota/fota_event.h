@@ -0,0 +1,51 @@
+/*
+ * fota_event.h - Event sources of the FOTA daemon
+ *
+ * The daemon sleeps in epoll_wait() without a timeout and only wakes up
+ * when there is work:
+ *   timerfd  - next periodic check, the interval plus a random jitter so
+ *              devices powered up together do not query the server in
+ *              lockstep (CLOCK_BOOTTIME, time in suspend counts)
+ *   inotify  - the trigger file appearing in its directory
+ *   signalfd - SIGTERM/SIGINT stop, SIGUSR1 checks now, SIGHUP reloads
+ *
+ * The signals are blocked while the event sources are open, so one that
+ * arrives during a check stays pending until the next wait instead of
+ * interrupting it; fota_event_stop_pending() lets long transfers notice
+ * a stop request early.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_EVENT_H_
+#define _FOTA_EVENT_H_
+
+/* Events returned by fota_event_wait(), several may be set at once */
+#define FOTA_EVENT_STOP     0x01    /* SIGTERM or SIGINT */
+#define FOTA_EVENT_TIMER    0x02    /* Check interval elapsed */
+#define FOTA_EVENT_TRIGGER  0x04    /* Trigger file created (and removed) */
+#define FOTA_EVENT_CHECK    0x08    /* SIGUSR1 */
+#define FOTA_EVENT_RELOAD   0x10    /* SIGHUP */
+
+typedef struct fota_event fota_event_t;
+
+/*
+ * Block the handled signals and set up the event sources
+ * A trigger file that already exists is removed: it predates the daemon,
+ * whose first check happens right after start.
+ */
+fota_event_t *fota_event_open(const char *trigger_file);
+
+/* (Re)arm the check timer: interval plus 0..jitter seconds */
+int fota_event_arm(fota_event_t *ev, int interval, int jitter);
+
+/* Sleep until at least one event, returns the FOTA_EVENT_* mask or -1 */
+int fota_event_wait(fota_event_t *ev);
+
+/* Non-blocking: is a SIGTERM/SIGINT waiting to be handled? */
+int fota_event_stop_pending(void);
+
+/* Close the event sources and unblock the signals */
+void fota_event_close(fota_event_t *ev);
+
+#endif /* _FOTA_EVENT_H_ */
@@ -0,0 +1,328 @@
+/*
+ * fota_fdt.c - Minimal flattened device tree editor for the FOTA client
+ *
+ * See fota_fdt.h. Format reference: Devicetree Specification, chapter
+ * "Flattened Devicetree (DTB) Format".
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <syslog.h>
+
+#include "fota_fdt.h"
+
+#define FDT_MAGIC           0xd00dfeed
+#define FDT_HEADER_SIZE     40          /* Version 17 */
+#define FDT_MAX_DEPTH       32
+
+/* Structure block tokens */
+#define FDT_BEGIN_NODE      1
+#define FDT_END_NODE        2
+#define FDT_PROP            3
+#define FDT_NOP             4
+#define FDT_END             9
+
+/* Header field offsets */
+#define HDR_MAGIC           0
+#define HDR_TOTALSIZE       4
+#define HDR_OFF_STRUCT      8
+#define HDR_OFF_STRINGS     12
+#define HDR_OFF_RSVMAP      16
+#define HDR_VERSION         20
+#define HDR_LAST_COMP       24
+#define HDR_BOOT_CPUID      28
+#define HDR_SIZE_STRINGS    32
+#define HDR_SIZE_STRUCT     36
+
+struct out {
+    unsigned char *p;
+    size_t len;
+    size_t cap;
+    int failed;
+};
+
+/* ============= Helpers ============= */
+
+static uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | p[3];
+}
+
+static void set_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void put(struct out *o, const void *data, size_t len)
+{
+    if (o->failed)
+        return;
+
+    if (o->len + len > o->cap) {
+        size_t cap = o->cap ? o->cap : 4096;
+        while (cap < o->len + len)
+            cap *= 2;
+        unsigned char *p = realloc(o->p, cap);
+        if (!p) {
+            o->failed = 1;
+            return;
+        }
+        o->p = p;
+        o->cap = cap;
+    }
+    memcpy(o->p + o->len, data, len);
+    o->len += len;
+}
+
+static void put_be32(struct out *o, uint32_t v)
+{
+    unsigned char b[4];
+
+    set_be32(b, v);
+    put(o, b, sizeof(b));
+}
+
+/* Pad with zeros to a multiple of align */
+static void put_align(struct out *o, size_t align)
+{
+    static const unsigned char zeros[8];
+
+    put(o, zeros, (align - o->len % align) % align);
+}
+
+static void put_prop(struct out *o, uint32_t nameoff, const void *value,
+                     size_t vlen)
+{
+    put_be32(o, FDT_PROP);
+    put_be32(o, vlen);
+    put_be32(o, nameoff);
+    put(o, value, vlen);
+    put_align(o, 4);
+}
+
+/* Does node name match path component comp (with len bytes)? */
+static int name_matches(const char *name, const char *comp, size_t len)
+{
+    if (strncmp(name, comp, len) != 0)
+        return 0;
+    if (name[len] == '\0')
+        return 1;
+
+    /* "memory" matches "memory@80000000" */
+    return name[len] == '@' && !memchr(comp, '@', len);
+}
+
+/* Offset of name in the strings block, -1 if not present */
+static long find_string(const char *strings, size_t size, const char *name)
+{
+    size_t len = strlen(name) + 1;
+
+    for (size_t off = 0; off + len <= size; off++) {
+        if (memcmp(strings + off, name, len) == 0)
+            return off;
+    }
+    return -1;
+}
+
+/* ============= Public API ============= */
+
+void *fota_fdt_setprop(const void *fdt, size_t len, const char *path,
+                       const char *name, const void *value, size_t vlen,
+                       size_t *out_len)
+{
+    const unsigned char *in = fdt;
+    const char *comps[FDT_MAX_DEPTH];
+    size_t comp_len[FDT_MAX_DEPTH];
+    int on_path[FDT_MAX_DEPTH + 1];
+    int ncomps = 0, depth = -1, done = 0;
+    struct out o = { 0 };
+
+    /* Split the node path */
+    for (const char *p = path; *p; ) {
+        while (*p == '/')
+            p++;
+        if (!*p)
+            break;
+        if (ncomps == FDT_MAX_DEPTH)
+            return NULL;
+        comps[ncomps] = p;
+        comp_len[ncomps] = strcspn(p, "/");
+        p += comp_len[ncomps++];
+    }
+
+    /* Header */
+    if (len < FDT_HEADER_SIZE - 4 || get_be32(in + HDR_MAGIC) != FDT_MAGIC) {
+        syslog(LOG_ERR, "fdt: not a flattened device tree");
+        return NULL;
+    }
+
+    uint32_t totalsize = get_be32(in + HDR_TOTALSIZE);
+    uint32_t off_struct = get_be32(in + HDR_OFF_STRUCT);
+    uint32_t off_strings = get_be32(in + HDR_OFF_STRINGS);
+    uint32_t off_rsvmap = get_be32(in + HDR_OFF_RSVMAP);
+    uint32_t version = get_be32(in + HDR_VERSION);
+    uint32_t size_strings = get_be32(in + HDR_SIZE_STRINGS);
+    uint32_t struct_end = version >= 17 && len >= FDT_HEADER_SIZE ?
+                          off_struct + get_be32(in + HDR_SIZE_STRUCT) :
+                          totalsize;
+
+    if (version < 16 || totalsize > len || off_struct > totalsize ||
+        struct_end > totalsize || struct_end < off_struct ||
+        off_strings > totalsize || size_strings > totalsize - off_strings ||
+        off_rsvmap > totalsize || (off_rsvmap % 8) || (off_struct % 4)) {
+        syslog(LOG_ERR, "fdt: malformed header");
+        return NULL;
+    }
+
+    const char *strings = (const char *)in + off_strings;
+
+    /* Name of the property in the new strings block */
+    long nameoff = find_string(strings, size_strings, name);
+    int new_name = nameoff < 0;
+    if (new_name)
+        nameoff = size_strings;
+
+    /* Header placeholder, then the memory reservations up to the (0, 0) end */
+    put(&o, in, FDT_HEADER_SIZE - 4);
+    put_be32(&o, 0);
+    uint32_t out_rsvmap = o.len;
+    for (uint32_t off = off_rsvmap; ; off += 16) {
+        if (off + 16 > totalsize)
+            goto malformed;
+        put(&o, in + off, 16);
+        if (get_be32(in + off) == 0 && get_be32(in + off + 4) == 0 &&
+            get_be32(in + off + 8) == 0 && get_be32(in + off + 12) == 0)
+            break;
+    }
+
+    /* Structure block */
+    uint32_t out_struct = o.len;
+    uint32_t off = off_struct;
+    for (;;) {
+        if (off + 4 > struct_end)
+            goto malformed;
+        uint32_t token = get_be32(in + off);
+        uint32_t start = off;
+        off += 4;
+
+        switch (token) {
+        case FDT_BEGIN_NODE: {
+            const char *node = (const char *)in + off;
+            size_t nlen = strnlen(node, struct_end - off);
+            if (off + nlen >= struct_end || depth + 1 > FDT_MAX_DEPTH)
+                goto malformed;
+            off += (nlen + 4) & ~3u;
+
+            /* Properties come before subnodes: add it before the first one */
+            if (depth == ncomps && on_path[depth] && !done) {
+                put_prop(&o, nameoff, value, vlen);
+                done = 1;
+            }
+
+            depth++;
+            if (depth == 0)
+                on_path[0] = 1;
+            else
+                on_path[depth] = on_path[depth - 1] && depth <= ncomps &&
+                                 name_matches(node, comps[depth - 1],
+                                              comp_len[depth - 1]);
+            put(&o, in + start, off - start);
+            break;
+        }
+
+        case FDT_END_NODE:
+            if (depth < 0)
+                goto malformed;
+            if (on_path[depth] && !done) {
+                if (depth == ncomps) {
+                    put_prop(&o, nameoff, value, vlen);
+                    done = 1;
+                } else if (depth == ncomps - 1) {
+                    /* The parent exists, create the node */
+                    put_be32(&o, FDT_BEGIN_NODE);
+                    put(&o, comps[depth], comp_len[depth]);
+                    put(&o, "", 1);
+                    put_align(&o, 4);
+                    put_prop(&o, nameoff, value, vlen);
+                    put_be32(&o, FDT_END_NODE);
+                    done = 1;
+                }
+            }
+            depth--;
+            put_be32(&o, FDT_END_NODE);
+            break;
+
+        case FDT_PROP: {
+            if (off + 8 > struct_end || depth < 0)
+                goto malformed;
+            uint32_t plen = get_be32(in + off);
+            uint32_t poff = get_be32(in + off + 4);
+            if (plen > struct_end - off - 8 || poff >= size_strings)
+                goto malformed;
+            off += 8 + ((plen + 3) & ~3u);
+
+            if (depth == ncomps && on_path[depth] && !done &&
+                strncmp(strings + poff, name, size_strings - poff) == 0) {
+                put_prop(&o, nameoff, value, vlen);
+                done = 1;
+            } else {
+                put(&o, in + start, off - start);
+            }
+            break;
+        }
+
+        case FDT_NOP:
+            break;
+
+        case FDT_END:
+            if (depth != -1)
+                goto malformed;
+            put_be32(&o, FDT_END);
+            goto end;
+
+        default:
+            goto malformed;
+        }
+    }
+
+end:
+    if (!done) {
+        syslog(LOG_ERR, "fdt: no node %s", path);
+        free(o.p);
+        return NULL;
+    }
+
+    /* Strings block */
+    uint32_t out_strings = o.len;
+    put(&o, strings, size_strings);
+    if (new_name)
+        put(&o, name, strlen(name) + 1);
+    if (o.failed)
+        goto fail;
+
+    set_be32(o.p + HDR_TOTALSIZE, o.len);
+    set_be32(o.p + HDR_OFF_STRUCT, out_struct);
+    set_be32(o.p + HDR_OFF_STRINGS, out_strings);
+    set_be32(o.p + HDR_OFF_RSVMAP, out_rsvmap);
+    set_be32(o.p + HDR_VERSION, 17);
+    set_be32(o.p + HDR_LAST_COMP, 16);
+    set_be32(o.p + HDR_SIZE_STRINGS, o.len - out_strings);
+    set_be32(o.p + HDR_SIZE_STRUCT, out_strings - out_struct);
+
+    *out_len = o.len;
+    return o.p;
+
+malformed:
+    syslog(LOG_ERR, "fdt: malformed structure block");
+fail:
+    free(o.p);
+    return NULL;
+}
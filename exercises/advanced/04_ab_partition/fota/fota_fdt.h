@@ -0,0 +1,40 @@
+/*
+ * fota_fdt.h - Minimal flattened device tree editor for the FOTA client
+ *
+ * Falcon mode boots the kernel straight from SPL with an "args" blob:
+ * the board's DTB as U-Boot would pass it, prepared once by
+ * "spl export fdt". The part of that preparation the kernel depends on
+ * is the command line in /chosen/bootargs, which differs per slot.
+ * This editor sets such a property without libfdt, so the client can
+ * prepare the args of a freshly written slot itself.
+ *
+ * The blob is rebuilt rather than edited in place: memory reservations
+ * are copied, the structure block is copied token by token with the
+ * property replaced or added, and the property name is appended to the
+ * strings block if it is not there yet. Only format version 17 is
+ * written, inputs must be version 16 or newer.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_FDT_H_
+#define _FOTA_FDT_H_
+
+#include <stddef.h>
+
+/* Largest DTB accepted */
+#define FOTA_FDT_MAX_SIZE   (1024 * 1024)
+
+/*
+ * Copy of the tree fdt (len bytes) with property name of the node at
+ * path (e.g. "/chosen") set to value. A node name without a unit
+ * address also matches "name@...". If the node itself is missing but
+ * its parent exists, it is created.
+ * Returns a malloc'ed blob of *out_len bytes, NULL if the tree is
+ * malformed or the node cannot be found.
+ */
+void *fota_fdt_setprop(const void *fdt, size_t len, const char *path,
+                       const char *name, const void *value, size_t vlen,
+                       size_t *out_len);
+
+#endif /* _FOTA_FDT_H_ */
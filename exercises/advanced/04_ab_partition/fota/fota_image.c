@@ -0,0 +1,426 @@
+/*
+ * fota_image.c - Raw block image writer for the FOTA client
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+#include "fota_aio.h"
+#include "fota_image.h"
+#include "fota_throttle.h"
+
+/* O_DIRECT wants the buffer and every write aligned to the sector size */
+#define IMAGE_ALIGN     4096
+#define SECTOR_SIZE     512
+
+/* How a block is transferred to the target */
+enum block_class {
+    BLOCK_DATA,
+    BLOCK_ZERO,
+    BLOCK_SKIP,
+    BLOCK_VERIFIED,
+};
+
+struct fota_image {
+    int fd;
+    int direct;                 /* Opened with O_DIRECT */
+    fota_writeback_t wb;        /* Dirty page limit without O_DIRECT */
+    int is_blkdev;
+    uint64_t capacity;          /* Target size, 0 if unlimited */
+
+    fota_aio_t *aio;            /* Queued writes, see fota_aio.h */
+    size_t block;               /* Write buffer size */
+    unsigned char *buf;         /* Aligned write buffer, owned by aio */
+    size_t buf_len;
+    uint64_t buf_offset;        /* Target offset of buf[0] */
+    unsigned char *zeros;       /* Fallback when zeroing is unsupported */
+    int zeroout_ok;
+
+    const fota_bmap_t *bmap;
+    size_t range_idx;
+
+    uint64_t resume_offset;     /* Image bytes an earlier attempt flushed */
+    unsigned char *check;       /* Target contents under buf */
+    size_t check_len;
+
+    fota_image_stats_t stats;
+};
+
+/* ============= Helpers ============= */
+
+static int is_zero(const unsigned char *p, size_t len)
+{
+    const uint64_t *w = (const uint64_t *)p;
+    size_t n = len / sizeof(uint64_t);
+
+    for (size_t i = 0; i < n; i++) {
+        if (w[i])
+            return 0;
+    }
+    for (size_t i = n * sizeof(uint64_t); i < len; i++) {
+        if (p[i])
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Does [offset, offset + len) touch a mapped block?
+ * Offsets are only ever increasing, so the range cursor moves forward.
+ */
+static int is_mapped(struct fota_image *img, uint64_t offset, size_t len)
+{
+    const fota_bmap_t *bmap = img->bmap;
+    uint64_t bs = bmap->block_size;
+
+    while (img->range_idx < bmap->nranges &&
+           (bmap->ranges[img->range_idx].last + 1) * bs <= offset)
+        img->range_idx++;
+
+    if (img->range_idx == bmap->nranges)
+        return 0;
+
+    return bmap->ranges[img->range_idx].first * bs < offset + len;
+}
+
+static enum block_class classify(struct fota_image *img, uint64_t offset,
+                                  const unsigned char *p, size_t len)
+{
+    size_t off = offset - img->buf_offset;
+
+    if (img->bmap && !is_mapped(img, offset, len))
+        return BLOCK_SKIP;
+
+    if (off + len <= img->check_len && memcmp(img->check + off, p, len) == 0)
+        return BLOCK_VERIFIED;
+
+    if (img->bmap)
+        return BLOCK_DATA;
+
+    return is_zero(p, len) ? BLOCK_ZERO : BLOCK_DATA;
+}
+
+/*
+ * Below the resume offset, read what the target holds under the buffer
+ * A short or failed read only means those blocks are written again.
+ */
+static void read_back(struct fota_image *img)
+{
+    size_t len = img->buf_len;
+
+    img->check_len = 0;
+    if (img->buf_offset >= img->resume_offset)
+        return;
+
+    if (img->resume_offset - img->buf_offset < len)
+        len = img->resume_offset - img->buf_offset;
+
+    /* O_DIRECT reads are whole sectors too */
+    if (img->direct)
+        len -= len % SECTOR_SIZE;
+
+    while (img->check_len < len) {
+        ssize_t n = pread(img->fd, img->check + img->check_len,
+                          len - img->check_len,
+                          img->buf_offset + img->check_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        img->check_len += n;
+    }
+}
+
+static int write_all(struct fota_image *img, const unsigned char *p,
+                     size_t len, uint64_t offset)
+{
+    /* O_DIRECT cannot write a tail that is not sector aligned */
+    if (img->direct && (len % SECTOR_SIZE)) {
+        if (fota_aio_drain(img->aio) < 0)
+            return -1;
+        int flags = fcntl(img->fd, F_GETFL);
+        fcntl(img->fd, F_SETFL, flags & ~O_DIRECT);
+        img->direct = 0;
+    }
+
+    while (len > 0) {
+        ssize_t n = pwrite(img->fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "image: write at %llu failed: %s",
+                   (unsigned long long)offset, strerror(errno));
+            return -1;
+        }
+        if (!img->direct)
+            fota_writeback_written(&img->wb, offset, n);
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Clear a range without sending data from user space if possible */
+static int zero_range(struct fota_image *img, uint64_t offset, size_t len)
+{
+    if (img->zeroout_ok) {
+        int ret;
+
+        if (img->is_blkdev) {
+            uint64_t range[2] = { offset, len };
+            ret = ioctl(img->fd, BLKZEROOUT, range);
+        } else {
+            ret = fallocate(img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            offset, len);
+        }
+        if (ret == 0)
+            return 0;
+
+        syslog(LOG_INFO, "image: zeroing not supported (%s), writing zeros",
+               strerror(errno));
+        img->zeroout_ok = 0;
+    }
+
+    if (!img->zeros) {
+        if (posix_memalign((void **)&img->zeros, IMAGE_ALIGN,
+                           FOTA_IMAGE_WRITE_SIZE) != 0)
+            return -1;
+        memset(img->zeros, 0, FOTA_IMAGE_WRITE_SIZE);
+    }
+
+    while (len > 0) {
+        size_t n = len < FOTA_IMAGE_WRITE_SIZE ? len : FOTA_IMAGE_WRITE_SIZE;
+        if (write_all(img, img->zeros, n, offset) < 0)
+            return -1;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int emit_run(struct fota_image *img, enum block_class cls,
+                    size_t start, size_t end)
+{
+    uint64_t offset = img->buf_offset + start;
+    size_t len = end - start;
+
+    switch (cls) {
+    case BLOCK_DATA:
+        img->stats.written_bytes += len;
+        if (img->direct && !(len % SECTOR_SIZE))
+            return fota_aio_write(img->aio, img->buf + start, len, offset);
+        return write_all(img, img->buf + start, len, offset);
+    case BLOCK_ZERO:
+        img->stats.zeroed_bytes += len;
+        return zero_range(img, offset, len);
+    case BLOCK_VERIFIED:
+        img->stats.verified_bytes += len;
+        return 0;
+    case BLOCK_SKIP:
+    default:
+        img->stats.skipped_bytes += len;
+        return 0;
+    }
+}
+
+/* Write out the buffer, coalescing runs of blocks of the same class */
+static int flush_buffer(struct fota_image *img)
+{
+    size_t run_start = 0;
+    enum block_class run_cls = BLOCK_DATA;
+
+    read_back(img);
+
+    for (size_t off = 0; off < img->buf_len; off += FOTA_IMAGE_BLOCK_SIZE) {
+        size_t len = img->buf_len - off;
+        if (len > FOTA_IMAGE_BLOCK_SIZE)
+            len = FOTA_IMAGE_BLOCK_SIZE;
+
+        enum block_class cls = classify(img, img->buf_offset + off,
+                                        img->buf + off, len);
+        if (off == 0) {
+            run_cls = cls;
+        } else if (cls != run_cls) {
+            if (emit_run(img, run_cls, run_start, off) < 0)
+                return -1;
+            run_start = off;
+            run_cls = cls;
+        }
+    }
+
+    if (img->buf_len > run_start &&
+        emit_run(img, run_cls, run_start, img->buf_len) < 0)
+        return -1;
+
+    /* The writes from this buffer may still be in flight, fill another */
+    fota_aio_put(img->aio, img->buf);
+    img->buf = fota_aio_get(img->aio);
+    if (!img->buf)
+        return -1;
+
+    img->buf_offset += img->buf_len;
+    img->buf_len = 0;
+    return 0;
+}
+
+/* ============= Public API ============= */
+
+fota_image_t *fota_image_open(const char *path, uint64_t image_size,
+                              const fota_bmap_t *bmap)
+{
+    struct fota_image *img = calloc(1, sizeof(*img));
+    struct stat st;
+
+    if (!img)
+        return NULL;
+
+    /* Read access for resuming */
+    img->fd = open(path, O_RDWR | O_CREAT | O_DIRECT | O_CLOEXEC, 0644);
+    img->direct = 1;
+    if (img->fd < 0 && errno == EINVAL) {
+        /* tmpfs and some FUSE filesystems do not support O_DIRECT */
+        img->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        img->direct = 0;
+    }
+    if (img->fd < 0) {
+        syslog(LOG_ERR, "image: cannot open %s: %s", path, strerror(errno));
+        free(img);
+        return NULL;
+    }
+
+    fota_writeback_init(&img->wb, img->fd);
+
+    if (fstat(img->fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        img->is_blkdev = 1;
+        if (ioctl(img->fd, BLKGETSIZE64, &img->capacity) < 0)
+            img->capacity = 0;
+    }
+
+    if (image_size && img->capacity && image_size > img->capacity) {
+        syslog(LOG_ERR, "image: %llu bytes do not fit into %s (%llu bytes)",
+               (unsigned long long)image_size, path,
+               (unsigned long long)img->capacity);
+        fota_image_close(img);
+        return NULL;
+    }
+
+    /* Without O_DIRECT writes are buffered anyway, keep them synchronous */
+    img->aio = fota_aio_new(img->fd, img->direct);
+    img->buf = img->aio ? fota_aio_get(img->aio) : NULL;
+    if (!img->buf) {
+        fota_image_close(img);
+        return NULL;
+    }
+    img->block = fota_aio_block_size(img->aio);
+
+    img->bmap = (bmap && bmap->nranges && bmap->block_size) ? bmap : NULL;
+    img->zeroout_ok = 1;
+
+    return img;
+}
+
+int fota_image_write(fota_image_t *img, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    if (img->capacity &&
+        img->stats.image_bytes + len > img->capacity) {
+        syslog(LOG_ERR, "image: larger than target device");
+        return -1;
+    }
+    img->stats.image_bytes += len;
+
+    while (len > 0) {
+        size_t n = img->block - img->buf_len;
+        if (n > len)
+            n = len;
+
+        memcpy(img->buf + img->buf_len, p, n);
+        img->buf_len += n;
+        p += n;
+        len -= n;
+
+        if (img->buf_len == img->block && flush_buffer(img) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+void fota_image_resume(fota_image_t *img, uint64_t offset)
+{
+    if (!img->check &&
+        posix_memalign((void **)&img->check, IMAGE_ALIGN, img->block) != 0) {
+        img->check = NULL;
+        return;
+    }
+    img->resume_offset = offset;
+}
+
+int fota_image_sync(fota_image_t *img, uint64_t *offset)
+{
+    if (fota_aio_drain(img->aio) < 0)
+        return -1;
+    if (fdatasync(img->fd) < 0) {
+        syslog(LOG_ERR, "image: fdatasync failed: %s", strerror(errno));
+        return -1;
+    }
+    *offset = img->buf_offset;
+    return 0;
+}
+
+int fota_image_drain(fota_image_t *img)
+{
+    return fota_aio_drain(img->aio);
+}
+
+int fota_image_finish(fota_image_t *img)
+{
+    if (img->buf_len > 0 && flush_buffer(img) < 0)
+        return -1;
+    if (fota_aio_drain(img->aio) < 0)
+        return -1;
+
+    /* Holes at the end of a regular file still count towards its size */
+    if (!img->is_blkdev) {
+        struct stat st;
+        if (fstat(img->fd, &st) == 0 &&
+            (uint64_t)st.st_size < img->stats.image_bytes &&
+            ftruncate(img->fd, img->stats.image_bytes) < 0)
+            return -1;
+    }
+
+    if (fsync(img->fd) < 0) {
+        syslog(LOG_ERR, "image: fsync failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void fota_image_get_stats(const fota_image_t *img, fota_image_stats_t *stats)
+{
+    *stats = img->stats;
+}
+
+void fota_image_close(fota_image_t *img)
+{
+    if (!img)
+        return;
+
+    fota_aio_free(img->aio);
+    close(img->fd);
+    free(img->zeros);
+    free(img->check);
+    free(img);
+}
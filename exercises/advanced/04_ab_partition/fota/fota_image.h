@@ -0,0 +1,95 @@
+/*
+ * fota_image.h - Raw block image writer for the FOTA client
+ *
+ * Writes a filesystem image straight to a block device (or a file)
+ * with large, aligned O_DIRECT writes instead of formatting the
+ * partition and extracting a tarball file by file.
+ *
+ * Blocks that carry no data are not transferred to the device:
+ *   - With a block map (bmap), blocks outside the mapped ranges are
+ *     skipped outright, exactly like bmaptool does.
+ *   - Without a block map, all-zero blocks are detected and zeroed
+ *     with BLKZEROOUT (or a punched hole for regular files), so the
+ *     device can use WRITE ZEROES/discard instead of data transfers.
+ *
+ * Data is written from a pool of buffers with several writes in
+ * flight (queue depth and buffer size from fota_aio_set_queue(), engine
+ * from fota_aio_select()).
+ *
+ * An interrupted write can be resumed: up to the offset the previous
+ * attempt flushed (see fota_image_sync()), each buffer is read back
+ * from the target first and only blocks that differ are written.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_IMAGE_H_
+#define _FOTA_IMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FOTA_IMAGE_BLOCK_SIZE   4096
+#define FOTA_IMAGE_WRITE_SIZE   (1024 * 1024)   /* Bytes per zero-fill write */
+
+/* Inclusive range of mapped blocks */
+typedef struct {
+    uint64_t first;
+    uint64_t last;
+} fota_range_t;
+
+/* bmap-style block map, ranges sorted and non-overlapping */
+typedef struct {
+    uint32_t block_size;
+    size_t nranges;
+    fota_range_t *ranges;
+} fota_bmap_t;
+
+typedef struct {
+    uint64_t image_bytes;       /* Image bytes received */
+    uint64_t written_bytes;     /* Bytes written with data */
+    uint64_t zeroed_bytes;      /* Zero blocks cleared without a data write */
+    uint64_t skipped_bytes;     /* Unmapped blocks left untouched */
+    uint64_t verified_bytes;    /* Already on the target, not rewritten */
+} fota_image_stats_t;
+
+typedef struct fota_image fota_image_t;
+
+/*
+ * Open the target for writing. image_size (0 if unknown) is checked
+ * against the target capacity, bmap may be NULL.
+ */
+fota_image_t *fota_image_open(const char *path, uint64_t image_size,
+                              const fota_bmap_t *bmap);
+
+/* Feed the next piece of the image, returns 0 or -1 */
+int fota_image_write(fota_image_t *img, const void *buf, size_t len);
+
+/*
+ * The first offset bytes of the image were flushed by an earlier
+ * attempt. They are compared with the target, not trusted blindly.
+ * Call before the first write.
+ */
+void fota_image_resume(fota_image_t *img, uint64_t offset);
+
+/*
+ * Flush what has been written so far to stable storage. *offset is set
+ * to the number of image bytes now durable on the target (the buffered
+ * tail is not included). Returns 0 or -1.
+ */
+int fota_image_sync(fota_image_t *img, uint64_t *offset);
+
+/*
+ * Wait for the writes in flight, without writing the buffered tail.
+ * Returns 0, or -1 if one of them failed.
+ */
+int fota_image_drain(fota_image_t *img);
+
+/* Write the tail and flush the target, returns 0 or -1 */
+int fota_image_finish(fota_image_t *img);
+
+void fota_image_get_stats(const fota_image_t *img, fota_image_stats_t *stats);
+
+void fota_image_close(fota_image_t *img);
+
+#endif /* _FOTA_IMAGE_H_ */
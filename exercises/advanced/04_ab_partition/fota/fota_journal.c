@@ -0,0 +1,151 @@
+/*
+ * fota_journal.c - Crash-consistent journal of an update being applied
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <json-c/json.h>
+
+#include "fota_journal.h"
+#include "fota_resume.h"
+
+static const char *const step_names[] = {
+    [FOTA_STEP_NONE] = "none",
+    [FOTA_STEP_DOWNLOADED] = "downloaded",
+    [FOTA_STEP_VERIFIED] = "verified",
+    [FOTA_STEP_BOOT_WRITTEN] = "boot_written",
+    [FOTA_STEP_ROOTFS_WRITTEN] = "rootfs_written",
+    [FOTA_STEP_ENV_SWITCHED] = "env_switched",
+};
+
+#define NSTEPS (sizeof(step_names) / sizeof(step_names[0]))
+
+static void read_boot_id(char *buf, size_t len)
+{
+    FILE *fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+    buf[0] = '\0';
+    if (fp) {
+        if (fgets(buf, len, fp))
+            buf[strcspn(buf, "\n")] = '\0';
+        fclose(fp);
+    }
+}
+
+const char *fota_step_name(fota_step_t step)
+{
+    return (unsigned int)step < NSTEPS ? step_names[step] : "unknown";
+}
+
+static void copy_string(struct json_object *root, const char *key,
+                        char *dst, size_t len)
+{
+    struct json_object *obj;
+
+    if (json_object_object_get_ex(root, key, &obj))
+        snprintf(dst, len, "%s", json_object_get_string(obj));
+}
+
+int fota_journal_load(const char *path, fota_journal_t *j)
+{
+    struct json_object *root, *obj;
+    char slot[2] = "";
+    char step[32] = "";
+    int ret = -1;
+
+    memset(j, 0, sizeof(*j));
+
+    root = json_object_from_file(path);
+    if (!root)
+        return -1;
+
+    copy_string(root, "version", j->version, sizeof(j->version));
+    copy_string(root, "slot", slot, sizeof(slot));
+    copy_string(root, "boot_sha256", j->boot_sha256, sizeof(j->boot_sha256));
+    copy_string(root, "rootfs_sha256", j->rootfs_sha256, sizeof(j->rootfs_sha256));
+    copy_string(root, "step", step, sizeof(step));
+    copy_string(root, "boot_id", j->boot_id, sizeof(j->boot_id));
+    copy_string(root, "verity_root", j->verity_root, sizeof(j->verity_root));
+    if (json_object_object_get_ex(root, "rootfs_offset", &obj))
+        j->rootfs_offset = json_object_get_int64(obj);
+    j->slot = slot[0];
+
+    for (size_t i = 0; i < NSTEPS; i++) {
+        if (strcmp(step, step_names[i]) == 0) {
+            j->step = i;
+            ret = 0;
+        }
+    }
+    if (ret < 0 || (j->slot != 'a' && j->slot != 'b')) {
+        syslog(LOG_WARNING, "Ignoring unusable update journal %s", path);
+        ret = -1;
+    }
+
+    json_object_put(root);
+    return ret;
+}
+
+int fota_journal_save(const char *path, fota_journal_t *j)
+{
+    char slot[2] = { j->slot, '\0' };
+
+    read_boot_id(j->boot_id, sizeof(j->boot_id));
+
+    struct json_object *root = json_object_new_object();
+    json_object_object_add(root, "version", json_object_new_string(j->version));
+    json_object_object_add(root, "slot", json_object_new_string(slot));
+    json_object_object_add(root, "boot_sha256", json_object_new_string(j->boot_sha256));
+    json_object_object_add(root, "rootfs_sha256", json_object_new_string(j->rootfs_sha256));
+    json_object_object_add(root, "step", json_object_new_string(fota_step_name(j->step)));
+    json_object_object_add(root, "rootfs_offset", json_object_new_int64(j->rootfs_offset));
+    json_object_object_add(root, "boot_id", json_object_new_string(j->boot_id));
+    if (j->verity_root[0])
+        json_object_object_add(root, "verity_root",
+                               json_object_new_string(j->verity_root));
+
+    int ret = fota_record_save(path, root);
+    json_object_put(root);
+
+    if (ret < 0)
+        syslog(LOG_ERR, "Cannot write update journal %s", path);
+    return ret;
+}
+
+int fota_journal_this_boot(const fota_journal_t *j)
+{
+    char boot_id[sizeof(j->boot_id)];
+
+    read_boot_id(boot_id, sizeof(boot_id));
+    return boot_id[0] && strcmp(boot_id, j->boot_id) == 0;
+}
+
+void fota_journal_clear(const char *path)
+{
+    unlink(path);
+}
+
+#ifdef FOTA_FAULT_INJECTION
+void fota_journal_fault(const char *point)
+{
+    static int hits;
+    const char *fault = getenv("FOTA_FAULT");
+    size_t len = strlen(point);
+
+    if (!fault || strncmp(fault, point, len) != 0 ||
+        (fault[len] != '\0' && fault[len] != ':'))
+        return;
+
+    int nth = fault[len] == ':' ? atoi(fault + len + 1) : 1;
+    if (++hits < nth)
+        return;
+
+    syslog(LOG_WARNING, "Fault injected at %s (hit %d)", point, hits);
+    kill(getpid(), SIGKILL);
+}
+#endif
@@ -0,0 +1,82 @@
+/*
+ * fota_journal.h - Crash-consistent journal of an update being applied
+ *
+ * Applying an update is a sequence of steps, each made durable before
+ * the next one starts:
+ *
+ *   none -> downloaded -> verified -> boot written -> rootfs written
+ *        -> env switched
+ *
+ * (streaming mode has no separate download and verify steps). Work may
+ * run ahead of the journal, e.g. the boot partition is flashed while the
+ * rootfs still downloads, but steps are recorded in this order. The
+ * journal records the last completed step for one update, identified
+ * by version, target slot and artifact digests. When the same update
+ * is offered again after a power cut, completed steps are skipped.
+ * The boot it was saved in tells a slot switch that still waits for
+ * its reboot from one that has been booted.
+ *
+ * While a raw rootfs image is being written, the journal also records
+ * how many image bytes are on the device and flushed (rootfs_offset).
+ * The next attempt reads that range back and compares it with the
+ * regenerated image instead of writing it again, see fota_image.h.
+ * Once a dm-verity hash tree is built for the image, its root hash is
+ * recorded too: the tree is checked against it at the slot switch.
+ *
+ * Fault injection: built with -DFOTA_FAULT_INJECTION, the process
+ * kills itself with SIGKILL at the fault point named by the FOTA_FAULT
+ * environment variable, "point" or "point:n" for the nth hit. Points
+ * are the step names, "checkpoint" (rootfs_offset recorded) and
+ * "extract" (each buffer of tar archive data extracted).
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_JOURNAL_H_
+#define _FOTA_JOURNAL_H_
+
+#include <stdint.h>
+
+/* Image bytes between two rootfs_offset checkpoints */
+#define FOTA_JOURNAL_CHECKPOINT (32 * 1024 * 1024)
+
+typedef enum {
+    FOTA_STEP_NONE,
+    FOTA_STEP_DOWNLOADED,
+    FOTA_STEP_VERIFIED,
+    FOTA_STEP_BOOT_WRITTEN,
+    FOTA_STEP_ROOTFS_WRITTEN,
+    FOTA_STEP_ENV_SWITCHED,
+} fota_step_t;
+
+typedef struct {
+    char version[32];
+    char slot;                  /* Slot being written */
+    char boot_sha256[65];
+    char rootfs_sha256[65];
+    fota_step_t step;           /* Last completed step */
+    uint64_t rootfs_offset;     /* Image bytes written and flushed */
+    char verity_root[65];       /* Root hash of the tree built, see fota_verity.h */
+    char boot_id[40];           /* Boot the journal was last saved in */
+} fota_journal_t;
+
+/* Read the journal, returns 0 or -1 if there is none or it is unusable */
+int fota_journal_load(const char *path, fota_journal_t *j);
+
+/* Atomically replace the journal (boot_id is filled in), returns 0 or -1 */
+int fota_journal_save(const char *path, fota_journal_t *j);
+
+/* Was the journal saved during the current boot? */
+int fota_journal_this_boot(const fota_journal_t *j);
+
+void fota_journal_clear(const char *path);
+
+const char *fota_step_name(fota_step_t step);
+
+#ifdef FOTA_FAULT_INJECTION
+void fota_journal_fault(const char *point);
+#else
+#define fota_journal_fault(point) do { } while (0)
+#endif
+
+#endif /* _FOTA_JOURNAL_H_ */
@@ -0,0 +1,192 @@
+/*
+ * fota_metrics.c - Timeline of an update attempt
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <json-c/json.h>
+
+#include "fota_metrics.h"
+#include "fota_resume.h"
+#include "fota_stream.h"
+
+static struct {
+    pthread_mutex_t lock;
+    double start;               /* fota_now() at the start */
+    time_t started;             /* The same on the wall clock */
+    fota_metric_t stages[FOTA_METRICS_MAX_STAGES];
+    int nstages;
+    int dropped;
+    struct {
+        char key[32];
+        char value[64];
+    } attrs[FOTA_METRICS_MAX_ATTRS];
+    int nattrs;
+} timeline = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Milliseconds since the start of the timeline */
+static int64_t ms(double t)
+{
+    return t > timeline.start ? (int64_t)((t - timeline.start) * 1000 + 0.5) : 0;
+}
+
+static int64_t ms_of(double s)
+{
+    return (int64_t)(s * 1000 + 0.5);
+}
+
+void fota_metrics_begin(void)
+{
+    pthread_mutex_lock(&timeline.lock);
+    timeline.start = fota_now();
+    timeline.started = time(NULL);
+    timeline.nstages = 0;
+    timeline.dropped = 0;
+    timeline.nattrs = 0;
+    pthread_mutex_unlock(&timeline.lock);
+}
+
+void fota_metrics_set(const char *key, const char *value)
+{
+    int i;
+
+    pthread_mutex_lock(&timeline.lock);
+    for (i = 0; i < timeline.nattrs; i++)
+        if (strcmp(timeline.attrs[i].key, key) == 0)
+            break;
+    if (i < FOTA_METRICS_MAX_ATTRS) {
+        snprintf(timeline.attrs[i].key, sizeof(timeline.attrs[i].key), "%s", key);
+        snprintf(timeline.attrs[i].value, sizeof(timeline.attrs[i].value),
+                 "%s", value);
+        if (i == timeline.nattrs)
+            timeline.nattrs++;
+    }
+    pthread_mutex_unlock(&timeline.lock);
+}
+
+void fota_metrics_add(const fota_metric_t *m)
+{
+    pthread_mutex_lock(&timeline.lock);
+    if (timeline.nstages < FOTA_METRICS_MAX_STAGES)
+        timeline.stages[timeline.nstages++] = *m;
+    else
+        timeline.dropped++;
+    pthread_mutex_unlock(&timeline.lock);
+}
+
+static int by_start(const void *a, const void *b)
+{
+    const fota_metric_t *x = a, *y = b;
+
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+static struct json_object *stage_json(const fota_metric_t *m)
+{
+    struct json_object *obj = json_object_new_object();
+    double seconds = m->end - m->start;
+
+    json_object_object_add(obj, "stage", json_object_new_string(m->stage));
+    if (m->artifact)
+        json_object_object_add(obj, "artifact", json_object_new_string(m->artifact));
+    json_object_object_add(obj, "start_ms", json_object_new_int64(ms(m->start)));
+    json_object_object_add(obj, "end_ms", json_object_new_int64(ms(m->end)));
+
+    if (m->bytes) {
+        json_object_object_add(obj, "bytes", json_object_new_int64(m->bytes));
+        if (seconds > 0)
+            json_object_object_add(obj, "kib_s",
+                                   json_object_new_int64(m->bytes / 1024.0 / seconds));
+    }
+
+    if (m->download_s || m->hash_s || m->write_s) {
+        json_object_object_add(obj, "download_ms",
+                               json_object_new_int64(ms_of(m->download_s)));
+        json_object_object_add(obj, "hash_ms", json_object_new_int64(ms_of(m->hash_s)));
+        json_object_object_add(obj, "write_ms",
+                               json_object_new_int64(ms_of(m->write_s)));
+    }
+
+    json_object_object_add(obj, "ok", json_object_new_boolean(m->ok));
+    return obj;
+}
+
+int fota_metrics_save(const char *path)
+{
+    fota_metric_t stages[FOTA_METRICS_MAX_STAGES];
+    struct json_object *root = json_object_new_object();
+    struct json_object *arr = json_object_new_array();
+
+    pthread_mutex_lock(&timeline.lock);
+    int n = timeline.nstages;
+    memcpy(stages, timeline.stages, n * sizeof(stages[0]));
+
+    json_object_object_add(root, "started", json_object_new_int64(timeline.started));
+    json_object_object_add(root, "total_ms", json_object_new_int64(ms(fota_now())));
+    for (int i = 0; i < timeline.nattrs; i++)
+        json_object_object_add(root, timeline.attrs[i].key,
+                               json_object_new_string(timeline.attrs[i].value));
+    if (timeline.dropped)
+        json_object_object_add(root, "dropped_stages",
+                               json_object_new_int(timeline.dropped));
+
+    /* Stages are added as they end, jobs running in the background last */
+    qsort(stages, n, sizeof(stages[0]), by_start);
+    for (int i = 0; i < n; i++)
+        json_object_array_add(arr, stage_json(&stages[i]));
+    pthread_mutex_unlock(&timeline.lock);
+
+    json_object_object_add(root, "stages", arr);
+
+    int ret = fota_record_save(path, root);
+    json_object_put(root);
+
+    if (ret < 0)
+        syslog(LOG_WARNING, "Cannot write update timeline %s", path);
+    return ret;
+}
+
+char *fota_metrics_unreported(const char *path, size_t max)
+{
+    struct json_object *root, *obj;
+    char *line = NULL;
+
+    if (access(path, F_OK) != 0)
+        return NULL;
+
+    root = json_object_from_file(path);
+    if (!root)
+        return NULL;
+
+    if (!json_object_object_get_ex(root, "reported", &obj) ||
+        !json_object_get_boolean(obj)) {
+        const char *json = json_object_to_json_string_ext(root, JSON_C_TO_STRING_PLAIN);
+
+        if (strlen(json) <= max)
+            line = strdup(json);
+        else
+            syslog(LOG_WARNING, "Update timeline %s too large to report", path);
+    }
+
+    json_object_put(root);
+    return line;
+}
+
+void fota_metrics_reported(const char *path)
+{
+    struct json_object *root = json_object_from_file(path);
+
+    if (!root)
+        return;
+
+    json_object_object_add(root, "reported", json_object_new_boolean(1));
+    fota_record_save(path, root);
+    json_object_put(root);
+}
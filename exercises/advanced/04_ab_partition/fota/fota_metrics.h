@@ -0,0 +1,80 @@
+/*
+ * fota_metrics.h - Timeline of an update attempt
+ *
+ * Shows where an update spends its time. Each stage of an attempt is
+ * recorded: the check, the download of each artifact, mkfs, mount,
+ * extraction, sync, image writes and the slot switch. A stage has a
+ * start and an end on the monotonic clock, relative to the start of the
+ * attempt, the bytes it moved and their throughput. Transfers also
+ * carry how much of their time went to the network, hashing and
+ * writing, which run overlapped.
+ *
+ * A timeline starts with every check but is only saved for attempts
+ * that got past it, so hourly "no update" checks do not write to
+ * flash. It is saved as JSON in /data/fota, which is shared by both
+ * slots, once the slot is switched or the attempt failed. A power cut
+ * in between loses it. The next check can send the unreported timeline
+ * to the server, which can then aggregate update performance across
+ * the fleet:
+ *
+ *   { "started": 1792113333, "total_ms": 9120, "result": "switched",
+ *     "from_version": "1.0", "to_version": "2.0", "mode": "staged",
+ *     "stages": [
+ *       { "stage": "check", "start_ms": 0, "end_ms": 41, "bytes": 312,
+ *         "kib_s": 7, "ok": true },
+ *       { "stage": "download", "artifact": "rootfs", "start_ms": 44,
+ *         "end_ms": 8012, "bytes": 104857600, "kib_s": 12851,
+ *         "download_ms": 7310, "hash_ms": 402, "write_ms": 255,
+ *         "ok": true }, ... ] }
+ *
+ * Stages may be recorded from any thread.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_METRICS_H_
+#define _FOTA_METRICS_H_
+
+#include <stdint.h>
+
+/* Stages and attributes kept per attempt, more are dropped */
+#define FOTA_METRICS_MAX_STAGES 32
+#define FOTA_METRICS_MAX_ATTRS 8
+
+typedef struct {
+    const char *stage;          /* "check", "download", "mkfs", ... */
+    const char *artifact;       /* "boot", "rootfs" or NULL */
+    double start;               /* fota_now() */
+    double end;
+    uint64_t bytes;             /* Payload moved, 0 if none */
+    double download_s;          /* Breakdown of a transfer, 0 if none */
+    double hash_s;
+    double write_s;
+    int ok;
+} fota_metric_t;
+
+/* Start a new timeline, at the time of the call */
+void fota_metrics_begin(void);
+
+/* Attribute of the attempt, e.g. ("to_version", "2.0"), copied */
+void fota_metrics_set(const char *key, const char *value);
+
+/* Record a stage, the strings must be static */
+void fota_metrics_add(const fota_metric_t *m);
+
+/*
+ * Atomically write the timeline to path, stages ordered by start.
+ * Returns 0 or -1.
+ */
+int fota_metrics_save(const char *path);
+
+/*
+ * Saved timeline not sent to the server yet, as one line of JSON of at
+ * most max bytes (malloc'ed). NULL if there is none.
+ */
+char *fota_metrics_unreported(const char *path, size_t max);
+
+/* Mark the saved timeline as sent */
+void fota_metrics_reported(const char *path);
+
+#endif /* _FOTA_METRICS_H_ */
@@ -0,0 +1,211 @@
+/*
+ * fota_mkchunks.c - Build-host generator for chunked rootfs updates
+ *
+ * Splits a root image into content-defined chunks (see fota_chunk.h),
+ * adds the chunks that are not there yet to a chunk store directory
+ * and writes the chunk index for the manifest:
+ *
+ *   store/<first 4 hex digits>/<sha256 hex>   one file per chunk
+ *
+ * The store is meant to be shared by all releases and published as is
+ * (rootfs_chunk_url), so every release only adds its new chunks.
+ * Finally a manifest snippet with sizes and digests is printed.
+ *
+ * Build: make mkchunks  (host tool, needs zlib and OpenSSL)
+ * Usage: fota_mkchunks [-z] [-s min:avg:max] <rootfs.img> <store> <out.cidx>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "fota_chunk.h"
+#include "fota_stream.h"
+
+static int gzip;
+static uint64_t stat_new, stat_new_bytes, stat_stored_bytes;
+
+/* Add a chunk to the store unless an earlier release already did */
+static int store_chunk(const char *store, const fota_chunk_t *c,
+                       const unsigned char *data)
+{
+    char hex[65], dir[PATH_MAX], path[PATH_MAX + 72], tmp[PATH_MAX + 80];
+    struct stat st;
+
+    fota_sha256_hex(c->id, hex);
+    snprintf(dir, sizeof(dir), "%s/%.4s", store, hex);
+    snprintf(path, sizeof(path), "%s/%s", dir, hex);
+    if (stat(path, &st) == 0)
+        return 0;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    gzFile out = gzopen(tmp, gzip ? "wb6" : "wbT");
+    if (!out || gzwrite(out, data, c->size) != (int)c->size) {
+        perror(tmp);
+        return -1;
+    }
+    if (gzclose(out) != Z_OK || rename(tmp, path) < 0 || stat(path, &st) < 0) {
+        perror(path);
+        return -1;
+    }
+
+    stat_new++;
+    stat_new_bytes += c->size;
+    stat_stored_bytes += st.st_size;
+    return 0;
+}
+
+static int add_chunk(fota_chunk_index_t *idx, size_t *alloc, const char *store,
+                     const unsigned char *data, uint32_t size)
+{
+    if (idx->count == *alloc) {
+        size_t n = *alloc ? *alloc * 2 : 1024;
+        fota_chunk_t *chunks = realloc(idx->chunks, n * sizeof(*chunks));
+        if (!chunks)
+            return -1;
+        idx->chunks = chunks;
+        *alloc = n;
+    }
+
+    fota_chunk_t *c = &idx->chunks[idx->count++];
+    fota_sha256(data, size, c->id);
+    c->size = size;
+    c->offset = idx->image_size;
+    idx->image_size += size;
+
+    return store_chunk(store, c, data);
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-z] [-s min:avg:max] <rootfs.img> <store> "
+            "<out.cidx>\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+    fota_chunk_index_t idx = {
+        .min_size = FOTA_CHUNK_MIN_SIZE,
+        .avg_size = FOTA_CHUNK_AVG_SIZE,
+        .max_size = FOTA_CHUNK_MAX_SIZE,
+    };
+    fota_chunker_t chunker;
+    const unsigned char *image;
+    unsigned char hash[FOTA_SHA256_DIGEST_LENGTH];
+    char image_hash[65], index_hash[65];
+    size_t alloc = 0;
+    struct stat st;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "zs:")) != -1) {
+        if (opt == 'z') {
+            gzip = 1;
+        } else if (opt == 's' &&
+                   sscanf(optarg, "%u:%u:%u", &idx.min_size, &idx.avg_size,
+                          &idx.max_size) == 3) {
+            continue;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 3 || idx.min_size <= 64 ||
+        idx.min_size > idx.avg_size || idx.avg_size > idx.max_size ||
+        idx.max_size > FOTA_CHUNK_LIMIT) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *store = argv[optind + 1];
+    const char *out_path = argv[optind + 2];
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    image = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                       : NULL;
+    close(fd);
+    if (image == MAP_FAILED) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    if (mkdir(store, 0755) < 0 && errno != EEXIST) {
+        perror(store);
+        return 1;
+    }
+
+    fota_chunker_init(&chunker, idx.min_size, idx.avg_size, idx.max_size);
+
+    size_t start = 0;
+    while (start < (size_t)st.st_size) {
+        size_t n = fota_chunker_next(&chunker, image + start, st.st_size - start);
+        if (n == 0)
+            n = st.st_size - start;
+        if (add_chunk(&idx, &alloc, store, image + start, n) < 0)
+            return 1;
+        start += n;
+    }
+
+    if (fota_chunk_index_save(out_path, &idx) < 0) {
+        fprintf(stderr, "%s: cannot write index\n", out_path);
+        return 1;
+    }
+
+    fota_sha256(image, st.st_size, hash);
+    fota_sha256_hex(hash, image_hash);
+
+    /* Digest of the index file as the client downloads it */
+    size_t index_size = FOTA_CHUNK_HEADER_SIZE + idx.count * FOTA_CHUNK_ENTRY_SIZE;
+    unsigned char *index = malloc(index_size);
+    FILE *fp = fopen(out_path, "r");
+    if (!index || !fp || fread(index, 1, index_size, fp) != index_size) {
+        perror(out_path);
+        return 1;
+    }
+    fclose(fp);
+    fota_sha256(index, index_size, hash);
+    fota_sha256_hex(hash, index_hash);
+
+    if (fota_chunk_index_sort(&idx) < 0)
+        return 1;
+    size_t unique = 0;
+    for (size_t i = 0; i < idx.count; i++)
+        if (i == 0 || memcmp(idx.by_id[i]->id, idx.by_id[i - 1]->id, 32) != 0)
+            unique++;
+
+    fprintf(stderr, "image  %zu bytes: %zu chunks, %zu distinct, avg %zu bytes\n",
+            (size_t)st.st_size, idx.count, unique,
+            idx.count ? (size_t)st.st_size / idx.count : 0);
+    fprintf(stderr, "store  %llu new chunks, %llu bytes (%llu stored)\n",
+            (unsigned long long)stat_new, (unsigned long long)stat_new_bytes,
+            (unsigned long long)stat_stored_bytes);
+
+    /* Manifest snippet */
+    printf("    \"rootfs_type\": \"rootfs_chunked\",\n");
+    printf("    \"rootfs_compression\": \"%s\",\n", gzip ? "gzip" : "none");
+    printf("    \"rootfs_size\": %zu,\n", index_size);
+    printf("    \"rootfs_sha256\": \"%s\",\n", index_hash);
+    printf("    \"rootfs_image_size\": %zu,\n", (size_t)st.st_size);
+    printf("    \"rootfs_image_sha256\": \"%s\"\n", image_hash);
+
+    return 0;
+}
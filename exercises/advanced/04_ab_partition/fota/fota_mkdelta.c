@@ -0,0 +1,398 @@
+/*
+ * fota_mkdelta.c - Build-host generator for FOTA block deltas
+ *
+ * Compares a new root image (target) with the image currently installed
+ * on the devices (source) and writes a delta in the format described in
+ * fota_delta.h:
+ *
+ *   - The source is indexed by aligned blocks with an rsync-style weak
+ *     rolling checksum.
+ *   - The target is scanned at every byte offset; a window whose weak
+ *     checksum hits the index and whose contents are identical becomes
+ *     a copy from the source, so data that merely moved is found too.
+ *   - All-zero target blocks become zero ops, everything else literals.
+ *
+ * Finally a manifest snippet with sizes and digests is printed. It
+ * includes the size and digest of the source, which the client checks
+ * against its active slot before it downloads the delta.
+ *
+ * Build: make mkdelta  (host tool, needs zlib and OpenSSL)
+ * Usage: fota_mkdelta [-b block_size] <source.img> <target.img> <out.delta[.gz]>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <openssl/sha.h>
+
+#include "fota_delta.h"
+
+#define DEFAULT_BLOCK_SIZE  4096
+#define MAX_LITERAL         (16 * 1024 * 1024)
+#define MAX_RUN             (1024 * 1024 * 1024)
+#define MAX_CHAIN           64      /* Candidates checked per weak hit */
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+} mapped_file_t;
+
+/* Source block index: weak checksum hash table with chaining */
+typedef struct {
+    uint32_t *weak;
+    int64_t *head;
+    int64_t *next;
+    unsigned int bits;
+} block_index_t;
+
+/* Op being accumulated, flushed when the next op cannot extend it */
+typedef struct {
+    char kind;                  /* 0, COPY, DATA or ZERO */
+    uint64_t src;               /* COPY: source offset, DATA: target offset */
+    uint64_t len;
+} pending_op_t;
+
+static gzFile out;
+static size_t block_size = DEFAULT_BLOCK_SIZE;
+static uint64_t stat_copy, stat_literal, stat_zero;
+
+/* ============= Helpers ============= */
+
+static int map_file(const char *path, mapped_file_t *m)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return -1;
+    }
+
+    m->size = st.st_size;
+    m->data = m->size ? mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0)
+                      : NULL;
+    close(fd);
+
+    if (m->size && m->data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    if (m->size)
+        madvise((void *)m->data, m->size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+/* rsync weak checksum of one window */
+static uint32_t weak_sum(const unsigned char *p, size_t len, uint32_t *a_out,
+                         uint32_t *b_out)
+{
+    uint32_t a = 0, b = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        a += p[i];
+        b += (len - i) * p[i];
+    }
+    *a_out = a & 0xffff;
+    *b_out = b & 0xffff;
+    return *a_out | (*b_out << 16);
+}
+
+static unsigned int bucket(const block_index_t *idx, uint32_t weak)
+{
+    return (weak * 2654435761u) >> (32 - idx->bits);
+}
+
+static int is_zero(const unsigned char *p, size_t len)
+{
+    return p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> (8 * i);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+static void out_write(const void *buf, size_t len)
+{
+    if (len && gzwrite(out, buf, len) != (int)len) {
+        fprintf(stderr, "write failed\n");
+        exit(1);
+    }
+}
+
+/* ============= Op encoding ============= */
+
+static void flush_op(pending_op_t *op, const mapped_file_t *target)
+{
+    unsigned char hdr[13];
+
+    switch (op->kind) {
+    case FOTA_DELTA_OP_COPY:
+        hdr[0] = FOTA_DELTA_OP_COPY;
+        put_le64(hdr + 1, op->src);
+        put_le32(hdr + 9, op->len);
+        out_write(hdr, 13);
+        stat_copy += op->len;
+        break;
+    case FOTA_DELTA_OP_ZERO:
+        hdr[0] = FOTA_DELTA_OP_ZERO;
+        put_le32(hdr + 1, op->len);
+        out_write(hdr, 5);
+        stat_zero += op->len;
+        break;
+    case FOTA_DELTA_OP_DATA:
+        hdr[0] = FOTA_DELTA_OP_DATA;
+        put_le32(hdr + 1, op->len);
+        out_write(hdr, 5);
+        out_write(target->data + op->src, op->len);
+        stat_literal += op->len;
+        break;
+    default:
+        break;
+    }
+    op->kind = 0;
+    op->len = 0;
+}
+
+/* Append len bytes of kind to the op stream, merging where possible */
+static void add_op(pending_op_t *op, const mapped_file_t *target, char kind,
+                   uint64_t src, uint64_t len)
+{
+    uint64_t limit = kind == FOTA_DELTA_OP_DATA ? MAX_LITERAL : MAX_RUN;
+
+    if (op->kind == kind && op->len + len <= limit &&
+        (kind == FOTA_DELTA_OP_ZERO || op->src + op->len == src)) {
+        op->len += len;
+        return;
+    }
+
+    flush_op(op, target);
+    op->kind = kind;
+    op->src = src;
+    op->len = len;
+}
+
+/* ============= Delta generation ============= */
+
+static int build_index(const mapped_file_t *source, block_index_t *idx)
+{
+    size_t nblocks = source->size / block_size;
+    uint32_t a, b;
+
+    idx->bits = 10;
+    while ((1ULL << idx->bits) < nblocks * 2)
+        idx->bits++;
+
+    idx->weak = calloc(nblocks ? nblocks : 1, sizeof(uint32_t));
+    idx->next = calloc(nblocks ? nblocks : 1, sizeof(int64_t));
+    idx->head = malloc((1ULL << idx->bits) * sizeof(int64_t));
+    if (!idx->weak || !idx->next || !idx->head)
+        return -1;
+
+    memset(idx->head, 0xff, (1ULL << idx->bits) * sizeof(int64_t));
+
+    /* Insert in reverse so chains are in ascending block order */
+    for (size_t i = nblocks; i-- > 0;) {
+        const unsigned char *p = source->data + i * block_size;
+
+        /* Zero blocks are encoded as zero ops, not as copies */
+        if (is_zero(p, block_size)) {
+            idx->next[i] = -1;
+            continue;
+        }
+
+        idx->weak[i] = weak_sum(p, block_size, &a, &b);
+        unsigned int h = bucket(idx, idx->weak[i]);
+        idx->next[i] = idx->head[h];
+        idx->head[h] = i;
+    }
+    return 0;
+}
+
+/* Find a source block identical to the target window at p, -1 if none */
+static int64_t find_match(const block_index_t *idx, const mapped_file_t *source,
+                          const unsigned char *p, uint32_t weak)
+{
+    int chain = 0;
+
+    for (int64_t i = idx->head[bucket(idx, weak)]; i >= 0 && chain < MAX_CHAIN;
+         i = idx->next[i], chain++) {
+        if (idx->weak[i] == weak &&
+            memcmp(source->data + i * block_size, p, block_size) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void generate(const mapped_file_t *source, const mapped_file_t *target,
+                     const block_index_t *idx)
+{
+    pending_op_t op = {0};
+    size_t p = 0;
+    uint32_t a = 0, b = 0, weak = 0;
+    int rolling = 0;            /* a/b/weak valid for the window at p */
+
+    while (p + block_size <= target->size) {
+        const unsigned char *w = target->data + p;
+
+        /* Fast path: the copy in progress simply continues */
+        if (op.kind == FOTA_DELTA_OP_COPY) {
+            uint64_t next = op.src + op.len;
+            if (next + block_size <= source->size &&
+                memcmp(source->data + next, w, block_size) == 0) {
+                add_op(&op, target, FOTA_DELTA_OP_COPY, next, block_size);
+                p += block_size;
+                rolling = 0;
+                continue;
+            }
+        }
+
+        if (w[0] == 0 && w[block_size - 1] == 0 && is_zero(w, block_size)) {
+            add_op(&op, target, FOTA_DELTA_OP_ZERO, 0, block_size);
+            p += block_size;
+            rolling = 0;
+            continue;
+        }
+
+        if (!rolling) {
+            weak = weak_sum(w, block_size, &a, &b);
+            rolling = 1;
+        }
+
+        int64_t match = find_match(idx, source, w, weak);
+        if (match >= 0) {
+            add_op(&op, target, FOTA_DELTA_OP_COPY,
+                   (uint64_t)match * block_size, block_size);
+            p += block_size;
+            rolling = 0;
+            continue;
+        }
+
+        /* No match: this byte becomes a literal, roll the window by one */
+        add_op(&op, target, FOTA_DELTA_OP_DATA, p, 1);
+        if (p + block_size < target->size) {
+            unsigned char old = w[0], new = w[block_size];
+            a = (a - old + new) & 0xffff;
+            b = (b - block_size * old + a) & 0xffff;
+            weak = a | (b << 16);
+        }
+        p++;
+    }
+
+    /* Tail shorter than a block */
+    if (p < target->size)
+        add_op(&op, target, FOTA_DELTA_OP_DATA, p, target->size - p);
+
+    flush_op(&op, target);
+}
+
+static void sha256_hex(const unsigned char *data, size_t len, char *hex)
+{
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+
+    SHA256(data, len, hash);
+    fota_sha256_hex(hash, hex);
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-b block_size] <source.img> <target.img> "
+            "<out.delta[.gz]>\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+    mapped_file_t source, target, delta;
+    block_index_t idx;
+    unsigned char hdr[FOTA_DELTA_HEADER_SIZE] = {0};
+    char source_hash[65], target_hash[65], delta_hash[65];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:")) != -1) {
+        if (opt == 'b') {
+            block_size = strtoul(optarg, NULL, 0);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 3 || block_size < 512) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *out_path = argv[optind + 2];
+    size_t len = strlen(out_path);
+    int gzip = len > 3 && strcmp(out_path + len - 3, ".gz") == 0;
+
+    if (map_file(argv[optind], &source) < 0 ||
+        map_file(argv[optind + 1], &target) < 0)
+        return 1;
+
+    if (build_index(&source, &idx) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    out = gzopen(out_path, gzip ? "wb6" : "wbT");
+    if (!out) {
+        perror(out_path);
+        return 1;
+    }
+
+    memcpy(hdr, FOTA_DELTA_MAGIC, 8);
+    put_le32(hdr + 8, block_size);
+    put_le64(hdr + 16, source.size);
+    put_le64(hdr + 24, target.size);
+    out_write(hdr, sizeof(hdr));
+
+    generate(&source, &target, &idx);
+
+    char end = FOTA_DELTA_OP_END;
+    out_write(&end, 1);
+    if (gzclose(out) != Z_OK) {
+        fprintf(stderr, "write failed\n");
+        return 1;
+    }
+
+    if (map_file(out_path, &delta) < 0)
+        return 1;
+
+    sha256_hex(source.data, source.size, source_hash);
+    sha256_hex(target.data, target.size, target_hash);
+    sha256_hex(delta.data, delta.size, delta_hash);
+
+    fprintf(stderr, "target %zu bytes: %llu copied, %llu literal, %llu zero\n",
+            target.size, (unsigned long long)stat_copy,
+            (unsigned long long)stat_literal, (unsigned long long)stat_zero);
+    fprintf(stderr, "delta  %zu bytes (%.1f%% of target)\n", delta.size,
+            target.size ? 100.0 * delta.size / target.size : 0.0);
+
+    /* Manifest snippet */
+    printf("    \"rootfs_type\": \"rootfs_delta\",\n");
+    printf("    \"rootfs_compression\": \"%s\",\n", gzip ? "gzip" : "none");
+    printf("    \"rootfs_size\": %zu,\n", delta.size);
+    printf("    \"rootfs_sha256\": \"%s\",\n", delta_hash);
+    printf("    \"rootfs_source_size\": %zu,\n", source.size);
+    printf("    \"rootfs_source_sha256\": \"%s\",\n", source_hash);
+    printf("    \"rootfs_image_size\": %zu,\n", target.size);
+    printf("    \"rootfs_image_sha256\": \"%s\"\n", target_hash);
+
+    return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * fota_net.c - Shared connection state for all FOTA transfers
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <openssl/ssl.h>
+
+#include "fota_net.h"
+
+static CURLSH *share;
+static CURL *api;
+static const char *ca_path;
+static long rate_limit;
+static int reuse = FOTA_NET_REUSE_ALL;
+static fota_net_stats_t stats;
+static int handshake_idx = -1;
+
+int fota_net_init(void)
+{
+    share = curl_share_init();
+    if (!share)
+        return -1;
+
+    /* Single threaded, no lock callbacks needed */
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+
+    handshake_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    return 0;
+}
+
+void fota_net_cleanup(void)
+{
+    if (api)
+        curl_easy_cleanup(api);
+    api = NULL;
+    if (share)
+        curl_share_cleanup(share);
+    share = NULL;
+}
+
+/*
+ * Count handshakes as OpenSSL completes them. With TLS 1.3 the
+ * callback fires again for every session ticket received afterwards,
+ * so only the first one per connection is counted.
+ */
+static void tls_info_callback(const SSL *ssl, int where, int ret)
+{
+    (void)ret;
+
+    if (!(where & SSL_CB_HANDSHAKE_DONE) ||
+        SSL_get_ex_data(ssl, handshake_idx))
+        return;
+
+    SSL_set_ex_data((SSL *)ssl, handshake_idx, (void *)1);
+    if (SSL_session_reused((SSL *)ssl))
+        stats.tls_resumed++;
+    else
+        stats.tls_full++;
+}
+
+static CURLcode ssl_ctx_callback(CURL *curl, void *ctx, void *parm)
+{
+    (void)curl;
+    (void)parm;
+
+    SSL_CTX_set_info_callback((SSL_CTX *)ctx, tls_info_callback);
+    return CURLE_OK;
+}
+
+void fota_net_setup(CURL *curl)
+{
+    if (reuse >= FOTA_NET_REUSE_SESSION)
+        curl_easy_setopt(curl, CURLOPT_SHARE, share);
+
+    if (reuse < FOTA_NET_REUSE_ALL) {
+        curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+        curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, 1L);
+    }
+    if (reuse == FOTA_NET_REUSE_NONE)
+        curl_easy_setopt(curl, CURLOPT_SSL_SESSIONID_CACHE, 0L);
+
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+    if (ca_path)
+        curl_easy_setopt(curl, CURLOPT_CAINFO, ca_path);
+
+    /* Keep idle connections alive through NAT between requests */
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 300L);
+
+    if (rate_limit > 0)
+        curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)rate_limit);
+
+    /* Only the OpenSSL backend knows this, others just skip the counting */
+    curl_easy_setopt(curl, CURLOPT_SSL_CTX_FUNCTION, ssl_ctx_callback);
+}
+
+CURL *fota_net_handle(void)
+{
+    if (api && reuse == FOTA_NET_REUSE_ALL) {
+        curl_easy_reset(api);
+    } else {
+        if (api)
+            curl_easy_cleanup(api);
+        api = curl_easy_init();
+        if (!api)
+            return NULL;
+    }
+
+    fota_net_setup(api);
+    return api;
+}
+
+void fota_net_set_ca(const char *path)
+{
+    ca_path = path;
+}
+
+void fota_net_set_rate_limit(long bytes_per_s)
+{
+    rate_limit = bytes_per_s;
+}
+
+void fota_net_set_reuse(int level)
+{
+    reuse = level;
+}
+
+void fota_net_account(CURL *curl)
+{
+    long connects = 0;
+    curl_off_t t = 0;
+
+    stats.transfers++;
+
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    if (connects > 0)
+        stats.connects += connects;
+    else
+        stats.reused++;
+
+    /* Time until the TLS handshake (or TCP connect for http) completed */
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &t);
+    if (t == 0)
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &t);
+    stats.connect_s += t / 1e6;
+}
+
+const fota_net_stats_t *fota_net_stats(void)
+{
+    return &stats;
+}
+
+void fota_net_reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+void fota_net_log_stats(const char *what)
+{
+    syslog(LOG_INFO, "%s: %lu transfers, %lu connections, %lu reused, "
+           "TLS %lu full / %lu resumed, %.3fs connecting, "
+           "%lu full handshakes avoided", what, stats.transfers,
+           stats.connects, stats.reused, stats.tls_full, stats.tls_resumed,
+           stats.connect_s, stats.reused + stats.tls_resumed);
+}
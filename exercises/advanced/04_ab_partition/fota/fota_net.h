@@ -0,0 +1,74 @@
+/*
+ * fota_net.h - Shared connection state for all FOTA transfers
+ *
+ * Every curl handle of the client is attached to one share object, so
+ * update checks, downloads and parallel ranges use a common connection
+ * cache, TLS session cache and DNS cache. A connection still open from
+ * the previous transfer is reused without any handshake; once the
+ * server has closed it, the cached TLS session still turns the next
+ * handshake into an abbreviated one (no certificate exchange and
+ * verification, no key exchange signature), which is where most of the
+ * connect CPU time goes on a Cortex-A8.
+ *
+ * Counters record what each transfer cost so the effect is visible in
+ * the log.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_NET_H_
+#define _FOTA_NET_H_
+
+#include <curl/curl.h>
+
+typedef struct {
+    unsigned long transfers;    /* Requests performed */
+    unsigned long connects;     /* New TCP connections */
+    unsigned long reused;       /* Requests on a cached connection */
+    unsigned long tls_full;     /* Full TLS handshakes */
+    unsigned long tls_resumed;  /* Abbreviated handshakes (cached session) */
+    double connect_s;           /* Time spent in TCP connect + TLS */
+} fota_net_stats_t;
+
+/* Create the share object, call after curl_global_init() */
+int fota_net_init(void);
+
+void fota_net_cleanup(void);
+
+/*
+ * Long-lived handle for API requests (update checks)
+ * Options are reset on every call, connections and caches are kept.
+ */
+CURL *fota_net_handle(void);
+
+/*
+ * Attach a handle to the shared caches and set the common transfer
+ * options (redirects, TLS verification, CA bundle, keepalive, rate limit)
+ */
+void fota_net_setup(CURL *curl);
+
+/* CA bundle for TLS verification, NULL: system default */
+void fota_net_set_ca(const char *path);
+
+/* Receive rate limit per transfer in bytes/s, 0: unlimited */
+void fota_net_set_rate_limit(long bytes_per_s);
+
+/* What may be carried over between transfers (benchmarking) */
+#define FOTA_NET_REUSE_NONE     0   /* Every transfer starts from scratch */
+#define FOTA_NET_REUSE_SESSION  1   /* New connections, cached TLS sessions */
+#define FOTA_NET_REUSE_ALL      2   /* Connections and sessions (default) */
+
+void fota_net_set_reuse(int level);
+
+/* Clear the counters */
+void fota_net_reset_stats(void);
+
+/* Account a finished transfer in the counters */
+void fota_net_account(CURL *curl);
+
+const fota_net_stats_t *fota_net_stats(void);
+
+/* Log the counters, with handshakes avoided */
+void fota_net_log_stats(const char *what);
+
+#endif /* _FOTA_NET_H_ */
@@ -0,0 +1,223 @@
+/*
+ * fota_pipe.c - Overlapping network and storage work in the FOTA client
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "fota_pipe.h"
+
+struct pipe_slot {
+    unsigned char *buf;
+    size_t len;
+};
+
+/*
+ * Slots first .. first + count - 1 are queued for the consumer, the
+ * slot after them is being filled by the writer.
+ */
+struct fota_pipe {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    struct pipe_slot slots[FOTA_PIPE_SLOTS];
+    int first;
+    int count;
+    int eof;
+    int failed;                 /* The sink returned an error */
+    double wait_s;
+
+    fota_sink_fn sink;
+    void *opaque;
+    int (*flush)(void *arg);
+    void *flush_arg;
+};
+
+static void *pipe_consumer(void *arg)
+{
+    struct fota_pipe *p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->count == 0 && !p->eof)
+            pthread_cond_wait(&p->not_empty, &p->lock);
+        if (p->count == 0)
+            break;
+
+        struct pipe_slot *slot = &p->slots[p->first];
+        int failed = p->failed;
+        pthread_mutex_unlock(&p->lock);
+
+        /* After a failure the rest is drained, the writer learns of it */
+        if (!failed && p->sink(p->opaque, slot->buf, slot->len) < 0)
+            failed = 1;
+
+        pthread_mutex_lock(&p->lock);
+        p->failed |= failed;
+        slot->len = 0;
+        p->first = (p->first + 1) % FOTA_PIPE_SLOTS;
+        p->count--;
+        pthread_cond_signal(&p->not_full);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    /* Even after a failure, what the sink started must end on this thread */
+    if (p->flush && p->flush(p->flush_arg) < 0) {
+        pthread_mutex_lock(&p->lock);
+        p->failed = 1;
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+/* Queue the slot being filled, called with the lock held */
+static void commit_slot(struct fota_pipe *p)
+{
+    p->count++;
+    pthread_cond_signal(&p->not_empty);
+}
+
+fota_pipe_t *fota_pipe_new(fota_sink_fn sink, void *opaque)
+{
+    struct fota_pipe *p = calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+
+    for (int i = 0; i < FOTA_PIPE_SLOTS; i++) {
+        p->slots[i].buf = malloc(FOTA_PIPE_SLOT_SIZE);
+        if (!p->slots[i].buf)
+            goto fail;
+    }
+
+    p->sink = sink;
+    p->opaque = opaque;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->not_empty, NULL);
+    pthread_cond_init(&p->not_full, NULL);
+
+    if (pthread_create(&p->thread, NULL, pipe_consumer, p) != 0) {
+        syslog(LOG_WARNING, "pipe: cannot start consumer thread");
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->not_empty);
+        pthread_cond_destroy(&p->not_full);
+        goto fail;
+    }
+    return p;
+
+fail:
+    for (int i = 0; i < FOTA_PIPE_SLOTS; i++)
+        free(p->slots[i].buf);
+    free(p);
+    return NULL;
+}
+
+int fota_pipe_write(void *pipe, const void *buf, size_t len)
+{
+    struct fota_pipe *p = pipe;
+    const unsigned char *src = buf;
+    int ret = 0;
+
+    pthread_mutex_lock(&p->lock);
+    while (len > 0 && !p->failed) {
+        if (p->count == FOTA_PIPE_SLOTS) {
+            double t0 = fota_now();
+            while (p->count == FOTA_PIPE_SLOTS && !p->failed)
+                pthread_cond_wait(&p->not_full, &p->lock);
+            p->wait_s += fota_now() - t0;
+            continue;
+        }
+
+        struct pipe_slot *slot = &p->slots[(p->first + p->count) % FOTA_PIPE_SLOTS];
+        size_t n = FOTA_PIPE_SLOT_SIZE - slot->len;
+        if (n > len)
+            n = len;
+
+        /* The consumer never touches the slot being filled */
+        pthread_mutex_unlock(&p->lock);
+        memcpy(slot->buf + slot->len, src, n);
+        pthread_mutex_lock(&p->lock);
+
+        slot->len += n;
+        src += n;
+        len -= n;
+        if (slot->len == FOTA_PIPE_SLOT_SIZE)
+            commit_slot(p);
+    }
+    if (p->failed)
+        ret = -1;
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+void fota_pipe_set_flush(fota_pipe_t *p, int (*flush)(void *arg), void *arg)
+{
+    pthread_mutex_lock(&p->lock);
+    p->flush = flush;
+    p->flush_arg = arg;
+    pthread_mutex_unlock(&p->lock);
+}
+
+int fota_pipe_close(fota_pipe_t *p, double *wait_s)
+{
+    pthread_mutex_lock(&p->lock);
+    if (p->slots[(p->first + p->count) % FOTA_PIPE_SLOTS].len > 0)
+        commit_slot(p);
+    p->eof = 1;
+    pthread_cond_signal(&p->not_empty);
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_join(p->thread, NULL);
+
+    int ret = p->failed ? -1 : 0;
+    if (wait_s)
+        *wait_s = p->wait_s;
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->not_empty);
+    pthread_cond_destroy(&p->not_full);
+    for (int i = 0; i < FOTA_PIPE_SLOTS; i++)
+        free(p->slots[i].buf);
+    free(p);
+    return ret;
+}
+
+/* ============= Background jobs ============= */
+
+static void *job_thread(void *arg)
+{
+    fota_job_t *job = arg;
+
+    job->ret = job->fn(job->arg);
+    return NULL;
+}
+
+void fota_job_start(fota_job_t *job, int (*fn)(void *arg), void *arg)
+{
+    job->fn = fn;
+    job->arg = arg;
+    job->ret = -1;
+    job->running = 0;
+
+    if (pthread_create(&job->thread, NULL, job_thread, job) == 0) {
+        job->running = 1;
+        return;
+    }
+
+    syslog(LOG_WARNING, "job: cannot start thread, running in the foreground");
+    job->ret = fn(arg);
+}
+
+int fota_job_wait(fota_job_t *job)
+{
+    if (job->running) {
+        pthread_join(job->thread, NULL);
+        job->running = 0;
+    }
+    return job->fn ? job->ret : -1;
+}
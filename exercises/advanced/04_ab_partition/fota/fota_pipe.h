@@ -0,0 +1,84 @@
+/*
+ * fota_pipe.h - Overlapping network and storage work in the FOTA client
+ *
+ * Run serially, an update takes the sum of its network and its storage
+ * time: while the body of an artifact is hashed, inflated and written,
+ * nothing is received, and while it is received the storage is idle.
+ * Two helpers let the apply path overlap them:
+ *
+ *   fota_pipe_t  A bounded queue of buffers in front of a sink that runs
+ *                in a thread of its own. The receiving side only copies
+ *                into a free slot and blocks when all slots are full, so
+ *                memory stays bounded (back-pressure reaches the server
+ *                through TCP flow control) and a write that blocks in
+ *                the kernel no longer stalls the transfer.
+ *
+ *   fota_job_t   A piece of apply work (flashing the boot partition,
+ *                formatting the root partition) run in the background
+ *                while the next artifact is still downloading.
+ *
+ * Even on a single core this helps: the threads mostly wait for the
+ * network or the block device, rarely for the CPU.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_PIPE_H_
+#define _FOTA_PIPE_H_
+
+#include <stddef.h>
+#include <pthread.h>
+#include "fota_stream.h"
+
+#define FOTA_PIPE_SLOTS     8
+#define FOTA_PIPE_SLOT_SIZE (64 * 1024)
+
+typedef struct fota_pipe fota_pipe_t;
+
+/*
+ * Start a consumer thread that hands everything written to the pipe to
+ * sink, in order. Returns NULL if the thread cannot be started.
+ */
+fota_pipe_t *fota_pipe_new(fota_sink_fn sink, void *opaque);
+
+/*
+ * Queue the next piece, blocking while the queue is full. A sink with
+ * the fota_sink_fn signature (opaque is the pipe). Returns 0, or -1 once
+ * the consumer's sink has failed.
+ */
+int fota_pipe_write(void *pipe, const void *buf, size_t len);
+
+/*
+ * Run flush(arg) on the consumer thread after the last piece has gone
+ * to the sink, before the thread exits. For sinks that leave
+ * asynchronous work behind: io_uring cancels the queued requests of a
+ * thread when it exits. A failing flush fails the pipe. Set it before
+ * fota_pipe_close().
+ */
+void fota_pipe_set_flush(fota_pipe_t *pipe, int (*flush)(void *arg), void *arg);
+
+/*
+ * Hand over what is still queued, wait for the consumer and free the
+ * pipe. *wait_s (may be NULL) receives the time writers spent blocked
+ * on a full queue. Returns 0, or -1 if the sink failed.
+ */
+int fota_pipe_close(fota_pipe_t *pipe, double *wait_s);
+
+typedef struct {
+    pthread_t thread;
+    int (*fn)(void *arg);
+    void *arg;
+    int ret;
+    int running;
+} fota_job_t;
+
+/*
+ * Run fn(arg) in a background thread. If no thread can be created it
+ * runs right away in the caller.
+ */
+void fota_job_start(fota_job_t *job, int (*fn)(void *arg), void *arg);
+
+/* Wait for the job, returns what fn returned (-1 if never started) */
+int fota_job_wait(fota_job_t *job);
+
+#endif /* _FOTA_PIPE_H_ */
@@ -0,0 +1,146 @@
+/*
+ * fota_resume.c - Download progress records for resumable transfers
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <syslog.h>
+#include <json-c/json.h>
+
+#include "fota_resume.h"
+
+/*
+ * The hash state is stored as the raw fota_sha256_ctx in hex. It is only
+ * read back by the same client binary, the size check catches records
+ * of a build with a different context layout. Records holding an OpenSSL
+ * SHA256_CTX (same size) used the key "ctx" and are ignored.
+ */
+static void ctx_to_hex(const fota_sha256_ctx *ctx, char *out)
+{
+    const unsigned char *p = (const unsigned char *)ctx;
+
+    for (size_t i = 0; i < sizeof(*ctx); i++)
+        sprintf(out + i * 2, "%02x", p[i]);
+    out[sizeof(*ctx) * 2] = '\0';
+}
+
+static int ctx_from_hex(const char *hex, fota_sha256_ctx *ctx)
+{
+    unsigned char *p = (unsigned char *)ctx;
+
+    if (strlen(hex) != sizeof(*ctx) * 2)
+        return -1;
+
+    for (size_t i = 0; i < sizeof(*ctx); i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+            return -1;
+        p[i] = byte;
+    }
+    return 0;
+}
+
+int fota_progress_load(const char *path, fota_progress_t *p)
+{
+    struct json_object *root, *obj;
+    int ret = -1;
+
+    memset(p, 0, sizeof(*p));
+
+    root = json_object_from_file(path);
+    if (!root)
+        return -1;
+
+    if (json_object_object_get_ex(root, "url", &obj))
+        strncpy(p->url, json_object_get_string(obj), sizeof(p->url) - 1);
+    if (json_object_object_get_ex(root, "sha256", &obj))
+        strncpy(p->sha256, json_object_get_string(obj), sizeof(p->sha256) - 1);
+    if (json_object_object_get_ex(root, "size", &obj))
+        p->size = json_object_get_int64(obj);
+    if (json_object_object_get_ex(root, "offset", &obj))
+        p->offset = json_object_get_int64(obj);
+
+    if (json_object_object_get_ex(root, "sha256_ctx", &obj) &&
+        ctx_from_hex(json_object_get_string(obj), &p->sha) == 0)
+        ret = 0;
+    else
+        syslog(LOG_WARNING, "Ignoring unusable progress record %s", path);
+
+    json_object_put(root);
+    return ret;
+}
+
+int fota_file_save(const char *path, const void *data, size_t len)
+{
+    char tmp[PATH_MAX];
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        syslog(LOG_ERR, "Cannot write record %s", tmp);
+        return -1;
+    }
+
+    if (fwrite(data, 1, len, fp) != len ||
+        fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        fclose(fp);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(fp);
+
+    if (rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    /* Make the rename itself durable */
+    char *slash = strrchr(tmp, '/');
+    if (slash) {
+        *slash = '\0';
+        int dfd = open(slash == tmp ? "/" : tmp, O_RDONLY | O_DIRECTORY);
+        if (dfd >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+    }
+    return 0;
+}
+
+int fota_record_save(const char *path, struct json_object *root)
+{
+    const char *json = json_object_to_json_string_ext(root, JSON_C_TO_STRING_PLAIN);
+
+    return fota_file_save(path, json, strlen(json));
+}
+
+int fota_progress_save(const char *path, const fota_progress_t *p)
+{
+    char ctx[sizeof(fota_sha256_ctx) * 2 + 1];
+
+    ctx_to_hex(&p->sha, ctx);
+
+    struct json_object *root = json_object_new_object();
+    json_object_object_add(root, "url", json_object_new_string(p->url));
+    json_object_object_add(root, "sha256", json_object_new_string(p->sha256));
+    json_object_object_add(root, "size", json_object_new_int64(p->size));
+    json_object_object_add(root, "offset", json_object_new_int64(p->offset));
+    json_object_object_add(root, "sha256_ctx", json_object_new_string(ctx));
+
+    int ret = fota_record_save(path, root);
+    json_object_put(root);
+    return ret;
+}
+
+void fota_progress_clear(const char *path)
+{
+    if (path)
+        unlink(path);
+}
@@ -0,0 +1,53 @@
+/*
+ * fota_resume.h - Download progress records for resumable transfers
+ *
+ * A progress record remembers how much of an artifact is safely on
+ * disk together with the SHA256 state over exactly those bytes, so an
+ * interrupted download (network drop, timeout, reboot) continues with
+ * an HTTP Range request instead of starting from zero, and without
+ * reading the partial file again to rebuild the digest.
+ *
+ * Records are small JSON files written with write-to-temp + rename, so
+ * after a power cut either the old or the new record is found.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_RESUME_H_
+#define _FOTA_RESUME_H_
+
+#include <stdint.h>
+#include "fota_sha256.h"
+
+struct json_object;
+
+/* Bytes between two progress records while downloading */
+#define FOTA_RESUME_CHECKPOINT (4 * 1024 * 1024)
+
+typedef struct {
+    char url[512];              /* Artifact URL */
+    char sha256[65];            /* Expected digest, "" if unknown */
+    uint64_t size;              /* Expected size, 0 if unknown */
+    uint64_t offset;            /* Bytes durably in the partial file */
+    fota_sha256_ctx sha;        /* Hash state after offset bytes */
+} fota_progress_t;
+
+/* Read a record, returns 0 or -1 if missing or unusable */
+int fota_progress_load(const char *path, fota_progress_t *p);
+
+/* Atomically replace the record, returns 0 or -1 */
+int fota_progress_save(const char *path, const fota_progress_t *p);
+
+/*
+ * Atomically replace a file (write to temp, fsync, rename, fsync the
+ * directory), shared with the other state files. Returns 0 or -1.
+ */
+int fota_file_save(const char *path, const void *data, size_t len);
+
+/* Same for a JSON record */
+int fota_record_save(const char *path, struct json_object *root);
+
+/* Remove the record (NULL: none kept) */
+void fota_progress_clear(const char *path);
+
+#endif /* _FOTA_RESUME_H_ */
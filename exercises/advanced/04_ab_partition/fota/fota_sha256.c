@@ -0,0 +1,459 @@
+/*
+ * fota_sha256.c - SHA-256 with runtime selected block functions
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+/*
+ * The backends share one padding and state layer and only differ in the
+ * block function, which libcrypto exposes as SHA256_Transform() alone.
+ * It is deprecated since OpenSSL 3.0 in favour of EVP, which hides the
+ * state, but still provided: keep it without the warning.
+ */
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/sha.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHANI 1
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#define HAVE_ARMV8CE 1
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+
+#if defined(__arm__)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+
+#include "fota_sha256.h"
+
+typedef void (*block_fn)(uint32_t h[8], const unsigned char *p, size_t nblocks);
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t H0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* ============= Backends ============= */
+
+#define ROR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define BSIG0(x)    (ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define BSIG1(x)    (ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define SSIG0(x)    (ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define SSIG1(x)    (ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+#define CH(e, f, g) (((e) & (f)) ^ (~(e) & (g)))
+#define MAJ(a, b, c) (((a) & (b)) ^ ((a) & (c)) ^ ((b) & (c)))
+
+static void blocks_generic(uint32_t h[8], const unsigned char *p, size_t n)
+{
+    uint32_t w[64];
+
+    for (; n; n--, p += FOTA_SHA256_BLOCK_SIZE) {
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        uint32_t e = h[4], f = h[5], g = h[6], hh = h[7];
+
+        for (int i = 0; i < 16; i++)
+            w[i] = get_be32(p + i * 4);
+        for (int i = 16; i < 64; i++)
+            w[i] = SSIG1(w[i - 2]) + w[i - 7] + SSIG0(w[i - 15]) + w[i - 16];
+
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = hh + BSIG1(e) + CH(e, f, g) + K[i] + w[i];
+            uint32_t t2 = BSIG0(a) + MAJ(a, b, c);
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+}
+
+/* libcrypto picks its own assembly (NEON, ARMv8 CE, SHA-NI, AVX2) */
+static void blocks_openssl(uint32_t h[8], const unsigned char *p, size_t n)
+{
+    SHA256_CTX c;
+
+    memcpy(c.h, h, sizeof(c.h));
+    for (; n; n--, p += FOTA_SHA256_BLOCK_SIZE)
+        SHA256_Transform(&c, p);
+    memcpy(h, c.h, sizeof(c.h));
+}
+
+#ifdef HAVE_SHANI
+/*
+ * The SHA extensions keep the state as ABEF/CDGH and do two rounds per
+ * sha256rnds2, message schedule with sha256msg1/msg2
+ */
+__attribute__((target("sha,sse4.1")))
+static void blocks_shani(uint32_t h[8], const unsigned char *p, size_t n)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                         0x0405060700010203ULL);
+    __m128i state0, state1, msg, tmp, w[4];
+
+    tmp = _mm_loadu_si128((const __m128i *)&h[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&h[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);             /* CDAB */
+    state1 = _mm_shuffle_epi32(state1, 0x1b);       /* EFGH */
+    state0 = _mm_alignr_epi8(tmp, state1, 8);       /* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);    /* CDGH */
+
+    for (; n; n--, p += FOTA_SHA256_BLOCK_SIZE) {
+        __m128i abef = state0, cdgh = state1;
+
+        for (int j = 0; j < 4; j++)
+            w[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + j * 16)),
+                                    bswap);
+
+#pragma GCC unroll 16
+        for (int j = 0; j < 16; j++) {
+            if (j >= 4) {
+                tmp = _mm_sha256msg1_epu32(w[j & 3], w[(j + 1) & 3]);
+                tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(j + 3) & 3],
+                                                         w[(j + 2) & 3], 4));
+                w[j & 3] = _mm_sha256msg2_epu32(tmp, w[(j + 3) & 3]);
+            }
+            msg = _mm_add_epi32(w[j & 3], _mm_loadu_si128((const __m128i *)&K[j * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0e);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);          /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xb1);       /* DCHG */
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);    /* DCBA */
+    state1 = _mm_alignr_epi8(state1, tmp, 8);       /* HGFE */
+    _mm_storeu_si128((__m128i *)&h[0], state0);
+    _mm_storeu_si128((__m128i *)&h[4], state1);
+}
+
+static int have_shani(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+        return 0;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (ebx & (1u << 29)) != 0;     /* CPUID.7.0:EBX.SHA */
+}
+#endif /* HAVE_SHANI */
+
+#ifdef HAVE_ARMV8CE
+/*
+ * sha256h/sha256h2 do four rounds on the ABCD/EFGH halves, schedule
+ * with sha256su0/su1
+ */
+__attribute__((target("+crypto")))
+static void blocks_armv8ce(uint32_t h[8], const unsigned char *p, size_t n)
+{
+    uint32x4_t state0 = vld1q_u32(&h[0]);
+    uint32x4_t state1 = vld1q_u32(&h[4]);
+    uint32x4_t w[4], msg, tmp;
+
+    for (; n; n--, p += FOTA_SHA256_BLOCK_SIZE) {
+        uint32x4_t abcd = state0, efgh = state1;
+
+        for (int j = 0; j < 4; j++)
+            w[j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + j * 16)));
+
+        for (int j = 0; j < 16; j++) {
+            if (j >= 4)
+                w[j & 3] = vsha256su1q_u32(vsha256su0q_u32(w[j & 3], w[(j + 1) & 3]),
+                                           w[(j + 2) & 3], w[(j + 3) & 3]);
+            msg = vaddq_u32(w[j & 3], vld1q_u32(&K[j * 4]));
+            tmp = state0;
+            state0 = vsha256hq_u32(state0, state1, msg);
+            state1 = vsha256h2q_u32(state1, tmp, msg);
+        }
+
+        state0 = vaddq_u32(state0, abcd);
+        state1 = vaddq_u32(state1, efgh);
+    }
+
+    vst1q_u32(&h[0], state0);
+    vst1q_u32(&h[4], state1);
+}
+
+static int have_armv8ce(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+#endif /* HAVE_ARMV8CE */
+
+static int have_always(void)
+{
+    return 1;
+}
+
+static const struct {
+    const char *name;
+    block_fn blocks;
+    int (*available)(void);
+} backends[] = {
+    /* In order of preference for "auto" */
+#ifdef HAVE_SHANI
+    { "shani",   blocks_shani,   have_shani },
+#endif
+#ifdef HAVE_ARMV8CE
+    { "armv8ce", blocks_armv8ce, have_armv8ce },
+#endif
+    { "openssl", blocks_openssl, have_always },
+    { "generic", blocks_generic, have_always },
+};
+
+#define NBACKENDS ((int)(sizeof(backends) / sizeof(backends[0])))
+
+static int current = -1;
+
+int fota_sha256_select(const char *name)
+{
+    for (int i = 0; i < NBACKENDS; i++) {
+        if (name && strcmp(name, "auto") != 0 && strcmp(name, backends[i].name) != 0)
+            continue;
+        if (!backends[i].available())
+            continue;
+        current = i;
+        return 0;
+    }
+
+    syslog(LOG_WARNING, "SHA-256 backend %s not available", name ? name : "auto");
+    return -1;
+}
+
+const char *fota_sha256_backend(void)
+{
+    if (current < 0)
+        fota_sha256_select(NULL);
+    return backends[current].name;
+}
+
+const char *fota_sha256_backend_name(int i)
+{
+    return i >= 0 && i < NBACKENDS ? backends[i].name : NULL;
+}
+
+int fota_sha256_backend_available(int i)
+{
+    return i >= 0 && i < NBACKENDS && backends[i].available();
+}
+
+/* ============= Streaming interface ============= */
+
+/* Contexts restored from a progress record never went through init */
+static block_fn backend_blocks(void)
+{
+    if (current < 0)
+        fota_sha256_select(NULL);
+    return backends[current].blocks;
+}
+
+void fota_sha256_init(fota_sha256_ctx *ctx)
+{
+    memcpy(ctx->h, H0, sizeof(ctx->h));
+    ctx->len = 0;
+    ctx->num = 0;
+}
+
+void fota_sha256_update(fota_sha256_ctx *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    block_fn blocks = backend_blocks();
+
+    ctx->len += len;
+
+    if (ctx->num) {
+        size_t n = FOTA_SHA256_BLOCK_SIZE - ctx->num;
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + ctx->num, p, n);
+        ctx->num += n;
+        p += n;
+        len -= n;
+        if (ctx->num < FOTA_SHA256_BLOCK_SIZE)
+            return;
+        blocks(ctx->h, ctx->buf, 1);
+        ctx->num = 0;
+    }
+
+    if (len >= FOTA_SHA256_BLOCK_SIZE) {
+        size_t nblocks = len / FOTA_SHA256_BLOCK_SIZE;
+        blocks(ctx->h, p, nblocks);
+        p += nblocks * FOTA_SHA256_BLOCK_SIZE;
+        len -= nblocks * FOTA_SHA256_BLOCK_SIZE;
+    }
+
+    memcpy(ctx->buf, p, len);
+    ctx->num = len;
+}
+
+/*
+ * Padding: 0x80, zeros, 64-bit big-endian bit count, into one or two
+ * final blocks. Returns the number of blocks written to tail.
+ */
+static int pad(unsigned char tail[2 * FOTA_SHA256_BLOCK_SIZE],
+               const unsigned char *rest, unsigned int num, uint64_t len)
+{
+    int nblocks = num < FOTA_SHA256_BLOCK_SIZE - 8 ? 1 : 2;
+    size_t end = nblocks * FOTA_SHA256_BLOCK_SIZE;
+
+    memset(tail, 0, end);
+    memcpy(tail, rest, num);
+    tail[num] = 0x80;
+    put_be32(tail + end - 8, (uint32_t)(len >> 29));
+    put_be32(tail + end - 4, (uint32_t)(len << 3));
+    return nblocks;
+}
+
+void fota_sha256_final(fota_sha256_ctx *ctx, unsigned char *digest)
+{
+    unsigned char tail[2 * FOTA_SHA256_BLOCK_SIZE];
+
+    int nblocks = pad(tail, ctx->buf, ctx->num, ctx->len);
+    backend_blocks()(ctx->h, tail, nblocks);
+
+    for (int i = 0; i < 8; i++)
+        put_be32(digest + i * 4, ctx->h[i]);
+}
+
+void fota_sha256(const void *data, size_t len, unsigned char *digest)
+{
+    fota_sha256_ctx ctx;
+
+    fota_sha256_init(&ctx);
+    fota_sha256_update(&ctx, data, len);
+    fota_sha256_final(&ctx, digest);
+}
+
+/* ============= Four lanes ============= */
+
+/*
+ * GCC vector extensions: NEON on ARM, SSE2 on x86. Lane i of every
+ * vector belongs to message i.
+ */
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+
+#if defined(__arm__) && !defined(__ARM_NEON)
+#define X4_TARGET __attribute__((target("fpu=neon")))
+#else
+#define X4_TARGET
+#endif
+
+X4_TARGET
+static void blocks_x4(v4u32 s[8], const unsigned char *const p[4], size_t off)
+{
+    v4u32 w[64];
+    v4u32 a = s[0], b = s[1], c = s[2], d = s[3];
+    v4u32 e = s[4], f = s[5], g = s[6], hh = s[7];
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (v4u32){ get_be32(p[0] + off + i * 4), get_be32(p[1] + off + i * 4),
+                        get_be32(p[2] + off + i * 4), get_be32(p[3] + off + i * 4) };
+    for (int i = 16; i < 64; i++)
+        w[i] = SSIG1(w[i - 2]) + w[i - 7] + SSIG0(w[i - 15]) + w[i - 16];
+
+    for (int i = 0; i < 64; i++) {
+        v4u32 t1 = hh + BSIG1(e) + CH(e, f, g) + K[i] + w[i];
+        v4u32 t2 = BSIG0(a) + MAJ(a, b, c);
+        hh = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+    s[4] += e; s[5] += f; s[6] += g; s[7] += hh;
+}
+
+static int have_x4(void)
+{
+#if defined(__arm__)
+    return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+    return 1;
+#endif
+}
+
+void fota_sha256_x4(const unsigned char *const data[4], size_t len,
+                    unsigned char digest[4][FOTA_SHA256_DIGEST_LENGTH])
+{
+    if (!have_x4()) {
+        for (int i = 0; i < 4; i++)
+            fota_sha256(data[i], len, digest[i]);
+        return;
+    }
+
+    v4u32 s[8];
+    for (int i = 0; i < 8; i++)
+        s[i] = (v4u32){ H0[i], H0[i], H0[i], H0[i] };
+
+    size_t full = len / FOTA_SHA256_BLOCK_SIZE * FOTA_SHA256_BLOCK_SIZE;
+    for (size_t off = 0; off < full; off += FOTA_SHA256_BLOCK_SIZE)
+        blocks_x4(s, data, off);
+
+    /* Same length, so the padding has the same shape in every lane */
+    unsigned char tail[4][2 * FOTA_SHA256_BLOCK_SIZE];
+    const unsigned char *tails[4] = { tail[0], tail[1], tail[2], tail[3] };
+    int nblocks = 0;
+
+    for (int i = 0; i < 4; i++)
+        nblocks = pad(tail[i], data[i] + full, len - full, len);
+    for (int j = 0; j < nblocks; j++)
+        blocks_x4(s, tails, j * FOTA_SHA256_BLOCK_SIZE);
+
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 8; j++)
+            put_be32(digest[i] + j * 4, s[j][i]);
+}
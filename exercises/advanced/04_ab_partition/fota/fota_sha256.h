@@ -0,0 +1,65 @@
+/*
+ * fota_sha256.h - SHA-256 with runtime selected block functions
+ *
+ * Buffering, padding and the context format are shared; only the
+ * compression of whole 64 byte blocks is done by a backend:
+ *   shani    - x86 SHA extensions
+ *   armv8ce  - ARMv8 cryptography extensions (AArch64)
+ *   openssl  - libcrypto's block function, which itself picks assembly
+ *              for the CPU (ARMv7 NEON on the Cortex-A8)
+ *   generic  - portable C
+ * The fastest available one is selected by feature detection at first
+ * use, fota_sha256_select() overrides it (hash_backend in fota.conf).
+ *
+ * A single stream is a strict chain of block compressions, so SIMD
+ * lanes cannot speed it up. fota_sha256_x4() instead hashes four
+ * independent equal-length messages at once, one per vector lane (NEON
+ * on ARM, SSE2 on x86), for callers that have several inputs ready.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_SHA256_H_
+#define _FOTA_SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FOTA_SHA256_DIGEST_LENGTH 32
+#define FOTA_SHA256_BLOCK_SIZE    64
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;               /* Bytes hashed so far */
+    unsigned char buf[FOTA_SHA256_BLOCK_SIZE];
+    unsigned int num;           /* Bytes pending in buf */
+} fota_sha256_ctx;
+
+void fota_sha256_init(fota_sha256_ctx *ctx);
+void fota_sha256_update(fota_sha256_ctx *ctx, const void *data, size_t len);
+void fota_sha256_final(fota_sha256_ctx *ctx, unsigned char *digest);
+
+/* One-shot digest of a buffer */
+void fota_sha256(const void *data, size_t len, unsigned char *digest);
+
+/*
+ * Use the named backend, or the best available one for NULL/"auto"
+ * Returns 0, or -1 if the backend is unknown or not supported here
+ * (the previous selection stays).
+ */
+int fota_sha256_select(const char *name);
+
+/* Name of the backend in use */
+const char *fota_sha256_backend(void);
+
+/* Enumerate backends: name of backend i (NULL past the end) */
+const char *fota_sha256_backend_name(int i);
+
+/* Is backend i supported by this CPU and build? */
+int fota_sha256_backend_available(int i);
+
+/* Digests of four independent messages of len bytes each */
+void fota_sha256_x4(const unsigned char *const data[4], size_t len,
+                    unsigned char digest[4][FOTA_SHA256_DIGEST_LENGTH]);
+
+#endif /* _FOTA_SHA256_H_ */
@@ -0,0 +1,312 @@
+/*
+ * fota_stream.c - Incremental artifact processing for the FOTA client
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fota_stream.h"
+#include "fota_zstd.h"
+
+#ifdef FOTA_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+static const char *const codec_names[] = {
+    [FOTA_COMP_NONE] = "none",
+    [FOTA_COMP_GZIP] = "gzip",
+    [FOTA_COMP_ZSTD] = "zstd",
+    [FOTA_COMP_LZ4] = "lz4",
+};
+
+static unsigned stream_threads;
+
+double fota_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void fota_sha256_hex(const unsigned char *hash, char *hash_out)
+{
+    for (int i = 0; i < FOTA_SHA256_DIGEST_LENGTH; i++) {
+        sprintf(hash_out + (i * 2), "%02x", hash[i]);
+    }
+    hash_out[64] = '\0';
+}
+
+int fota_stream_codec(const char *name)
+{
+    for (int i = 0; i < (int)(sizeof(codec_names) / sizeof(codec_names[0])); i++) {
+        if (strcmp(name, codec_names[i]) != 0)
+            continue;
+#ifndef FOTA_HAVE_ZSTD
+        if (i == FOTA_COMP_ZSTD)
+            return -1;
+#endif
+#ifndef FOTA_HAVE_LZ4
+        if (i == FOTA_COMP_LZ4)
+            return -1;
+#endif
+        return i;
+    }
+    return -1;
+}
+
+void fota_stream_set_threads(unsigned threads)
+{
+    stream_threads = threads;
+}
+
+/* Hand decompressed data to the sink in pieces of at most the window */
+static int stream_emit(void *opaque, const void *buf, size_t len)
+{
+    fota_stream_t *s = opaque;
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        size_t n = len < FOTA_STREAM_BUF_SIZE ? len : FOTA_STREAM_BUF_SIZE;
+        if (s->sink(s->opaque, p, n) < 0)
+            return -1;
+        s->out_bytes += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int fota_stream_init(fota_stream_t *s, int comp, fota_sink_fn sink,
+                     void *opaque)
+{
+    memset(s, 0, sizeof(*s));
+    fota_sha256_init(&s->sha);
+    s->sink = sink;
+    s->opaque = opaque;
+    s->comp = comp;
+
+    if (comp == FOTA_COMP_NONE)
+        return 0;
+
+#ifdef FOTA_HAVE_ZSTD
+    if (comp == FOTA_COMP_ZSTD) {
+        unsigned threads = stream_threads;
+        if (threads == 0) {
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            threads = n > 0 ? n : 1;
+        }
+        s->zstd = fota_zstd_new(threads, stream_emit, s);
+        return s->zstd ? 0 : -1;
+    }
+#endif
+
+    s->out = malloc(FOTA_STREAM_BUF_SIZE);
+    if (!s->out)
+        return -1;
+
+#ifdef FOTA_HAVE_LZ4
+    if (comp == FOTA_COMP_LZ4) {
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&s->lz4, LZ4F_VERSION))) {
+            free(s->out);
+            s->out = NULL;
+            return -1;
+        }
+        s->lz4_hint = 1;
+        return 0;
+    }
+#endif
+
+    /* 16 + MAX_WBITS: expect a gzip wrapper */
+    if (comp != FOTA_COMP_GZIP || inflateInit2(&s->zs, 16 + MAX_WBITS) != Z_OK) {
+        free(s->out);
+        s->out = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Inflate one input piece and pass every output window to the sink */
+static int stream_inflate(fota_stream_t *s, const void *buf, size_t len)
+{
+    s->zs.next_in = (unsigned char *)buf;
+    s->zs.avail_in = len;
+
+    while (s->zs.avail_in > 0) {
+        s->zs.next_out = s->out;
+        s->zs.avail_out = FOTA_STREAM_BUF_SIZE;
+
+        int ret = inflate(&s->zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            syslog(LOG_ERR, "gzip: %s", s->zs.msg ? s->zs.msg : "inflate failed");
+            return -1;
+        }
+
+        size_t have = FOTA_STREAM_BUF_SIZE - s->zs.avail_out;
+        if (have > 0 && stream_emit(s, s->out, have) < 0)
+            return -1;
+
+        /* Concatenated gzip members (pigz, appended archives) */
+        if (ret == Z_STREAM_END) {
+            if (s->zs.avail_in == 0)
+                break;
+            inflateReset(&s->zs);
+        } else if (ret == Z_BUF_ERROR && have == 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+#ifdef FOTA_HAVE_LZ4
+/*
+ * Decompress one lz4 input piece and pass every output window to the
+ * sink, until nothing is held back
+ */
+static int stream_lz4(fota_stream_t *s, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    size_t out;
+
+    do {
+        size_t in = len;
+        out = FOTA_STREAM_BUF_SIZE;
+
+        size_t ret = LZ4F_decompress(s->lz4, s->out, &out, p, &in, NULL);
+        if (LZ4F_isError(ret)) {
+            syslog(LOG_ERR, "lz4: %s", LZ4F_getErrorName(ret));
+            return -1;
+        }
+        if (out > 0 && stream_emit(s, s->out, out) < 0)
+            return -1;
+
+        /* Concatenated frames are decoded one after the other */
+        if (in > 0 || out > 0)
+            s->lz4_hint = ret;
+        p += in;
+        len -= in;
+    } while (len > 0 || out == FOTA_STREAM_BUF_SIZE);
+    return 0;
+}
+#endif
+
+int fota_stream_feed(fota_stream_t *s, const void *buf, size_t len)
+{
+    if (s->failed)
+        return -1;
+
+    double t0 = fota_now();
+    fota_sha256_update(&s->sha, buf, len);
+    double t1 = fota_now();
+
+    int ret;
+    switch (s->comp) {
+    case FOTA_COMP_GZIP:
+        ret = stream_inflate(s, buf, len);
+        break;
+#ifdef FOTA_HAVE_ZSTD
+    case FOTA_COMP_ZSTD:
+        ret = fota_zstd_feed(s->zstd, buf, len);
+        break;
+#endif
+#ifdef FOTA_HAVE_LZ4
+    case FOTA_COMP_LZ4:
+        ret = len ? stream_lz4(s, buf, len) : 0;
+        break;
+#endif
+    default:
+        ret = s->sink(s->opaque, buf, len);
+        if (ret == 0)
+            s->out_bytes += len;
+        break;
+    }
+
+    s->hash_s += t1 - t0;
+    s->sink_s += fota_now() - t1;
+    s->in_bytes += len;
+
+    if (ret < 0)
+        s->failed = 1;
+    return ret;
+}
+
+/* Flush whatever inflate still holds back, returns 0 or -1 */
+static int finish_inflate(fota_stream_t *s)
+{
+    int ret;
+    do {
+        s->zs.next_in = NULL;
+        s->zs.avail_in = 0;
+        s->zs.next_out = s->out;
+        s->zs.avail_out = FOTA_STREAM_BUF_SIZE;
+        ret = inflate(&s->zs, Z_FINISH);
+
+        size_t have = FOTA_STREAM_BUF_SIZE - s->zs.avail_out;
+        if (have > 0 && stream_emit(s, s->out, have) < 0)
+            return -1;
+    } while (ret == Z_BUF_ERROR && s->zs.avail_out == 0);
+
+    if (ret != Z_STREAM_END) {
+        syslog(LOG_ERR, "gzip: stream truncated");
+        return -1;
+    }
+    return 0;
+}
+
+int fota_stream_finish(fota_stream_t *s, char *hash_out)
+{
+    unsigned char hash[FOTA_SHA256_DIGEST_LENGTH];
+
+    double t0 = fota_now();
+    fota_sha256_final(&s->sha, hash);
+    fota_sha256_hex(hash, hash_out);
+    s->hash_s += fota_now() - t0;
+
+    if (s->failed)
+        return -1;
+
+    int ret = 0;
+    t0 = fota_now();
+    switch (s->comp) {
+    case FOTA_COMP_GZIP:
+        ret = finish_inflate(s);
+        break;
+#ifdef FOTA_HAVE_ZSTD
+    case FOTA_COMP_ZSTD:
+        ret = fota_zstd_finish(s->zstd);
+        break;
+#endif
+#ifdef FOTA_HAVE_LZ4
+    case FOTA_COMP_LZ4:
+        if (s->lz4_hint != 0) {
+            syslog(LOG_ERR, "lz4: stream truncated");
+            ret = -1;
+        }
+        break;
+#endif
+    }
+    s->sink_s += fota_now() - t0;
+    return ret;
+}
+
+void fota_stream_cleanup(fota_stream_t *s)
+{
+    if (s->comp == FOTA_COMP_GZIP)
+        inflateEnd(&s->zs);
+#ifdef FOTA_HAVE_ZSTD
+    fota_zstd_free(s->zstd);
+    s->zstd = NULL;
+#endif
+#ifdef FOTA_HAVE_LZ4
+    if (s->lz4)
+        LZ4F_freeDecompressionContext(s->lz4);
+    s->lz4 = NULL;
+#endif
+    free(s->out);
+    s->out = NULL;
+}
@@ -0,0 +1,92 @@
+/*
+ * fota_stream.h - Incremental artifact processing for the FOTA client
+ *
+ * A stream takes the artifact body piece by piece as it arrives from
+ * the network, feeds it to a running SHA256 and, optionally after
+ * decompression, hands it to a sink (file, tar extractor, ...).
+ * The only buffer is the fixed output window (parallel zstd aside),
+ * so memory use is independent of the artifact size.
+ *
+ * Compression, named in the manifest per artifact:
+ *   gzip  zlib, always built in
+ *   zstd  libzstd, make WITH_ZSTD=1 (FOTA_HAVE_ZSTD). Archives made of
+ *         independent frames are decompressed on several threads, see
+ *         fota_zstd.h
+ *   lz4   liblz4 frame format, make WITH_LZ4=1 (FOTA_HAVE_LZ4)
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_STREAM_H_
+#define _FOTA_STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "fota_sha256.h"
+
+/* Inflate output window, also the largest piece handed to a sink */
+#define FOTA_STREAM_BUF_SIZE (64 * 1024)
+
+/* Compression of an artifact */
+enum {
+    FOTA_COMP_NONE = 0,
+    FOTA_COMP_GZIP,
+    FOTA_COMP_ZSTD,
+    FOTA_COMP_LZ4,
+};
+
+/* Sink callback: consume len bytes, return 0 or -1 to abort */
+typedef int (*fota_sink_fn)(void *opaque, const void *buf, size_t len);
+
+typedef struct {
+    fota_sha256_ctx sha;
+    int comp;                   /* FOTA_COMP_*, decompress before the sink */
+    z_stream zs;
+    struct fota_zstd *zstd;
+    struct LZ4F_dctx_s *lz4;
+    size_t lz4_hint;            /* 0 at the end of an lz4 frame */
+    unsigned char *out;         /* Inflate output window */
+    fota_sink_fn sink;
+    void *opaque;
+
+    uint64_t in_bytes;          /* Bytes fed (compressed) */
+    uint64_t out_bytes;         /* Bytes handed to the sink */
+    double hash_s;              /* Time spent hashing */
+    double sink_s;              /* Time spent inflating and in the sink */
+    int failed;
+} fota_stream_t;
+
+/*
+ * Codec of a manifest compression name ("none", "gzip", "zstd", "lz4")
+ * Returns FOTA_COMP_*, or -1 if unknown or not built in
+ */
+int fota_stream_codec(const char *name);
+
+/*
+ * Threads decompressing zstd frames for streams set up from now on,
+ * 0 (the default) = one per online CPU
+ */
+void fota_stream_set_threads(unsigned threads);
+
+int fota_stream_init(fota_stream_t *s, int comp, fota_sink_fn sink,
+                     void *opaque);
+
+/* Feed the next piece of the artifact, returns 0 or -1 */
+int fota_stream_feed(fota_stream_t *s, const void *buf, size_t len);
+
+/*
+ * End of input: checks the compressed stream is complete and
+ * returns the hex digest of everything fed. Returns 0 or -1.
+ */
+int fota_stream_finish(fota_stream_t *s, char *hash_out);
+
+void fota_stream_cleanup(fota_stream_t *s);
+
+/* Monotonic clock in seconds */
+double fota_now(void);
+
+/* Convert a binary SHA256 digest to a hex string */
+void fota_sha256_hex(const unsigned char *hash, char *hash_out);
+
+#endif /* _FOTA_STREAM_H_ */
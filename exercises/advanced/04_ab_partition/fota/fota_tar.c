@@ -0,0 +1,1041 @@
+/*
+ * fota_tar.c - Streaming tar extractor for the FOTA client
+ *
+ * See fota_tar.h for the supported subset of the format.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+
+#include "fota_tar.h"
+#include "fota_sha256.h"
+#include "fota_stream.h"
+
+#define TAR_BLOCK       512
+#define TAR_MAX_PAX     (64 * 1024)   /* Upper bound for a pax header */
+#define TAR_MAX_XATTRS  16
+
+/* Parser states */
+enum tar_state {
+    TAR_HEADER,         /* Collecting a 512 byte header block */
+    TAR_DATA,           /* Writing file payload */
+    TAR_LONGNAME,       /* Collecting a GNU 'L'/'K' or pax 'x' record */
+    TAR_SKIP,           /* Discarding payload (pax 'g', unknown types) */
+    TAR_PADDING,        /* Skipping to the next block boundary */
+    TAR_END,            /* End-of-archive marker seen */
+};
+
+/* Directory whose metadata is applied at the end, see fota_tar_finish() */
+struct tar_dir {
+    char *path;
+    mode_t mode;
+    unsigned long uid, gid;
+    struct timespec mtime;
+};
+
+struct tar_xattr {
+    char *name;
+    char *value;
+    size_t len;
+};
+
+/* Overrides collected from GNU long name and pax records */
+struct tar_overrides {
+    char *path;
+    char *linkpath;
+    int have_size, have_uid, have_gid, have_mtime;
+    uint64_t size;
+    unsigned long uid, gid;
+    time_t mtime;
+    struct tar_xattr xattrs[TAR_MAX_XATTRS];
+    int nxattrs;
+};
+
+struct fota_tar {
+    int rootfd;
+    enum tar_state state;
+
+    unsigned char header[TAR_BLOCK];
+    size_t header_len;
+    int zero_blocks;
+
+    /* Current entry */
+    uint64_t remaining;         /* Payload bytes left in this entry */
+    uint64_t padding;           /* Padding bytes left after the payload */
+    int fd;                     /* Open regular file, -1 otherwise */
+    char record_type;           /* 'L', 'K' or 'x' while collecting */
+    char *record;
+    size_t record_len;
+    struct timespec mtime;
+
+    struct tar_overrides next;  /* Applies to the next real entry */
+
+    struct tar_dir *dirs;       /* Directories extracted, in archive order */
+    size_t ndirs, dirs_cap;
+
+    unsigned long entries;
+    uint64_t bytes;
+    int is_root;
+
+    uint64_t writeback;         /* syncfs() interval in bytes, 0: never */
+    uint64_t unsynced;
+
+    /* Incremental mode, see fota_tar_set_files() */
+    char **paths;               /* Sanitized copies of the listed paths */
+    const fota_tar_file_t *files;
+    size_t nfiles;
+    const fota_tar_file_t *expect;  /* Entry of the current file, if listed */
+    fota_sha256_ctx sha;        /* Payload of the current listed file */
+    int tmp_dirfd;              /* Parent of the temporary file, -1 if none */
+    char *tmp_base;             /* Final name of the temporary file */
+    char tmp_name[NAME_MAX + 1];
+    unsigned long unchanged;
+    uint64_t unchanged_bytes;
+};
+
+/* ============= Helpers ============= */
+
+/* Parse an octal or GNU base-256 numeric field */
+static uint64_t tar_number(const unsigned char *p, size_t n)
+{
+    uint64_t v = 0;
+
+    if (p[0] & 0x80) {
+        /* Base-256: big-endian, first byte without the marker bit */
+        v = p[0] & 0x3f;
+        for (size_t i = 1; i < n; i++)
+            v = (v << 8) | p[i];
+        return v;
+    }
+
+    size_t i = 0;
+    while (i < n && (p[i] == ' ' || p[i] == '\0'))
+        i++;
+    for (; i < n && p[i] >= '0' && p[i] <= '7'; i++)
+        v = (v << 3) | (p[i] - '0');
+    return v;
+}
+
+static int tar_checksum_ok(const unsigned char *h)
+{
+    unsigned long sum = 0;
+
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : h[i];
+
+    return sum == tar_number(h + 148, 8);
+}
+
+static int is_zero_block(const unsigned char *h)
+{
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        if (h[i])
+            return 0;
+    }
+    return 1;
+}
+
+static void overrides_clear(struct tar_overrides *o)
+{
+    free(o->path);
+    free(o->linkpath);
+    for (int i = 0; i < o->nxattrs; i++) {
+        free(o->xattrs[i].name);
+        free(o->xattrs[i].value);
+    }
+    memset(o, 0, sizeof(*o));
+}
+
+/*
+ * Normalize an archive path in place: drop leading '/' and "./",
+ * collapse "//" and "/./", reject "..". Returns NULL if the path must
+ * not be extracted, "" for the root itself.
+ */
+static char *sanitize_path(char *path)
+{
+    char *out = path, *in = path;
+
+    while (*in) {
+        while (*in == '/')
+            in++;
+        if (!*in)
+            break;
+
+        char *end = strchr(in, '/');
+        size_t len = end ? (size_t)(end - in) : strlen(in);
+
+        if (len == 1 && in[0] == '.') {
+            /* skip */
+        } else if (len == 2 && in[0] == '.' && in[1] == '.') {
+            return NULL;
+        } else {
+            if (out != path)
+                *out++ = '/';
+            memmove(out, in, len);
+            out += len;
+        }
+        in += len;
+    }
+    *out = '\0';
+    return path;
+}
+
+/*
+ * Open the parent directory of a sanitized path without following
+ * symlinks, creating missing directories on the way.
+ * *base is set to the last path component.
+ */
+static int open_parent(struct fota_tar *tar, char *path, const char **base,
+                       int create)
+{
+    int dirfd = dup(tar->rootfd);
+    char *comp = path;
+    char *slash;
+
+    if (dirfd < 0)
+        return -1;
+
+    while ((slash = strchr(comp, '/')) != NULL) {
+        *slash = '\0';
+
+        int fd = openat(dirfd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (fd < 0 && errno == ENOENT && create) {
+            if (mkdirat(dirfd, comp, 0755) < 0 && errno != EEXIST) {
+                *slash = '/';
+                close(dirfd);
+                return -1;
+            }
+            fd = openat(dirfd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        }
+
+        *slash = '/';
+        close(dirfd);
+        if (fd < 0)
+            return -1;
+
+        dirfd = fd;
+        comp = slash + 1;
+    }
+
+    *base = comp;
+    return dirfd;
+}
+
+/* Remove whatever is in the way of a new non-directory entry */
+static void remove_existing(int dirfd, const char *base)
+{
+    struct stat st;
+
+    if (fstatat(dirfd, base, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        !S_ISDIR(st.st_mode))
+        unlinkat(dirfd, base, 0);
+}
+
+/* Apply ownership, mode and mtime to a non-regular entry */
+static void set_metadata(struct fota_tar *tar, int dirfd, const char *base,
+                         mode_t mode, unsigned long uid, unsigned long gid,
+                         const struct timespec *mtime, int is_symlink)
+{
+    struct timespec times[2];
+
+    if (tar->is_root)
+        fchownat(dirfd, base, uid, gid, AT_SYMLINK_NOFOLLOW);
+
+    /* chmod after chown, chown clears the set-id bits */
+    if (!is_symlink)
+        fchmodat(dirfd, base, mode & 07777, 0);
+
+    times[0] = *mtime;
+    times[1] = *mtime;
+    utimensat(dirfd, base, times, AT_SYMLINK_NOFOLLOW);
+}
+
+/*
+ * Remember a directory's metadata for fota_tar_finish(): creating its
+ * children would reset its mtime, and a read-only mode would stop them
+ * being created at all when not running as root.
+ */
+static int defer_dir(struct fota_tar *tar, const char *path, mode_t mode,
+                     unsigned long uid, unsigned long gid)
+{
+    if (tar->ndirs == tar->dirs_cap) {
+        size_t cap = tar->dirs_cap ? 2 * tar->dirs_cap : 64;
+        struct tar_dir *dirs = realloc(tar->dirs, cap * sizeof(*dirs));
+
+        if (!dirs)
+            return -1;
+        tar->dirs = dirs;
+        tar->dirs_cap = cap;
+    }
+
+    struct tar_dir *d = &tar->dirs[tar->ndirs];
+
+    d->path = strdup(path);
+    if (!d->path)
+        return -1;
+    d->mode = mode;
+    d->uid = uid;
+    d->gid = gid;
+    d->mtime = tar->mtime;
+    tar->ndirs++;
+    return 0;
+}
+
+/* Apply deferred directory metadata, deepest entries of the archive first */
+static void apply_dirs(struct fota_tar *tar)
+{
+    while (tar->ndirs > 0) {
+        struct tar_dir *d = &tar->dirs[--tar->ndirs];
+        const char *base;
+        int dirfd = open_parent(tar, d->path, &base, 0);
+
+        if (dirfd >= 0) {
+            set_metadata(tar, dirfd, base, d->mode, d->uid, d->gid,
+                         &d->mtime, 0);
+            close(dirfd);
+        }
+        free(d->path);
+    }
+}
+
+/* Index of a sanitized path in the file list, -1 if not listed */
+static int find_file(const struct fota_tar *tar, const char *path)
+{
+    for (size_t i = 0; i < tar->nfiles; i++) {
+        if (strcmp(tar->paths[i], path) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Is a listed file below directory dir? */
+static int holds_listed(const struct fota_tar *tar, const char *dir)
+{
+    size_t len = strlen(dir);
+
+    for (size_t i = 0; i < tar->nfiles; i++) {
+        if (strncmp(tar->paths[i], dir, len) == 0 && tar->paths[i][len] == '/')
+            return 1;
+    }
+    return 0;
+}
+
+/* Does the existing file base already have the listed size and digest? */
+static int file_matches(int dirfd, const char *base, const fota_tar_file_t *f)
+{
+    unsigned char buf[64 * 1024];
+    unsigned char hash[FOTA_SHA256_DIGEST_LENGTH];
+    char hex[65];
+    fota_sha256_ctx ctx;
+    struct stat st;
+    ssize_t n;
+
+    int fd = openat(dirfd, base, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        (uint64_t)st.st_size != f->size) {
+        close(fd);
+        return 0;
+    }
+
+    fota_sha256_init(&ctx);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        fota_sha256_update(&ctx, buf, n);
+    close(fd);
+    if (n < 0)
+        return 0;
+
+    fota_sha256_final(&ctx, hash);
+    fota_sha256_hex(hash, hex);
+    return strcasecmp(hex, f->sha256) == 0;
+}
+
+/* Ownership, mode and xattrs of a new regular file */
+static void set_file_metadata(struct fota_tar *tar, const char *path,
+                              mode_t mode, unsigned long uid,
+                              unsigned long gid)
+{
+    if (tar->is_root)
+        fchown(tar->fd, uid, gid);
+    fchmod(tar->fd, mode & 07777);
+    for (int i = 0; i < tar->next.nxattrs; i++) {
+        struct tar_xattr *x = &tar->next.xattrs[i];
+        if (fsetxattr(tar->fd, x->name, x->value, x->len, 0) < 0)
+            syslog(LOG_WARNING, "tar: cannot set %s on %s: %s",
+                   x->name, path, strerror(errno));
+    }
+}
+
+/*
+ * Incremental mode: leave a listed file that already matches alone,
+ * otherwise open a temporary file next to it. The payload of a listed
+ * file is hashed either way.
+ */
+static int start_file(struct fota_tar *tar, int dirfd, const char *base,
+                      const char *path, uint64_t size, mode_t mode,
+                      unsigned long uid, unsigned long gid)
+{
+    int idx = find_file(tar, path);
+
+    if (idx >= 0) {
+        tar->expect = &tar->files[idx];
+        fota_sha256_init(&tar->sha);
+
+        if (tar->expect->size == size &&
+            file_matches(dirfd, base, tar->expect)) {
+            tar->unchanged++;
+            tar->unchanged_bytes += size;
+            return 0;
+        }
+    }
+
+    if (snprintf(tar->tmp_name, sizeof(tar->tmp_name), ".%s.fota-tmp",
+                 base) >= (int)sizeof(tar->tmp_name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    tar->tmp_base = strdup(base);
+    tar->tmp_dirfd = dup(dirfd);
+    if (!tar->tmp_base || tar->tmp_dirfd < 0)
+        return -1;
+
+    remove_existing(dirfd, tar->tmp_name);
+    tar->fd = openat(dirfd, tar->tmp_name,
+                     O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                     0600);
+    if (tar->fd < 0)
+        return -1;
+
+    set_file_metadata(tar, path, mode, uid, gid);
+    return 0;
+}
+
+/* Drop the temporary file of an entry that was not completed */
+static void discard_tmp(struct fota_tar *tar)
+{
+    if (tar->tmp_dirfd >= 0) {
+        unlinkat(tar->tmp_dirfd, tar->tmp_name, 0);
+        close(tar->tmp_dirfd);
+        tar->tmp_dirfd = -1;
+    }
+    free(tar->tmp_base);
+    tar->tmp_base = NULL;
+}
+
+/* Remove unlisted entries below dirfd, path is its name relative to the root */
+static unsigned long prune_dir(struct fota_tar *tar, int dirfd,
+                               const char *path)
+{
+    unsigned long removed = 0;
+    char sub[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+
+    int fd = dup(dirfd);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+
+        if (snprintf(sub, sizeof(sub), "%s%s%s", path, path[0] ? "/" : "",
+                     de->d_name) >= (int)sizeof(sub))
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            int subfd = openat(dirfd, de->d_name,
+                               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (subfd >= 0) {
+                removed += prune_dir(tar, subfd, sub);
+                close(subfd);
+            }
+            if (!holds_listed(tar, sub) &&
+                unlinkat(dirfd, de->d_name, AT_REMOVEDIR) == 0)
+                removed++;
+        } else if (find_file(tar, sub) < 0) {
+            if (unlinkat(dirfd, de->d_name, 0) == 0)
+                removed++;
+            else
+                syslog(LOG_WARNING, "tar: cannot remove %s: %s",
+                       sub, strerror(errno));
+        }
+    }
+
+    closedir(dir);
+    return removed;
+}
+
+/* ============= Entry creation ============= */
+
+/*
+ * Close the current regular file and set its mtime
+ * In incremental mode, check a listed file against its digest and move
+ * the temporary file into place.
+ */
+static int finish_file(struct fota_tar *tar)
+{
+    int ret = 0;
+
+    if (tar->expect) {
+        unsigned char hash[FOTA_SHA256_DIGEST_LENGTH];
+        char hex[65];
+
+        fota_sha256_final(&tar->sha, hash);
+        fota_sha256_hex(hash, hex);
+        if (strcasecmp(hex, tar->expect->sha256) != 0) {
+            syslog(LOG_ERR, "tar: %s does not match the file manifest",
+                   tar->expect->path);
+            ret = -1;
+        }
+        tar->expect = NULL;
+    }
+
+    if (tar->fd >= 0) {
+        struct timespec times[2] = { tar->mtime, tar->mtime };
+        futimens(tar->fd, times);
+        if (tar->tmp_base && fsync(tar->fd) < 0)
+            ret = -1;
+        if (close(tar->fd) < 0)
+            ret = -1;
+        tar->fd = -1;
+    }
+
+    if (tar->tmp_base) {
+        if (ret == 0 && renameat(tar->tmp_dirfd, tar->tmp_name,
+                                 tar->tmp_dirfd, tar->tmp_base) < 0) {
+            syslog(LOG_ERR, "tar: cannot replace %s: %s",
+                   tar->tmp_base, strerror(errno));
+            ret = -1;
+        }
+        if (ret == 0) {
+            close(tar->tmp_dirfd);
+            tar->tmp_dirfd = -1;
+        }
+        discard_tmp(tar);
+    }
+    return ret;
+}
+
+static int start_entry(struct fota_tar *tar, const unsigned char *h)
+{
+    char namebuf[TAR_BLOCK];
+    char linkbuf[101];
+    char *path;
+    char type = h[156];
+    const char *base;
+    int ret = 0;
+
+    uint64_t size = tar_number(h + 124, 12);
+    mode_t mode = tar_number(h + 100, 8);
+    unsigned long uid = tar_number(h + 108, 8);
+    unsigned long gid = tar_number(h + 116, 8);
+    time_t mtime = tar_number(h + 136, 12);
+
+    /* Name: prefix + "/" + name for POSIX ustar, plain name otherwise
+     * (old GNU headers keep atime/ctime where ustar has the prefix) */
+    if (memcmp(h + 257, "ustar\0", 6) == 0 && h[345]) {
+        snprintf(namebuf, sizeof(namebuf), "%.155s/%.100s", h + 345, h);
+    } else {
+        snprintf(namebuf, sizeof(namebuf), "%.100s", h);
+    }
+    snprintf(linkbuf, sizeof(linkbuf), "%.100s", h + 157);
+
+    if (tar->next.have_size)
+        size = tar->next.size;
+    if (tar->next.have_uid)
+        uid = tar->next.uid;
+    if (tar->next.have_gid)
+        gid = tar->next.gid;
+    if (tar->next.have_mtime)
+        mtime = tar->next.mtime;
+
+    path = tar->next.path ? tar->next.path : namebuf;
+    const char *link = tar->next.linkpath ? tar->next.linkpath : linkbuf;
+
+    /*
+     * Only regular files have data blocks. POSIX has the size field of
+     * links and directories ignored, not zero, and some archivers fill
+     * it in; GNU tar reads no data for device nodes and FIFOs either.
+     */
+    if (type == '0' || type == '\0' || type == '7') {
+        tar->remaining = size;
+        tar->padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    } else {
+        tar->remaining = 0;
+        tar->padding = 0;
+    }
+    tar->mtime.tv_sec = mtime;
+    tar->mtime.tv_nsec = 0;
+    tar->fd = -1;
+
+    if (!sanitize_path(path)) {
+        syslog(LOG_ERR, "tar: refusing unsafe path: %s", path);
+        return -1;
+    }
+
+    if (path[0] == '\0') {
+        /* Archive root ("./"), nothing to create */
+        overrides_clear(&tar->next);
+        tar->state = tar->remaining ? TAR_SKIP : TAR_PADDING;
+        return 0;
+    }
+
+    int dirfd = open_parent(tar, path, &base, 1);
+    if (dirfd < 0) {
+        syslog(LOG_ERR, "tar: cannot open parent of %s: %s",
+               path, strerror(errno));
+        return -1;
+    }
+
+    switch (type) {
+    case '0':
+    case '\0':
+    case '7':
+        if (tar->files) {
+            ret = start_file(tar, dirfd, base, path, size, mode, uid, gid);
+            break;
+        }
+        remove_existing(dirfd, base);
+        tar->fd = openat(dirfd, base,
+                         O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                         0600);
+        if (tar->fd < 0) {
+            ret = -1;
+            break;
+        }
+        set_file_metadata(tar, path, mode, uid, gid);
+        break;
+
+    case '5':
+        if (mkdirat(dirfd, base, 0700) < 0 && errno != EEXIST) {
+            ret = -1;
+            break;
+        }
+        ret = defer_dir(tar, path, mode, uid, gid);
+        break;
+
+    case '2':
+        remove_existing(dirfd, base);
+        if (symlinkat(link, dirfd, base) < 0) {
+            ret = -1;
+            break;
+        }
+        set_metadata(tar, dirfd, base, mode, uid, gid, &tar->mtime, 1);
+        break;
+
+    case '1': {
+        char target[PATH_MAX];
+        const char *target_base;
+
+        snprintf(target, sizeof(target), "%s", link);
+        if (!sanitize_path(target) || target[0] == '\0') {
+            syslog(LOG_ERR, "tar: refusing unsafe link target: %s", link);
+            ret = -1;
+            break;
+        }
+
+        int tdirfd = open_parent(tar, target, &target_base, 0);
+        if (tdirfd < 0) {
+            ret = -1;
+            break;
+        }
+        remove_existing(dirfd, base);
+        ret = linkat(tdirfd, target_base, dirfd, base, 0);
+        close(tdirfd);
+        break;
+    }
+
+    case '3':
+    case '4':
+    case '6': {
+        mode_t kind = type == '3' ? S_IFCHR : type == '4' ? S_IFBLK : S_IFIFO;
+        dev_t dev = makedev(tar_number(h + 329, 8), tar_number(h + 337, 8));
+
+        remove_existing(dirfd, base);
+        if (mknodat(dirfd, base, kind | (mode & 07777), dev) < 0) {
+            ret = -1;
+            break;
+        }
+        set_metadata(tar, dirfd, base, mode, uid, gid, &tar->mtime, 0);
+        break;
+    }
+
+    default:
+        syslog(LOG_WARNING, "tar: skipping %s (type '%c')", path, type);
+        tar->remaining = size;
+        tar->padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+        break;
+    }
+
+    if (ret < 0)
+        syslog(LOG_ERR, "tar: cannot create %s: %s", path, strerror(errno));
+
+    close(dirfd);
+    overrides_clear(&tar->next);
+    tar->entries++;
+
+    if (ret < 0)
+        return -1;
+
+    if (tar->remaining) {
+        tar->state = (tar->fd >= 0 || tar->expect) ? TAR_DATA : TAR_SKIP;
+        return 0;
+    }
+
+    /* Empty files are complete already */
+    tar->state = TAR_PADDING;
+    return finish_file(tar);
+}
+
+/*
+ * Parse the pax records collected in tar->record, "<len> <key>=<value>\n"
+ * each with <len> counting the whole record. Returns -1 on a malformed
+ * record: the archive is not trusted before its digest is checked.
+ */
+static int parse_pax(struct fota_tar *tar)
+{
+    char *p = tar->record;
+    char *end = tar->record + tar->record_len;
+
+    while (p < end) {
+        char *sp;
+        unsigned long len = strtoul(p, &sp, 10);
+
+        if (sp == p || *sp != ' ' || len <= (size_t)(sp - p) + 1 ||
+            len > (size_t)(end - p) || p[len - 1] != '\n') {
+            syslog(LOG_ERR, "tar: malformed pax record");
+            return -1;
+        }
+
+        char *key = sp + 1;
+        char *rec_end = p + len - 1;    /* Points at the trailing '\n' */
+        char *eq = memchr(key, '=', rec_end - key);
+
+        if (eq) {
+            char *value = eq + 1;
+            size_t vlen = rec_end - value;
+            *eq = '\0';
+
+            if (strcmp(key, "path") == 0) {
+                free(tar->next.path);
+                tar->next.path = strndup(value, vlen);
+            } else if (strcmp(key, "linkpath") == 0) {
+                free(tar->next.linkpath);
+                tar->next.linkpath = strndup(value, vlen);
+            } else if (strcmp(key, "size") == 0) {
+                tar->next.size = strtoull(value, NULL, 10);
+                tar->next.have_size = 1;
+            } else if (strcmp(key, "uid") == 0) {
+                tar->next.uid = strtoul(value, NULL, 10);
+                tar->next.have_uid = 1;
+            } else if (strcmp(key, "gid") == 0) {
+                tar->next.gid = strtoul(value, NULL, 10);
+                tar->next.have_gid = 1;
+            } else if (strcmp(key, "mtime") == 0) {
+                tar->next.mtime = strtoll(value, NULL, 10);
+                tar->next.have_mtime = 1;
+            } else if (strncmp(key, "SCHILY.xattr.", 13) == 0 &&
+                       tar->next.nxattrs < TAR_MAX_XATTRS) {
+                struct tar_xattr *x = &tar->next.xattrs[tar->next.nxattrs++];
+                x->name = strdup(key + 13);
+                x->value = malloc(vlen ? vlen : 1);
+                if (x->value)
+                    memcpy(x->value, value, vlen);
+                x->len = vlen;
+            }
+        }
+        p += len;
+    }
+    return 0;
+}
+
+static int finish_record(struct fota_tar *tar)
+{
+    int ret = 0;
+
+    if (tar->record_type == 'x') {
+        ret = parse_pax(tar);
+    } else {
+        /* GNU records are NUL terminated names */
+        char *name = strndup(tar->record, tar->record_len);
+        char **slot = tar->record_type == 'L' ? &tar->next.path
+                                              : &tar->next.linkpath;
+        free(*slot);
+        *slot = name;
+    }
+
+    free(tar->record);
+    tar->record = NULL;
+    tar->record_len = 0;
+    return ret;
+}
+
+/* Handle a complete header block */
+static int handle_header(struct fota_tar *tar)
+{
+    const unsigned char *h = tar->header;
+
+    if (is_zero_block(h)) {
+        if (++tar->zero_blocks == 2)
+            tar->state = TAR_END;
+        return 0;
+    }
+    tar->zero_blocks = 0;
+
+    if (!tar_checksum_ok(h)) {
+        syslog(LOG_ERR, "tar: header checksum mismatch");
+        return -1;
+    }
+
+    char type = h[156];
+    uint64_t size = tar_number(h + 124, 12);
+
+    switch (type) {
+    case 'L':
+    case 'K':
+    case 'x':
+        if (size > TAR_MAX_PAX) {
+            syslog(LOG_ERR, "tar: extended header too large");
+            return -1;
+        }
+        tar->record = malloc(size + 1);
+        if (!tar->record)
+            return -1;
+        tar->record_type = type;
+        tar->record_len = 0;
+        tar->remaining = size;
+        tar->padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+        tar->state = size ? TAR_LONGNAME : TAR_PADDING;
+        if (!size)
+            return finish_record(tar);
+        return 0;
+
+    case 'g':
+        /* Global pax header: not needed for extraction */
+        tar->remaining = size;
+        tar->padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+        tar->state = size ? TAR_SKIP : TAR_PADDING;
+        return 0;
+
+    default:
+        return start_entry(tar, h);
+    }
+}
+
+/* ============= Public API ============= */
+
+fota_tar_t *fota_tar_new(const char *root)
+{
+    struct fota_tar *tar = calloc(1, sizeof(*tar));
+    if (!tar)
+        return NULL;
+
+    tar->rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (tar->rootfd < 0) {
+        syslog(LOG_ERR, "tar: cannot open %s: %s", root, strerror(errno));
+        free(tar);
+        return NULL;
+    }
+
+    tar->fd = -1;
+    tar->tmp_dirfd = -1;
+    tar->state = TAR_HEADER;
+    tar->is_root = (geteuid() == 0);
+
+    return tar;
+}
+
+void fota_tar_set_writeback(fota_tar_t *tar, uint64_t bytes)
+{
+    tar->writeback = bytes;
+}
+
+int fota_tar_set_files(fota_tar_t *tar, const fota_tar_filelist_t *list)
+{
+    tar->paths = calloc(list->nfiles ? list->nfiles : 1, sizeof(char *));
+    if (!tar->paths)
+        return -1;
+
+    tar->files = list->files;
+    for (size_t i = 0; i < list->nfiles; i++) {
+        tar->paths[i] = strdup(list->files[i].path);
+        tar->nfiles++;
+        if (!tar->paths[i] || !sanitize_path(tar->paths[i]) ||
+            tar->paths[i][0] == '\0') {
+            syslog(LOG_ERR, "tar: unusable path in file manifest: %s",
+                   list->files[i].path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+unsigned long fota_tar_prune(fota_tar_t *tar)
+{
+    return prune_dir(tar, tar->rootfd, "");
+}
+
+int fota_tar_write(fota_tar_t *tar, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        size_t n;
+
+        switch (tar->state) {
+        case TAR_HEADER:
+            n = TAR_BLOCK - tar->header_len;
+            if (n > len)
+                n = len;
+            memcpy(tar->header + tar->header_len, p, n);
+            tar->header_len += n;
+            if (tar->header_len == TAR_BLOCK) {
+                tar->header_len = 0;
+                if (handle_header(tar) < 0)
+                    return -1;
+            }
+            break;
+
+        case TAR_DATA:
+            n = len < tar->remaining ? len : tar->remaining;
+            if (tar->fd >= 0) {
+                ssize_t w = write(tar->fd, p, n);
+                if (w <= 0) {
+                    syslog(LOG_ERR, "tar: write failed: %s", strerror(errno));
+                    return -1;
+                }
+                n = w;
+                tar->bytes += n;
+                tar->unsynced += n;
+            }
+            if (tar->expect)
+                fota_sha256_update(&tar->sha, p, n);
+            tar->remaining -= n;
+            if (tar->writeback && tar->unsynced >= tar->writeback) {
+                syncfs(tar->rootfd);
+                tar->unsynced = 0;
+            }
+            if (tar->remaining == 0) {
+                if (finish_file(tar) < 0)
+                    return -1;
+                tar->state = TAR_PADDING;
+            }
+            break;
+
+        case TAR_LONGNAME:
+            n = len < tar->remaining ? len : tar->remaining;
+            memcpy(tar->record + tar->record_len, p, n);
+            tar->record_len += n;
+            tar->remaining -= n;
+            if (tar->remaining == 0) {
+                tar->record[tar->record_len] = '\0';
+                if (finish_record(tar) < 0)
+                    return -1;
+                tar->state = TAR_PADDING;
+            }
+            break;
+
+        case TAR_SKIP:
+            n = len < tar->remaining ? len : tar->remaining;
+            tar->remaining -= n;
+            if (tar->remaining == 0)
+                tar->state = TAR_PADDING;
+            break;
+
+        case TAR_PADDING:
+            n = len < tar->padding ? len : tar->padding;
+            tar->padding -= n;
+            if (tar->padding == 0)
+                tar->state = TAR_HEADER;
+            break;
+
+        case TAR_END:
+        default:
+            /* Trailing blocks after the end marker are ignored */
+            return 0;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    /* Zero length entries complete without further input */
+    if (tar->state == TAR_PADDING && tar->padding == 0)
+        tar->state = TAR_HEADER;
+
+    return 0;
+}
+
+int fota_tar_finish(fota_tar_t *tar)
+{
+    /* GNU tar always writes the end marker, some tools stop after one block */
+    if (tar->state == TAR_END ||
+        (tar->state == TAR_HEADER && tar->header_len == 0)) {
+        apply_dirs(tar);
+        return 0;
+    }
+
+    syslog(LOG_ERR, "tar: archive truncated");
+    return -1;
+}
+
+void fota_tar_stats(const fota_tar_t *tar, unsigned long *entries,
+                    uint64_t *bytes)
+{
+    if (entries)
+        *entries = tar->entries;
+    if (bytes)
+        *bytes = tar->bytes;
+}
+
+void fota_tar_unchanged(const fota_tar_t *tar, unsigned long *files,
+                        uint64_t *bytes)
+{
+    if (files)
+        *files = tar->unchanged;
+    if (bytes)
+        *bytes = tar->unchanged_bytes;
+}
+
+void fota_tar_free(fota_tar_t *tar)
+{
+    if (!tar)
+        return;
+
+    if (tar->fd >= 0)
+        close(tar->fd);
+    discard_tmp(tar);
+    for (size_t i = 0; i < tar->nfiles; i++)
+        free(tar->paths[i]);
+    free(tar->paths);
+    close(tar->rootfd);
+    free(tar->record);
+    for (size_t i = 0; i < tar->ndirs; i++)
+        free(tar->dirs[i].path);
+    free(tar->dirs);
+    overrides_clear(&tar->next);
+    free(tar);
+}
@@ -0,0 +1,95 @@
+/*
+ * fota_tar.h - Streaming tar extractor for the FOTA client
+ *
+ * The extractor is fed an uncompressed tar stream in arbitrary sized
+ * pieces and creates the entries below a root directory as they
+ * arrive. Only a 512 byte header block and the current long name / pax
+ * record are buffered, so memory use does not depend on the archive size.
+ *
+ * Supported: ustar, GNU long names/links, pax path/linkpath/size/uid/
+ * gid/mtime and SCHILY.xattr.* records, regular files, directories,
+ * symlinks, hard links, device nodes and FIFOs.
+ *
+ * Entries are never created outside the root: absolute names are made
+ * relative, ".." components are rejected and symlinks are not followed
+ * while resolving parent directories.
+ *
+ * Given a per-file manifest (fota_tar_set_files()), the extractor
+ * updates a populated directory in place instead: regular files whose
+ * content already matches are left untouched, the others are written to
+ * a temporary name, checked, fsync'ed and renamed over the old file.
+ * A partition holding the previous release then only sees writes for
+ * the files that changed, and never has a half-written file under its
+ * final name.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_TAR_H_
+#define _FOTA_TAR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct fota_tar fota_tar_t;
+
+/* Expected content of a regular file, path relative to the root */
+typedef struct {
+    char *path;
+    uint64_t size;
+    char sha256[65];            /* Hex digest */
+} fota_tar_file_t;
+
+/* Per-file manifest of an archive */
+typedef struct {
+    size_t nfiles;
+    fota_tar_file_t *files;
+} fota_tar_filelist_t;
+
+/* Start extracting into an existing directory, NULL on failure */
+fota_tar_t *fota_tar_new(const char *root);
+
+/*
+ * Flush the target filesystem every bytes of extracted data (0: leave
+ * it to the kernel), bounding the dirty page cache at the cost of speed
+ */
+void fota_tar_set_writeback(fota_tar_t *tar, uint64_t bytes);
+
+/*
+ * Extract incrementally against a per-file manifest (see above).
+ * Listed files are checked against their digest whether they are
+ * written or not; a mismatch fails the extraction. Files the archive
+ * has but the list does not are still replaced atomically.
+ * Call before the first write, returns 0 or -1 on an unsafe path.
+ */
+int fota_tar_set_files(fota_tar_t *tar, const fota_tar_filelist_t *list);
+
+/*
+ * Remove everything below the root that is not in the file list:
+ * unlisted non-directories and directories that hold no listed file.
+ * Done before extracting, so replaced files only ever need space for
+ * one temporary copy. Returns the number of entries removed.
+ */
+unsigned long fota_tar_prune(fota_tar_t *tar);
+
+/* Feed the next piece of the tar stream, returns 0 or -1 on error */
+int fota_tar_write(fota_tar_t *tar, const void *buf, size_t len);
+
+/*
+ * Check that the stream ended on an entry boundary and apply the
+ * ownership, mode and mtime of the extracted directories, which are
+ * held back until then like GNU tar does. Returns 0 or -1.
+ */
+int fota_tar_finish(fota_tar_t *tar);
+
+/* Number of entries and payload bytes extracted so far */
+void fota_tar_stats(const fota_tar_t *tar, unsigned long *entries,
+                    uint64_t *bytes);
+
+/* Listed files that already matched and were left in place */
+void fota_tar_unchanged(const fota_tar_t *tar, unsigned long *files,
+                        uint64_t *bytes);
+
+void fota_tar_free(fota_tar_t *tar);
+
+#endif /* _FOTA_TAR_H_ */
@@ -0,0 +1,244 @@
+/*
+ * fota_throttle.c - Keep update work out of the way of the application
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/syscall.h>
+
+#include "fota_event.h"
+#include "fota_stream.h"
+#include "fota_throttle.h"
+
+/* include/uapi/linux/ioprio.h, not wrapped by glibc */
+#define IOPRIO_WHO_PROCESS      1
+#define IOPRIO_CLASS_IDLE       3
+#define IOPRIO_CLASS_SHIFT      13
+
+static int saved;
+static int saved_policy;
+static struct sched_param saved_param;
+static int saved_ioprio;
+
+static fota_pause_t pause_cfg;
+static double next_sample;
+/* Held while sampling and pausing: apply jobs on other threads wait too */
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static int psi_missing;
+
+/* Threads of this process, 0 if unknown */
+static int thread_count(void)
+{
+    char line[128];
+    int n = 0;
+
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "Threads: %d", &n) == 1)
+            break;
+    }
+    fclose(fp);
+    return n;
+}
+
+int fota_throttle_enter(void)
+{
+    struct sched_param param = { .sched_priority = 0 };
+    int ret = 0;
+
+    /* Threads already running keep their policy */
+    if (thread_count() > 1)
+        syslog(LOG_WARNING, "Low-impact mode entered with threads running, "
+               "they are not throttled");
+
+    if (!saved) {
+        saved_policy = sched_getscheduler(0);
+        sched_getparam(0, &saved_param);
+        saved_ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+        saved = 1;
+    }
+
+    if (sched_setscheduler(0, SCHED_IDLE, &param) < 0) {
+        syslog(LOG_WARNING, "Cannot switch to SCHED_IDLE: %s", strerror(errno));
+        ret = -1;
+    }
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0) {
+        syslog(LOG_WARNING, "Cannot set idle I/O priority: %s", strerror(errno));
+        ret = -1;
+    }
+    return ret;
+}
+
+void fota_throttle_leave(void)
+{
+    if (!saved)
+        return;
+
+    sched_setscheduler(0, saved_policy, &saved_param);
+    if (saved_ioprio >= 0)
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, saved_ioprio);
+    saved = 0;
+}
+
+void fota_throttle_set_pause(const fota_pause_t *pause)
+{
+    pause_cfg = *pause;
+    if (pause_cfg.max_pause <= 0)
+        pause_cfg.max_pause = 30;
+    next_sample = 0;
+}
+
+/* "some avg10=1.23 avg60=..." from /proc/pressure/<res>, -1 if unavailable */
+static double read_psi(const char *res)
+{
+    char path[64], line[128];
+    double avg10 = -1;
+
+    snprintf(path, sizeof(path), "/proc/pressure/%s", res);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    if (fgets(line, sizeof(line), fp))
+        sscanf(line, "some avg10=%lf", &avg10);
+    fclose(fp);
+    return avg10;
+}
+
+static double read_load(void)
+{
+    double load = 0;
+
+    FILE *fp = fopen("/proc/loadavg", "r");
+    if (!fp)
+        return 0;
+    if (fscanf(fp, "%lf", &load) != 1)
+        load = 0;
+    fclose(fp);
+    return load;
+}
+
+/*
+ * Returns 1 and describes the reason if a signal is above its threshold
+ */
+static int overloaded(char *reason, size_t len)
+{
+    if (pause_cfg.max_load > 0) {
+        double load = read_load();
+        if (load > pause_cfg.max_load) {
+            snprintf(reason, len, "load %.2f > %.2f", load, pause_cfg.max_load);
+            return 1;
+        }
+    }
+
+    if (pause_cfg.max_psi > 0 && !psi_missing) {
+        double cpu = read_psi("cpu");
+        double io = read_psi("io");
+
+        if (cpu < 0 && io < 0) {
+            syslog(LOG_WARNING, "No /proc/pressure (CONFIG_PSI), pause_psi ignored");
+            psi_missing = 1;
+            return 0;
+        }
+        if (cpu > pause_cfg.max_psi || io > pause_cfg.max_psi) {
+            snprintf(reason, len, "pressure cpu %.1f%% io %.1f%% > %.1f%%",
+                     cpu, io, pause_cfg.max_psi);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void fota_throttle_pause(void)
+{
+    char reason[96];
+
+    if (pause_cfg.max_load <= 0 && pause_cfg.max_psi <= 0)
+        return;
+
+    pthread_mutex_lock(&pause_lock);
+    double now = fota_now();
+    if (now < next_sample)
+        goto out;
+    next_sample = now + 1;
+
+    if (!overloaded(reason, sizeof(reason)))
+        goto out;
+
+    syslog(LOG_INFO, "Pausing update work: %s", reason);
+
+    int waited = 0;
+    while (waited < pause_cfg.max_pause && !fota_event_stop_pending()) {
+        sleep(1);
+        waited++;
+        if (!overloaded(reason, sizeof(reason)))
+            break;
+    }
+
+    syslog(LOG_INFO, "Resuming update work after %d s", waited);
+    next_sample = fota_now() + 1;
+out:
+    pthread_mutex_unlock(&pause_lock);
+}
+
+void fota_writeback_init(fota_writeback_t *wb, int fd)
+{
+    memset(wb, 0, sizeof(*wb));
+    wb->fd = fd;
+}
+
+void fota_writeback_written(fota_writeback_t *wb, uint64_t offset, size_t len)
+{
+    if (wb->start == wb->end) {
+        wb->start = offset;
+        wb->end = offset + len;
+    } else {
+        if (offset < wb->start)
+            wb->start = offset;
+        if (offset + len > wb->end)
+            wb->end = offset + len;
+    }
+
+    if (wb->end - wb->start < FOTA_WRITEBACK_WINDOW)
+        return;
+
+    /* Start writeback of this window without waiting for it */
+    sync_file_range(wb->fd, wb->start, wb->end - wb->start,
+                    SYNC_FILE_RANGE_WRITE);
+
+    /* Wait for the previous one and drop it from the page cache */
+    if (wb->prev_end > wb->prev_start) {
+        sync_file_range(wb->fd, wb->prev_start, wb->prev_end - wb->prev_start,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(wb->fd, wb->prev_start, wb->prev_end - wb->prev_start,
+                      POSIX_FADV_DONTNEED);
+    }
+
+    wb->prev_start = wb->start;
+    wb->prev_end = wb->end;
+    wb->start = wb->end;
+}
+
+int fota_syncfs(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    int ret = syncfs(fd);
+    if (ret < 0)
+        syslog(LOG_ERR, "syncfs %s failed: %s", path, strerror(errno));
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,80 @@
+/*
+ * fota_throttle.h - Keep update work out of the way of the application
+ *
+ * Installing an update competes with the device's real workload for CPU,
+ * the block device and the page cache. In low-impact mode the client
+ * runs the apply phase as SCHED_IDLE with the idle I/O class (inherited
+ * by mkfs and other helpers), keeps the amount of dirty page cache small
+ * with sync_file_range()/syncfs() on the target instead of letting it
+ * pile up for a system-wide sync(), and optionally pauses while the
+ * load average or the CPU/I/O pressure (PSI) is above a threshold.
+ *
+ * The idle I/O class only has an effect with an I/O scheduler that
+ * implements priorities (BFQ, CFQ); with none/mq-deadline the writeback
+ * limiting is what keeps request queues short.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_THROTTLE_H_
+#define _FOTA_THROTTLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Dirty data allowed per file before writeback is started and waited for */
+#define FOTA_WRITEBACK_WINDOW (2 * 1024 * 1024)
+
+/* Extracted bytes between two syncfs() calls in low-impact mode */
+#define FOTA_WRITEBACK_SYNC (8 * 1024 * 1024)
+
+typedef struct {
+    double max_load;            /* 1 min load average, 0: ignore */
+    double max_psi;             /* CPU or I/O "some avg10" in %, 0: ignore */
+    int max_pause;              /* Longest single pause in seconds */
+} fota_pause_t;
+
+/*
+ * Switch the calling thread to SCHED_IDLE and the idle I/O class,
+ * remembering the previous settings. Both act on the calling thread
+ * only: call it before starting any threads, only threads and helper
+ * processes created afterwards inherit the policy. A warning is logged
+ * if other threads already run. Returns 0 or -1.
+ */
+int fota_throttle_enter(void);
+
+/* Restore the settings saved by fota_throttle_enter(), calling thread only */
+void fota_throttle_leave(void);
+
+/* Pause thresholds, all zero: never pause */
+void fota_throttle_set_pause(const fota_pause_t *pause);
+
+/*
+ * Called between pieces of work. Samples the load signals at most once
+ * per second and sleeps while one is above its threshold, up to
+ * max_pause seconds at a time. Thread-safe: other threads calling it
+ * during a pause wait until it ends.
+ */
+void fota_throttle_pause(void);
+
+/*
+ * Bounded writeback for a buffered file: once a window of dirty data
+ * has accumulated its writeback is started, and the previous window is
+ * waited for and dropped from the page cache. At most two windows of
+ * the file are dirty or under writeback at any time.
+ */
+typedef struct {
+    int fd;
+    uint64_t start, end;        /* Dirty range not yet submitted */
+    uint64_t prev_start, prev_end;  /* Submitted, not yet waited for */
+} fota_writeback_t;
+
+void fota_writeback_init(fota_writeback_t *wb, int fd);
+
+/* Account a write of len bytes at offset */
+void fota_writeback_written(fota_writeback_t *wb, uint64_t offset, size_t len);
+
+/* Flush the filesystem containing path (instead of a global sync()) */
+int fota_syncfs(const char *path);
+
+#endif /* _FOTA_THROTTLE_H_ */
@@ -0,0 +1,386 @@
+/*
+ * fota_verity.c - dm-verity hash tree of a read-only rootfs slot
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "fota_sha256.h"
+#include "fota_stream.h"
+#include "fota_verity.h"
+
+#define BLOCK           FOTA_VERITY_BLOCK_SIZE
+#define DIGEST          FOTA_SHA256_DIGEST_LENGTH
+#define HASH_BITS       7               /* log2(BLOCK / DIGEST) */
+#define READ_BLOCKS     256             /* Data blocks per read */
+
+/* veritysetup superblock, little-endian, in the block before the tree */
+#define SB_SIGNATURE    "verity\0\0"
+#define SB_VERSION      0x08
+#define SB_HASH_TYPE    0x0c
+#define SB_UUID         0x10
+#define SB_ALGORITHM    0x20
+#define SB_DATA_BS      0x40
+#define SB_HASH_BS      0x44
+#define SB_DATA_BLOCKS  0x48
+#define SB_SALT_SIZE    0x50
+#define SB_SALT         0x58
+
+/* ============= Helpers ============= */
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> (8 * i);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+static void to_hex(const unsigned char *p, size_t len, char *out)
+{
+    for (size_t i = 0; i < len; i++)
+        sprintf(out + 2 * i, "%02x", p[i]);
+    out[2 * len] = '\0';
+}
+
+/* Returns the number of bytes, -1 if hex is malformed or too long */
+static int from_hex(const char *hex, unsigned char *out, size_t max)
+{
+    size_t len = strlen(hex);
+
+    if (len % 2 || len / 2 > max)
+        return -1;
+    for (size_t i = 0; i < len / 2; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+            return -1;
+        out[i] = byte;
+    }
+    return len / 2;
+}
+
+/* Blocks of level i, level 0 hashing the data blocks */
+static uint64_t level_blocks(const fota_verity_t *v, int i)
+{
+    int shift = (i + 1) * HASH_BITS;
+
+    return (v->data_blocks + ((uint64_t)1 << shift) - 1) >> shift;
+}
+
+/* Block of level i, counted from hash_start: the top level comes first */
+static uint64_t level_start(const fota_verity_t *v, int i)
+{
+    uint64_t pos = 0;
+
+    for (int j = v->levels - 1; j > i; j--)
+        pos += level_blocks(v, j);
+    return pos;
+}
+
+/* Salted digests of n consecutive blocks, four at a time with scratch */
+static void hash_blocks(const fota_verity_t *v, const unsigned char *blocks,
+                        size_t n, unsigned char *out, unsigned char *scratch)
+{
+    size_t i = 0;
+
+    if (scratch) {
+        const size_t len = v->salt_len + BLOCK;
+        const unsigned char *lanes[4];
+
+        for (; i + 4 <= n; i += 4) {
+            for (int l = 0; l < 4; l++) {
+                if (v->salt_len) {
+                    memcpy(scratch + l * len, v->salt, v->salt_len);
+                    memcpy(scratch + l * len + v->salt_len,
+                           blocks + (i + l) * BLOCK, BLOCK);
+                    lanes[l] = scratch + l * len;
+                } else {
+                    lanes[l] = blocks + (i + l) * BLOCK;
+                }
+            }
+            fota_sha256_x4(lanes, len, (unsigned char (*)[DIGEST])(out + i * DIGEST));
+        }
+    }
+
+    for (; i < n; i++) {
+        fota_sha256_ctx ctx;
+
+        fota_sha256_init(&ctx);
+        fota_sha256_update(&ctx, v->salt, v->salt_len);
+        fota_sha256_update(&ctx, blocks + i * BLOCK, BLOCK);
+        fota_sha256_final(&ctx, out + i * DIGEST);
+    }
+}
+
+static int check_root(const fota_verity_t *v, const char *dev,
+                      const char *expected_root)
+{
+    char root[2 * DIGEST + 1];
+
+    fota_verity_root_hex(v, root);
+    if (expected_root && expected_root[0] && strcasecmp(root, expected_root) != 0) {
+        syslog(LOG_ERR, "verity: root hash of %s is %s, expected %s",
+               dev, root, expected_root);
+        return -1;
+    }
+    return 0;
+}
+
+/* ============= Public API ============= */
+
+int fota_verity_init(fota_verity_t *v, uint64_t image_size, const char *salt_hex)
+{
+    memset(v, 0, sizeof(*v));
+
+    if (image_size % BLOCK || image_size < 2 * BLOCK) {
+        syslog(LOG_ERR, "verity: image size %llu is not a multiple of %d bytes",
+               (unsigned long long)image_size, BLOCK);
+        return -1;
+    }
+
+    int salt_len = from_hex(salt_hex ? salt_hex : "", v->salt, sizeof(v->salt));
+    if (salt_len < 0) {
+        syslog(LOG_ERR, "verity: bad salt %s (at most %d bytes of hex)",
+               salt_hex, FOTA_VERITY_MAX_SALT);
+        return -1;
+    }
+    v->salt_len = salt_len;
+
+    /* Same number of levels as the kernel derives from data_blocks */
+    v->data_blocks = image_size / BLOCK;
+    while ((v->data_blocks - 1) >> (v->levels * HASH_BITS))
+        v->levels++;
+    if (v->levels > FOTA_VERITY_MAX_LEVELS)
+        return -1;
+
+    v->hash_start = v->data_blocks + 1;
+    for (int i = 0; i < v->levels; i++)
+        v->hash_blocks += level_blocks(v, i);
+    return 0;
+}
+
+int fota_verity_build(fota_verity_t *v, const char *dev, const char *expected_root)
+{
+    unsigned char *tree = NULL, *buf = NULL, *scratch = NULL;
+    unsigned char sb[BLOCK];
+    uint64_t capacity = 0;
+    struct stat st;
+    int ret = -1;
+
+    /* The flash, not what the writer left in the page cache */
+    int fd = open(dev, O_RDWR | O_DIRECT | O_CLOEXEC);
+    int direct = 1;
+    if (fd < 0 && errno == EINVAL) {
+        fd = open(dev, O_RDWR | O_CLOEXEC);
+        direct = 0;
+    }
+    if (fd < 0) {
+        syslog(LOG_ERR, "verity: cannot open %s: %s", dev, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) &&
+        ioctl(fd, BLKGETSIZE64, &capacity) == 0 &&
+        (v->hash_start + v->hash_blocks) * BLOCK > capacity) {
+        syslog(LOG_ERR, "verity: image and hash tree (%llu bytes) do not fit "
+               "into %s (%llu bytes)",
+               (unsigned long long)((v->hash_start + v->hash_blocks) * BLOCK),
+               dev, (unsigned long long)capacity);
+        goto out;
+    }
+
+    tree = calloc(v->hash_blocks, BLOCK);
+    if (posix_memalign((void **)&buf, BLOCK, READ_BLOCKS * BLOCK) != 0)
+        buf = NULL;
+    scratch = malloc(4 * (v->salt_len + BLOCK));
+    if (!tree || !buf || !scratch) {
+        syslog(LOG_ERR, "verity: out of memory for a %llu block tree",
+               (unsigned long long)v->hash_blocks);
+        goto out;
+    }
+    if (!direct)
+        posix_fadvise(fd, 0, v->data_blocks * BLOCK, POSIX_FADV_DONTNEED);
+
+    /* Level 0 from the data, read in order */
+    unsigned char *level0 = tree + level_start(v, 0) * BLOCK;
+    for (uint64_t b = 0; b < v->data_blocks; b += READ_BLOCKS) {
+        size_t n = v->data_blocks - b < READ_BLOCKS ? v->data_blocks - b : READ_BLOCKS;
+        ssize_t got = pread(fd, buf, n * BLOCK, b * BLOCK);
+
+        if (got != (ssize_t)(n * BLOCK)) {
+            syslog(LOG_ERR, "verity: cannot read %s at %llu: %s", dev,
+                   (unsigned long long)(b * BLOCK),
+                   got < 0 ? strerror(errno) : "short read");
+            goto out;
+        }
+        if (b > 0 || n < READ_BLOCKS) {
+            hash_blocks(v, buf, n, level0 + b * DIGEST, scratch);
+            continue;
+        }
+
+        /*
+         * Four SIMD lanes or one stream: hardware SHA instructions (also
+         * inside libcrypto) beat the lanes, NEON lanes may beat ARMv7
+         * scalar code. Half of the first read is hashed each way.
+         */
+        double t0 = fota_now();
+        hash_blocks(v, buf, n / 2, level0, scratch);
+        double t1 = fota_now();
+        hash_blocks(v, buf + n / 2 * BLOCK, n / 2, level0 + n / 2 * DIGEST, NULL);
+        if (fota_now() - t1 <= t1 - t0) {
+            free(scratch);
+            scratch = NULL;
+        }
+    }
+
+    /* Each level hashes the blocks of the one below, zero padded */
+    for (int i = 0; i + 1 < v->levels; i++)
+        hash_blocks(v, tree + level_start(v, i) * BLOCK, level_blocks(v, i),
+                    tree + level_start(v, i + 1) * BLOCK, scratch);
+    hash_blocks(v, tree, 1, v->root, NULL);
+
+    if (check_root(v, dev, expected_root) < 0)
+        goto out;
+
+    /* The tree first, the superblock that points at it once it is durable */
+    for (uint64_t b = 0; b < v->hash_blocks; b += READ_BLOCKS) {
+        size_t n = v->hash_blocks - b < READ_BLOCKS ? v->hash_blocks - b : READ_BLOCKS;
+
+        memcpy(buf, tree + b * BLOCK, n * BLOCK);
+        if (pwrite(fd, buf, n * BLOCK, (v->hash_start + b) * BLOCK) !=
+            (ssize_t)(n * BLOCK)) {
+            syslog(LOG_ERR, "verity: cannot write hash tree to %s: %s", dev,
+                   strerror(errno));
+            goto out;
+        }
+    }
+    if (fdatasync(fd) < 0) {
+        syslog(LOG_ERR, "verity: cannot flush hash tree to %s: %s", dev,
+               strerror(errno));
+        goto out;
+    }
+
+    memset(sb, 0, sizeof(sb));
+    memcpy(sb, SB_SIGNATURE, 8);
+    put_le32(sb + SB_VERSION, 1);
+    put_le32(sb + SB_HASH_TYPE, 1);
+    memcpy(sb + SB_UUID, v->root, 16);      /* Any UUID, this one is stable */
+    sb[SB_UUID + 6] = (sb[SB_UUID + 6] & 0x0f) | 0x40;
+    sb[SB_UUID + 8] = (sb[SB_UUID + 8] & 0x3f) | 0x80;
+    strcpy((char *)sb + SB_ALGORITHM, "sha256");
+    put_le32(sb + SB_DATA_BS, BLOCK);
+    put_le32(sb + SB_HASH_BS, BLOCK);
+    put_le64(sb + SB_DATA_BLOCKS, v->data_blocks);
+    sb[SB_SALT_SIZE] = v->salt_len;
+    memcpy(sb + SB_SALT, v->salt, v->salt_len);
+
+    memcpy(buf, sb, BLOCK);
+    if (pwrite(fd, buf, BLOCK, (v->hash_start - 1) * BLOCK) != BLOCK ||
+        fdatasync(fd) < 0) {
+        syslog(LOG_ERR, "verity: cannot write superblock to %s: %s", dev,
+               strerror(errno));
+        goto out;
+    }
+    ret = 0;
+
+out:
+    close(fd);
+    free(tree);
+    free(buf);
+    free(scratch);
+    return ret;
+}
+
+int fota_verity_load(fota_verity_t *v, const char *dev, const char *expected_root)
+{
+    unsigned char blocks[2 * BLOCK];
+    int ret = -1;
+
+    int fd = open(dev, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        syslog(LOG_ERR, "verity: cannot open %s: %s", dev, strerror(errno));
+        return -1;
+    }
+
+    /* Superblock and top level are adjacent */
+    if (pread(fd, blocks, sizeof(blocks), (v->hash_start - 1) * BLOCK) !=
+        (ssize_t)sizeof(blocks)) {
+        syslog(LOG_ERR, "verity: cannot read hash tree of %s", dev);
+        goto out;
+    }
+
+    const unsigned char *sb = blocks;
+    if (memcmp(sb, SB_SIGNATURE, 8) != 0 ||
+        get_le32(sb + SB_VERSION) != 1 || get_le32(sb + SB_HASH_TYPE) != 1 ||
+        strcmp((const char *)sb + SB_ALGORITHM, "sha256") != 0 ||
+        get_le32(sb + SB_DATA_BS) != BLOCK || get_le32(sb + SB_HASH_BS) != BLOCK ||
+        get_le64(sb + SB_DATA_BLOCKS) != v->data_blocks ||
+        (size_t)(sb[SB_SALT_SIZE] | sb[SB_SALT_SIZE + 1] << 8) != v->salt_len ||
+        memcmp(sb + SB_SALT, v->salt, v->salt_len) != 0) {
+        syslog(LOG_ERR, "verity: no hash tree for this image on %s", dev);
+        goto out;
+    }
+
+    hash_blocks(v, blocks + BLOCK, 1, v->root, NULL);
+    ret = check_root(v, dev, expected_root);
+
+out:
+    close(fd);
+    return ret;
+}
+
+void fota_verity_root_hex(const fota_verity_t *v, char *out)
+{
+    to_hex(v->root, DIGEST, out);
+}
+
+int fota_verity_rootargs(const fota_verity_t *v, const char *dev,
+                         char *buf, size_t len)
+{
+    char root[2 * DIGEST + 1], salt[2 * FOTA_VERITY_MAX_SALT + 1];
+
+    fota_verity_root_hex(v, root);
+    to_hex(v->salt, v->salt_len, salt);
+
+    /*
+     * dm-mod.waitfor holds dm-init back until the eMMC is probed, the
+     * table is "<start> <sectors> verity <version> <data dev> <hash dev>
+     * <data bs> <hash bs> <data blocks> <hash start> <alg> <root> <salt>
+     * <#opt> <opt>"
+     */
+    int n = snprintf(buf, len,
+                     "root=/dev/dm-0 dm-mod.waitfor=%s dm-mod.create=\"vroot,,,ro,"
+                     "0 %llu verity 1 %s %s %d %d %llu %llu sha256 %s %s "
+                     "1 restart_on_corruption\"",
+                     dev, (unsigned long long)(v->data_blocks * (BLOCK / 512)),
+                     dev, dev, BLOCK, BLOCK,
+                     (unsigned long long)v->data_blocks,
+                     (unsigned long long)v->hash_start,
+                     root, v->salt_len ? salt : "-");
+    return n > 0 && (size_t)n < len ? 0 : -1;
+}
@@ -0,0 +1,82 @@
+/*
+ * fota_verity.h - dm-verity hash tree of a read-only rootfs slot
+ *
+ * A squashfs or erofs image is never written after the update, so the
+ * kernel can check it block by block as it is read instead of anyone
+ * hashing the whole partition at boot. The slot then boots through a
+ * dm-verity target (dm-mod.create= on the kernel command line, no
+ * initramfs needed) and a block that does not match the tree fails the
+ * read; with restart_on_corruption the board reboots and the bootcount
+ * falls back to the other slot.
+ *
+ * The tree is built on the device from the image as it landed on the
+ * partition (read back with O_DIRECT, so it is the flash that is
+ * hashed, not the page cache) and stored behind the image on the same
+ * partition, in the layout veritysetup uses with --hash-offset:
+ *
+ *   | image | superblock (4 KiB) | top level | ... | level 0 |
+ *
+ * Hash type 1, SHA-256, 4 KiB data and hash blocks, every digest
+ * salted in front. The blocks are independent messages, so they are
+ * hashed four at a time with fota_sha256_x4() where that is faster than
+ * the selected backend. When the manifest carries the root hash computed on
+ * the build host, the build fails unless the partition reproduces it.
+ * At the slot switch the root hash is taken from the top level of the
+ * tree again, which costs two block reads whatever the image size.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_VERITY_H_
+#define _FOTA_VERITY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FOTA_VERITY_BLOCK_SIZE  4096
+#define FOTA_VERITY_MAX_SALT    32      /* Bytes, keeps the command line short */
+#define FOTA_VERITY_MAX_LEVELS  8
+
+typedef struct {
+    uint64_t data_blocks;       /* Image size in blocks */
+    uint64_t hash_start;        /* Block of the top level, after the superblock */
+    uint64_t hash_blocks;       /* Blocks of all levels */
+    int levels;
+    unsigned char salt[FOTA_VERITY_MAX_SALT];
+    size_t salt_len;
+    unsigned char root[32];     /* Root hash, set by build and load */
+} fota_verity_t;
+
+/*
+ * Tree layout for an image of image_size bytes (a multiple of the block
+ * size) followed by its tree, with the salt given as hex ("" for none).
+ * Returns 0 or -1.
+ */
+int fota_verity_init(fota_verity_t *v, uint64_t image_size, const char *salt_hex);
+
+/*
+ * Hash the image on dev, write the tree and superblock behind it and
+ * flush them. If expected_root (hex) is not empty, the root hash must
+ * match it. Returns 0 or -1.
+ */
+int fota_verity_build(fota_verity_t *v, const char *dev, const char *expected_root);
+
+/*
+ * Check the superblock on dev against the layout in v and recompute the
+ * root hash from the top level of the tree, which must match
+ * expected_root unless that is empty. Returns 0 or -1.
+ */
+int fota_verity_load(fota_verity_t *v, const char *dev, const char *expected_root);
+
+/* Root hash as hex, out must hold 65 bytes */
+void fota_verity_root_hex(const fota_verity_t *v, char *out);
+
+/*
+ * Kernel arguments booting the image on dev through dm-verity:
+ * root=/dev/dm-0 and its dm-mod.create table. Returns 0, -1 if len is
+ * too small.
+ */
+int fota_verity_rootargs(const fota_verity_t *v, const char *dev,
+                         char *buf, size_t len);
+
+#endif /* _FOTA_VERITY_H_ */
@@ -0,0 +1,398 @@
+/*
+ * fota_zstd.c - Parallel zstd decompression for the FOTA client
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifdef FOTA_HAVE_ZSTD
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <zstd.h>
+#include <zstd_errors.h>
+
+#include "fota_zstd.h"
+
+#define ZSTD_MAX_THREADS 16
+
+/* Longest frame header (ZSTD_FRAMEHEADERSIZE_MAX, not in the stable API) */
+#define ZSTD_HEADER_MAX 18
+
+struct zstd_job {
+    unsigned char *in;          /* The compressed frame */
+    size_t in_len;
+    size_t in_cap;
+    unsigned char *out;         /* Its content, filled by a worker */
+    size_t out_len;
+    size_t out_cap;
+    int done;
+    int failed;
+};
+
+/*
+ * Jobs are used round robin: queued counts the frames handed out, taken
+ * those a worker has started on, sunk those passed on to the sink.
+ * sunk <= taken <= queued <= sunk + njobs.
+ */
+struct fota_zstd {
+    fota_sink_fn sink;
+    void *opaque;
+
+    /* In place decompression */
+    ZSTD_DStream *ds;
+    unsigned char *out;
+    int streaming;              /* Inside a frame decompressed in place */
+
+    /* Start of the next frame, collected until it is complete */
+    unsigned char *acc;
+    size_t acc_len;
+    size_t acc_cap;
+    unsigned long frames;
+
+    unsigned nthreads;
+    pthread_t threads[ZSTD_MAX_THREADS];
+    struct zstd_job *jobs;
+    unsigned njobs;
+    unsigned long queued;
+    unsigned long taken;
+    unsigned long sunk;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+};
+
+static void *zstd_worker(void *arg)
+{
+    struct fota_zstd *z = arg;
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+
+    pthread_mutex_lock(&z->lock);
+    for (;;) {
+        while (z->taken == z->queued && !z->stop)
+            pthread_cond_wait(&z->work, &z->lock);
+        if (z->stop)
+            break;
+
+        struct zstd_job *job = &z->jobs[z->taken++ % z->njobs];
+        pthread_mutex_unlock(&z->lock);
+
+        int failed = 1;
+        if (dctx) {
+            size_t ret = ZSTD_decompressDCtx(dctx, job->out, job->out_len,
+                                             job->in, job->in_len);
+            if (ZSTD_isError(ret))
+                syslog(LOG_ERR, "zstd: %s", ZSTD_getErrorName(ret));
+            else if (ret != job->out_len)
+                syslog(LOG_ERR, "zstd: frame content size mismatch");
+            else
+                failed = 0;
+        }
+
+        pthread_mutex_lock(&z->lock);
+        job->failed = failed;
+        job->done = 1;
+        pthread_cond_broadcast(&z->done);
+    }
+    pthread_mutex_unlock(&z->lock);
+
+    ZSTD_freeDCtx(dctx);
+    return NULL;
+}
+
+static int reserve(unsigned char **buf, size_t *cap, size_t len)
+{
+    if (*cap >= len)
+        return 0;
+
+    size_t n = *cap ? *cap : FOTA_STREAM_BUF_SIZE;
+    while (n < len)
+        n *= 2;
+    unsigned char *p = realloc(*buf, n);
+    if (!p) {
+        syslog(LOG_ERR, "zstd: out of memory");
+        return -1;
+    }
+    *buf = p;
+    *cap = n;
+    return 0;
+}
+
+/* Pass the oldest frame handed out on to the sink, in archive order */
+static int sink_job(struct fota_zstd *z)
+{
+    struct zstd_job *job = &z->jobs[z->sunk % z->njobs];
+
+    pthread_mutex_lock(&z->lock);
+    while (!job->done)
+        pthread_cond_wait(&z->done, &z->lock);
+    job->done = 0;
+    pthread_mutex_unlock(&z->lock);
+
+    z->sunk++;
+    if (job->failed)
+        return -1;
+    return z->sink(z->opaque, job->out, job->out_len);
+}
+
+static int drain(struct fota_zstd *z)
+{
+    while (z->sunk < z->queued) {
+        if (sink_job(z) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Hand the first size bytes of acc, a frame with content bytes, to a
+ * worker. The collect buffer goes with it, the rest is copied back.
+ */
+static int submit(struct fota_zstd *z, size_t size, size_t content)
+{
+    if (z->queued - z->sunk == z->njobs && sink_job(z) < 0)
+        return -1;
+
+    struct zstd_job *job = &z->jobs[z->queued % z->njobs];
+    if (reserve(&job->out, &job->out_cap, content) < 0)
+        return -1;
+    job->out_len = content;
+
+    unsigned char *frame = z->acc;
+    size_t cap = z->acc_cap, rest = z->acc_len - size;
+    z->acc = job->in;
+    z->acc_cap = job->in_cap;
+    z->acc_len = 0;
+    job->in = frame;
+    job->in_cap = cap;
+    job->in_len = size;
+
+    if (reserve(&z->acc, &z->acc_cap, rest) < 0)
+        return -1;
+    memcpy(z->acc, frame + size, rest);
+    z->acc_len = rest;
+
+    pthread_mutex_lock(&z->lock);
+    z->queued++;
+    pthread_cond_signal(&z->work);
+    pthread_mutex_unlock(&z->lock);
+
+    z->frames++;
+    return 0;
+}
+
+/*
+ * Decompress in place up to the end of the current frame
+ * Returns the bytes consumed, or -1 on failure
+ */
+static long stream_frame(struct fota_zstd *z, const unsigned char *p, size_t len)
+{
+    ZSTD_inBuffer in = { p, len, 0 };
+
+    for (;;) {
+        ZSTD_outBuffer out = { z->out, FOTA_STREAM_BUF_SIZE, 0 };
+        size_t ret = ZSTD_decompressStream(z->ds, &out, &in);
+        if (ZSTD_isError(ret)) {
+            syslog(LOG_ERR, "zstd: %s", ZSTD_getErrorName(ret));
+            return -1;
+        }
+        if (out.pos > 0 && z->sink(z->opaque, z->out, out.pos) < 0)
+            return -1;
+
+        /* Frame complete and flushed, the rest is the next one */
+        if (ret == 0) {
+            z->streaming = 0;
+            z->frames++;
+            break;
+        }
+        if (in.pos == in.size && out.pos < out.size)
+            break;
+    }
+    return in.pos;
+}
+
+static void consume(struct fota_zstd *z, size_t n)
+{
+    memmove(z->acc, z->acc + n, z->acc_len - n);
+    z->acc_len -= n;
+}
+
+/*
+ * Go through the frames collected in acc: complete ones that fit go to
+ * the workers, the others are decompressed in place
+ */
+static int collect(struct fota_zstd *z)
+{
+    while (z->acc_len > 0) {
+        if (z->streaming) {
+            long n = stream_frame(z, z->acc, z->acc_len);
+            if (n < 0)
+                return -1;
+            consume(z, n);
+            continue;
+        }
+
+        if (z->acc_len < 4)
+            return 0;
+
+        uint32_t magic = z->acc[0] | z->acc[1] << 8 | z->acc[2] << 16 |
+                         (uint32_t)z->acc[3] << 24;
+        unsigned long long content = ZSTD_getFrameContentSize(z->acc, z->acc_len);
+        if (content == ZSTD_CONTENTSIZE_ERROR) {
+            if (z->acc_len < ZSTD_HEADER_MAX)
+                return 0;
+            syslog(LOG_ERR, "zstd: bad frame header");
+            return -1;
+        }
+
+        /* Skippable frames (pzstd writes them) are dropped by the stream */
+        if (z->nthreads < 2 ||
+            (magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START ||
+            content == ZSTD_CONTENTSIZE_UNKNOWN || content > FOTA_ZSTD_MAX_FRAME) {
+            if (drain(z) < 0)
+                return -1;
+            z->streaming = 1;
+            continue;
+        }
+
+        size_t size = ZSTD_findFrameCompressedSize(z->acc, z->acc_len);
+        if (ZSTD_isError(size)) {
+            if (ZSTD_getErrorCode(size) != ZSTD_error_srcSize_wrong ||
+                z->acc_len > ZSTD_compressBound(content) + ZSTD_HEADER_MAX) {
+                syslog(LOG_ERR, "zstd: bad frame");
+                return -1;
+            }
+            return 0;   /* Not complete yet */
+        }
+
+        if (submit(z, size, content) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+fota_zstd_t *fota_zstd_new(unsigned threads, fota_sink_fn sink, void *opaque)
+{
+    struct fota_zstd *z = calloc(1, sizeof(*z));
+    if (!z)
+        return NULL;
+
+    z->sink = sink;
+    z->opaque = opaque;
+    z->ds = ZSTD_createDStream();
+    z->out = malloc(FOTA_STREAM_BUF_SIZE);
+    if (!z->ds || !z->out)
+        goto fail;
+
+    if (threads > ZSTD_MAX_THREADS)
+        threads = ZSTD_MAX_THREADS;
+    if (threads < 2)
+        return z;
+
+    /* One frame more than workers, so they keep going while one is sunk */
+    z->njobs = threads + 1;
+    z->jobs = calloc(z->njobs, sizeof(*z->jobs));
+    if (!z->jobs)
+        goto fail;
+
+    pthread_mutex_init(&z->lock, NULL);
+    pthread_cond_init(&z->work, NULL);
+    pthread_cond_init(&z->done, NULL);
+    while (z->nthreads < threads &&
+           pthread_create(&z->threads[z->nthreads], NULL, zstd_worker, z) == 0)
+        z->nthreads++;
+
+    if (z->nthreads < threads)
+        syslog(LOG_WARNING, "zstd: started %u of %u threads", z->nthreads,
+               threads);
+    return z;
+
+fail:
+    ZSTD_freeDStream(z->ds);
+    free(z->out);
+    free(z);
+    return NULL;
+}
+
+int fota_zstd_feed(fota_zstd_t *z, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    /* Inside a frame decompressed in place, nothing needs collecting */
+    if (z->streaming && z->acc_len == 0) {
+        long n = stream_frame(z, p, len);
+        if (n < 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    if (len == 0)
+        return 0;
+
+    if (reserve(&z->acc, &z->acc_cap, z->acc_len + len) < 0)
+        return -1;
+    memcpy(z->acc + z->acc_len, p, len);
+    z->acc_len += len;
+    return collect(z);
+}
+
+int fota_zstd_finish(fota_zstd_t *z)
+{
+    /* Frames too short to read a full header from, or truncated ones */
+    while (z->acc_len > 0) {
+        if (!z->streaming) {
+            if (drain(z) < 0)
+                return -1;
+            z->streaming = 1;
+        }
+        long n = stream_frame(z, z->acc, z->acc_len);
+        if (n < 0)
+            return -1;
+        consume(z, n);
+        if (z->streaming)
+            break;
+    }
+
+    if (drain(z) < 0)
+        return -1;
+
+    if (z->streaming || z->acc_len > 0 || z->frames == 0) {
+        syslog(LOG_ERR, "zstd: stream truncated");
+        return -1;
+    }
+    return 0;
+}
+
+void fota_zstd_free(fota_zstd_t *z)
+{
+    if (!z)
+        return;
+
+    if (z->jobs) {
+        pthread_mutex_lock(&z->lock);
+        z->stop = 1;
+        pthread_cond_broadcast(&z->work);
+        pthread_mutex_unlock(&z->lock);
+        for (unsigned i = 0; i < z->nthreads; i++)
+            pthread_join(z->threads[i], NULL);
+
+        pthread_mutex_destroy(&z->lock);
+        pthread_cond_destroy(&z->work);
+        pthread_cond_destroy(&z->done);
+        for (unsigned i = 0; i < z->njobs; i++) {
+            free(z->jobs[i].in);
+            free(z->jobs[i].out);
+        }
+        free(z->jobs);
+    }
+
+    ZSTD_freeDStream(z->ds);
+    free(z->out);
+    free(z->acc);
+    free(z);
+}
+
+#endif /* FOTA_HAVE_ZSTD */
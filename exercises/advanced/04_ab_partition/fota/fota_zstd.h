@@ -0,0 +1,54 @@
+/*
+ * fota_zstd.h - Parallel zstd decompression for the FOTA client
+ *
+ * zstd inflates several times faster than gzip, but a single frame is
+ * still decompressed on one core. An archive made of independent frames
+ * (the input split into pieces, each compressed on its own) can use all
+ * of them: every frame that records its decompressed size in the
+ * header, up to FOTA_ZSTD_MAX_FRAME, goes to a worker thread, and the
+ * output is handed to the sink in archive order on the thread feeding
+ * the input.
+ *
+ * Any other frame (plain zstd writes one frame for the whole input,
+ * without a size when reading a pipe) is decompressed in place as a
+ * stream through a fixed window, as with one thread, so every valid
+ * zstd input works with bounded memory.
+ *
+ * Memory in parallel mode: threads + 1 frames, compressed and
+ * decompressed.
+ *
+ * Built with WITH_ZSTD=1 (FOTA_HAVE_ZSTD), see fota_stream.h.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _FOTA_ZSTD_H_
+#define _FOTA_ZSTD_H_
+
+#include <stddef.h>
+#include "fota_stream.h"
+
+/* Largest frame decompressed by a worker, bigger ones are streamed */
+#define FOTA_ZSTD_MAX_FRAME (8 * 1024 * 1024)
+
+typedef struct fota_zstd fota_zstd_t;
+
+/*
+ * Decompressor handing its output to sink, with up to threads workers
+ * (1: no workers, everything in place). Returns NULL on failure.
+ */
+fota_zstd_t *fota_zstd_new(unsigned threads, fota_sink_fn sink, void *opaque);
+
+/* Feed the next piece of compressed input, returns 0 or -1 */
+int fota_zstd_feed(fota_zstd_t *z, const void *buf, size_t len);
+
+/*
+ * End of input: waits for the workers, checks the last frame is
+ * complete. Returns 0 or -1.
+ */
+int fota_zstd_finish(fota_zstd_t *z);
+
+/* Stop the workers and free everything */
+void fota_zstd_free(fota_zstd_t *z);
+
+#endif /* _FOTA_ZSTD_H_ */
@@ -0,0 +1,130 @@
+#!/bin/bash
+#
+# bench_image_update.sh - Compare rootfs update paths on a loopback device
+#
+# Measures the two ways fota_client can write a root slot:
+#   tar   - mkfs.ext4 + mount + tar xzf + sync + umount (rootfs.tar.gz)
+#   image - fota_client --write-image (raw ext4 image, O_DIRECT,
+#           empty blocks zeroed instead of written), plain and gzip'ed
+#
+# Usage: sudo ./bench_image_update.sh <rootfs_dir|rootfs.tar.gz> [size_mb] [fota_client]
+#
+# License: MIT
+
+set -e
+
+SOURCE="$1"
+SIZE_MB="${2:-1024}"
+FOTA_CLIENT="${3:-$(dirname "$0")/../fota/fota_client}"
+
+# Colors
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+NC='\033[0m'
+
+if [ -z "$SOURCE" ]; then
+    echo "Usage: $0 <rootfs_dir|rootfs.tar.gz> [size_mb] [fota_client]"
+    echo ""
+    echo "Example:"
+    echo "  sudo $0 /path/to/buildroot/output/images/rootfs.tar.gz 512"
+    exit 1
+fi
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo -e "${RED}Error: losetup and mount require root${NC}"
+    exit 1
+fi
+
+if [ ! -x "$FOTA_CLIENT" ]; then
+    echo -e "${RED}Error: fota_client not found at $FOTA_CLIENT (run 'make host')${NC}"
+    exit 1
+fi
+
+WORK=$(mktemp -d /var/tmp/fota_bench.XXXXXX)
+LOOP=""
+
+cleanup() {
+    mountpoint -q "$WORK/mnt" 2>/dev/null && umount "$WORK/mnt"
+    [ -n "$LOOP" ] && losetup -d "$LOOP"
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+drop_caches() {
+    sync
+    echo 3 > /proc/sys/vm/drop_caches 2>/dev/null || true
+}
+
+# Seconds since epoch with nanoseconds
+now() {
+    date +%s.%N
+}
+
+elapsed() {
+    awk -v a="$1" -v b="$2" 'BEGIN { printf "%.3f", b - a }'
+}
+
+# --- Prepare artifacts ---
+echo "Preparing artifacts in $WORK..."
+mkdir -p "$WORK/rootfs" "$WORK/mnt"
+
+if [ -d "$SOURCE" ]; then
+    tar czf "$WORK/rootfs.tar.gz" -C "$SOURCE" .
+    ROOTFS_DIR="$SOURCE"
+else
+    cp "$SOURCE" "$WORK/rootfs.tar.gz"
+    tar xzf "$SOURCE" -C "$WORK/rootfs"
+    ROOTFS_DIR="$WORK/rootfs"
+fi
+
+truncate -s "${SIZE_MB}M" "$WORK/rootfs.img"
+mkfs.ext4 -q -F -L ROOT_B -d "$ROOTFS_DIR" "$WORK/rootfs.img"
+gzip -k "$WORK/rootfs.img"
+
+# Slot backing file, filled with data so zero blocks really cost a write
+dd if=/dev/urandom of="$WORK/slot.bin" bs=1M count="$SIZE_MB" status=none
+LOOP=$(losetup -f --show "$WORK/slot.bin")
+echo "Standby slot: $LOOP (${SIZE_MB} MiB)"
+echo ""
+
+# --- tar path (what apply_update() does for rootfs.tar.gz) ---
+drop_caches
+T0=$(now)
+mkfs.ext4 -q -F -L ROOT_B "$LOOP"
+mount "$LOOP" "$WORK/mnt"
+tar xzf "$WORK/rootfs.tar.gz" -C "$WORK/mnt/"
+sync
+umount "$WORK/mnt"
+T1=$(now)
+TAR_TIME=$(elapsed "$T0" "$T1")
+
+# --- image path, uncompressed ---
+drop_caches
+T0=$(now)
+"$FOTA_CLIENT" --write-image "$WORK/rootfs.img" "$LOOP" > /dev/null
+T1=$(now)
+IMG_TIME=$(elapsed "$T0" "$T1")
+fsck.ext4 -n -f "$LOOP" > /dev/null 2>&1 || echo -e "${RED}fsck failed after image write${NC}"
+
+# --- image path, gzip'ed ---
+drop_caches
+T0=$(now)
+"$FOTA_CLIENT" --write-image "$WORK/rootfs.img.gz" "$LOOP" > /dev/null
+T1=$(now)
+GZ_TIME=$(elapsed "$T0" "$T1")
+fsck.ext4 -n -f "$LOOP" > /dev/null 2>&1 || echo -e "${RED}fsck failed after image write${NC}"
+
+# --- Report ---
+size_of() {
+    stat -c %s "$1"
+}
+
+echo "========================================"
+echo "      Rootfs update path comparison"
+echo "========================================"
+printf "%-22s %12s %10s\n" "Path" "Artifact" "Time (s)"
+printf "%-22s %12s %10.2f\n" "mkfs + tar xzf" "$(size_of "$WORK/rootfs.tar.gz")" "$TAR_TIME"
+printf "%-22s %12s %10.2f\n" "raw image" "$(size_of "$WORK/rootfs.img")" "$IMG_TIME"
+printf "%-22s %12s %10.2f\n" "raw image (gzip)" "$(size_of "$WORK/rootfs.img.gz")" "$GZ_TIME"
+echo ""
+echo -e "${GREEN}Done.${NC} Artifact sizes in bytes; times include the final sync."
@@ -0,0 +1,191 @@
+#!/bin/bash
+#
+# bench_ro_rootfs.sh - Compare ext4+tar slots with read-only image slots
+#
+# For the same root filesystem, measures on loopback devices:
+#   apply  - ext4: mkfs.ext4 + mount + tar xzf + sync + umount
+#            image: fota_client --write-image of the squashfs/erofs image
+#   mount  - ext4: mount read-write
+#            image: mount the image read-only, the data partition, and
+#            the overlay on top (what overlay-init does)
+#   walk   - stat every file from cold caches (ldconfig, udev, systemd
+#            generators and the like)
+#   read   - read every file from cold caches; an upper bound, a boot
+#            reads only part of the tree
+#
+# Build the image from the same tree with build_ro_rootfs.sh. The loop
+# devices use direct I/O, so reads hit the backing file and not its page
+# cache; decompression runs on this CPU, which is much faster than the
+# target's. Throttle the devices (cgroup blkio) and the CPU to get closer
+# to the board.
+#
+# Usage: sudo ./bench_ro_rootfs.sh <rootfs_dir|rootfs.tar.gz> <image> [size_mb] [fota_client]
+#
+# License: MIT
+
+set -e
+
+SOURCE="$1"
+IMAGE="$2"
+SIZE_MB="${3:-1024}"
+FOTA_CLIENT="${4:-$(dirname "$0")/../fota/fota_client}"
+
+# Colors
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+NC='\033[0m'
+
+if [ -z "$SOURCE" ] || [ ! -f "$IMAGE" ]; then
+    echo "Usage: $0 <rootfs_dir|rootfs.tar.gz> <image> [size_mb] [fota_client]"
+    echo ""
+    echo "Example:"
+    echo "  sudo ./build_ro_rootfs.sh rootfs.tar rootfs.sqfs squashfs"
+    echo "  sudo $0 rootfs.tar.gz rootfs.sqfs 512"
+    exit 1
+fi
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo -e "${RED}Error: losetup and mount require root${NC}"
+    exit 1
+fi
+
+if [ ! -x "$FOTA_CLIENT" ]; then
+    echo -e "${RED}Error: fota_client not found at $FOTA_CLIENT (run 'make host')${NC}"
+    exit 1
+fi
+
+if [ "$(head -c 4 "$IMAGE")" = "hsqs" ]; then
+    FS=squashfs
+elif [ "$(od -An -tx4 -j1024 -N4 "$IMAGE" | tr -d ' ')" = "e0f5e1e2" ]; then
+    FS=erofs
+else
+    echo -e "${RED}Error: $IMAGE is neither squashfs nor erofs${NC}"
+    exit 1
+fi
+
+WORK=$(mktemp -d /var/tmp/fota_robench.XXXXXX)
+LOOP=""
+DATA=""
+
+cleanup() {
+    for mnt in mnt ro data; do
+        mountpoint -q "$WORK/$mnt" 2>/dev/null && umount "$WORK/$mnt"
+    done
+    [ -n "$LOOP" ] && losetup -d "$LOOP"
+    [ -n "$DATA" ] && losetup -d "$DATA"
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+drop_caches() {
+    sync
+    echo 3 > /proc/sys/vm/drop_caches 2>/dev/null || true
+}
+
+# Seconds since epoch with nanoseconds
+now() {
+    date +%s.%N
+}
+
+elapsed() {
+    awk -v a="$1" -v b="$2" 'BEGIN { printf "%.3f", b - a }'
+}
+
+# Time a command, in seconds
+timed() {
+    local t0
+    t0=$(now)
+    "$@" > /dev/null
+    elapsed "$t0" "$(now)"
+}
+
+walk_tree() {
+    find "$WORK/mnt" -xdev -ls > /dev/null
+}
+
+read_tree() {
+    find "$WORK/mnt" -xdev -type f -exec cat {} + > /dev/null
+}
+
+# --- Prepare artifacts ---
+echo "Preparing artifacts in $WORK..."
+mkdir -p "$WORK"/{mnt,ro,data}
+
+if [ -d "$SOURCE" ]; then
+    tar czf "$WORK/rootfs.tar.gz" -C "$SOURCE" .
+else
+    cp "$SOURCE" "$WORK/rootfs.tar.gz"
+fi
+
+# Slot filled with data, so nothing is served from never-written blocks
+dd if=/dev/urandom of="$WORK/slot.bin" bs=1M count="$SIZE_MB" status=none
+LOOP=$(losetup -f --show --direct-io=on "$WORK/slot.bin")
+truncate -s 64M "$WORK/data.bin"
+mkfs.ext4 -q -F -L DATA "$WORK/data.bin"
+DATA=$(losetup -f --show --direct-io=on "$WORK/data.bin")
+echo "Standby slot: $LOOP (${SIZE_MB} MiB), data: $DATA"
+echo ""
+
+# --- ext4 + tar ---
+echo "ext4 + tar..."
+drop_caches
+T0=$(now)
+mkfs.ext4 -q -F -L ROOT_B "$LOOP"
+mount "$LOOP" "$WORK/mnt"
+tar xzf "$WORK/rootfs.tar.gz" -C "$WORK/mnt/"
+sync
+umount "$WORK/mnt"
+EXT4_APPLY=$(elapsed "$T0" "$(now)")
+
+drop_caches
+EXT4_MOUNT=$(timed mount -o rw "$LOOP" "$WORK/mnt")
+EXT4_WALK=$(timed walk_tree)
+umount "$WORK/mnt"
+drop_caches
+mount -o rw "$LOOP" "$WORK/mnt"
+EXT4_READ=$(timed read_tree)
+umount "$WORK/mnt"
+
+# --- read-only image + overlay ---
+mount_overlay() {
+    mount -t "$FS" -o ro "$LOOP" "$WORK/ro"
+    mount -o noatime "$DATA" "$WORK/data"
+    mkdir -p "$WORK/data/overlay/upper" "$WORK/data/overlay/work"
+    mount -t overlay overlay -o "lowerdir=$WORK/ro,upperdir=$WORK/data/overlay/upper,workdir=$WORK/data/overlay/work" "$WORK/mnt"
+}
+
+umount_overlay() {
+    umount "$WORK/mnt" "$WORK/data" "$WORK/ro"
+}
+
+echo "$FS image..."
+drop_caches
+T0=$(now)
+"$FOTA_CLIENT" --write-image "$IMAGE" "$LOOP" > /dev/null
+IMG_APPLY=$(elapsed "$T0" "$(now)")
+
+drop_caches
+IMG_MOUNT=$(timed mount_overlay)
+IMG_WALK=$(timed walk_tree)
+umount_overlay
+drop_caches
+mount_overlay
+IMG_READ=$(timed read_tree)
+umount_overlay
+
+# --- Report ---
+size_of() {
+    stat -c %s "$1"
+}
+
+echo ""
+echo "========================================"
+echo "   ext4 + tar vs. read-only $FS slot"
+echo "========================================"
+printf "%-18s %12s %9s %9s %9s %9s\n" "Slot" "Artifact" "Apply" "Mount" "Walk" "Read"
+printf "%-18s %12s %9.2f %9.3f %9.2f %9.2f\n" "ext4 + tar" \
+       "$(size_of "$WORK/rootfs.tar.gz")" "$EXT4_APPLY" "$EXT4_MOUNT" "$EXT4_WALK" "$EXT4_READ"
+printf "%-18s %12s %9.2f %9.3f %9.2f %9.2f\n" "$FS + overlay" \
+       "$(size_of "$IMAGE")" "$IMG_APPLY" "$IMG_MOUNT" "$IMG_WALK" "$IMG_READ"
+echo ""
+echo -e "${GREEN}Done.${NC} Artifact sizes in bytes, times in seconds from cold caches."
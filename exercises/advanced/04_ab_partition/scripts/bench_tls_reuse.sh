@@ -0,0 +1,63 @@
+#!/bin/bash
+#
+# bench_tls_reuse.sh - Measure connection and TLS session reuse in fota_client
+#
+# Starts update_server.sh over HTTPS (self-signed certificate, HTTP/1.1
+# keep-alive, TLS session tickets) and runs
+# fota_client --bench-net against it:
+#   no reuse          - new TCP connection and full TLS handshake per request
+#   TLS session reuse - new connection, abbreviated handshake (what an
+#                       hourly check gets once the server closed the socket)
+#   connection reuse  - requests on the cached connection, no handshake
+#
+# Run it on the target to see the Cortex-A8 numbers; the CPU column is
+# the client only.
+#
+# Usage: ./bench_tls_reuse.sh [requests] [fota_client]
+#
+# License: MIT
+
+set -e
+
+COUNT="${1:-50}"
+FOTA_CLIENT="${2:-$(dirname "$0")/../fota/fota_client}"
+PORT=8743
+
+# Colors
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+NC='\033[0m'
+
+if [ ! -x "$FOTA_CLIENT" ]; then
+    echo -e "${RED}Error: fota_client not found at $FOTA_CLIENT (run 'make host')${NC}"
+    exit 1
+fi
+
+WORK=$(mktemp -d /tmp/fota_tls.XXXXXX)
+SERVER_PID=""
+
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=localhost" \
+    -addext "subjectAltName=DNS:localhost" \
+    -keyout "$WORK/key.pem" -out "$WORK/cert.pem" 2>/dev/null
+
+# --- Update server stand-in over HTTPS, every check answers "no update" ---
+mkdir -p "$WORK/release"
+echo '{ "update_available": false }' > "$WORK/release/manifest.json"
+"$(dirname "$0")/update_server.sh" "$WORK/release" --port "$PORT" \
+    --cert "$WORK/cert.pem" --key "$WORK/key.pem" 2> /dev/null &
+SERVER_PID=$!
+sleep 1
+
+URL="https://localhost:$PORT/api/v1/devices/bench/update"
+
+echo "$COUNT requests per mode against $URL"
+echo ""
+"$FOTA_CLIENT" --bench-net "$URL" "$COUNT" "$WORK/cert.pem"
+echo ""
+echo -e "${GREEN}Done.${NC} connect/TLS columns count new connections and handshakes."
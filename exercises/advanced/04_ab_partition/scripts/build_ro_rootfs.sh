@@ -0,0 +1,138 @@
+#!/bin/bash
+#
+# build_ro_rootfs.sh - Build a read-only rootfs image for A/B updates
+#
+# Packs a root filesystem tree into a compressed squashfs or erofs image
+# that the FOTA client writes as-is to the standby root partition (no
+# mkfs, no file extraction on the device). The image boots read-only
+# with a writable overlay on /data, set up by /sbin/overlay-init, which
+# this script installs into the image together with the mount points it
+# needs.
+#
+# Prints the manifest fields of a rootfs_image update for the result,
+# including the dm-verity root hash and salt of the image when
+# veritysetup (cryptsetup) is installed. The client builds the same hash
+# tree on the device and refuses to switch to a slot that does not
+# reproduce that root hash.
+#
+# Usage: sudo ./build_ro_rootfs.sh <rootfs_dir|rootfs.tar[.gz]> <output.img> \
+#            [squashfs|erofs] [compressor]
+#
+#   compressor  squashfs: gzip (default), xz, lzo, lz4, zstd
+#               erofs:    lz4hc (default), lz4, lzma, deflate, zstd
+#               The kernel must support it (CONFIG_SQUASHFS_<X>,
+#               CONFIG_EROFS_FS_ZIP_<X>).
+#
+# Root is needed to keep file ownership when the tree is copied.
+#
+# License: MIT
+
+set -e
+
+SOURCE="$1"
+OUTPUT="$2"
+FS="${3:-squashfs}"
+COMP="$4"
+OVERLAY_INIT="$(dirname "$0")/../rootfs/sbin/overlay-init"
+
+# Colors
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+NC='\033[0m'
+
+if [ -z "$SOURCE" ] || [ -z "$OUTPUT" ]; then
+    echo "Usage: $0 <rootfs_dir|rootfs.tar[.gz]> <output.img> [squashfs|erofs] [compressor]"
+    echo ""
+    echo "Example:"
+    echo "  sudo $0 /path/to/buildroot/output/images/rootfs.tar rootfs-1.1.0.sqfs squashfs xz"
+    exit 1
+fi
+
+case "$FS" in
+    squashfs)
+        TOOL=mksquashfs
+        COMP="${COMP:-gzip}"
+        ;;
+    erofs)
+        TOOL=mkfs.erofs
+        COMP="${COMP:-lz4hc}"
+        ;;
+    *)
+        echo -e "${RED}Error: unknown filesystem $FS (squashfs or erofs)${NC}"
+        exit 1
+        ;;
+esac
+
+if ! command -v "$TOOL" > /dev/null 2>&1; then
+    echo -e "${RED}Error: $TOOL not found (squashfs-tools / erofs-utils)${NC}"
+    exit 1
+fi
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo -e "${RED}Error: run as root to keep file ownership${NC}"
+    exit 1
+fi
+
+STAGE=$(mktemp -d /var/tmp/ro_rootfs.XXXXXX)
+trap 'rm -rf "$STAGE"' EXIT
+
+# --- Stage the tree (the source is left untouched) ---
+echo "Staging $SOURCE..."
+if [ -d "$SOURCE" ]; then
+    cp -a "$SOURCE/." "$STAGE/"
+else
+    tar xf "$SOURCE" -C "$STAGE" --numeric-owner
+fi
+
+# Mount points cannot be created on the device later
+for dir in proc sys dev tmp run data mnt rom; do
+    [ -e "$STAGE/$dir" ] || [ -L "$STAGE/$dir" ] || mkdir -p "$STAGE/$dir"
+done
+
+# Through a merged /usr, but never out of the tree (absolute links)
+SBIN="$STAGE/sbin"
+if [ -L "$SBIN" ]; then
+    case "$(readlink "$SBIN")" in
+        /*) SBIN="$STAGE$(readlink "$SBIN")" ;;
+    esac
+fi
+install -D -m 0755 "$OVERLAY_INIT" "$SBIN/overlay-init"
+
+# --- Build the image ---
+echo "Building $FS image ($COMP)..."
+rm -f "$OUTPUT"
+if [ "$FS" = "squashfs" ]; then
+    # Padded to 4 KiB, so the client writes all of it with O_DIRECT
+    mksquashfs "$STAGE" "$OUTPUT" -comp "$COMP" -noappend -quiet
+else
+    mkfs.erofs -z"$COMP" "$OUTPUT" "$STAGE" > /dev/null
+fi
+
+# --- Manifest fields ---
+SIZE=$(stat -c %s "$OUTPUT")
+SHA=$(sha256sum "$OUTPUT" | cut -d' ' -f1)
+TREE=$(du -sb "$STAGE" | cut -f1)
+
+# Same parameters as the client: SHA-256, 4 KiB blocks, 32 byte salt
+VERITY="    \"rootfs_verity\": true"
+if command -v veritysetup > /dev/null 2>&1; then
+    SALT=$(head -c 32 /dev/urandom | od -An -tx1 | tr -d ' \n')
+    ROOT_HASH=$(veritysetup format --data-block-size=4096 --hash-block-size=4096 \
+                    --salt="$SALT" "$OUTPUT" "$STAGE/verity.tree" |
+                sed -n 's/^Root hash:[[:space:]]*//p')
+    VERITY="    \"rootfs_verity_root_hash\": \"$ROOT_HASH\",
+    \"rootfs_verity_salt\": \"$SALT\""
+fi
+
+echo ""
+echo -e "${GREEN}Built $OUTPUT${NC}: $SIZE bytes ($((TREE / 1024 / 1024)) MiB tree)"
+echo ""
+echo "Manifest fields (the image is already compressed, send it as-is):"
+echo "    \"rootfs_type\": \"rootfs_image\","
+echo "    \"rootfs_fs\": \"$FS\","
+echo "    \"rootfs_compression\": \"none\","
+echo "    \"rootfs_url\": \"https://updates.example.com/releases/<version>/$(basename "$OUTPUT")\","
+echo "    \"rootfs_sha256\": \"$SHA\","
+echo "    \"rootfs_size\": $SIZE,"
+echo "    \"rootfs_image_size\": $SIZE,"
+echo "$VERITY"
@@ -1,6 +1,9 @@
 #!/bin/bash
 # Populate A/B partitions with boot files and rootfs
-# Usage: sudo ./populate_partitions.sh /dev/sdX [boot_files_dir] [rootfs_tar]
+# Usage: sudo ./populate_partitions.sh /dev/sdX [boot_files_dir] [rootfs_tar|rootfs_image]
+#
+# A squashfs or erofs image (see build_ro_rootfs.sh) is written as-is to
+# both root partitions instead of extracting a tarball into them.
 
 set -e
 
@@ -9,12 +12,13 @@ BOOT_DIR="${2:-./boot}"
 ROOTFS_TAR="${3:-./rootfs.tar}"
 
 if [ "$DEVICE" = "/dev/sdX" ]; then
-    echo "Usage: $0 /dev/sdX [boot_files_dir] [rootfs_tar]"
+    echo "Usage: $0 /dev/sdX [boot_files_dir] [rootfs_tar|rootfs_image]"
     echo ""
     echo "Arguments:"
     echo "  /dev/sdX        - SD card device"
     echo "  boot_files_dir  - Directory containing MLO, u-boot.img, zImage, DTB"
     echo "  rootfs_tar      - Root filesystem tarball"
+    echo "  rootfs_image    - Or a read-only squashfs/erofs image"
     exit 1
 fi
 
@@ -33,6 +37,14 @@ if [ ! -f "$ROOTFS_TAR" ]; then
     exit 1
 fi
 
+# Read-only image instead of a tarball?
+ROOTFS_FS=""
+if [ "$(head -c 4 "$ROOTFS_TAR")" = "hsqs" ]; then
+    ROOTFS_FS="squashfs"
+elif [ "$(od -An -tx4 -j1024 -N4 "$ROOTFS_TAR" | tr -d ' ')" = "e0f5e1e2" ]; then
+    ROOTFS_FS="erofs"
+fi
+
 # Create mount points
 MNT_BASE="/tmp/ab_partition_mnt"
 mkdir -p "$MNT_BASE"/{boot_a,root_a,boot_b,root_b,data}
@@ -48,10 +60,12 @@ trap cleanup EXIT
 
 echo "Mounting partitions..."
 mount "${DEVICE}1" "$MNT_BASE/boot_a"
-mount "${DEVICE}2" "$MNT_BASE/root_a"
 mount "${DEVICE}3" "$MNT_BASE/boot_b"
-mount "${DEVICE}5" "$MNT_BASE/root_b"
 mount "${DEVICE}6" "$MNT_BASE/data"
+if [ -z "$ROOTFS_FS" ]; then
+    mount "${DEVICE}2" "$MNT_BASE/root_a"
+    mount "${DEVICE}5" "$MNT_BASE/root_b"
+fi
 
 echo "Copying boot files to Slot A..."
 cp -v "$BOOT_DIR"/MLO "$MNT_BASE/boot_a/"
@@ -65,14 +79,22 @@ cp -v "$BOOT_DIR"/u-boot.img "$MNT_BASE/boot_b/"
 cp -v "$BOOT_DIR"/zImage "$MNT_BASE/boot_b/"
 cp -v "$BOOT_DIR"/am335x-boneblack.dtb "$MNT_BASE/boot_b/"
 
-echo "Extracting rootfs to Slot A..."
-tar xf "$ROOTFS_TAR" -C "$MNT_BASE/root_a/"
+if [ -z "$ROOTFS_FS" ]; then
+    echo "Extracting rootfs to Slot A..."
+    tar xf "$ROOTFS_TAR" -C "$MNT_BASE/root_a/"
+
+    echo "Extracting rootfs to Slot B..."
+    tar xf "$ROOTFS_TAR" -C "$MNT_BASE/root_b/"
+else
+    echo "Writing $ROOTFS_FS image to Slot A..."
+    dd if="$ROOTFS_TAR" of="${DEVICE}2" bs=4M conv=fsync status=none
 
-echo "Extracting rootfs to Slot B..."
-tar xf "$ROOTFS_TAR" -C "$MNT_BASE/root_b/"
+    echo "Writing $ROOTFS_FS image to Slot B..."
+    dd if="$ROOTFS_TAR" of="${DEVICE}5" bs=4M conv=fsync status=none
+fi
 
 echo "Creating data partition structure..."
-mkdir -p "$MNT_BASE/data"/{config,logs,user,fota}
+mkdir -p "$MNT_BASE/data"/{config,logs,user,fota,overlay}
 
 echo "Syncing..."
 sync
@@ -85,3 +107,11 @@ ls -la "$MNT_BASE/boot_a/"
 echo ""
 echo "Data partition structure:"
 ls -la "$MNT_BASE/data/"
+
+if [ -n "$ROOTFS_FS" ]; then
+    echo ""
+    echo "Both slots boot read-only, set in U-Boot:"
+    echo "  => setenv rootargs_a 'ro rootfstype=$ROOTFS_FS init=/sbin/overlay-init'"
+    echo "  => setenv rootargs_b 'ro rootfstype=$ROOTFS_FS init=/sbin/overlay-init'"
+    echo "  => saveenv"
+fi
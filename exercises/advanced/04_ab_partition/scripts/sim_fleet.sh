@@ -0,0 +1,379 @@
+#!/bin/bash
+#
+# sim_fleet.sh - Run a fleet of fota_client instances against a local server
+#
+# Generates a release, serves it with update_server.sh and gives every
+# simulated device its own standby slots on loop devices, U-Boot
+# environment, /etc/fota and /data/fota. Then:
+#   1. update      - all devices run fota_client --check at the same time,
+#                    download and apply the release and switch slots. A
+#                    failed run is repeated after a second, as the
+#                    daemon's next check would (up to 5 runs per device)
+#   2. idle checks - the updated fleet checks <checks> more times per
+#                    device, which the server answers with "no update",
+#                    then with 304 once the client has its ETag; the first
+#                    check reports the timeline of the update
+# For each phase it reports the end-to-end time per device, the bytes
+# sent by the server and the server's requests per second, and it checks
+# that every device ends up with exactly the new release in slot b.
+# Last, the update timelines reported by the devices are summed up per
+# stage.
+#
+# Server options (throttling, faults, ...) are passed on with -o, e.g.
+#   sudo ./sim_fleet.sh -n 8 -o "--rate 8M --drop 0.2"
+# see ./update_server.sh --help.
+#
+# The clients run in private mount namespaces, as in test_apply_journal.sh,
+# with a fake "reboot" first in PATH. All devices run from one shared
+# slot a pair, which is never written.
+#
+# Usage: sudo ./sim_fleet.sh [-n devices] [-s rootfs_mb] [-k checks]
+#                            [-m stream_mode] [-o "server options"]
+#                            [fota_client]
+#
+# License: MIT
+
+set -e
+
+DEVICES=4
+ROOTFS_MB=32
+CHECKS=10
+STREAM=0
+SERVER_OPTS=""
+MAX_RUNS=5
+PORT=8731
+
+while getopts "n:s:k:m:o:" opt; do
+    case $opt in
+        n) DEVICES=$OPTARG ;;
+        s) ROOTFS_MB=$OPTARG ;;
+        k) CHECKS=$OPTARG ;;
+        m) STREAM=$OPTARG ;;
+        o) SERVER_OPTS=$OPTARG ;;
+        *) sed -n 's/^# Usage: /Usage: /p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+SCRIPTS="$(realpath "$(dirname "$0")")"
+FOTA_CLIENT="$(realpath "${1:-$SCRIPTS/../fota/fota_client}")"
+
+# Colors
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+NC='\033[0m'
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo -e "${RED}Error: losetup, mount and unshare require root${NC}"
+    exit 1
+fi
+
+if [ ! -x "$FOTA_CLIENT" ]; then
+    echo -e "${RED}Error: fota_client not found at $FOTA_CLIENT (run 'make host')${NC}"
+    exit 1
+fi
+
+WORK=$(mktemp -d /var/tmp/fota_fleet.XXXXXX)
+SERVER_PID=""
+LOOPS=()
+
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null || true
+    wait 2>/dev/null || true
+    for dev in "${LOOPS[@]}"; do
+        losetup -d "$dev" 2>/dev/null || true
+    done
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+mkdir -p "$WORK"/{src/boot,src/rootfs,release,bin,mnt}
+
+# --- Release 2.0: the boot files and a root filesystem of rootfs_mb ---
+echo "Creating release 2.0 (${ROOTFS_MB} MB root filesystem)..."
+head -c 64K /dev/urandom > "$WORK/src/boot/MLO"
+head -c 512K /dev/urandom > "$WORK/src/boot/u-boot.img"
+head -c 4M /dev/urandom > "$WORK/src/boot/zImage"
+echo "release=2.0" > "$WORK/src/boot/uEnv.txt"
+mkdir -p "$WORK/src/rootfs"/{bin,etc,usr/lib}
+echo 'VERSION_ID=2.0' > "$WORK/src/rootfs/etc/os-release"
+for i in $(seq 1 $((ROOTFS_MB / 2))); do
+    head -c 2M /dev/urandom > "$WORK/src/rootfs/usr/lib/lib$i.so"
+done
+
+tar czf "$WORK/release/boot.tar.gz" -C "$WORK/src/boot" .
+tar czf "$WORK/release/rootfs.tar.gz" -C "$WORK/src/rootfs" .
+cat > "$WORK/release/manifest.json" << EOF
+{ "update_available": true, "version": "2.0", "min_version": "1.0",
+  "supported_devices": ["sim-*"],
+  "boot_url": "boot.tar.gz", "rootfs_url": "rootfs.tar.gz" }
+EOF
+ARTIFACT_BYTES=$(( $(stat -c %s "$WORK/release/boot.tar.gz") +
+                   $(stat -c %s "$WORK/release/rootfs.tar.gz") ))
+
+# --- Update server ---
+# shellcheck disable=SC2086
+"$SCRIPTS/update_server.sh" "$WORK/release" --port "$PORT" \
+    --timelines "$WORK/timelines.json" $SERVER_OPTS \
+    2> "$WORK/server.log" &
+SERVER_PID=$!
+
+# $1: /stats or /stats/reset, prints the counters as S_<name>=<value>
+stats() {
+    python3 - "http://127.0.0.1:$PORT$1" << 'EOF'
+import json, sys, urllib.request
+for key, value in json.load(urllib.request.urlopen(sys.argv[1])).items():
+    if not isinstance(value, dict):
+        print("S_%s=%s" % (key, value))
+EOF
+}
+
+for _ in $(seq 1 50); do
+    stats /stats > /dev/null 2>&1 && break
+    kill -0 "$SERVER_PID" 2>/dev/null || break
+    sleep 0.2
+done
+if ! stats /stats > /dev/null 2>&1; then
+    echo -e "${RED}Error: the update server did not start${NC}"
+    cat "$WORK/server.log"
+    exit 1
+fi
+
+# --- Devices: slot b on loop devices, slot a shared ---
+loop() {
+    truncate -s "$2" "$1"
+    dev=$(losetup -f --show "$1")
+    LOOPS+=("$dev")
+}
+
+ROOT_MB=$((ROOTFS_MB + ROOTFS_MB / 4 + 32))
+loop "$WORK/boot_a.img" 16M; BOOT_A=$dev
+loop "$WORK/root_a.img" "${ROOT_MB}M"; ROOT_A=$dev
+
+BOOT_B=()
+ROOT_B=()
+for i in $(seq 1 "$DEVICES"); do
+    mkdir -p "$WORK/dev$i"/{etc,state,dl}
+    loop "$WORK/dev$i/boot_b.img" 16M; BOOT_B[i]=$dev
+    loop "$WORK/dev$i/root_b.img" "${ROOT_MB}M"; ROOT_B[i]=$dev
+    echo "$WORK/dev$i/uboot.env 0x0 0x4000" > "$WORK/dev$i/fw_env.config"
+done
+
+cat > "$WORK/bin/reboot" << 'EOF'
+#!/bin/sh
+touch "$SIM_DEV/rebooted"
+EOF
+chmod +x "$WORK/bin/reboot"
+
+# $1: device, $2: slot
+write_env() {
+    python3 - "$WORK/dev$1/uboot.env" "$2" << 'EOF'
+import struct, sys, zlib
+data = ("slot=%s\0bootcount=0\0\0" % sys.argv[2]).encode().ljust(0x4000 - 4, b"\0")
+open(sys.argv[1], "wb").write(struct.pack("<I", zlib.crc32(data)) + data)
+EOF
+}
+
+env_slot() {
+    tail -c +5 "$WORK/dev$1/uboot.env" | tr '\0' '\n' | sed -n 's/^slot=//p'
+}
+
+# $1: device, $2: current_version
+write_config() {
+    cat > "$WORK/dev$1/etc/fota.conf" << EOF
+server_url=http://127.0.0.1:$PORT
+device_id=sim-$1
+current_version=$2
+stream_mode=$STREAM
+download_dir=$WORK/dev$1/dl
+boot_a=$BOOT_A
+root_a=$ROOT_A
+boot_b=${BOOT_B[$1]}
+root_b=${ROOT_B[$1]}
+fw_env_config=$WORK/dev$1/fw_env.config
+report_timeline=1
+EOF
+}
+
+# Run device $1's client in its own mount namespace
+run_client() {
+    local dir="$WORK/dev$1"
+    PATH="$WORK/bin:$PATH" SIM_DEV="$dir" unshare -m sh -c "
+        mount --make-rprivate /
+        mkdir -p /etc/fota /data/fota
+        mount --bind '$dir/etc' /etc/fota
+        mount --bind '$dir/state' /data/fota
+        exec '$FOTA_CLIENT' --check" >> "$dir/client.log" 2>&1
+}
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# Update device $1, records "<runs> <ms>" in its result file
+update_device() {
+    local dir="$WORK/dev$1" runs=0 t0
+    t0=$(now_ms)
+    while [ "$runs" -lt "$MAX_RUNS" ] && [ ! -e "$dir/rebooted" ]; do
+        runs=$((runs + 1))
+        run_client "$1" || true
+        [ -e "$dir/rebooted" ] || sleep 1
+    done
+    echo "$runs $(( $(now_ms) - t0 ))" > "$dir/result"
+}
+
+# $1 checks of device $2, records the failed ones in its result file
+check_device() {
+    local failed=0
+    for _ in $(seq 1 "$1"); do
+        run_client "$2" || failed=$((failed + 1))
+    done
+    echo "$failed" > "$WORK/dev$2/result"
+}
+
+# Does the filesystem on $1 hold exactly the tree $2?
+same_files() {
+    local ret
+    mount -o ro "$1" "$WORK/mnt" 2>/dev/null || return 1
+    diff -r -x lost+found "$2" "$WORK/mnt" > /dev/null && ret=0 || ret=1
+    umount "$WORK/mnt"
+    return $ret
+}
+
+mb() {
+    awk -v b="$1" 'BEGIN { printf "%.1f MB", b / 1e6 }'
+}
+
+FAILED=0
+
+fail() {
+    echo -e "${RED}FAIL${NC} $1"
+    FAILED=1
+}
+
+echo "$DEVICES devices, $(mb "$ARTIFACT_BYTES") of artifacts," \
+     "stream_mode=$STREAM, server options: ${SERVER_OPTS:-none}"
+
+# --- 1. Update: every device on 1.0 checks at the same time ---
+for i in $(seq 1 "$DEVICES"); do
+    write_env "$i" a
+    write_config "$i" 1.0
+    mkfs.ext4 -q -F -L BOOT_B "${BOOT_B[i]}"
+    rm -f "$WORK/dev$i/rebooted" "$WORK/dev$i/result"
+done
+
+stats /stats/reset > /dev/null
+t0=$(now_ms)
+pids=()
+for i in $(seq 1 "$DEVICES"); do
+    update_device "$i" &
+    pids+=($!)
+done
+wait "${pids[@]}"
+wall=$(( $(now_ms) - t0 ))
+eval "$(stats /stats)"
+
+updated=0
+for i in $(seq 1 "$DEVICES"); do
+    err=""
+    [ -e "$WORK/dev$i/rebooted" ] || err="no reboot after $MAX_RUNS runs"
+    [ "$(env_slot "$i")" = b ] || err="${err:-environment selects slot $(env_slot "$i")}"
+    same_files "${BOOT_B[i]}" "$WORK/src/boot" || err="${err:-boot files differ}"
+    same_files "${ROOT_B[i]}" "$WORK/src/rootfs" || err="${err:-root files differ}"
+    if [ -n "$err" ]; then
+        fail "sim-$i: $err"
+    else
+        updated=$((updated + 1))
+    fi
+done
+
+echo ""
+echo "Update: $updated of $DEVICES devices in $(awk -v t="$wall" 'BEGIN { printf "%.1f s", t / 1000 }')"
+cat "$WORK"/dev*/result | awk -v bytes="$ARTIFACT_BYTES" '
+    { runs += $1; t = $2 / 1000; sum += t
+      if (NR == 1 || t < min) min = t
+      if (t > max) max = t }
+    END { printf "  per device:  min %.1f s, avg %.1f s, max %.1f s, %.1f MB/s avg, %d runs\n",
+                 min, sum / NR, max, bytes / 1e6 / (sum / NR), runs }'
+echo "  server:      $(mb "$S_bytes") sent" \
+     "($(awk -v s="$S_bytes" -v a="$ARTIFACT_BYTES" -v n="$DEVICES" \
+         'BEGIN { printf "%.2f", s / (a * n) }')x the artifacts)," \
+     "$S_requests requests, $S_transfers transfers"
+echo "               $(awk -v r="$S_requests" -v t="$wall" \
+         'BEGIN { printf "%.1f", r * 1000 / t }') requests/s," \
+     "peak $S_peak_requests_per_s/s; injected $S_errors errors," \
+     "$S_drops drops, $S_stalls stalls"
+
+# --- 2. Idle checks: the fleet is on 2.0, as after booting and confirming it ---
+# Only the update timeline in /data/fota is kept, for the first check
+for i in $(seq 1 "$DEVICES"); do
+    write_env "$i" a
+    write_config "$i" 2.0
+    find "$WORK/dev$i/state" -mindepth 1 -maxdepth 1 ! -name timeline.json \
+        -exec rm -rf {} +
+    rm -f "$WORK/dev$i/result"
+done
+
+stats /stats/reset > /dev/null
+t0=$(now_ms)
+pids=()
+for i in $(seq 1 "$DEVICES"); do
+    check_device "$CHECKS" "$i" &
+    pids+=($!)
+done
+wait "${pids[@]}"
+wall=$(( $(now_ms) - t0 ))
+eval "$(stats /stats)"
+
+failed=$(cat "$WORK"/dev*/result | awk '{ n += $1 } END { print n }')
+[ "$S_offered" -eq 0 ] || fail "idle checks: update offered $S_offered times"
+[ "$S_timelines" -eq "$updated" ] ||
+    fail "idle checks: $S_timelines update timelines reported, expected $updated"
+
+echo ""
+echo "Idle checks: $((DEVICES * CHECKS)) in" \
+     "$(awk -v t="$wall" 'BEGIN { printf "%.1f s", t / 1000 }'), $failed failed"
+echo "  server:      $S_checks checks, $S_not_modified answered 304," \
+     "$S_bytes body bytes"
+echo "               $(awk -v r="$S_requests" -v t="$wall" \
+         'BEGIN { printf "%.1f", r * 1000 / t }') requests/s," \
+     "peak $S_peak_requests_per_s/s"
+
+# --- Timelines reported by the devices, see fota/fota_metrics.h ---
+echo ""
+python3 - "$WORK/timelines.json" << 'EOF'
+import json, os, sys
+timelines = []
+if os.path.exists(sys.argv[1]):
+    timelines = [json.loads(line) for line in open(sys.argv[1])]
+switched = [t for t in timelines if t.get("result") == "switched"]
+print("Timelines: %d reported, %d of failed runs" % (
+    len(timelines), len(timelines) - len(switched)))
+if not switched:
+    sys.exit()
+stages = {}
+for t in switched:
+    for s in t["stages"]:
+        name = s["stage"] + (" " + s["artifact"] if "artifact" in s else "")
+        stages.setdefault(name, []).append(s)
+print("  %-16s %7s %7s %8s  %s" % ("stage", "avg ms", "max ms", "KiB/s",
+                                  "network/hash/write ms"))
+for name, runs in sorted(stages.items(), key=lambda kv: kv[1][0]["start_ms"]):
+    ms = [s["end_ms"] - s["start_ms"] for s in runs]
+    rate = [s["kib_s"] for s in runs if "kib_s" in s]
+    split = ""
+    if "download_ms" in runs[0]:
+        split = "/".join("%d" % (sum(s.get(k, 0) for s in runs) / len(runs))
+                         for k in ("download_ms", "hash_ms", "write_ms"))
+    print("  %-16s %7d %7d %8s  %s" % (
+        name, sum(ms) / len(ms), max(ms),
+        "%d" % (sum(rate) / len(rate)) if rate else "-", split))
+print("  %-16s %7d %7d" % ("total", sum(t["total_ms"] for t in switched) / len(switched),
+                           max(t["total_ms"] for t in switched)))
+EOF
+
+echo ""
+if [ "$FAILED" -ne 0 ]; then
+    exit 1
+fi
+echo -e "${GREEN}Done.${NC}"
@@ -0,0 +1,314 @@
+#!/bin/bash
+#
+# test_apply_journal.sh - Kill fota_client at every apply step and resume
+#
+# Sets up both A/B slots on loopback devices, a file-backed U-Boot
+# environment and a local update server, then for each fault point:
+#   1. runs fota_client --check with FOTA_FAULT=<point>, which SIGKILLs
+#      the client right after that step was recorded (see fota_journal.h)
+#   2. runs it again without a fault, as the daemon would on its next check
+#   3. checks that slot b holds exactly the new release, the environment
+#      selects it, the journal ends in env_switched, and that the second
+#      run skipped what the journal had as done (HTTP requests, rewritten
+#      sectors)
+#
+# Covers staged and streaming mode with tar and raw image artifacts, and
+# a streamed archive with a malformed pax header, which must be rejected
+# without touching the environment.
+# The client runs in a private mount namespace with /etc/fota and
+# /data/fota bind-mounted from the work directory, and a fake "reboot"
+# first in PATH, so the host is not touched.
+#
+# Note: SIGKILL leaves the page cache intact, so this exercises the
+# restart logic, not the ordering of fsyncs against a power cut.
+#
+# Usage: sudo ./test_apply_journal.sh [fota_client]
+#        (fota_client built with: make host FAULT_INJECTION=1)
+#
+# License: MIT
+
+set -e
+
+FOTA_CLIENT="$(realpath "${1:-$(dirname "$0")/../fota/fota_client}")"
+PORT=8721
+ROOT_MB=192
+IMAGE_MB=160
+
+# Colors
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+NC='\033[0m'
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo -e "${RED}Error: losetup, mount and unshare require root${NC}"
+    exit 1
+fi
+
+if [ ! -x "$FOTA_CLIENT" ]; then
+    echo -e "${RED}Error: fota_client not found at $FOTA_CLIENT (run 'make host FAULT_INJECTION=1')${NC}"
+    exit 1
+fi
+
+WORK=$(mktemp -d /var/tmp/fota_journal.XXXXXX)
+SERVER_PID=""
+LOOPS=()
+
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null || true
+    for dev in "${LOOPS[@]}"; do
+        losetup -d "$dev" 2>/dev/null || true
+    done
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+mkdir -p "$WORK"/{src/boot,src/rootfs,srv,etc,state,dl,bin,mnt}
+
+# --- Releases: boot files and a root filesystem with some bulk ---
+echo "Creating release 2.0..."
+head -c 64K /dev/urandom > "$WORK/src/boot/MLO"
+head -c 512K /dev/urandom > "$WORK/src/boot/u-boot.img"
+head -c 4M /dev/urandom > "$WORK/src/boot/zImage"
+echo "release=2.0" > "$WORK/src/boot/uEnv.txt"
+mkdir -p "$WORK/src/rootfs"/{bin,etc,usr/lib}
+echo 'VERSION_ID=2.0' > "$WORK/src/rootfs/etc/os-release"
+head -c 2M /dev/urandom > "$WORK/src/rootfs/bin/busybox"
+for i in $(seq 1 48); do
+    head -c 2M /dev/urandom > "$WORK/src/rootfs/usr/lib/lib$i.so"
+done
+
+tar czf "$WORK/srv/boot.tar.gz" -C "$WORK/src/boot" .
+tar czf "$WORK/srv/rootfs.tar.gz" -C "$WORK/src/rootfs" .
+truncate -s "${IMAGE_MB}M" "$WORK/srv/rootfs.img"
+mkfs.ext4 -q -F -L ROOT_B -d "$WORK/src/rootfs" "$WORK/srv/rootfs.img"
+
+# A pax record shorter than its own length prefix, then a regular file
+python3 - "$WORK/srv/malformed.tar.gz" << 'EOF'
+import io, sys, tarfile
+with tarfile.open(sys.argv[1], "w:gz", format=tarfile.GNU_FORMAT) as t:
+    for name, data, kind in (("pax", b"1 abcdefgh", tarfile.XHDTYPE),
+                             ("etc/os-release", b"VERSION_ID=2.0\n", tarfile.REGTYPE)):
+        info = tarfile.TarInfo(name)
+        info.type, info.size = kind, len(data)
+        t.addfile(info, io.BytesIO(data))
+EOF
+
+# Plain file names: the server fills in their URL, digest and size
+cat > "$WORK/srv/tar.json" << EOF
+{ "update_available": true, "version": "2.0",
+  "boot_url": "boot.tar.gz", "rootfs_url": "rootfs.tar.gz" }
+EOF
+cat > "$WORK/srv/image.json" << EOF
+{ "update_available": true, "version": "2.0",
+  "boot_url": "boot.tar.gz", "rootfs_url": "rootfs.img",
+  "rootfs_type": "rootfs_image", "rootfs_image_size": $((IMAGE_MB << 20)) }
+EOF
+cat > "$WORK/srv/malformed.json" << EOF
+{ "update_available": true, "version": "2.0",
+  "boot_url": "boot.tar.gz", "rootfs_url": "malformed.tar.gz" }
+EOF
+cp "$WORK/srv/tar.json" "$WORK/manifest.json"
+
+# --- Update server: logs every request, manifest picked by the test ---
+"$(dirname "$0")/update_server.sh" "$WORK/srv" --port "$PORT" \
+    --manifest "$WORK/manifest.json" --access-log "$WORK/access.log" 2> /dev/null &
+SERVER_PID=$!
+sleep 1
+if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+    echo -e "${RED}Error: cannot start the update server on port $PORT${NC}"
+    exit 1
+fi
+
+# --- Slots on loop devices, environment in a file ---
+for part in boot_a boot_b root_a root_b; do
+    case $part in
+        boot_*) truncate -s 16M "$WORK/$part.img" ;;
+        root_*) truncate -s "${ROOT_MB}M" "$WORK/$part.img" ;;
+    esac
+    dev=$(losetup -f --show "$WORK/$part.img")
+    LOOPS+=("$dev")
+    eval "${part^^}=$dev"
+done
+mkfs.ext4 -q -F -L BOOT_B "$BOOT_B"
+
+echo "$WORK/uboot.env 0x0 0x4000" > "$WORK/fw_env.config"
+
+write_env() {
+    python3 - "$WORK/uboot.env" "$1" << 'EOF'
+import struct, sys, zlib
+data = ("slot=%s\0bootcount=0\0\0" % sys.argv[2]).encode().ljust(0x4000 - 4, b"\0")
+open(sys.argv[1], "wb").write(struct.pack("<I", zlib.crc32(data)) + data)
+EOF
+}
+
+env_slot() {
+    tail -c +5 "$WORK/uboot.env" | tr '\0' '\n' | sed -n 's/^slot=//p'
+}
+
+cat > "$WORK/bin/reboot" << EOF
+#!/bin/sh
+touch "$WORK/rebooted"
+EOF
+chmod +x "$WORK/bin/reboot"
+
+# $1: stream_mode
+write_config() {
+    cat > "$WORK/etc/fota.conf" << EOF
+server_url=http://127.0.0.1:$PORT
+device_id=journal-test
+current_version=1.0
+stream_mode=$1
+download_dir=$WORK/dl
+boot_a=$BOOT_A
+root_a=$ROOT_A
+boot_b=$BOOT_B
+root_b=$ROOT_B
+fw_env_config=$WORK/fw_env.config
+EOF
+}
+
+# Run the client in its own mount namespace, $1: FOTA_FAULT ("" for none)
+run_client() {
+    PATH="$WORK/bin:$PATH" FOTA_FAULT="$1" unshare -m sh -c "
+        mount --make-rprivate /
+        mkdir -p /etc/fota /data/fota
+        mount --bind '$WORK/etc' /etc/fota
+        mount --bind '$WORK/state' /data/fota
+        exec '$FOTA_CLIENT' --check" > /dev/null 2>&1
+}
+
+journal_field() {
+    sed -n "s/.*\"$1\": *\"\{0,1\}\([^\",}]*\).*/\1/p" "$WORK/state/apply.journal" 2>/dev/null
+}
+
+# Does the filesystem on $1 hold exactly the tree $2?
+same_files() {
+    local ret
+    mount -o ro "$1" "$WORK/mnt" 2>/dev/null || return 1
+    diff -r -x lost+found "$2" "$WORK/mnt" > /dev/null && ret=0 || ret=1
+    umount "$WORK/mnt"
+    return $ret
+}
+
+sectors_written() {
+    awk '{ print $7 }' "/sys/block/$(basename "$ROOT_B")/stat"
+}
+
+FAILED=0
+
+fail() {
+    echo -e "${RED}FAIL${NC} $1"
+    FAILED=1
+}
+
+# $1: stream_mode, $2: tar|image, $3: fault point
+scenario() {
+    local mode=$1 type=$2 point=$3
+    local name="$([ "$mode" = 1 ] && echo stream || echo staged)/$type killed at $point"
+    local err="" status offset sectors requests
+
+    write_env a
+    write_config "$mode"
+    cp "$WORK/srv/$type.json" "$WORK/manifest.json"
+    rm -rf "${WORK:?}/state/"* "${WORK:?}/dl/"* "$WORK/rebooted"
+    mkfs.ext4 -q -F -L BOOT_B "$BOOT_B"
+    dd if=/dev/zero of="$ROOT_B" bs=1M count=8 status=none conv=fsync
+
+    # 1. Killed at the fault point
+    status=0
+    (run_client "$point") 2> /dev/null || status=$?
+    if [ "$status" -ne 137 ]; then
+        fail "$name: fault point not reached (exit $status)"
+        return
+    fi
+    offset=$(journal_field rootfs_offset)
+    : > "$WORK/access.log"
+    sectors=$(sectors_written)
+
+    # 2. Resumed by the next check
+    (run_client "") 2> /dev/null || err="second run failed"
+    requests=$(cat "$WORK/access.log")
+    sectors=$(( $(sectors_written) - sectors ))
+
+    # 3. Outcome
+    [ -e "$WORK/rebooted" ] || err="${err:-no reboot}"
+    [ "$(env_slot)" = b ] || err="${err:-environment selects slot $(env_slot)}"
+    [ "$(journal_field step)" = env_switched ] || err="${err:-journal at $(journal_field step)}"
+    grep -q '"pending_slot": *"b"' "$WORK/state/state.json" 2>/dev/null ||
+        err="${err:-no pending state}"
+
+    same_files "$BOOT_B" "$WORK/src/boot" || err="${err:-boot files differ}"
+
+    if [ "$type" = image ]; then
+        cmp -s -n $((IMAGE_MB << 20)) "$WORK/srv/rootfs.img" "$ROOT_B" ||
+            err="${err:-root image differs}"
+    else
+        same_files "$ROOT_B" "$WORK/src/rootfs" || err="${err:-root files differ}"
+    fi
+
+    # What the journal had as done must not be redone
+    case $point in
+        boot_written|checkpoint*)
+            echo "$requests" | grep -q boot.tar.gz && err="${err:-boot fetched again}" ;;
+        rootfs_written)
+            echo "$requests" | grep -q -v '^/api/' && err="${err:-artifacts fetched again}" ;;
+        env_switched)
+            [ -z "$requests" ] || err="${err:-update checked again}" ;;
+    esac
+    if [ "${point%%:*}" = checkpoint ]; then
+        [ "${offset:-0}" -gt 0 ] || err="${err:-no rootfs offset recorded}"
+        [ $((sectors * 512)) -le $(((IMAGE_MB << 20) - offset + (4 << 20))) ] ||
+            err="${err:-rewrote $((sectors >> 11)) MiB below offset}"
+    fi
+
+    if [ -n "$err" ]; then
+        fail "$name: $err"
+    else
+        [ "${offset:-0}" -gt 0 ] && name="$name (offset $((offset >> 20)) MiB)"
+        echo -e "${GREEN}PASS${NC} $name, resume wrote $((sectors >> 11)) MiB"
+    fi
+}
+
+# Streamed archive with a malformed pax header: the apply fails cleanly
+malformed() {
+    local name="stream/tar with a malformed pax header"
+    local err="" status
+
+    write_env a
+    write_config 1
+    cp "$WORK/srv/malformed.json" "$WORK/manifest.json"
+    rm -rf "${WORK:?}/state/"* "${WORK:?}/dl/"* "$WORK/rebooted"
+
+    status=0
+    (run_client "") 2> /dev/null || status=$?
+    [ "$status" -eq 0 ] || err="client exited with $status"
+    [ ! -e "$WORK/rebooted" ] || err="${err:-rebooted}"
+    [ "$(env_slot)" = a ] || err="${err:-environment selects slot $(env_slot)}"
+    grep -q '"result": *"failed"' "$WORK/state/timeline.json" 2>/dev/null ||
+        err="${err:-apply not reported as failed}"
+
+    if [ -n "$err" ]; then
+        fail "$name: $err"
+    else
+        echo -e "${GREEN}PASS${NC} $name, rejected"
+    fi
+}
+
+echo ""
+for point in downloaded verified boot_written extract:1000 rootfs_written env_switched; do
+    scenario 0 tar "$point"
+done
+for point in checkpoint:3 rootfs_written; do
+    scenario 0 image "$point"
+done
+for point in boot_written extract:1000; do
+    scenario 1 tar "$point"
+done
+scenario 1 image checkpoint:2
+malformed
+
+echo ""
+if [ "$FAILED" -ne 0 ]; then
+    exit 1
+fi
+echo -e "${GREEN}Done.${NC}"
@@ -0,0 +1,177 @@
+#!/bin/bash
+#
+# test_resume_download.sh - Exercise resumable FOTA downloads on a flaky link
+#
+# Serves a random artifact with update_server.sh, cutting nine in ten
+# transfers at a random offset, then checks that fota_client --download
+# still delivers it intact:
+#   1. cut connections   - the client resumes with Range requests
+#   2. killed client     - SIGKILL right after the first checkpoint
+#                          (power cut), rerun resumes from the progress
+#                          record
+#   3. no Range support  - server answers 200 to Range (--no-range),
+#                          client restarts the whole transfer
+#   4. parallel ranges   - 4 ranges at once, each cut and resumed
+#
+# Cases 2 and 3 pace transfers to 2 MiB/s until the kill, so the
+# first checkpoint (FOTA_RESUME_CHECKPOINT, 4 MiB) is recorded before
+# the transfer could complete.
+#
+# Usage: ./test_resume_download.sh [size_mb (>= 8)] [fota_client]
+#
+# License: MIT
+
+set -e
+
+SIZE_MB="${1:-32}"
+FOTA_CLIENT="${2:-$(dirname "$0")/../fota/fota_client}"
+PORT=8719
+
+# Colors
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+NC='\033[0m'
+
+if [ "$SIZE_MB" -lt 8 ]; then
+    echo -e "${RED}Error: size_mb must be at least 8 to kill a transfer after its 4 MiB checkpoint${NC}"
+    exit 1
+fi
+
+if [ ! -x "$FOTA_CLIENT" ]; then
+    echo -e "${RED}Error: fota_client not found at $FOTA_CLIENT (run 'make host')${NC}"
+    exit 1
+fi
+
+WORK=$(mktemp -d /tmp/fota_resume.XXXXXX)
+SERVER_PID=""
+
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+mkdir -p "$WORK/release"
+echo '{ "update_available": false }' > "$WORK/release/manifest.json"
+dd if=/dev/urandom of="$WORK/release/rootfs.tar.gz" bs=1M count="$SIZE_MB" status=none
+EXPECTED=$(sha256sum "$WORK/release/rootfs.tar.gz" | cut -d' ' -f1)
+URL="http://127.0.0.1:$PORT/files/rootfs.tar.gz"
+
+# (Re)start the update server with the given options
+start_server() {
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null || true
+        wait "$SERVER_PID" 2>/dev/null || true
+    fi
+    "$(dirname "$0")/update_server.sh" "$WORK/release" --port "$PORT" "$@" 2> /dev/null &
+    SERVER_PID=$!
+    sleep 1
+}
+
+FAILED=0
+
+check() {
+    local name="$1"
+    local got
+    got=$(sha256sum "$WORK/out.bin" | cut -d' ' -f1)
+    if [ "$got" = "$EXPECTED" ] && [ ! -e "$WORK/out.bin.progress" ]; then
+        echo -e "${GREEN}PASS${NC} $name"
+    else
+        echo -e "${RED}FAIL${NC} $name ($got)"
+        FAILED=1
+    fi
+}
+
+# Client output since the last mark_log
+mark_log() {
+    LOG_MARK=$(wc -l < "$WORK/client.log")
+}
+
+new_log() {
+    tail -n +$((LOG_MARK + 1)) "$WORK/client.log"
+}
+
+# Start a download and SIGKILL it once a checkpoint is recorded, sets OFFSET
+kill_after_checkpoint() {
+    local pid
+
+    start_server --drop 0.9 --conn-rate 2M
+    "$FOTA_CLIENT" --download "$URL" "$WORK/out.bin" >> "$WORK/client.log" 2>&1 &
+    pid=$!
+    OFFSET=0
+    for _ in $(seq 1 200); do
+        OFFSET=$(grep -o '"offset":[0-9]*' "$WORK/out.bin.progress" 2>/dev/null | cut -d: -f2)
+        [ "${OFFSET:-0}" -gt 0 ] && break
+        sleep 0.05
+    done
+    kill -9 "$pid" 2>/dev/null || true
+    wait "$pid" 2>/dev/null || true
+    OFFSET=${OFFSET:-0}
+    echo "  killed with $OFFSET bytes recorded"
+}
+
+# $1: name, $2: reason the case did not test what it should
+fail() {
+    echo -e "${RED}FAIL${NC} $1 ($2)"
+    FAILED=1
+}
+
+# Run until the client reports success, as the daemon would on later checks
+download() {
+    for _ in 1 2 3 4 5; do
+        "$FOTA_CLIENT" --download "$URL" "$WORK/out.bin" "${1:-1}" \
+            >> "$WORK/client.log" 2>&1 && return 0
+    done
+    return 1
+}
+
+# --- 1. Connections cut at random offsets ---
+rm -f "$WORK/out.bin"*
+start_server --drop 0.9
+download || true
+check "resume after dropped connections"
+
+# --- 2. Client killed mid-transfer ---
+rm -f "$WORK/out.bin"*
+kill_after_checkpoint
+start_server --drop 0.9
+mark_log
+download || true
+if [ "$OFFSET" -eq 0 ]; then
+    fail "resume after SIGKILL" "no checkpoint before the kill"
+elif ! new_log | grep -q "Resuming .* at byte $OFFSET"; then
+    fail "resume after SIGKILL" "rerun did not resume at byte $OFFSET"
+else
+    check "resume after SIGKILL"
+fi
+
+# --- 3. Server without Range support ---
+rm -f "$WORK/out.bin"*
+kill_after_checkpoint
+start_server --no-range
+mark_log
+download || true
+if [ "$OFFSET" -eq 0 ]; then
+    fail "restart when ranges are not supported" "no checkpoint before the kill"
+elif ! new_log | grep -q "cannot resume"; then
+    fail "restart when ranges are not supported" "rerun did not restart the transfer"
+else
+    check "restart when ranges are not supported"
+fi
+
+# --- 4. Parallel ranges, each cut at random offsets ---
+rm -f "$WORK/out.bin"*
+start_server --drop 0.9
+download 4 || true
+check "parallel ranges with dropped connections"
+
+echo ""
+echo "Interrupted transfers: $(grep -c 'interrupted at byte' "$WORK/client.log")"
+echo "Resumed after kill: $(grep -c 'Resuming' "$WORK/client.log")"
+echo "Restarted transfers: $(grep -c 'cannot resume' "$WORK/client.log")"
+
+if [ "$FAILED" -ne 0 ]; then
+    cat "$WORK/client.log"
+    exit 1
+fi
+echo -e "${GREEN}Done.${NC}"
@@ -0,0 +1,406 @@
+#!/bin/bash
+#
+# update_server.sh - Local stand-in for the FOTA update server
+#
+# Serves a release directory the way the update server does, so updates
+# can be tested and measured without one:
+#   GET /api/v1/devices/<id>/update   manifest.json of the release, or
+#                                     "no update" when X-Current-Version
+#                                     is not older (also honours
+#                                     min_version, max_version and
+#                                     supported_devices)
+#   GET /files/<name>                 the artifacts, with Range requests
+#   GET /stats, /stats/reset          request and byte counters (JSON)
+#
+# The manifest is re-read whenever it changes, so a test can switch the
+# release offered by rewriting it (--manifest picks a file other than
+# <release_dir>/manifest.json). --cert and --key serve HTTPS instead.
+#
+# In manifest.json an artifact URL may be a plain file name from the
+# release directory: it is turned into a URL on this server, and its
+# _sha256 and _size are filled in when missing (or "auto"):
+#
+#   { "update_available": true, "version": "2.0",
+#     "boot_url": "boot.tar.gz", "rootfs_url": "rootfs.tar.gz" }
+#
+# "No update" answers carry an ETag, so a client that sends it back gets
+# a bodyless 304. Update timelines reported by clients (X-Update-Timeline,
+# see fota/fota_metrics.h) are counted and can be collected with
+# --timelines. Throttling (shared uplink and/or per transfer), latency
+# and faults (503 answers, transfers cut or stalled at a random offset)
+# are set with the options below; scripts/sim_fleet.sh drives a fleet of
+# clients against it.
+#
+# Usage: ./update_server.sh [options] <release_dir>
+#        ./update_server.sh --help
+#
+# License: MIT
+
+exec python3 - "$@" << 'EOF'
+import argparse, fnmatch, hashlib, http.server, json, os, random, re, ssl
+import sys, threading, time
+
+CHUNK = 64 << 10
+COMPACT_TYPE = "application/x-fota-manifest"
+
+def size_arg(s):
+    m = re.fullmatch(r"(\d+(?:\.\d+)?)([kKmMgG]?)", s)
+    if not m:
+        raise argparse.ArgumentTypeError("bad size: " + s)
+    unit = {"": 1, "k": 1 << 10, "m": 1 << 20, "g": 1 << 30}[m.group(2).lower()]
+    return int(float(m.group(1)) * unit)
+
+p = argparse.ArgumentParser(prog="update_server.sh",
+                            description="Local stand-in for the FOTA update server")
+p.add_argument("release", help="directory with manifest.json and the artifacts")
+p.add_argument("--bind", default="127.0.0.1", help="address to listen on")
+p.add_argument("--port", type=int, default=8780, help="port (8780)")
+p.add_argument("--manifest", metavar="FILE",
+               help="manifest to serve instead of <release>/manifest.json")
+p.add_argument("--cert", metavar="PEM", help="serve HTTPS with this certificate")
+p.add_argument("--key", metavar="PEM", help="private key of --cert")
+p.add_argument("--rate", type=size_arg, default=0,
+               help="uplink in bytes/s shared by all transfers, K/M/G suffixes")
+p.add_argument("--conn-rate", type=size_arg, default=0,
+               help="bytes/s per transfer")
+p.add_argument("--latency", type=float, default=0,
+               help="milliseconds before every answer")
+p.add_argument("--no-range", action="store_true",
+               help="ignore Range, always send whole files")
+p.add_argument("--no-etag", action="store_true",
+               help="no validators, never answer 304")
+p.add_argument("--compact", action="store_true",
+               help="answer checks in the compact format when the client accepts it")
+p.add_argument("--error", type=float, default=0, metavar="P",
+               help="probability of answering 503")
+p.add_argument("--drop", type=float, default=0, metavar="P",
+               help="probability of cutting a transfer")
+p.add_argument("--stall", type=float, default=0, metavar="P",
+               help="probability of stalling a transfer")
+p.add_argument("--stall-time", type=float, default=5, metavar="S",
+               help="length of a stall in seconds (5)")
+p.add_argument("--seed", type=int, help="seed for the fault injection")
+p.add_argument("--log", help="append one line per request to this file")
+p.add_argument("--access-log", metavar="FILE",
+               help="append the path of every request to this file")
+p.add_argument("--timelines", metavar="FILE",
+               help="append the update timelines reported by clients to this "
+                    "file, one JSON object per line")
+args = p.parse_args()
+random.seed(args.seed)
+
+ROOT = os.path.realpath(args.release)
+MANIFEST_PATH = args.manifest or os.path.join(ROOT, "manifest.json")
+
+def version_key(v):
+    return [int(n) for n in re.findall(r"\d+", v or "")]
+
+def file_etag(path):
+    st = os.stat(path)
+    return '"%x-%x"' % (st.st_size, int(st.st_mtime))
+
+def load_release():
+    with open(MANIFEST_PATH) as f:
+        manifest = json.load(f)
+    local = []
+    for key in [k for k in manifest if k.endswith("_url")]:
+        name = manifest[key]
+        path = os.path.join(ROOT, name or "")
+        if not name or "://" in name or not os.path.exists(path):
+            continue
+        local.append(key)
+        if not os.path.isfile(path):
+            continue
+        base = key[:-4]
+        if manifest.get(base + "_sha256") in (None, "", "auto"):
+            h = hashlib.sha256()
+            with open(path, "rb") as f:
+                for data in iter(lambda: f.read(1 << 20), b""):
+                    h.update(data)
+            manifest[base + "_sha256"] = h.hexdigest()
+        manifest.setdefault(base + "_size", os.path.getsize(path))
+    return manifest, local
+
+RELEASE_LOCK = threading.Lock()
+RELEASE = {"stat": None}
+
+def release():
+    """The manifest and its local URL keys, reloaded when the file changed"""
+    with RELEASE_LOCK:
+        st = os.stat(MANIFEST_PATH)
+        stat = (st.st_ino, st.st_size, st.st_mtime_ns)
+        if stat != RELEASE["stat"]:
+            RELEASE["manifest"], RELEASE["local"] = load_release()
+            RELEASE["stat"] = stat
+        return RELEASE["manifest"], RELEASE["local"]
+
+class Bucket:
+    """Paces writes to rate bytes/s, shared by whoever holds it"""
+
+    def __init__(self, rate):
+        self.rate = rate
+        self.next = 0.0
+        self.lock = threading.Lock()
+
+    def take(self, n):
+        if not self.rate:
+            return
+        with self.lock:
+            now = time.monotonic()
+            self.next = max(now, self.next) + n / self.rate
+            wait = self.next - now
+        time.sleep(wait)
+
+UPLINK = Bucket(args.rate)
+
+class Stats:
+    KEYS = ("requests", "checks", "offered", "not_modified", "transfers",
+            "bytes", "errors", "drops", "stalls", "timelines")
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.reset()
+
+    def reset(self):
+        with self.lock:
+            self.count = dict.fromkeys(self.KEYS, 0)
+            self.status = {}
+            self.per_second = {}
+            self.first = self.last = None
+
+    def request(self, status):
+        now = time.time()
+        with self.lock:
+            self.count["requests"] += 1
+            self.status[status] = self.status.get(status, 0) + 1
+            second = int(now)
+            self.per_second[second] = self.per_second.get(second, 0) + 1
+            self.first = self.first or now
+            self.last = now
+
+    def add(self, key, n=1):
+        with self.lock:
+            self.count[key] += n
+
+    def report(self):
+        with self.lock:
+            r = dict(self.count)
+            r["status"] = {str(k): v for k, v in sorted(self.status.items())}
+            span = (self.last - self.first) if self.first else 0
+            r["seconds"] = round(span, 3)
+            r["requests_per_s"] = round(r["requests"] / span, 1) if span > 0 else 0
+            r["peak_requests_per_s"] = max(self.per_second.values(), default=0)
+            return r
+
+STATS = Stats()
+LOG_LOCK = threading.Lock()
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    disable_nagle_algorithm = True
+
+    def log_message(self, *args):
+        pass
+
+    def send_response(self, code, message=None):
+        self.status = code
+        super().send_response(code, message)
+
+    def reply(self, code, body=b"", ctype="application/json", headers=()):
+        self.send_response(code)
+        for name, value in headers:
+            self.send_header(name, value)
+        if code not in (204, 304):
+            self.send_header("Content-Type", ctype)
+            self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if body and self.command != "HEAD":
+            self.wfile.write(body)
+            self.sent += len(body)
+
+    def do_GET(self):
+        self.status, self.sent, self.device = 0, 0, "-"
+        if self.path.startswith("/stats"):
+            if self.path == "/stats/reset":
+                STATS.reset()
+            self.reply(200, json.dumps(STATS.report()).encode())
+            return
+
+        start = time.monotonic()
+        try:
+            self.route()
+        finally:
+            STATS.request(self.status)
+            STATS.add("bytes", self.sent)
+            if args.access_log:
+                with LOG_LOCK, open(args.access_log, "a") as log:
+                    log.write(self.path + "\n")
+            if args.log:
+                with LOG_LOCK, open(args.log, "a") as log:
+                    log.write("%.3f %s %s %s %d %d %.3f\n" % (
+                        time.time(), self.device, self.command, self.path,
+                        self.status, self.sent, time.monotonic() - start))
+
+    do_HEAD = do_GET
+
+    def route(self):
+        if args.latency:
+            time.sleep(args.latency / 1000)
+        if args.error and random.random() < args.error:
+            STATS.add("errors")
+            self.reply(503, b'{"error": "injected"}', headers=[("Retry-After", "1")])
+            return
+
+        m = re.fullmatch(r"/api/v1/devices/([^/]+)/update", self.path)
+        if m:
+            self.device = m.group(1)
+            self.check()
+        elif self.path.startswith("/files/"):
+            self.artifact(self.path[len("/files/"):])
+        else:
+            self.reply(404, b'{"error": "not found"}')
+
+    def offer(self, release):
+        current = version_key(self.headers.get("X-Current-Version"))
+        patterns = release.get("supported_devices") or ["*"]
+        return (release.get("update_available", True) and
+                current < version_key(release.get("version")) and
+                any(fnmatch.fnmatch(self.device, p) for p in patterns) and
+                (not release.get("min_version") or
+                 current >= version_key(release["min_version"])) and
+                (not release.get("max_version") or
+                 current <= version_key(release["max_version"])))
+
+    def timeline(self):
+        try:
+            timeline = json.loads(self.headers.get("X-Update-Timeline"))
+        except ValueError:
+            return
+        STATS.add("timelines")
+        if args.timelines:
+            timeline["device"] = self.device
+            with LOG_LOCK, open(args.timelines, "a") as out:
+                out.write(json.dumps(timeline) + "\n")
+
+    def check(self):
+        STATS.add("checks")
+        if "X-Update-Timeline" in self.headers:
+            self.timeline()
+        release_manifest, local_urls = release()
+        manifest = {"update_available": False}
+        if self.offer(release_manifest):
+            STATS.add("offered")
+            manifest = dict({"update_available": True}, **release_manifest)
+            manifest["update_available"] = True
+            base = "%s://%s/files/" % (SCHEME, self.headers.get(
+                "Host", "%s:%d" % (args.bind, args.port)))
+            for key in local_urls:
+                manifest[key] = base + manifest[key]
+
+        # Compact: flat values only, the rest is for the server's eyes
+        compact = args.compact and COMPACT_TYPE in self.headers.get("Accept", "")
+        if compact and manifest["update_available"]:
+            lines = []
+            for key, value in manifest.items():
+                if isinstance(value, bool):
+                    value = int(value)
+                if isinstance(value, (str, int, float)):
+                    lines.append("%s=%s\n" % (key, value))
+            body, ctype, code = "".join(lines).encode(), COMPACT_TYPE, 200
+        elif compact:
+            body, ctype, code = b"", COMPACT_TYPE, 204
+        else:
+            body, ctype, code = json.dumps(manifest).encode(), "application/json", 200
+
+        headers = []
+        if not args.no_etag:
+            etag = '"%s"' % hashlib.sha256(ctype.encode() + body).hexdigest()[:16]
+            headers.append(("ETag", etag))
+            if self.headers.get("If-None-Match") == etag:
+                STATS.add("not_modified")
+                self.reply(304, headers=headers)
+                return
+        self.reply(code, body, ctype, headers)
+
+    def artifact(self, name):
+        path = os.path.realpath(os.path.join(ROOT, name))
+        if not path.startswith(ROOT + os.sep) or not os.path.isfile(path):
+            self.reply(404, b'{"error": "not found"}')
+            return
+
+        size = os.path.getsize(path)
+        etag = file_etag(path)
+        start, end = 0, size
+        m = re.fullmatch(r"bytes=(\d+)-(\d*)", self.headers.get("Range", ""))
+        if_range = self.headers.get("If-Range")
+        if m and not args.no_range and (not if_range or if_range == etag):
+            start = int(m.group(1))
+            if m.group(2):
+                end = min(int(m.group(2)) + 1, size)
+            if start >= size or start >= end:
+                self.reply(416, headers=[("Content-Range", "bytes */%d" % size)])
+                return
+            self.send_response(206)
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end - 1, size))
+        else:
+            self.send_response(200)
+        if not args.no_range:
+            self.send_header("Accept-Ranges", "bytes")
+        self.send_header("ETag", etag)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(end - start))
+        self.end_headers()
+        if self.command == "HEAD":
+            return
+
+        STATS.add("transfers")
+        length = end - start
+        cut, stall_at = length, -1
+        fault = random.random()
+        if fault < args.drop:
+            STATS.add("drops")
+            cut = random.randrange(length) if length else 0
+        elif fault < args.drop + args.stall:
+            STATS.add("stalls")
+            stall_at = random.randrange(length) if length else 0
+
+        conn = Bucket(args.conn_rate)
+        with open(path, "rb") as f:
+            f.seek(start)
+            while self.sent < cut:
+                n = min(CHUNK, cut - self.sent)
+                if stall_at == self.sent:
+                    time.sleep(args.stall_time)
+                    stall_at = -1
+                elif self.sent < stall_at:
+                    n = min(n, stall_at - self.sent)
+                UPLINK.take(n)
+                conn.take(n)
+                data = f.read(n)
+                if not data:
+                    break
+                try:
+                    self.wfile.write(data)
+                except ConnectionError:
+                    break
+                self.sent += len(data)
+
+        # A short body only shows if the connection goes with it
+        if self.sent < length:
+            self.close_connection = True
+
+class Server(http.server.ThreadingHTTPServer):
+    daemon_threads = True
+    request_queue_size = 128    # A fleet connecting at once
+
+SCHEME = "https" if args.cert else "http"
+srv = Server((args.bind, args.port), Handler)
+if args.cert:
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    ctx.load_cert_chain(args.cert, args.key)
+    srv.socket = ctx.wrap_socket(srv.socket, server_side=True)
+print("update_server: version %s from %s on %s://%s:%d" % (
+      release()[0].get("version"), ROOT, SCHEME, args.bind, args.port),
+      file=sys.stderr)
+srv.serve_forever()
+EOF